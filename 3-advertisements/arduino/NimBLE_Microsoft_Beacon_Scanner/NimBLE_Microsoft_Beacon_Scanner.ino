@@ -4,11 +4,36 @@
  *
  * SPDX-License-Identifier: MIT
  *
+ * Instead of printing each advertisement, the sketch counts the
+ * distinct devices of each device type in a sliding window, see
+ * device_counter.h, and prints a summary at regular intervals.
  */
 #include "NimBLEDevice.h"
+#include "ad_parser.h"
+#include "advert_queue.h"
+#include "advert_ring.h"
+#include "device_counter.h"
+
+#define COMPANY_ID_MICROSOFT 0x0006
+
+// Number of queued advertisements, must be a power of two
+#define RING_SIZE 32
+// Sliding window to count distinct devices in, in milliseconds
+#define COUNT_WINDOW 60000
+// Number of sub-windows, the granularity of the sliding window
+#define COUNT_SUB_WINDOWS 6
+// Interval to report counts and statistics, in milliseconds
+#define STATS_INTERVAL 10000
 
 NimBLEScan *pBLEScan;
 
+/* Matching advertisements are queued by the scan callback on the
+ * NimBLE host task and printed in loop(), so slow serial output
+ * doesn't block the host task.
+ */
+static AdvertRing<RING_SIZE> advertRing;
+static uint32_t lastStats = 0;
+
 // See
 // https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-cdp/77b446d0-8cea-4821-ad21-fabdf4d9a569
 const char *deviceTypeMicrosoft[] = {"",
@@ -27,46 +52,87 @@ const char *deviceTypeMicrosoft[] = {"",
                                      "Windows IoT",
                                      "Surface Hub"};
 
+#define DEVICE_TYPES (sizeof(deviceTypeMicrosoft) / sizeof(char *))
+// Counter for device types not in deviceTypeMicrosoft
+#define DEVICE_TYPE_OTHER DEVICE_TYPES
+
+/* Distinct devices per device type, only accessed from loop(). With
+ * the default precision this takes 16 * 6 * 256 bytes.
+ */
+static DeviceCounter<DEVICE_TYPES + 1, COUNT_SUB_WINDOWS>
+    deviceCounter(COUNT_WINDOW);
+
+const char *getDeviceTypeMicrosoft(uint8_t deviceType) {
+  if (deviceType >= DEVICE_TYPES) {
+    return "";
+  }
+  return deviceTypeMicrosoft[deviceType];
+}
+
+// Get the Microsoft beacon data from an advertisement, if any.
+bool getMicrosoftBeaconData(const uint8_t *payload, size_t length,
+                            ManufacturerData &manufacturerData) {
+  AdParser parser(payload, length);
+
+  return parser.getManufacturerData(manufacturerData) &&
+         manufacturerData.companyId == COMPANY_ID_MICROSOFT &&
+         manufacturerData.length >= 24 &&
+         manufacturerData.data[0] == 0x01;
+}
+
 class MyAdvertisedDeviceCallbacks
     : public NimBLEAdvertisedDeviceCallbacks {
   void onResult(NimBLEAdvertisedDevice *advertisedDevice) {
-    if (advertisedDevice->haveManufacturerData() == true) {
-      std::string strManufacturerData =
-          advertisedDevice->getManufacturerData();
-      uint8_t deviceType;
-      uint8_t salt[4];
-      uint8_t deviceHash[16];
-
-      if (strManufacturerData[0] == 0x06 &&
-          strManufacturerData[1] == 0x00 &&
-          strManufacturerData[2] == 0x01) {
-        deviceType = strManufacturerData[3] & 0b00111111;
-        memcpy(&salt, &strManufacturerData[6], 4);
-        memcpy(&deviceHash, &strManufacturerData[10], 16);
-
-        Serial.printf("Device type: %s (%d)\n",
-                      deviceTypeMicrosoft[deviceType], deviceType);
-        Serial.printf("RSSI       : %d dBm\n",
-                      advertisedDevice->getRSSI());
-
-        Serial.printf("Salt       : ");
-        for (int i = 0; i < 4; i++) {
-          Serial.printf("%02x", salt[i]);
-        }
-        Serial.println();
-
-        Serial.printf("Device hash: ");
-        for (int i = 0; i < 16; i++) {
-          Serial.printf("%02x", deviceHash[i]);
-        }
-        Serial.println();
-        Serial.println(
-            "---------------------------------------------");
-      }
+    ManufacturerData manufacturerData;
+
+    if (getMicrosoftBeaconData(advertisedDevice->getPayload(),
+                               advertisedDevice->getPayloadLength(),
+                               manufacturerData)) {
+      queueAdvert(advertRing, advertisedDevice);
     }
   }
 };
 
+// Count the device that sent the advertisement.
+void countAdvert(const AdvertRecord *record) {
+  ManufacturerData manufacturerData;
+
+  if (!getMicrosoftBeaconData(record->payload, record->length,
+                              manufacturerData)) {
+    return;
+  }
+
+  const uint8_t *data = manufacturerData.data;
+  uint8_t deviceType = data[1] & 0b00111111;
+  const uint8_t *deviceHash = &data[8];
+
+  if (deviceType >= DEVICE_TYPES ||
+      deviceTypeMicrosoft[deviceType][0] == '\0') {
+    deviceType = DEVICE_TYPE_OTHER;
+  }
+  deviceCounter.add(deviceType, deviceHash, record->timestamp);
+}
+
+// Print the estimated number of devices per type in the window.
+void printCounts() {
+  uint32_t now = millis();
+
+  Serial.printf("Devices in last %u s: %u (%u advertisements)",
+                (unsigned)(deviceCounter.window() / 1000),
+                (unsigned)deviceCounter.estimateTotal(now),
+                (unsigned)deviceCounter.adverts(now));
+  for (uint8_t type = 0; type <= DEVICE_TYPE_OTHER; type++) {
+    uint32_t count = deviceCounter.estimate(type, now);
+    if (count > 0) {
+      const char *name = type == DEVICE_TYPE_OTHER
+                             ? "Other"
+                             : deviceTypeMicrosoft[type];
+      Serial.printf(", %s: %u", name, (unsigned)count);
+    }
+  }
+  Serial.println();
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println("Scanning for Microsoft advertising beacons...");
@@ -81,9 +147,28 @@ void setup() {
 }
 
 void loop() {
+  // Count all queued advertisements.
+  const AdvertRecord *record;
+  while ((record = advertRing.peek()) != nullptr) {
+    countAdvert(record);
+    advertRing.pop();
+  }
+
+  /* Report the device counts, and dropped advertisements to help
+   * sizing the ring.
+   */
+  if (millis() - lastStats >= STATS_INTERVAL) {
+    lastStats = millis();
+    printCounts();
+    Serial.printf("Ring: %u dropped, high-water mark %u/%u\n",
+                  (unsigned)advertRing.drops(),
+                  (unsigned)advertRing.highWater(),
+                  (unsigned)advertRing.capacity());
+  }
+
   if (pBLEScan->isScanning() == false) {
     pBLEScan->start(0);
   }
 
-  delay(2000);
+  delay(10);
 }
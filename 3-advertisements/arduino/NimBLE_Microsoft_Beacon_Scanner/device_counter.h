@@ -0,0 +1,182 @@
+/** Count distinct devices in a sliding time window.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The counter estimates the number of distinct devices per device
+ * type with a HyperLogLog sketch of 2^Precision one-byte registers.
+ * Devices are identified by a hash in their advertisements, not by
+ * their address, so rotating addresses don't inflate the counts. The
+ * standard error is 1.04 / sqrt(2^Precision), 6.5% for the default
+ * precision of 8.
+ *
+ * The window is divided into SubWindows sub-windows, each with its
+ * own registers. Adding a device only touches the registers of the
+ * current sub-window. When a sub-window expires, its registers are
+ * cleared. An estimate merges the registers of all sub-windows, so it
+ * covers the last window. Memory is fixed, Types * SubWindows *
+ * 2^Precision bytes, however many devices there are.
+ */
+#ifndef DEVICE_COUNTER_H_
+#define DEVICE_COUNTER_H_
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+template <size_t Types, size_t SubWindows, uint8_t Precision = 8>
+class DeviceCounter {
+  static_assert(Precision >= 4 && Precision <= 16,
+                "Precision must be between 4 and 16");
+
+public:
+  // window: length of the sliding window in ms
+  DeviceCounter(uint32_t window)
+      : subWindowLength(window / SubWindows), currentSlot(0),
+        started(false) {
+    memset(registers, 0, sizeof(registers));
+    memset(advertCounts, 0, sizeof(advertCounts));
+  }
+
+  /* Count a device of the given type, identified by a hash of at
+   * least 8 bytes. type must be less than Types.
+   */
+  void add(uint8_t type, const uint8_t *deviceHash, uint32_t now) {
+    advance(now);
+
+    uint64_t hash = mix(deviceHash);
+    uint32_t index = (uint32_t)(hash >> (64 - Precision));
+    /* Position of the first 1 bit after the index bits, with a
+     * sentinel bit so the rank is bounded.
+     */
+    uint64_t rest = (hash << Precision) | (1ull << (Precision - 1));
+    uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+
+    uint8_t &reg = registers[currentSlot % SubWindows][type][index];
+    if (rank > reg) {
+      reg = rank;
+    }
+    advertCounts[currentSlot % SubWindows]++;
+  }
+
+  // Estimated number of distinct devices of a type in the window.
+  uint32_t estimate(uint8_t type, uint32_t now) {
+    uint8_t merged[M];
+
+    advance(now);
+    memset(merged, 0, sizeof(merged));
+    for (size_t s = 0; s < SubWindows; s++) {
+      merge(merged, registers[s][type]);
+    }
+    return estimateRegisters(merged);
+  }
+
+  // Estimated number of distinct devices of all types in the window.
+  uint32_t estimateTotal(uint32_t now) {
+    uint8_t merged[M];
+
+    advance(now);
+    memset(merged, 0, sizeof(merged));
+    for (size_t s = 0; s < SubWindows; s++) {
+      for (size_t t = 0; t < Types; t++) {
+        merge(merged, registers[s][t]);
+      }
+    }
+    return estimateRegisters(merged);
+  }
+
+  // Number of advertisements in the window.
+  uint32_t adverts(uint32_t now) {
+    uint32_t count = 0;
+
+    advance(now);
+    for (size_t s = 0; s < SubWindows; s++) {
+      count += advertCounts[s];
+    }
+    return count;
+  }
+
+  uint32_t window() const { return subWindowLength * SubWindows; }
+
+private:
+  static const size_t M = (size_t)1 << Precision;
+
+  uint8_t registers[SubWindows][Types][M];
+  uint32_t advertCounts[SubWindows];
+  uint32_t subWindowLength;
+  uint32_t currentSlot;
+  bool started;
+
+  /* Move to the sub-window of now, clearing the ones that expired. A
+   * time in an earlier sub-window counts in the current one: records
+   * queued before a call with a later time arrive out of order.
+   */
+  void advance(uint32_t now) {
+    uint32_t slot = now / subWindowLength;
+    if (!started) {
+      currentSlot = slot;
+      started = true;
+      return;
+    }
+    if ((int32_t)(slot - currentSlot) <= 0) {
+      return;
+    }
+
+    uint32_t steps = slot - currentSlot;
+    if (steps > SubWindows) {
+      steps = SubWindows;
+    }
+    for (uint32_t i = 1; i <= steps; i++) {
+      size_t s = (currentSlot + i) % SubWindows;
+      memset(registers[s], 0, sizeof(registers[s]));
+      advertCounts[s] = 0;
+    }
+    currentSlot = slot;
+  }
+
+  /* Spread the bits of the first 8 bytes of the device hash, so the
+   * estimate doesn't depend on how random its bits are.
+   */
+  static uint64_t mix(const uint8_t *deviceHash) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+      x = (x << 8) | deviceHash[i];
+    }
+    // Finalizer of splitmix64
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  static void merge(uint8_t *merged, const uint8_t *regs) {
+    for (size_t j = 0; j < M; j++) {
+      if (regs[j] > merged[j]) {
+        merged[j] = regs[j];
+      }
+    }
+  }
+
+  static uint32_t estimateRegisters(const uint8_t *regs) {
+    float sum = 0;
+    size_t zeros = 0;
+
+    for (size_t j = 0; j < M; j++) {
+      sum += ldexpf(1.0f, -regs[j]);
+      if (regs[j] == 0) {
+        zeros++;
+      }
+    }
+
+    float alpha = 0.7213f / (1.0f + 1.079f / M);
+    float estimate = alpha * M * M / sum;
+    // Linear counting is more accurate for small counts.
+    if (estimate <= 2.5f * M && zeros > 0) {
+      estimate = M * logf((float)M / zeros);
+    }
+    return (uint32_t)(estimate + 0.5f);
+  }
+};
+
+#endif /* DEVICE_COUNTER_H_ */
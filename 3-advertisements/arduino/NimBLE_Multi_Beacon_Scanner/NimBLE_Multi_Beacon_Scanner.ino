@@ -0,0 +1,194 @@
+/** Scan for iBeacon, Microsoft and BME280 advertisements at once.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The beacon formats are decoders in beacon_decoders.h. Enable or
+ * disable a format by adding it to or removing it from the
+ * BeaconScanner type below. The sketch reports the average decoding
+ * cost per advertisement in CPU cycles, so you can see what each
+ * extra format costs. The decoder_bench of the advert_replay host
+ * harness measures each decoder on its own.
+ */
+#include "NimBLEDevice.h"
+#include "ad_parser.h"
+#include "advert_queue.h"
+#include "advert_ring.h"
+#include "beacon_decoders.h"
+
+// Number of queued advertisements, must be a power of two
+#define RING_SIZE 32
+// Interval to report statistics, in milliseconds
+#define STATS_INTERVAL 10000
+
+typedef BeaconDispatcher<IBeaconDecoder, MicrosoftBeaconDecoder,
+                         Bme280BeaconDecoder>
+    BeaconScanner;
+
+NimBLEScan *pBLEScan;
+
+/* Matching advertisements are queued by the scan callback on the
+ * NimBLE host task and printed in loop(), so slow serial output
+ * doesn't block the host task.
+ */
+static AdvertRing<RING_SIZE> advertRing;
+static uint32_t lastStats = 0;
+
+/* Decoding cost since the last report, added by the scan callback.
+ * The lock keeps both counters consistent with each other: loop()
+ * runs on the other core.
+ */
+static portMUX_TYPE decodeLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t decodeCycles = 0;
+static uint32_t decodeCount = 0;
+
+class MyAdvertisedDeviceCallbacks
+    : public NimBLEAdvertisedDeviceCallbacks {
+  void onResult(NimBLEAdvertisedDevice *advertisedDevice) {
+    uint32_t start = ESP.getCycleCount();
+    bool matches =
+        BeaconScanner::matches(advertisedDevice->getPayload(),
+                               advertisedDevice->getPayloadLength());
+    uint32_t cycles = ESP.getCycleCount() - start;
+
+    portENTER_CRITICAL(&decodeLock);
+    decodeCycles += cycles;
+    decodeCount++;
+    portEXIT_CRITICAL(&decodeLock);
+
+    if (matches) {
+      queueAdvert(advertRing, advertisedDevice);
+    }
+  }
+};
+
+// See
+// https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-cdp/77b446d0-8cea-4821-ad21-fabdf4d9a569
+const char *deviceTypeMicrosoft[] = {"",
+                                     "Xbox One",
+                                     "",
+                                     "",
+                                     "",
+                                     "",
+                                     "Apple iPhone",
+                                     "Apple iPad",
+                                     "Android device",
+                                     "Windows 10 Desktop",
+                                     "",
+                                     "Windows 10 Phone",
+                                     "Linus device",
+                                     "Windows IoT",
+                                     "Surface Hub"};
+
+const char *getDeviceTypeMicrosoft(uint8_t deviceType) {
+  if (deviceType >= sizeof(deviceTypeMicrosoft) / sizeof(char *)) {
+    return "";
+  }
+  return deviceTypeMicrosoft[deviceType];
+}
+
+// Print decoded beacons, called by the dispatcher.
+struct BeaconPrinter {
+  void onBeacon(const AdvertRecord *record, const IBeacon &beacon) {
+    const uint8_t *uuid = beacon.uuid;
+
+    Serial.println("iBeacon");
+    Serial.printf("UUID       : %02x%02x%02x%02x-%02x%02x-%02x%02x-"
+                  "%02x%02x-%02x%02x%02x%02x%02x%02x\n",
+                  uuid[0], uuid[1], uuid[2], uuid[3], uuid[4],
+                  uuid[5], uuid[6], uuid[7], uuid[8], uuid[9],
+                  uuid[10], uuid[11], uuid[12], uuid[13], uuid[14],
+                  uuid[15]);
+    Serial.printf("Major      : %d\n", beacon.major);
+    Serial.printf("Minor      : %d\n", beacon.minor);
+    Serial.printf("TX power   : %d dBm\n", beacon.txPower);
+    printFooter(record);
+  }
+
+  void onBeacon(const AdvertRecord *record,
+                const MicrosoftBeacon &beacon) {
+    Serial.println("Microsoft beacon");
+    Serial.printf("Device type: %s (%d)\n",
+                  getDeviceTypeMicrosoft(beacon.deviceType),
+                  beacon.deviceType);
+    Serial.printf("Salt       : ");
+    for (int i = 0; i < 4; i++) {
+      Serial.printf("%02x", beacon.salt[i]);
+    }
+    Serial.println();
+    Serial.printf("Device hash: ");
+    for (int i = 0; i < 16; i++) {
+      Serial.printf("%02x", beacon.deviceHash[i]);
+    }
+    Serial.println();
+    printFooter(record);
+  }
+
+  void onBeacon(const AdvertRecord *record,
+                const Bme280Beacon &beacon) {
+    Serial.println("BME280 sensor");
+    Serial.printf("Temperature: %.2f °C\n",
+                  beacon.temperature / 100.0);
+    Serial.printf("Humidity   : %.2f %%\n", beacon.humidity / 100.0);
+    Serial.printf("Pressure   : %.2f hPa\n", beacon.pressure / 100.0);
+    printFooter(record);
+  }
+
+  void printFooter(const AdvertRecord *record) {
+    Serial.printf("RSSI       : %d dBm\n", record->rssi);
+    Serial.println("---------------------------------------------");
+  }
+};
+
+static BeaconPrinter printer;
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("Scanning for beacons...");
+
+  NimBLEDevice::init("");
+  pBLEScan = NimBLEDevice::getScan();
+  pBLEScan->setAdvertisedDeviceCallbacks(
+      new MyAdvertisedDeviceCallbacks(), true);
+  pBLEScan->setInterval(97);
+  pBLEScan->setWindow(37);
+  pBLEScan->setMaxResults(0);
+}
+
+void loop() {
+  // Decode and print all queued advertisements.
+  const AdvertRecord *record;
+  while ((record = advertRing.peek()) != nullptr) {
+    BeaconScanner::dispatch(record->payload, record->length, record,
+                            printer);
+    advertRing.pop();
+  }
+
+  // Report dropped advertisements and the decoding cost.
+  if (millis() - lastStats >= STATS_INTERVAL) {
+    lastStats = millis();
+    Serial.printf("Ring: %u dropped, high-water mark %u/%u\n",
+                  (unsigned)advertRing.drops(),
+                  (unsigned)advertRing.highWater(),
+                  (unsigned)advertRing.capacity());
+
+    portENTER_CRITICAL(&decodeLock);
+    uint32_t cycles = decodeCycles;
+    uint32_t count = decodeCount;
+    decodeCycles = 0;
+    decodeCount = 0;
+    portEXIT_CRITICAL(&decodeLock);
+    if (count) {
+      Serial.printf("Decoding: %u cycles/advertisement (%u "
+                    "advertisements)\n",
+                    (unsigned)(cycles / count), (unsigned)count);
+    }
+  }
+
+  if (pBLEScan->isScanning() == false) {
+    pBLEScan->start(0);
+  }
+
+  delay(10);
+}
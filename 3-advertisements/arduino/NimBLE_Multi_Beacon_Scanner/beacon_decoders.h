@@ -0,0 +1,188 @@
+/** Compile-time dispatch of beacon decoders.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * A decoder describes a beacon format in manufacturer-specific data:
+ * its company ID, the allowed data length and a fixed prefix, plus a
+ * function that decodes the data into a typed struct. The dispatcher
+ * is a template over a list of decoders. It walks the AD structures
+ * of an advertisement once and checks each manufacturer-specific data
+ * structure against the decoders in turn. All checks are resolved at
+ * compile time into plain comparisons: no virtual calls, no strings
+ * and no allocation.
+ */
+#ifndef BEACON_DECODERS_H_
+#define BEACON_DECODERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ad_parser.h"
+
+#define COMPANY_ID_MICROSOFT 0x0006
+#define COMPANY_ID_APPLE 0x004c
+#define COMPANY_ID_TEST 0xffff
+
+// Fixed prefix of the manufacturer data, after the company ID.
+template <uint8_t... Bytes> struct Prefix;
+
+template <> struct Prefix<> {
+  static const uint8_t length = 0;
+
+  static bool matches(const uint8_t *data) { return true; }
+};
+
+template <uint8_t First, uint8_t... Rest>
+struct Prefix<First, Rest...> {
+  static const uint8_t length = 1 + sizeof...(Rest);
+
+  static bool matches(const uint8_t *data) {
+    return data[0] == First && Prefix<Rest...>::matches(data + 1);
+  }
+};
+
+/* Base of a decoder for manufacturer data with the given company ID,
+ * length range and prefix.
+ */
+template <uint16_t CompanyId, uint8_t MinLength, uint8_t MaxLength,
+          typename P>
+struct ManufacturerDecoder {
+  static_assert(MinLength >= P::length,
+                "Prefix is longer than the minimum length");
+
+  static bool matches(const ManufacturerData &manufacturerData) {
+    return manufacturerData.companyId == CompanyId &&
+           manufacturerData.length >= MinLength &&
+           manufacturerData.length <= MaxLength &&
+           P::matches(manufacturerData.data);
+  }
+};
+
+// Apple iBeacon
+struct IBeacon {
+  const uint8_t *uuid;
+  uint16_t major;
+  uint16_t minor;
+  int8_t txPower;
+};
+
+struct IBeaconDecoder
+    : ManufacturerDecoder<COMPANY_ID_APPLE, 23, 23,
+                          Prefix<0x02, 0x15>> {
+  typedef IBeacon Result;
+
+  static void decode(const uint8_t *data, IBeacon &beacon) {
+    beacon.uuid = &data[2];
+    // Major and minor are big-endian
+    beacon.major = (uint16_t)((data[18] << 8) | data[19]);
+    beacon.minor = (uint16_t)((data[20] << 8) | data[21]);
+    beacon.txPower = (int8_t)data[22];
+  }
+};
+
+// Microsoft Connected Devices Platform beacon
+struct MicrosoftBeacon {
+  uint8_t deviceType;
+  const uint8_t *salt;
+  const uint8_t *deviceHash;
+};
+
+struct MicrosoftBeaconDecoder
+    : ManufacturerDecoder<COMPANY_ID_MICROSOFT, 24, 255,
+                          Prefix<0x01>> {
+  typedef MicrosoftBeacon Result;
+
+  static void decode(const uint8_t *data, MicrosoftBeacon &beacon) {
+    beacon.deviceType = data[1] & 0b00111111;
+    beacon.salt = &data[4];
+    beacon.deviceHash = &data[8];
+  }
+};
+
+// BME280 sensor values from the advertise_bme280 Zephyr application
+struct Bme280Beacon {
+  int16_t temperature; // 1/100 °C
+  uint32_t pressure;   // Pa
+  uint16_t humidity;   // 1/100 %
+};
+
+struct Bme280BeaconDecoder
+    : ManufacturerDecoder<COMPANY_ID_TEST, 6, 6, Prefix<>> {
+  typedef Bme280Beacon Result;
+
+  static void decode(const uint8_t *data, Bme280Beacon &beacon) {
+    beacon.temperature = (int16_t)(data[0] | (data[1] << 8));
+    beacon.pressure = (uint32_t)(data[2] | (data[3] << 8)) + 50000;
+    beacon.humidity = (uint16_t)(data[4] | (data[5] << 8));
+  }
+};
+
+/* Try the decoders in order on manufacturer data. On the first match,
+ * decode the data and call handler.onBeacon(advert, result).
+ */
+template <typename... Decoders> struct DecoderList;
+
+template <> struct DecoderList<> {
+  template <typename Advert, typename Handler>
+  static bool dispatch(const ManufacturerData &manufacturerData,
+                       const Advert &advert, Handler &handler) {
+    return false;
+  }
+};
+
+template <typename Decoder, typename... Rest>
+struct DecoderList<Decoder, Rest...> {
+  template <typename Advert, typename Handler>
+  static bool dispatch(const ManufacturerData &manufacturerData,
+                       const Advert &advert, Handler &handler) {
+    if (Decoder::matches(manufacturerData)) {
+      typename Decoder::Result result;
+      Decoder::decode(manufacturerData.data, result);
+      handler.onBeacon(advert, result);
+      return true;
+    }
+    return DecoderList<Rest...>::dispatch(manufacturerData, advert,
+                                          handler);
+  }
+};
+
+template <typename... Decoders> class BeaconDispatcher {
+public:
+  /* Walk the advertising data once and dispatch each manufacturer
+   * data structure to the first decoder that matches. Returns the
+   * number of decoded beacons.
+   */
+  template <typename Advert, typename Handler>
+  static int dispatch(const uint8_t *payload, size_t length,
+                      const Advert &advert, Handler &handler) {
+    AdParser parser(payload, length);
+    AdStructure ad;
+    ManufacturerData manufacturerData;
+    int decoded = 0;
+
+    while (parser.next(ad)) {
+      if (AdParser::toManufacturerData(ad, manufacturerData) &&
+          DecoderList<Decoders...>::dispatch(manufacturerData, advert,
+                                             handler)) {
+        decoded++;
+      }
+    }
+    return decoded;
+  }
+
+  // Check whether any decoder matches, without decoding.
+  static bool matches(const uint8_t *payload, size_t length) {
+    NullHandler handler;
+    return dispatch(payload, length, handler, handler) > 0;
+  }
+
+private:
+  struct NullHandler {
+    template <typename Advert, typename Result>
+    void onBeacon(const Advert &advert, const Result &result) {}
+  };
+};
+
+#endif /* BEACON_DECODERS_H_ */
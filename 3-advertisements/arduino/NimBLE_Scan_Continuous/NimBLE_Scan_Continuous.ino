@@ -1,78 +1,368 @@
 /** Example of continuous scanning for BLE advertisements.
  * This example will scan forever while consuming as few resources as
- * possible and report all advertisments on the serial monitor.
+ * possible and report advertisments on the serial monitor.
+ *
+ * A device is reported when it's first seen, when its advertising
+ * data changes, when its smoothed RSSI changes by more than
+ * RSSI_THRESHOLD and when it hasn't been seen for DEVICE_TIMEOUT.
+ *
+ * The scan interval and window adapt to the number of advertisements
+ * and new devices, between the bounds in schedulerConfig.
+ *
+ * With LOG_TO_FLASH, reported advertisements are also kept in a
+ * circular log on LittleFS, so they aren't lost while no serial host
+ * is connected. Send 'd' over serial to dump the log, 'c' to clear
+ * it.
  *
  * Created: on January 31 2021
  *      Author: H2zero
  *
  */
 
+/* Set to 1 to send advertisements as compact binary frames instead of
+ * text. Decode them with serial_scan_decoder.py.
+ */
+#ifndef OUTPUT_BINARY
+#define OUTPUT_BINARY 0
+#endif
+// Set to 1 to log reported advertisements to flash.
+#define LOG_TO_FLASH 0
+
 #include "NimBLEDevice.h"
+#if LOG_TO_FLASH
+#include <LittleFS.h>
+#endif
+#include "ad_parser.h"
+#include "advert_frame.h"
+#include "advert_queue.h"
+#include "advert_ring.h"
+#include "device_table.h"
+#include "flash_log.h"
+#include "scan_scheduler.h"
+
+// Number of queued advertisements, must be a power of two
+#define RING_SIZE 64
+// Number of device table slots, must be a power of two
+#define TABLE_SIZE 256
+// Smoothed RSSI change that is reported, in dBm
+#define RSSI_THRESHOLD 6
+// Time after which an unseen device is reported lost, in milliseconds
+#define DEVICE_TIMEOUT 30000
+// Interval to check for lost devices, in milliseconds
+#define EXPIRY_INTERVAL 1000
+// Interval to report statistics, in milliseconds
+#define STATS_INTERVAL 10000
+// Directory of the flash log, LittleFS is mounted at /littlefs
+#define LOG_DIRECTORY "/littlefs/scanlog"
+// Page size of the flash log, the LittleFS block size
+#define LOG_PAGE_SIZE 4096
+// Number of pages in the flash log
+#define LOG_PAGES 64
+// Interval to write a partially filled log page, in milliseconds
+#define LOG_FLUSH_INTERVAL 60000
 
 NimBLEScan *pBLEScan;
 
+/* Advertisements are queued by the scan callback on the NimBLE host
+ * task and printed in loop(), so slow serial output doesn't block the
+ * host task.
+ */
+static AdvertRing<RING_SIZE> advertRing;
+
+/* The device table replaces the duplicate filter of the controller.
+ * It's only accessed from loop().
+ */
+static DeviceTable<TABLE_SIZE> deviceTable(RSSI_THRESHOLD);
+
+/* Adapt the scan interval and window every 10 seconds:
+ * more scanning when new devices show up or it's busy, less when it's
+ * quiet.
+ */
+static const ScanSchedulerConfig schedulerConfig = {
+    60,    // Minimum interval, ms
+    500,   // Maximum interval, ms
+    20,    // Minimum window, ms
+    60,    // Maximum window, ms
+    10000, // Evaluation period, ms
+    5,     // Quiet below this number of advertisements/s
+    200,   // Busy above this number of advertisements/s
+    true,  // Allow active scanning
+};
+static ScanScheduler scheduler(schedulerConfig);
+
+static uint32_t lastExpiry = 0;
+static uint32_t lastStats = 0;
+
+#if LOG_TO_FLASH
+// Circular log of reported advertisements, only accessed from loop()
+static FlashLog<LOG_PAGE_SIZE, LOG_PAGES> flashLog(LOG_DIRECTORY);
+static uint32_t lastFlush = 0;
+#endif
+
+const char *reportNames[] = {"", "new", "payload", "RSSI"};
+
 class MyAdvertisedDeviceCallbacks
     : public NimBLEAdvertisedDeviceCallbacks {
   void onResult(NimBLEAdvertisedDevice *advertisedDevice) {
-    Serial.printf("Advertised Device: %s \n",
-                  advertisedDevice->toString().c_str());
+    queueAdvert(advertRing, advertisedDevice);
   }
 };
 
+void printAdvert(const AdvertRecord *record, const DeviceEntry *entry,
+                 DeviceReport report) {
+  const uint8_t *address = record->address;
+  AdParser parser(record->payload, record->length);
+  LocalName name;
+
+  Serial.printf("Advertised Device: %02x:%02x:%02x:%02x:%02x:%02x, "
+                "Report: %s, RSSI: %d dBm",
+                address[5], address[4], address[3], address[2],
+                address[1], address[0], reportNames[report],
+                entry->rssi());
+  if (parser.getName(name)) {
+    Serial.printf(", Name: %.*s", name.length, name.name);
+  }
+  Serial.print(", Payload: ");
+  for (int i = 0; i < record->length; i++) {
+    Serial.printf("%02x", record->payload[i]);
+  }
+  Serial.println();
+}
+
+void printLost(const DeviceEntry &entry) {
+  const uint8_t *address = entry.address;
+
+  Serial.printf("Lost Device: %02x:%02x:%02x:%02x:%02x:%02x, "
+                "%u advertisements in %u s\n",
+                address[5], address[4], address[3], address[2],
+                address[1], address[0], (unsigned)entry.count,
+                (unsigned)(entry.lastSeen - entry.firstSeen) / 1000);
+}
+
+void printStats() {
+  Serial.printf("Ring: %u dropped, high-water mark %u/%u\n",
+                (unsigned)advertRing.drops(),
+                (unsigned)advertRing.highWater(),
+                (unsigned)advertRing.capacity());
+  Serial.printf("Devices: %u/%u, %u evicted\n",
+                (unsigned)deviceTable.size(),
+                (unsigned)deviceTable.capacity(),
+                (unsigned)deviceTable.evictions());
+#if LOG_TO_FLASH
+  uint32_t amplification = flashLog.amplification();
+  Serial.printf("Log: %u records, %u pages written, write "
+                "amplification %u.%02u\n",
+                (unsigned)flashLog.records(),
+                (unsigned)flashLog.pagesWritten(),
+                (unsigned)(amplification / 100),
+                (unsigned)(amplification % 100));
+#endif
+}
+
+void printScan() {
+  const ScanStats &stats = scheduler.lastStats();
+  uint16_t dutyCycle = scheduler.dutyCycle();
+
+  Serial.printf("Scan: interval %u ms, window %u ms, duty cycle "
+                "%u.%u%%, %s\n",
+                scheduler.interval(), scheduler.window(),
+                dutyCycle / 10, dutyCycle % 10,
+                scheduler.activeScan() ? "active" : "passive");
+  Serial.printf("Last period: %u advertisements, %u new devices, "
+                "%u/%u/%u ms min/mean/max between advertisements\n",
+                (unsigned)stats.adverts, (unsigned)stats.newDevices,
+                (unsigned)stats.gapMin, (unsigned)stats.gapMean,
+                (unsigned)stats.gapMax);
+}
+
+void writeAdvertFrame(const AdvertRecord *record,
+                      const DeviceEntry *entry) {
+  uint8_t frame[FRAME_MAX_SIZE];
+
+  size_t length = frameEncodeAdvert(record, entry->rssi(), frame);
+
+  Serial.write(frame, length);
+}
+
+void writeLostFrame(const DeviceEntry &entry) {
+  uint8_t frame[FRAME_MAX_SIZE];
+
+  size_t length = frameEncodeLost(entry, frame);
+
+  Serial.write(frame, length);
+}
+
+void writeScanFrame() {
+  uint8_t frame[FRAME_MAX_SIZE];
+  size_t length = frameEncodeScan(scheduler, frame);
+
+  Serial.write(frame, length);
+}
+
+void writeStatsFrame() {
+  uint8_t frame[FRAME_MAX_SIZE];
+
+  size_t length = frameEncodeStats(
+      advertRing.drops(), advertRing.highWater(), deviceTable.size(),
+      deviceTable.evictions(), frame);
+
+  Serial.write(frame, length);
+}
+
+#if LOG_TO_FLASH
+void printLogged(const AdvertRecord &record) {
+  const uint8_t *address = record.address;
+
+  Serial.printf("Logged Device: %02x:%02x:%02x:%02x:%02x:%02x, "
+                "Time: %u ms, RSSI: %d dBm, Payload: ",
+                address[5], address[4], address[3], address[2],
+                address[1], address[0], (unsigned)record.timestamp,
+                record.rssi);
+  for (int i = 0; i < record.length; i++) {
+    Serial.printf("%02x", record.payload[i]);
+  }
+  Serial.println();
+}
+
+// Send all records in the flash log, oldest first.
+void dumpLog() {
+  uint32_t records = flashLog.read([](const AdvertRecord &record) {
+    if (OUTPUT_BINARY) {
+      uint8_t frame[FRAME_MAX_SIZE];
+      size_t length = frameEncodeAdvert(&record, record.rssi, frame);
+      Serial.write(frame, length);
+    } else {
+      printLogged(record);
+    }
+  });
+  if (!OUTPUT_BINARY) {
+    Serial.printf("Dumped %u logged advertisements\n",
+                  (unsigned)records);
+  }
+}
+
+// Handle commands from the serial host.
+void handleCommands() {
+  while (Serial.available() > 0) {
+    switch (Serial.read()) {
+    case 'd':
+      dumpLog();
+      break;
+    case 'c':
+      flashLog.clear();
+      break;
+    }
+  }
+}
+#endif
+
+void applyScanParameters() {
+  // How often the scan occurs / switches channels; in milliseconds,
+  pBLEScan->setInterval(scheduler.interval());
+  // How long to scan during the interval; in milliseconds.
+  pBLEScan->setWindow(scheduler.window());
+  // Active scanning gets more data from the advertiser.
+  pBLEScan->setActiveScan(scheduler.activeScan());
+}
+
 void setup() {
   Serial.begin(115200);
-  Serial.println("Scanning...");
-
-  /** *Optional* Sets the filtering mode used by the scanner in the
-   * BLE controller.
-   *
-   *  Can be one of:
-   *  CONFIG_BTDM_SCAN_DUPL_TYPE_DEVICE (0) (default)
-   *  Filter by device address only, advertisements from the same
-   *  address will be reported only once.
-   *
-   *  CONFIG_BTDM_SCAN_DUPL_TYPE_DATA (1)
-   *  Filter by data only, advertisements with the same data will only
-   *  be reported once, even from different addresses.
-   *
-   *  CONFIG_BTDM_SCAN_DUPL_TYPE_DATA_DEVICE (2)
-   *  Filter by address and data, advertisements from the same address
-   *  will be reported only once, except if the data in the
-   *  advertisement has changed, then it will be reported again.
-   *
-   *  Can only be used BEFORE calling NimBLEDevice::init.
-   */
-  NimBLEDevice::setScanFilterMode(CONFIG_BTDM_SCAN_DUPL_TYPE_DEVICE);
-
-  /** *Optional* Sets the scan filter cache size in the BLE
-   * controller. When the number of duplicate advertisements seen by
-   * the controller reaches this value it will clear the cache and
-   * start reporting previously seen devices. The larger this number,
-   * the longer time between repeated device reports. Range 10 - 1000.
-   * (default 20)
-   *
-   *  Can only be used BEFORE calling NimBLEDevice::init.
-   */
-  NimBLEDevice::setScanDuplicateCacheSize(200);
+  if (!OUTPUT_BINARY) {
+    Serial.println("Scanning...");
+  }
+
+#if LOG_TO_FLASH
+  // Format the file system if it can't be mounted.
+  if (!LittleFS.begin(true) && !OUTPUT_BINARY) {
+    Serial.println("Mounting LittleFS failed");
+  }
+  flashLog.begin();
+#endif
 
   NimBLEDevice::init("");
 
   // Create new scan
   pBLEScan = NimBLEDevice::getScan();
-  // Set the callback for when devices are discovered, no duplicates.
+  /* Set the callback for when devices are discovered, with
+   * duplicates. The device table decides what to report, so disable
+   * the duplicate filter of the controller. Its cache overflows in
+   * busy environments and it suppresses RSSI updates.
+   */
   pBLEScan->setAdvertisedDeviceCallbacks(
-      new MyAdvertisedDeviceCallbacks(), false);
-  // Set active scanning, this will get more data from the advertiser.
-  pBLEScan->setActiveScan(true);
-  // How often the scan occurs / switches channels; in milliseconds,
-  pBLEScan->setInterval(97);
-  // How long to scan during the interval; in milliseconds.
-  pBLEScan->setWindow(37);
+      new MyAdvertisedDeviceCallbacks(), true);
+  pBLEScan->setDuplicateFilter(false);
+  applyScanParameters();
   // Do not store the scan results, use callback only.
   pBLEScan->setMaxResults(0);
 }
 
 void loop() {
+  // Report queued advertisements if the device state changed.
+  const AdvertRecord *record;
+  while ((record = advertRing.peek()) != nullptr) {
+    const DeviceEntry *entry;
+    DeviceReport report = deviceTable.update(record, entry);
+    scheduler.onAdvert(report == REPORT_NEW, entry->lastGap);
+
+    if (report != REPORT_NONE) {
+      if (OUTPUT_BINARY) {
+        writeAdvertFrame(record, entry);
+      } else {
+        printAdvert(record, entry, report);
+      }
+#if LOG_TO_FLASH
+      flashLog.append(record);
+#endif
+    }
+    advertRing.pop();
+  }
+
+  // Report and remove devices that haven't been seen for a while.
+  if (millis() - lastExpiry >= EXPIRY_INTERVAL) {
+    lastExpiry = millis();
+    deviceTable.expire(lastExpiry, DEVICE_TIMEOUT,
+                       [](const DeviceEntry &entry) {
+                         if (OUTPUT_BINARY) {
+                           writeLostFrame(entry);
+                         } else {
+                           printLost(entry);
+                         }
+                       });
+  }
+
+  // Adapt the scan parameters to the advertisements of last period.
+  if (scheduler.evaluate(millis())) {
+    if (scheduler.parametersChanged()) {
+      // The scan is restarted below.
+      pBLEScan->stop();
+      applyScanParameters();
+    }
+    if (OUTPUT_BINARY) {
+      writeScanFrame();
+    } else {
+      printScan();
+    }
+  }
+
+#if LOG_TO_FLASH
+  // Write the partially filled page now and then.
+  if (millis() - lastFlush >= LOG_FLUSH_INTERVAL) {
+    lastFlush = millis();
+    flashLog.flush();
+  }
+  handleCommands();
+#endif
+
+  // Report statistics to help sizing the ring and the table.
+  if (millis() - lastStats >= STATS_INTERVAL) {
+    lastStats = millis();
+    if (OUTPUT_BINARY) {
+      writeStatsFrame();
+    } else {
+      printStats();
+    }
+  }
+
   // If an error occurs that stops the scan, it will be restarted
   // here.
   if (pBLEScan->isScanning() == false) {
@@ -81,5 +371,5 @@ void loop() {
     pBLEScan->start(0, nullptr, false);
   }
 
-  delay(2000);
+  delay(10);
 }
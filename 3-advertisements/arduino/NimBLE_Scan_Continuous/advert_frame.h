@@ -0,0 +1,187 @@
+/** Compact binary framing of advertisement records.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Each frame is a record followed by a CRC-16/CCITT-FALSE over the
+ * record (little-endian), COBS-encoded and terminated by a zero byte.
+ * A decoder can resynchronize on any zero byte.
+ *
+ * Advertisement record (FRAME_TYPE_ADVERT):
+ *   type (1), address (6, little-endian), address type (1),
+ *   RSSI (1, signed), timestamp in ms (4, little-endian),
+ *   raw advertising data (0-62)
+ *
+ * Statistics record (FRAME_TYPE_STATS):
+ *   type (1), dropped advertisements (4, little-endian),
+ *   high-water mark (4, little-endian), devices (4, little-endian),
+ *   evicted devices (4, little-endian)
+ *
+ * Lost device record (FRAME_TYPE_LOST):
+ *   type (1), address (6, little-endian), address type (1),
+ *   first seen in ms (4, little-endian),
+ *   last seen in ms (4, little-endian),
+ *   number of advertisements (4, little-endian)
+ *
+ * Scan parameters record (FRAME_TYPE_SCAN):
+ *   type (1), interval in ms (2, little-endian),
+ *   window in ms (2, little-endian), active scan (1),
+ *   advertisements (4, little-endian),
+ *   new devices (4, little-endian), minimum, mean and maximum time
+ *   between advertisements of the same device in ms
+ *   (3 x 4, little-endian)
+ */
+#ifndef ADVERT_FRAME_H_
+#define ADVERT_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "advert_ring.h"
+#include "device_table.h"
+#include "scan_scheduler.h"
+
+#define FRAME_TYPE_ADVERT 0x01
+#define FRAME_TYPE_STATS 0x02
+#define FRAME_TYPE_LOST 0x03
+#define FRAME_TYPE_SCAN 0x04
+
+// Largest record and CRC before encoding
+#define FRAME_MAX_RAW (13 + ADVERT_MAX_PAYLOAD + 2)
+// COBS adds one byte per 254 bytes, plus the zero delimiter
+#define FRAME_MAX_SIZE (FRAME_MAX_RAW + FRAME_MAX_RAW / 254 + 2)
+
+static inline uint16_t frameCrc16(const uint8_t *data,
+                                  size_t length) {
+  uint16_t crc = 0xffff;
+
+  for (size_t i = 0; i < length; i++) {
+    crc = (uint16_t)((crc >> 8) | (crc << 8));
+    crc ^= data[i];
+    crc ^= (crc & 0xff) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xff) << 5;
+  }
+  return crc;
+}
+
+/* COBS-encode length bytes from in into out, followed by the zero
+ * delimiter. Returns the number of bytes written.
+ */
+static inline size_t frameCobsEncode(const uint8_t *in, size_t length,
+                                     uint8_t *out) {
+  size_t codeIndex = 0;
+  size_t outIndex = 1;
+  uint8_t code = 1;
+
+  for (size_t i = 0; i < length; i++) {
+    if (in[i] != 0) {
+      out[outIndex++] = in[i];
+      code++;
+    }
+    if (in[i] == 0 || code == 0xff) {
+      out[codeIndex] = code;
+      codeIndex = outIndex++;
+      code = 1;
+    }
+  }
+  out[codeIndex] = code;
+  out[outIndex++] = 0;
+  return outIndex;
+}
+
+static inline void framePut16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value & 0xff;
+  buffer[1] = (value >> 8) & 0xff;
+}
+
+static inline void framePut32(uint8_t *buffer, uint32_t value) {
+  buffer[0] = value & 0xff;
+  buffer[1] = (value >> 8) & 0xff;
+  buffer[2] = (value >> 16) & 0xff;
+  buffer[3] = (value >> 24) & 0xff;
+}
+
+// Add the CRC to a record and encode it into a frame.
+static inline size_t frameFinish(uint8_t *raw, size_t length,
+                                 uint8_t *frame) {
+  uint16_t crc = frameCrc16(raw, length);
+
+  raw[length++] = crc & 0xff;
+  raw[length++] = crc >> 8;
+  return frameCobsEncode(raw, length, frame);
+}
+
+/* Encode an advertisement record with the given RSSI into frame,
+ * which must have room for FRAME_MAX_SIZE bytes. Returns the frame
+ * length.
+ */
+static inline size_t frameEncodeAdvert(const AdvertRecord *record,
+                                       int8_t rssi, uint8_t *frame) {
+  uint8_t raw[FRAME_MAX_RAW];
+
+  raw[0] = FRAME_TYPE_ADVERT;
+  for (int i = 0; i < 6; i++) {
+    raw[1 + i] = record->address[i];
+  }
+  raw[7] = record->addressType;
+  raw[8] = (uint8_t)rssi;
+  framePut32(&raw[9], record->timestamp);
+  for (int i = 0; i < record->length; i++) {
+    raw[13 + i] = record->payload[i];
+  }
+  return frameFinish(raw, 13 + record->length, frame);
+}
+
+// Encode statistics into frame. Returns the frame length.
+static inline size_t frameEncodeStats(uint32_t drops,
+                                      uint32_t highWater,
+                                      uint32_t devices,
+                                      uint32_t evictions,
+                                      uint8_t *frame) {
+  uint8_t raw[17 + 2];
+
+  raw[0] = FRAME_TYPE_STATS;
+  framePut32(&raw[1], drops);
+  framePut32(&raw[5], highWater);
+  framePut32(&raw[9], devices);
+  framePut32(&raw[13], evictions);
+  return frameFinish(raw, 17, frame);
+}
+
+// Encode a lost device into frame. Returns the frame length.
+static inline size_t frameEncodeLost(const DeviceEntry &entry,
+                                     uint8_t *frame) {
+  uint8_t raw[20 + 2];
+
+  raw[0] = FRAME_TYPE_LOST;
+  for (int i = 0; i < 6; i++) {
+    raw[1 + i] = entry.address[i];
+  }
+  raw[7] = entry.addressType;
+  framePut32(&raw[8], entry.firstSeen);
+  framePut32(&raw[12], entry.lastSeen);
+  framePut32(&raw[16], entry.count);
+  return frameFinish(raw, 20, frame);
+}
+
+// Encode the scan parameters into frame. Returns the frame length.
+static inline size_t frameEncodeScan(const ScanScheduler &scheduler,
+                                     uint8_t *frame) {
+  const ScanStats &stats = scheduler.lastStats();
+  uint8_t raw[26 + 2];
+
+  raw[0] = FRAME_TYPE_SCAN;
+  framePut16(&raw[1], scheduler.interval());
+  framePut16(&raw[3], scheduler.window());
+  raw[5] = scheduler.activeScan();
+  framePut32(&raw[6], stats.adverts);
+  framePut32(&raw[10], stats.newDevices);
+  framePut32(&raw[14], stats.gapMin);
+  framePut32(&raw[18], stats.gapMean);
+  framePut32(&raw[22], stats.gapMax);
+  return frameFinish(raw, 26, frame);
+}
+
+#endif /* ADVERT_FRAME_H_ */
@@ -0,0 +1,216 @@
+/** Fixed-capacity table with the state of advertising devices.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The table uses open addressing with linear probing, keyed by
+ * address and address type. It never allocates: when it's full, the
+ * least recently seen device is evicted. For every advertisement,
+ * update() tells whether the device should be reported: when it's
+ * new, when its payload changed or when its smoothed RSSI moved more
+ * than a threshold since the last report. expire() removes devices
+ * that haven't been seen for a while.
+ */
+#ifndef DEVICE_TABLE_H_
+#define DEVICE_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "advert_ring.h"
+
+enum DeviceReport {
+  REPORT_NONE,
+  REPORT_NEW,
+  REPORT_PAYLOAD,
+  REPORT_RSSI,
+};
+
+struct DeviceEntry {
+  uint8_t address[6];
+  uint8_t addressType;
+  uint8_t used;
+  int16_t smoothedRssi; // dBm in 1/16 dBm units
+  int16_t reportedRssi; // dBm in 1/16 dBm units
+  uint32_t payloadHash;
+  uint32_t firstSeen;
+  uint32_t lastSeen;
+  uint32_t lastGap; // ms between the last two advertisements
+  uint32_t count;
+
+  int8_t rssi() const { return (int8_t)(smoothedRssi / 16); }
+};
+
+// 32-bit FNV-1a hash
+static inline uint32_t deviceHash(const uint8_t *data, size_t length,
+                                  uint32_t hash = 2166136261u) {
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// N must be a power of two.
+template <size_t N> class DeviceTable {
+  static_assert(N > 0 && (N & (N - 1)) == 0,
+                "Table size must be a power of two");
+
+public:
+  /* rssiThreshold: smoothed RSSI change in dBm that triggers a
+   * report. rssiShift: smoothing factor of the RSSI filter as a power
+   * of two. Each advertisement moves the smoothed RSSI 1/2^rssiShift
+   * of the way to the new RSSI.
+   */
+  DeviceTable(uint8_t rssiThreshold = 6, uint8_t rssiShift = 2)
+      : rssiThreshold(rssiThreshold * 16), rssiShift(rssiShift),
+        entryCount(0), evictionCount(0) {
+    memset(entries, 0, sizeof(entries));
+  }
+
+  /* Update the state of the device that sent the advertisement. If
+   * the device should be reported, returns the reason and sets entry.
+   */
+  DeviceReport update(const AdvertRecord *record,
+                      const DeviceEntry *&entry) {
+    uint32_t payloadHash =
+        deviceHash(record->payload, record->length);
+    int16_t rssi = record->rssi * 16;
+    size_t i = find(record->address, record->addressType);
+
+    if (!entries[i].used) {
+      if (entryCount >= MAX_ENTRIES) {
+        evictLeastRecentlySeen();
+        i = find(record->address, record->addressType);
+      }
+
+      DeviceEntry &e = entries[i];
+      memcpy(e.address, record->address, 6);
+      e.addressType = record->addressType;
+      e.used = 1;
+      e.smoothedRssi = rssi;
+      e.reportedRssi = rssi;
+      e.payloadHash = payloadHash;
+      e.firstSeen = record->timestamp;
+      e.lastSeen = record->timestamp;
+      e.lastGap = 0;
+      e.count = 1;
+      entryCount++;
+      entry = &e;
+      return REPORT_NEW;
+    }
+
+    DeviceEntry &e = entries[i];
+    e.lastGap = record->timestamp - e.lastSeen;
+    e.lastSeen = record->timestamp;
+    e.count++;
+    e.smoothedRssi += (rssi - e.smoothedRssi) / (1 << rssiShift);
+    entry = &e;
+
+    if (e.payloadHash != payloadHash) {
+      e.payloadHash = payloadHash;
+      e.reportedRssi = e.smoothedRssi;
+      return REPORT_PAYLOAD;
+    }
+
+    int16_t delta = e.smoothedRssi - e.reportedRssi;
+    if (delta >= rssiThreshold || -delta >= rssiThreshold) {
+      e.reportedRssi = e.smoothedRssi;
+      return REPORT_RSSI;
+    }
+
+    return REPORT_NONE;
+  }
+
+  /* Remove all devices not seen for more than timeout ms before now,
+   * and call callback(const DeviceEntry &) for each of them.
+   */
+  template <typename Callback>
+  void expire(uint32_t now, uint32_t timeout, Callback callback) {
+    size_t i = 0;
+    while (i < N) {
+      if (entries[i].used && now - entries[i].lastSeen > timeout) {
+        callback(entries[i]);
+        // Removing can shift a later entry into this slot.
+        remove(i);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  size_t size() const { return entryCount; }
+
+  size_t capacity() const { return MAX_ENTRIES; }
+
+  // Number of devices evicted because the table was full.
+  uint32_t evictions() const { return evictionCount; }
+
+private:
+  // Keep the load factor at 3/4 so probe sequences stay short.
+  static const size_t MAX_ENTRIES = N - N / 4;
+
+  DeviceEntry entries[N];
+  int16_t rssiThreshold;
+  uint8_t rssiShift;
+  size_t entryCount;
+  uint32_t evictionCount;
+
+  static size_t home(const uint8_t *address, uint8_t addressType) {
+    return deviceHash(&addressType, 1, deviceHash(address, 6)) &
+           (N - 1);
+  }
+
+  // Find the slot of a device, or the empty slot where it belongs.
+  size_t find(const uint8_t *address, uint8_t addressType) const {
+    size_t i = home(address, addressType);
+    while (entries[i].used &&
+           (entries[i].addressType != addressType ||
+            memcmp(entries[i].address, address, 6) != 0)) {
+      i = (i + 1) & (N - 1);
+    }
+    return i;
+  }
+
+  void evictLeastRecentlySeen() {
+    size_t oldest = N;
+    for (size_t i = 0; i < N; i++) {
+      if (entries[i].used &&
+          (oldest == N ||
+           (int32_t)(entries[i].lastSeen - entries[oldest].lastSeen) <
+               0)) {
+        oldest = i;
+      }
+    }
+    remove(oldest);
+    evictionCount++;
+  }
+
+  /* Remove the entry in slot i with backward shift deletion, so no
+   * tombstones are needed.
+   */
+  void remove(size_t i) {
+    size_t j = i;
+    entries[i].used = 0;
+    entryCount--;
+
+    while (true) {
+      j = (j + 1) & (N - 1);
+      if (!entries[j].used) {
+        return;
+      }
+
+      // Move the entry back if its home slot isn't between i and j.
+      size_t k = home(entries[j].address, entries[j].addressType);
+      bool between = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+      if (!between) {
+        entries[i] = entries[j];
+        entries[j].used = 0;
+        i = j;
+      }
+    }
+  }
+};
+
+#endif /* DEVICE_TABLE_H_ */
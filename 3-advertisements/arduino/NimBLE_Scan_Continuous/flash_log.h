@@ -0,0 +1,284 @@
+/** Circular log of advertisement records on a file system.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Records are collected in a page in RAM. A full page is written as
+ * one file in the log directory, so each flash write is a whole page.
+ * Page n goes to segment file n % PageCount, which makes the log
+ * circular: when it's full, the oldest page is overwritten, and all
+ * segments are written equally often. Writing whole small files also
+ * suits LittleFS, which would copy the rest of a large file when
+ * overwriting its middle.
+ *
+ * The log uses stdio, so it works on the ESP32 with LittleFS mounted
+ * in the VFS (at /littlefs by default) and on Linux, for benchmarks.
+ * SPIFFS works too: it has no directories, but accepts slashes in
+ * file names.
+ *
+ * Page layout (little-endian):
+ *   magic (4), sequence number (4), number of records (2),
+ *   length of the records (2), CRC-16/CCITT-FALSE of the records (2),
+ *   reserved (2), records
+ *
+ * Record layout:
+ *   timestamp in ms (4), address (6), address type (1),
+ *   RSSI (1, signed), length (1), raw advertising data (0-62)
+ */
+#ifndef FLASH_LOG_H_
+#define FLASH_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "advert_frame.h"
+#include "advert_ring.h"
+
+#define LOG_PAGE_MAGIC 0x474f4c53 // "SLOG"
+#define LOG_PAGE_HEADER 16
+#define LOG_RECORD_HEADER 13
+#define LOG_PATH_MAX 64
+
+static inline uint16_t logGet16(const uint8_t *buffer) {
+  return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+static inline uint32_t logGet32(const uint8_t *buffer) {
+  return (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) |
+         ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+template <size_t PageSize, uint16_t PageCount> class FlashLog {
+  static_assert(PageSize >= LOG_PAGE_HEADER + LOG_RECORD_HEADER +
+                                ADVERT_MAX_PAYLOAD,
+                "Page too small for a record");
+  static_assert(PageCount >= 2, "Log needs at least two pages");
+
+public:
+  // directory: where to store the segment files
+  FlashLog(const char *directory)
+      : directory(directory), sequence(0), used(0), count(0),
+        recordCount(0), recordBytes(0), pageCount(0), byteCount(0) {}
+
+  /* Create the log directory if needed and continue after the newest
+   * page in it.
+   */
+  void begin() {
+    // Fails if it exists, or on SPIFFS
+    mkdir(directory, 0755);
+
+    bool found = false;
+    for (uint16_t segment = 0; segment < PageCount; segment++) {
+      uint32_t pageSequence;
+      if (readPage(segment, pageSequence, nullptr) &&
+          (!found || (int32_t)(pageSequence - sequence) > 0)) {
+        sequence = pageSequence;
+        found = true;
+      }
+    }
+    // Start a new page, the last one may be partially filled.
+    if (found) {
+      sequence++;
+    }
+    startPage();
+  }
+
+  /* Add a record to the page in RAM. When the page is full, it's
+   * written first. Returns false if writing failed.
+   */
+  bool append(const AdvertRecord *record) {
+    size_t length = LOG_RECORD_HEADER + record->length;
+    bool ok = true;
+
+    if (LOG_PAGE_HEADER + used + length > PageSize) {
+      ok = writePage();
+      sequence++;
+      startPage();
+    }
+
+    uint8_t *p = &page[LOG_PAGE_HEADER + used];
+    framePut32(&p[0], record->timestamp);
+    memcpy(&p[4], record->address, 6);
+    p[10] = record->addressType;
+    p[11] = (uint8_t)record->rssi;
+    p[12] = record->length;
+    memcpy(&p[13], record->payload, record->length);
+    used += length;
+    count++;
+    recordCount++;
+    recordBytes += length;
+    return ok;
+  }
+
+  /* Write the partially filled page, so its records survive a reset.
+   * The page is written again when more records are added.
+   */
+  bool flush() { return count == 0 || writePage(); }
+
+  /* Call callback(const AdvertRecord &) for all records in the log,
+   * oldest first, including the ones that aren't written yet. Returns
+   * the number of records.
+   */
+  template <typename Callback> uint32_t read(Callback callback) {
+    uint32_t records = 0;
+    uint32_t oldest = sequence - PageCount;
+
+    /* The segment of the page in RAM still holds the oldest page,
+     * unless the page in RAM was flushed.
+     */
+    for (uint32_t s = oldest; s != sequence; s++) {
+      uint32_t pageSequence;
+      if (readPage(s % PageCount, pageSequence, readBuffer) &&
+          pageSequence == s) {
+        records += readRecords(readBuffer, callback);
+      }
+    }
+    return records + readRecords(page, callback);
+  }
+
+  // Remove all pages and start with an empty log.
+  void clear() {
+    char path[LOG_PATH_MAX];
+
+    for (uint16_t segment = 0; segment < PageCount; segment++) {
+      segmentPath(segment, path);
+      remove(path);
+    }
+    sequence = 0;
+    startPage();
+  }
+
+  // Number of records appended since begin()
+  uint32_t records() const { return recordCount; }
+
+  // Number of pages written since begin(), including partial pages
+  uint32_t pagesWritten() const { return pageCount; }
+
+  // Bytes written to storage since begin()
+  uint64_t bytesWritten() const { return byteCount; }
+
+  /* Write amplification: bytes written per byte of records appended,
+   * in 1/100. Partial pages that are flushed and written again add to
+   * it.
+   */
+  uint32_t amplification() const {
+    return recordBytes ? (uint32_t)(byteCount * 100 / recordBytes)
+                       : 0;
+  }
+
+  size_t capacity() const { return PageSize * PageCount; }
+
+private:
+  const char *directory;
+  uint8_t page[PageSize];
+  // For read(), too large for the stack of the loop task
+  uint8_t readBuffer[PageSize];
+  uint32_t sequence; // Sequence number of the page in RAM
+  size_t used;       // Bytes of records in the page in RAM
+  uint16_t count;    // Records in the page in RAM
+  uint32_t recordCount;
+  uint64_t recordBytes;
+  uint32_t pageCount;
+  uint64_t byteCount;
+
+  void segmentPath(uint16_t segment, char *path) const {
+    snprintf(path, LOG_PATH_MAX, "%s/%04u.log", directory,
+             (unsigned)segment);
+  }
+
+  void startPage() {
+    used = 0;
+    count = 0;
+  }
+
+  // Write the page in RAM to its segment file.
+  bool writePage() {
+    char path[LOG_PATH_MAX];
+    size_t length = LOG_PAGE_HEADER + used;
+
+    framePut32(&page[0], LOG_PAGE_MAGIC);
+    framePut32(&page[4], sequence);
+    framePut16(&page[8], count);
+    framePut16(&page[10], (uint16_t)used);
+    framePut16(&page[12], frameCrc16(&page[LOG_PAGE_HEADER], used));
+    framePut16(&page[14], 0);
+
+    segmentPath(sequence % PageCount, path);
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    bool ok = fwrite(page, 1, length, file) == length;
+    ok = fclose(file) == 0 && ok;
+
+    pageCount++;
+    byteCount += length;
+    return ok;
+  }
+
+  /* Read and check the page in a segment file. If buffer is nullptr,
+   * only the header is checked.
+   */
+  bool readPage(uint16_t segment, uint32_t &pageSequence,
+                uint8_t *buffer) const {
+    char path[LOG_PATH_MAX];
+    uint8_t header[LOG_PAGE_HEADER];
+
+    segmentPath(segment, path);
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+      return false;
+    }
+
+    size_t headerLength = fread(header, 1, sizeof(header), file);
+    bool ok = headerLength == sizeof(header);
+    uint16_t length = ok ? logGet16(&header[10]) : 0;
+    ok = ok && logGet32(&header[0]) == LOG_PAGE_MAGIC &&
+         (size_t)LOG_PAGE_HEADER + length <= PageSize;
+    if (ok && buffer != nullptr) {
+      uint8_t *records = &buffer[LOG_PAGE_HEADER];
+      memcpy(buffer, header, sizeof(header));
+      ok = fread(records, 1, length, file) == length &&
+           frameCrc16(records, length) == logGet16(&header[12]);
+    }
+    fclose(file);
+
+    if (ok) {
+      pageSequence = logGet32(&header[4]);
+    }
+    return ok;
+  }
+
+  // Call callback for each record in a page.
+  template <typename Callback>
+  uint32_t readRecords(const uint8_t *buffer, Callback callback) {
+    size_t length = buffer == page ? used : logGet16(&buffer[10]);
+    const uint8_t *p = &buffer[LOG_PAGE_HEADER];
+    const uint8_t *end = p + length;
+    uint32_t records = 0;
+    AdvertRecord record;
+
+    while (end - p >= LOG_RECORD_HEADER) {
+      record.timestamp = logGet32(&p[0]);
+      memcpy(record.address, &p[4], 6);
+      record.addressType = p[10];
+      record.rssi = (int8_t)p[11];
+      record.length = p[12];
+      if (record.length > ADVERT_MAX_PAYLOAD ||
+          end - p < LOG_RECORD_HEADER + record.length) {
+        break;
+      }
+      memcpy(record.payload, &p[13], record.length);
+      p += LOG_RECORD_HEADER + record.length;
+      callback(record);
+      records++;
+    }
+    return records;
+  }
+};
+
+#endif /* FLASH_LOG_H_ */
@@ -0,0 +1,165 @@
+/** Adaptive scan interval and window.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The scheduler counts advertisements and newly discovered devices
+ * during an evaluation period. At the end of the period it moves the
+ * scan duty cycle between the configured bounds: up when new devices
+ * show up or the environment is busy, down when it's quiet. Active
+ * scanning is only used while new devices are being discovered and
+ * the environment isn't too busy, because scan requests cost airtime.
+ *
+ * As a measure of discovery latency, the scheduler keeps the time
+ * between consecutive advertisements of the same device. A new device
+ * is discovered on average that long after it appears.
+ */
+#ifndef SCAN_SCHEDULER_H_
+#define SCAN_SCHEDULER_H_
+
+#include <stdint.h>
+
+struct ScanSchedulerConfig {
+  uint16_t minInterval; // ms
+  uint16_t maxInterval; // ms
+  uint16_t minWindow;   // ms
+  uint16_t maxWindow;   // ms
+  uint32_t period;      // Evaluation period, ms
+  uint16_t quietRate;   // Advertisements/s below which it's quiet
+  uint16_t busyRate;    // Advertisements/s above which it's busy
+  bool allowActive;     // Allow switching to active scanning
+};
+
+// Statistics of the last evaluation period
+struct ScanStats {
+  uint32_t adverts;
+  uint32_t newDevices;
+  uint32_t gapMin; // ms between advertisements of the same device
+  uint32_t gapMean;
+  uint32_t gapMax;
+};
+
+class ScanScheduler {
+public:
+  // Number of steps between the lowest and highest duty cycle
+  static const uint8_t LEVELS = 8;
+
+  ScanScheduler(const ScanSchedulerConfig &config)
+      : config(config), level(LEVELS / 2), active(false),
+        changed(false), periodStart(0), stats() {
+    resetCounters();
+    apply();
+  }
+
+  /* Count an advertisement. gap is the time since the previous
+   * advertisement of the same device, or 0 for a new device.
+   */
+  void onAdvert(bool newDevice, uint32_t gap) {
+    adverts++;
+    if (newDevice) {
+      newDevices++;
+    } else {
+      gapCount++;
+      gapSum += gap;
+      if (gap < gapMin) {
+        gapMin = gap;
+      }
+      if (gap > gapMax) {
+        gapMax = gap;
+      }
+    }
+  }
+
+  /* Call regularly. At the end of an evaluation period, adapt the
+   * scan parameters and return true. If parametersChanged() is true
+   * after that, restart the scan with the new parameters.
+   */
+  bool evaluate(uint32_t now) {
+    uint32_t elapsed = now - periodStart;
+    if (elapsed < config.period) {
+      return false;
+    }
+
+    uint32_t rate = adverts * 1000 / elapsed;
+    uint8_t oldLevel = level;
+    bool oldActive = active;
+
+    if (newDevices > 0 || rate > config.busyRate) {
+      level = (level + 2 < LEVELS) ? level + 2 : LEVELS - 1;
+    } else if (rate < config.quietRate && level > 0) {
+      level--;
+    }
+    active = config.allowActive && newDevices > 0 &&
+             rate <= config.busyRate;
+
+    stats.adverts = adverts;
+    stats.newDevices = newDevices;
+    stats.gapMin = gapCount ? gapMin : 0;
+    stats.gapMean = gapCount ? (uint32_t)(gapSum / gapCount) : 0;
+    stats.gapMax = gapMax;
+
+    periodStart = now;
+    resetCounters();
+    apply();
+    changed = level != oldLevel || active != oldActive;
+    return true;
+  }
+
+  bool parametersChanged() const { return changed; }
+
+  uint16_t interval() const { return scanInterval; }
+
+  uint16_t window() const { return scanWindow; }
+
+  bool activeScan() const { return active; }
+
+  // Fraction of time the radio listens, in per mille
+  uint16_t dutyCycle() const {
+    return (uint16_t)((uint32_t)scanWindow * 1000 / scanInterval);
+  }
+
+  const ScanStats &lastStats() const { return stats; }
+
+private:
+  ScanSchedulerConfig config;
+  uint8_t level;
+  bool active;
+  bool changed;
+  uint16_t scanInterval;
+  uint16_t scanWindow;
+  uint32_t periodStart;
+  uint32_t adverts;
+  uint32_t newDevices;
+  uint32_t gapCount;
+  uint64_t gapSum;
+  uint32_t gapMin;
+  uint32_t gapMax;
+  ScanStats stats;
+
+  void resetCounters() {
+    adverts = 0;
+    newDevices = 0;
+    gapCount = 0;
+    gapSum = 0;
+    gapMin = UINT32_MAX;
+    gapMax = 0;
+  }
+
+  // Interpolate interval and window between the bounds.
+  void apply() {
+    scanInterval =
+        config.maxInterval -
+        (uint32_t)(config.maxInterval - config.minInterval) * level /
+            (LEVELS - 1);
+    scanWindow =
+        config.minWindow +
+        (uint32_t)(config.maxWindow - config.minWindow) * level /
+            (LEVELS - 1);
+    if (scanWindow > scanInterval) {
+      scanWindow = scanInterval;
+    }
+  }
+};
+
+#endif /* SCAN_SCHEDULER_H_ */
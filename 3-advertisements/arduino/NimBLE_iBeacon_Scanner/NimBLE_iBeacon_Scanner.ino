@@ -6,45 +6,136 @@
  *
  * Based on h2zero's example BLE_Beacon_Scanner.ino.
  *
+ * For each beacon, the sketch estimates the distance and zone
+ * (immediate, near or far) from the smoothed RSSI, see
+ * beacon_distance.h. It prints a beacon when it's first seen and when
+ * its zone changes.
  */
-#include "NimBLEBeacon.h"
 #include "NimBLEDevice.h"
+#include "ad_parser.h"
+#include "advert_queue.h"
+#include "advert_ring.h"
+#include "beacon_distance.h"
 
-#define ENDIAN_CHANGE_U16(x) ((((x)&0xff00) >> 8) + (((x)&0xff) << 8))
+#define COMPANY_ID_APPLE 0x004c
+
+// Number of queued advertisements, must be a power of two
+#define RING_SIZE 32
+// Number of beacon table slots, must be a power of two
+#define TABLE_SIZE 512
+// Path loss exponent in tenths: 20 in free space, 25 to 40 indoors
+#define PATH_LOSS_EXPONENT 25
+/* To calibrate the path loss exponent, put a beacon at a known
+ * distance of more than 1 m and set its major, minor and distance in
+ * cm here. The calibration uses the smoothed RSSI after
+ * CALIBRATION_COUNT advertisements.
+ */
+#define CALIBRATION_MAJOR 0
+#define CALIBRATION_MINOR 0
+#define CALIBRATION_DISTANCE 0
+#define CALIBRATION_COUNT 50
+// Interval to report statistics, in milliseconds
+#define STATS_INTERVAL 10000
 
 NimBLEScan *pBLEScan;
 
+/* Matching advertisements are queued by the scan callback on the
+ * NimBLE host task and printed in loop(), so slow serial output
+ * doesn't block the host task.
+ */
+static AdvertRing<RING_SIZE> advertRing;
+static uint32_t lastStats = 0;
+
+// Distance estimates per beacon, only accessed from loop()
+static BeaconTable<TABLE_SIZE> beaconTable(PATH_LOSS_EXPONENT);
+static bool calibrated = false;
+
+const char *zoneNames[] = {"immediate", "near", "far"};
+
+// Get the iBeacon data from an advertisement, if it's an iBeacon.
+bool getIBeaconData(const uint8_t *payload, size_t length,
+                    ManufacturerData &manufacturerData) {
+  AdParser parser(payload, length);
+
+  return parser.getManufacturerData(manufacturerData) &&
+         manufacturerData.companyId == COMPANY_ID_APPLE &&
+         manufacturerData.length == 23 &&
+         manufacturerData.data[0] == 0x02 &&
+         manufacturerData.data[1] == 0x15;
+}
+
 class MyAdvertisedDeviceCallbacks
     : public NimBLEAdvertisedDeviceCallbacks {
   void onResult(NimBLEAdvertisedDevice *advertisedDevice) {
-    if (advertisedDevice->haveManufacturerData() == true) {
-      std::string strManufacturerData =
-          advertisedDevice->getManufacturerData();
-
-      if (strManufacturerData.length() == 25 &&
-          strManufacturerData[0] == 0x4c &&
-          strManufacturerData[1] == 0x00 &&
-          strManufacturerData[2] == 0x02 &&
-          strManufacturerData[3] == 0x15) {
-        NimBLEBeacon iBeacon = NimBLEBeacon();
-        iBeacon.setData(strManufacturerData);
-        Serial.printf("UUID     : %s\n",
-                      iBeacon.getProximityUUID().toString().c_str());
-        Serial.printf("Major    : %d\n",
-                      ENDIAN_CHANGE_U16(iBeacon.getMajor()));
-        Serial.printf("Minor    : %d\n",
-                      ENDIAN_CHANGE_U16(iBeacon.getMinor()));
-        Serial.printf("TX power : %d dBm\n",
-                      iBeacon.getSignalPower());
-        Serial.printf("RSSI     : %d dBm\n",
-                      advertisedDevice->getRSSI());
-        Serial.println(
-            "-----------------------------------------------");
-      }
+    ManufacturerData manufacturerData;
+
+    if (getIBeaconData(advertisedDevice->getPayload(),
+                       advertisedDevice->getPayloadLength(),
+                       manufacturerData)) {
+      queueAdvert(advertRing, advertisedDevice);
     }
   }
 };
 
+/* Print a beacon on one line when it's new or changes zone. Printing
+ * every advertisement, 230 bytes each, would limit loop() to some 50
+ * advertisements/s at 115200 baud.
+ */
+void printBeacon(const BeaconEntry *entry) {
+  const uint8_t *uuid = entry->uuid;
+
+  Serial.printf("%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+                "%02x%02x%02x%02x%02x%02x %u %u: %s, %u.%02u m, "
+                "%d dBm\n",
+                uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5],
+                uuid[6], uuid[7], uuid[8], uuid[9], uuid[10],
+                uuid[11], uuid[12], uuid[13], uuid[14], uuid[15],
+                entry->major, entry->minor, zoneNames[entry->zone],
+                (unsigned)(entry->distance / 100),
+                (unsigned)(entry->distance % 100), entry->rssi());
+}
+
+// Calibrate the path loss exponent with the calibration beacon.
+void calibrate(const BeaconEntry *entry) {
+  if (CALIBRATION_DISTANCE == 0 || calibrated ||
+      entry->major != CALIBRATION_MAJOR ||
+      entry->minor != CALIBRATION_MINOR ||
+      entry->count < CALIBRATION_COUNT) {
+    return;
+  }
+
+  calibrated = true;
+  if (beaconTable.calibrate(*entry, CALIBRATION_DISTANCE)) {
+    Serial.printf("Calibrated path loss exponent: %u.%u\n",
+                  beaconTable.pathLossExponent() / 10,
+                  beaconTable.pathLossExponent() % 10);
+  } else {
+    Serial.println("Calibration failed, keeping path loss exponent");
+  }
+}
+
+// Update the beacon's distance estimate and print a zone change.
+void handleAdvert(const AdvertRecord *record) {
+  ManufacturerData manufacturerData;
+
+  if (!getIBeaconData(record->payload, record->length,
+                      manufacturerData)) {
+    return;
+  }
+
+  const uint8_t *data = manufacturerData.data;
+  // Major and minor are big-endian
+  uint16_t major = (data[18] << 8) | data[19];
+  uint16_t minor = (data[20] << 8) | data[21];
+  const BeaconEntry *entry =
+      beaconTable.update(&data[2], major, minor, (int8_t)data[22],
+                         record->rssi, record->timestamp);
+  calibrate(entry);
+  if (entry->zoneChanged) {
+    printBeacon(entry);
+  }
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println("Scanning for iBeacons...");
@@ -59,9 +150,29 @@ void setup() {
 }
 
 void loop() {
+  // Handle all queued advertisements.
+  const AdvertRecord *record;
+  while ((record = advertRing.peek()) != nullptr) {
+    handleAdvert(record);
+    advertRing.pop();
+  }
+
+  // Report statistics to help sizing the ring and the table.
+  if (millis() - lastStats >= STATS_INTERVAL) {
+    lastStats = millis();
+    Serial.printf("Ring: %u dropped, high-water mark %u/%u\n",
+                  (unsigned)advertRing.drops(),
+                  (unsigned)advertRing.highWater(),
+                  (unsigned)advertRing.capacity());
+    Serial.printf("Beacons: %u/%u, %u evicted\n",
+                  (unsigned)beaconTable.size(),
+                  (unsigned)beaconTable.capacity(),
+                  (unsigned)beaconTable.evictions());
+  }
+
   if (pBLEScan->isScanning() == false) {
     pBLEScan->start(0);
   }
 
-  delay(2000);
+  delay(10);
 }
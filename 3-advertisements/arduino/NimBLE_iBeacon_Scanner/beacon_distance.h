@@ -0,0 +1,315 @@
+/** Fixed-point distance and zone estimates of iBeacons.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Each beacon, identified by its UUID, major and minor, has an entry
+ * in a fixed-size table with an exponentially smoothed RSSI. The
+ * distance follows from the log-distance path loss model:
+ *
+ *   distance = 10 ^ ((txPower - rssi) / (10 * n)) m
+ *
+ * with txPower the beacon's measured RSSI at 1 m and n the path loss
+ * exponent: 2 in free space, 2.5 to 4 indoors. The exponent can be
+ * calibrated with a beacon at a known distance. Everything is integer
+ * arithmetic, and the table never allocates: when it's full, the
+ * least recently seen beacon is evicted.
+ *
+ * The zone (immediate, near or far) only changes when the distance
+ * crosses a zone boundary by more than a margin, so it doesn't flap
+ * around a boundary.
+ */
+#ifndef BEACON_DISTANCE_H_
+#define BEACON_DISTANCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum BeaconZone {
+  ZONE_IMMEDIATE,
+  ZONE_NEAR,
+  ZONE_FAR,
+};
+
+// Upper bounds of the immediate and near zones, in cm
+#define ZONE_IMMEDIATE_DISTANCE 50
+#define ZONE_NEAR_DISTANCE 300
+// Margin to cross a zone boundary, as a fraction 1/n of the boundary
+#define ZONE_HYSTERESIS 8
+
+// log2(10) in Q12
+#define LOG2_10_Q12 13607
+
+struct BeaconEntry {
+  uint8_t uuid[16];
+  uint16_t major;
+  uint16_t minor;
+  uint8_t used;
+  uint8_t zone;
+  int8_t txPower;       // Measured RSSI at 1 m, dBm
+  bool zoneChanged;     // New beacon or zone changed in last update
+  int16_t smoothedRssi; // dBm in 1/16 dBm units
+  uint32_t distance;    // cm
+  uint32_t lastSeen;
+  uint32_t count;
+
+  int8_t rssi() const { return (int8_t)(smoothedRssi / 16); }
+};
+
+/* 2^x for x in Q16 fixed point, as Q16. Saturates at 2^15 and uses
+ * linear interpolation in a table of 2^(i/16).
+ */
+static inline uint32_t fixedExp2(int32_t x) {
+  static const uint32_t table[17] = {
+      65536,  68438,  71468,  74632,  77936,  81386,
+      84990,  88752,  92682,  96785,  101070, 105545,
+      110218, 115098, 120194, 125515, 131072};
+
+  int32_t integer = x >> 16; // Rounds down, also for negative x
+  uint32_t fraction = (uint32_t)x & 0xffff;
+  if (integer >= 15) {
+    return UINT32_MAX;
+  }
+  if (integer < -16) {
+    return 0;
+  }
+
+  uint32_t i = fraction >> 12;
+  uint32_t step = table[i + 1] - table[i];
+  uint32_t value = table[i] + ((step * (fraction & 0xfff)) >> 12);
+  return integer >= 0 ? value << integer : value >> -integer;
+}
+
+/* log2(x) for x > 0 in Q16 fixed point, as Q16. Uses linear
+ * interpolation in a table of log2(1 + i/16).
+ */
+static inline int32_t fixedLog2(uint32_t x) {
+  static const uint32_t table[17] = {
+      0,     5732,  11136, 16248, 21098, 25711, 30109, 34312, 38336,
+      42196, 45904, 49472, 52911, 56229, 59434, 62534, 65536};
+
+  // Normalize x to [1, 2) in Q16.
+  int msb = 31 - __builtin_clz(x);
+  uint32_t mantissa = msb >= 16 ? x >> (msb - 16) : x << (16 - msb);
+  uint32_t fraction = mantissa - 65536;
+
+  uint32_t i = fraction >> 12;
+  uint32_t step = table[i + 1] - table[i];
+  uint32_t value = table[i] + ((step * (fraction & 0xfff)) >> 12);
+  return (int32_t)((msb - 16) * 65536) + (int32_t)value;
+}
+
+static inline uint32_t beaconHash(const uint8_t *uuid, uint16_t major,
+                                  uint16_t minor) {
+  // 32-bit FNV-1a
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 16; i++) {
+    hash = (hash ^ uuid[i]) * 16777619u;
+  }
+  hash = (hash ^ (major >> 8)) * 16777619u;
+  hash = (hash ^ (major & 0xff)) * 16777619u;
+  hash = (hash ^ (minor >> 8)) * 16777619u;
+  hash = (hash ^ (minor & 0xff)) * 16777619u;
+  return hash;
+}
+
+// N must be a power of two.
+template <size_t N> class BeaconTable {
+  static_assert(N > 0 && (N & (N - 1)) == 0,
+                "Table size must be a power of two");
+
+public:
+  /* pathLossExponent: path loss exponent n in tenths. rssiShift:
+   * smoothing factor of the RSSI filter as a power of two. Each
+   * advertisement moves the smoothed RSSI 1/2^rssiShift of the way to
+   * the new RSSI.
+   */
+  BeaconTable(uint8_t pathLossExponent = 20, uint8_t rssiShift = 3)
+      : exponent(pathLossExponent), rssiShift(rssiShift),
+        entryCount(0), evictionCount(0) {
+    memset(entries, 0, sizeof(entries));
+  }
+
+  // Update the beacon's estimates with a new advertisement.
+  const BeaconEntry *update(const uint8_t *uuid, uint16_t major,
+                            uint16_t minor, int8_t txPower,
+                            int8_t rssi, uint32_t now) {
+    size_t i = find(uuid, major, minor);
+
+    if (!entries[i].used) {
+      if (entryCount >= MAX_ENTRIES) {
+        evictLeastRecentlySeen();
+        i = find(uuid, major, minor);
+      }
+
+      BeaconEntry &e = entries[i];
+      memcpy(e.uuid, uuid, 16);
+      e.major = major;
+      e.minor = minor;
+      e.used = 1;
+      e.smoothedRssi = rssi * 16;
+      e.count = 0;
+      entryCount++;
+    } else {
+      BeaconEntry &e = entries[i];
+      e.smoothedRssi +=
+          (rssi * 16 - e.smoothedRssi) / (1 << rssiShift);
+    }
+
+    BeaconEntry &e = entries[i];
+    e.txPower = txPower;
+    e.lastSeen = now;
+    e.distance = estimateDistance(e);
+    uint8_t zone = e.count ? nextZone(e.distance, e.zone)
+                           : nextZone(e.distance, ZONE_IMMEDIATE, 0);
+    e.zoneChanged = e.count == 0 || zone != e.zone;
+    e.zone = zone;
+    e.count++;
+    return &e;
+  }
+
+  /* Calibrate the path loss exponent with a beacon that is at a known
+   * distance in cm, more than 1 m. Returns false if the result isn't
+   * plausible, between 1.0 and 6.0.
+   */
+  bool calibrate(const BeaconEntry &entry, uint32_t distance) {
+    if (distance <= 100) {
+      return false;
+    }
+
+    // n = (txPower - rssi) / (10 * log10(distance in m))
+    int32_t pathLoss = entry.txPower * 16 - entry.smoothedRssi;
+    int32_t log2Distance =
+        fixedLog2((uint32_t)(((uint64_t)distance << 16) / 100));
+    int32_t calibrated =
+        (int32_t)((int64_t)pathLoss * LOG2_10_Q12 / log2Distance);
+    if (calibrated < 10 || calibrated > 60) {
+      return false;
+    }
+
+    exponent = (uint8_t)calibrated;
+    return true;
+  }
+
+  // Path loss exponent in tenths
+  uint8_t pathLossExponent() const { return exponent; }
+
+  void setPathLossExponent(uint8_t pathLossExponent) {
+    exponent = pathLossExponent;
+  }
+
+  size_t size() const { return entryCount; }
+
+  size_t capacity() const { return MAX_ENTRIES; }
+
+  // Number of beacons evicted because the table was full.
+  uint32_t evictions() const { return evictionCount; }
+
+private:
+  // Keep the load factor at 3/4 so probe sequences stay short.
+  static const size_t MAX_ENTRIES = N - N / 4;
+
+  BeaconEntry entries[N];
+  uint8_t exponent;
+  uint8_t rssiShift;
+  size_t entryCount;
+  uint32_t evictionCount;
+
+  // Distance in cm from the smoothed RSSI.
+  uint32_t estimateDistance(const BeaconEntry &e) const {
+    /* The exponent of 10 is pathLoss / (10 * n), with the path loss
+     * in 1/16 dB and n in tenths. Convert it to an exponent of 2 in
+     * Q16.
+     */
+    int32_t pathLoss = e.txPower * 16 - e.smoothedRssi;
+    int32_t x = (int32_t)((int64_t)pathLoss * LOG2_10_Q12 / exponent);
+    uint64_t distance = (uint64_t)fixedExp2(x) * 100 >> 16;
+    return distance > UINT32_MAX ? UINT32_MAX : (uint32_t)distance;
+  }
+
+  /* Move to the zone of the distance, but only cross a boundary when
+   * the distance is more than 1/hysteresis beyond it.
+   */
+  static uint8_t nextZone(uint32_t distance, uint8_t zone,
+                          uint8_t hysteresis = ZONE_HYSTERESIS) {
+    static const uint32_t boundaries[] = {ZONE_IMMEDIATE_DISTANCE,
+                                          ZONE_NEAR_DISTANCE};
+
+    while (zone < ZONE_FAR) {
+      uint32_t b = boundaries[zone];
+      if (distance <= b + (hysteresis ? b / hysteresis : 0)) {
+        break;
+      }
+      zone++;
+    }
+    while (zone > ZONE_IMMEDIATE) {
+      uint32_t b = boundaries[zone - 1];
+      if (distance >= b - (hysteresis ? b / hysteresis : 0)) {
+        break;
+      }
+      zone--;
+    }
+    return zone;
+  }
+
+  static size_t home(const uint8_t *uuid, uint16_t major,
+                     uint16_t minor) {
+    return beaconHash(uuid, major, minor) & (N - 1);
+  }
+
+  // Find the slot of a beacon, or the empty slot where it belongs.
+  size_t find(const uint8_t *uuid, uint16_t major,
+              uint16_t minor) const {
+    size_t i = home(uuid, major, minor);
+    while (entries[i].used &&
+           (entries[i].major != major || entries[i].minor != minor ||
+            memcmp(entries[i].uuid, uuid, 16) != 0)) {
+      i = (i + 1) & (N - 1);
+    }
+    return i;
+  }
+
+  void evictLeastRecentlySeen() {
+    size_t oldest = N;
+    for (size_t i = 0; i < N; i++) {
+      if (entries[i].used &&
+          (oldest == N ||
+           (int32_t)(entries[i].lastSeen - entries[oldest].lastSeen) <
+               0)) {
+        oldest = i;
+      }
+    }
+    remove(oldest);
+    evictionCount++;
+  }
+
+  /* Remove the entry in slot i with backward shift deletion, so no
+   * tombstones are needed.
+   */
+  void remove(size_t i) {
+    size_t j = i;
+    entries[i].used = 0;
+    entryCount--;
+
+    while (true) {
+      j = (j + 1) & (N - 1);
+      if (!entries[j].used) {
+        return;
+      }
+
+      // Move the entry back if its home slot isn't between i and j.
+      size_t k =
+          home(entries[j].uuid, entries[j].major, entries[j].minor);
+      bool between = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+      if (!between) {
+        entries[i] = entries[j];
+        entries[j].used = 0;
+        i = j;
+      }
+    }
+  }
+};
+
+#endif /* BEACON_DISTANCE_H_ */
@@ -0,0 +1,145 @@
+"""Read a history of BME280 sensor values from BLE advertisement data.
+
+Copyright (c) 2022 Koen Vervloesem
+
+SPDX-License-Identifier: MIT
+
+Decodes the extended advertisements of advertise_bme280_history. Each
+one carries the newest sample and the differences of older samples
+with their newer neighbour, see history.c of the firmware. The samples
+are numbered, so the scanner only prints the ones it didn't receive
+yet, including the ones from advertisements that it missed. It counts
+the samples that were too old to recover.
+
+Receiving extended advertisements needs a Bluetooth 5 adapter.
+"""
+import asyncio
+from dataclasses import dataclass
+
+from construct import (
+    Array,
+    Const,
+    Int8sl,
+    Int8ul,
+    Int16sl,
+    Int16ul,
+    Struct,
+    this,
+)
+from construct.core import ConstructError
+
+from bleak import BleakScanner
+from bleak.backends.device import BLEDevice
+from bleak.backends.scanner import AdvertisementData
+
+HISTORY_VERSION = 1
+
+history_format = Struct(
+    "version" / Const(HISTORY_VERSION, Int8ul),
+    "sequence" / Int16ul,
+    "count" / Int8ul,
+    "interval" / Int8ul,
+    "temperature" / Int16sl,
+    "pressure" / Int16ul,
+    "humidity" / Int16ul,
+    "deltas"
+    / Array(
+        this.count - 1,
+        Struct(
+            "temperature" / Int8sl,
+            "pressure" / Int8sl,
+            "humidity" / Int8sl,
+        ),
+    ),
+)
+
+
+@dataclass
+class DeviceHistory:
+    """Samples received from one device."""
+
+    sequence: int = -1
+    received: int = 0
+    lost: int = 0
+
+
+histories = {}
+
+
+def decode_samples(history):
+    """Return the samples in a history, from new to old.
+
+    Each sample is a tuple of sequence, temperature, pressure and
+    humidity.
+    """
+    temperature = history.temperature
+    pressure = history.pressure
+    humidity = history.humidity
+    samples = [(history.sequence, temperature, pressure, humidity)]
+    for i, delta in enumerate(history.deltas, start=1):
+        temperature += delta.temperature
+        pressure += delta.pressure
+        humidity += delta.humidity
+        sequence = (history.sequence - i) % 0x10000
+        samples.append((sequence, temperature, pressure, humidity))
+    return samples
+
+
+def device_found(
+    device: BLEDevice, advertisement_data: AdvertisementData
+):
+    """Decode new BME280 sensor values from advertisement data."""
+    try:
+        data = advertisement_data.manufacturer_data[0xFFFF]
+        history = history_format.parse(data)
+    except KeyError:
+        # Test company ID (0xffff) not found
+        return
+    except ConstructError:
+        # Wrong format
+        return
+
+    state = histories.setdefault(device.address, DeviceHistory())
+    newer = (history.sequence - state.sequence) % 0x10000
+    if state.sequence < 0 or newer > 0x8000:
+        # First advertisement, or the device restarted
+        state.sequence = (history.sequence - history.count) % 0x10000
+        newer = history.count
+    if newer == 0:
+        return
+
+    # Samples between the last received one and the oldest in this
+    # advertisement are lost.
+    if newer > history.count:
+        state.lost += newer - history.count
+    state.sequence = history.sequence
+
+    samples = decode_samples(history)[: min(newer, history.count)]
+    for sequence, temperature, pressure, humidity in samples[::-1]:
+        age = (history.sequence - sequence) % 0x10000
+        age *= history.interval
+        print(
+            f"{device.address} #{sequence:5} ({age:3} s ago): "
+            f"{temperature / 100:6.2f} °C, "
+            f"{humidity / 100:6.2f} %, "
+            f"{(pressure + 50000) / 100:7.2f} hPa"
+        )
+        state.received += 1
+    print(
+        f"{device.address}: {state.received} samples received, "
+        f"{state.lost} lost"
+    )
+
+
+async def main():
+    """Register detection callback and scan for devices."""
+    scanner = BleakScanner()
+    scanner.register_detection_callback(device_found)
+
+    while True:
+        await scanner.start()
+        await asyncio.sleep(1.0)
+        await scanner.stop()
+
+
+asyncio.run(main())
@@ -0,0 +1,243 @@
+"""Decode the output of the NimBLE_Scan_Continuous sketch.
+
+Copyright (c) 2022 Koen Vervloesem
+
+SPDX-License-Identifier: MIT
+
+In binary mode, the sketch sends COBS-encoded frames with a
+CRC-16/CCITT-FALSE, terminated by a zero byte. In text mode, it sends
+one line per advertisement. In both modes, this script reports the
+received advertisements and bytes per second, so you can compare the
+throughput of both output modes.
+
+Configure the serial port first, for instance:
+
+    stty -F /dev/ttyUSB0 115200 raw
+    python3 serial_scan_decoder.py /dev/ttyUSB0 binary
+"""
+import binascii
+import sys
+import time
+
+from construct import (
+    Bytes,
+    GreedyBytes,
+    Int8sl,
+    Int8ul,
+    Int16ul,
+    Int32ul,
+    Struct,
+)
+from construct.core import StreamError
+
+FRAME_TYPE_ADVERT = 0x01
+FRAME_TYPE_STATS = 0x02
+FRAME_TYPE_LOST = 0x03
+FRAME_TYPE_SCAN = 0x04
+
+advert_format = Struct(
+    "address" / Bytes(6),
+    "address_type" / Int8ul,
+    "rssi" / Int8sl,
+    "timestamp" / Int32ul,
+    "payload" / GreedyBytes,
+)
+
+stats_format = Struct(
+    "drops" / Int32ul,
+    "high_water" / Int32ul,
+    "devices" / Int32ul,
+    "evictions" / Int32ul,
+)
+
+lost_format = Struct(
+    "address" / Bytes(6),
+    "address_type" / Int8ul,
+    "first_seen" / Int32ul,
+    "last_seen" / Int32ul,
+    "count" / Int32ul,
+)
+
+scan_format = Struct(
+    "interval" / Int16ul,
+    "window" / Int16ul,
+    "active" / Int8ul,
+    "adverts" / Int32ul,
+    "new_devices" / Int32ul,
+    "gap_min" / Int32ul,
+    "gap_mean" / Int32ul,
+    "gap_max" / Int32ul,
+)
+
+
+def cobs_decode(data: bytes) -> bytes:
+    """Decode a COBS-encoded frame without its zero delimiter."""
+    decoded = bytearray()
+    index = 0
+    while index < len(data):
+        code = data[index]
+        if code == 0 or index + code > len(data) + 1:
+            raise ValueError("Invalid COBS code")
+        block_start = index + 1
+        index += code
+        decoded += data[block_start:index]
+        if code < 0xFF and index < len(data):
+            decoded.append(0)
+    return bytes(decoded)
+
+
+def decode_frame(frame: bytes):
+    """Decode a frame and return its type and parsed record."""
+    record = cobs_decode(frame)
+    if len(record) < 3:
+        raise ValueError("Frame too short")
+
+    crc = int.from_bytes(record[-2:], "little")
+    if binascii.crc_hqx(record[:-2], 0xFFFF) != crc:
+        raise ValueError("CRC mismatch")
+
+    frame_type = record[0]
+    if frame_type == FRAME_TYPE_ADVERT:
+        return frame_type, advert_format.parse(record[1:-2])
+    if frame_type == FRAME_TYPE_STATS:
+        return frame_type, stats_format.parse(record[1:-2])
+    if frame_type == FRAME_TYPE_LOST:
+        return frame_type, lost_format.parse(record[1:-2])
+    if frame_type == FRAME_TYPE_SCAN:
+        return frame_type, scan_format.parse(record[1:-2])
+
+    raise ValueError(f"Unknown frame type {frame_type}")
+
+
+def format_address(address: bytes) -> str:
+    """Format a little-endian Bluetooth address."""
+    return ":".join(f"{byte:02x}" for byte in reversed(address))
+
+
+def print_record(frame_type: int, record):
+    """Show a decoded record."""
+    if frame_type == FRAME_TYPE_ADVERT:
+        address = format_address(record.address)
+        print(
+            f"{record.timestamp:>10} {address} "
+            f"({record.address_type}) {record.rssi:>4} dBm "
+            f"{record.payload.hex()}"
+        )
+    elif frame_type == FRAME_TYPE_LOST:
+        address = format_address(record.address)
+        print(
+            f"{record.last_seen:>10} {address} "
+            f"({record.address_type}) lost after {record.count} "
+            "advertisements"
+        )
+    elif frame_type == FRAME_TYPE_SCAN:
+        mode = "active" if record.active else "passive"
+        print(
+            f"Scan: interval {record.interval} ms, "
+            f"window {record.window} ms, {mode}"
+        )
+        print(
+            f"Last period: {record.adverts} advertisements, "
+            f"{record.new_devices} new devices, "
+            f"{record.gap_min}/{record.gap_mean}/{record.gap_max} ms "
+            "min/mean/max between advertisements"
+        )
+    else:
+        print(
+            f"Ring: {record.drops} dropped, "
+            f"high-water mark {record.high_water}"
+        )
+        print(
+            f"Devices: {record.devices}, {record.evictions} evicted"
+        )
+
+
+class Throughput:
+    """Count advertisements and bytes per second."""
+
+    def __init__(self):
+        self.adverts = 0
+        self.bytes = 0
+        self.errors = 0
+        self.start = time.monotonic()
+
+    def add(self, length: int, advert: bool = True):
+        """Count received bytes and advertisements."""
+        self.bytes += length
+        if advert:
+            self.adverts += 1
+
+    def report(self):
+        """Print and reset the counters every second."""
+        elapsed = time.monotonic() - self.start
+        if elapsed < 1.0:
+            return
+
+        print(
+            f"Throughput: {self.adverts / elapsed:.1f} adverts/s, "
+            f"{self.bytes / elapsed:.0f} bytes/s, "
+            f"{self.errors} errors"
+        )
+        self.adverts = 0
+        self.bytes = 0
+        self.errors = 0
+        self.start = time.monotonic()
+
+
+def read_binary(port, throughput: Throughput):
+    """Read and decode binary frames."""
+    buffer = bytearray()
+    while True:
+        data = port.read(256)
+        if not data:
+            break
+
+        buffer += data
+        while b"\x00" in buffer:
+            frame, _, buffer = buffer.partition(b"\x00")
+            try:
+                frame_type, record = decode_frame(bytes(frame))
+            except (ValueError, StreamError):
+                throughput.errors += 1
+                throughput.add(len(frame) + 1, False)
+                continue
+
+            throughput.add(
+                len(frame) + 1, frame_type == FRAME_TYPE_ADVERT
+            )
+            print_record(frame_type, record)
+
+        throughput.report()
+
+
+def read_text(port, throughput: Throughput):
+    """Read text lines and count advertisements."""
+    buffer = bytearray()
+    while True:
+        data = port.read(256)
+        if not data:
+            break
+
+        buffer += data
+        while b"\n" in buffer:
+            line, _, buffer = buffer.partition(b"\n")
+            throughput.add(
+                len(line) + 1, line.startswith(b"Advertised Device:")
+            )
+
+        throughput.report()
+
+
+if __name__ == "__main__":
+
+    if len(sys.argv) == 3 and sys.argv[2] in ("binary", "text"):
+        with open(sys.argv[1], "rb", buffering=0) as serial_port:
+            if sys.argv[2] == "binary":
+                read_binary(serial_port, Throughput())
+            else:
+                read_text(serial_port, Throughput())
+    else:
+        print(
+            "Please specify the serial port and the output mode "
+            "(binary or text)."
+        )
@@ -0,0 +1,616 @@
+/** Check and benchmark the advertising data parser of the scanners.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Checks AdParser on well-formed payloads, on truncated, zero-length
+ * and overlong AD structures, and on random payloads, where it may
+ * never return data outside the payload.
+ *
+ * Then it times getting the manufacturer data, the service data of a
+ * 16-bit UUID and the list of 16-bit service UUIDs from a few typical
+ * payloads, with AdParser and with a model of the accessors of
+ * NimBLEAdvertisedDevice in NimBLE-Arduino 1.x that the scanners used
+ * before. Those walk the payload from the start for every field and
+ * return copies in a std::string. The model only looks for 16-bit
+ * service data, so its times are a lower bound. Times are in ns on
+ * this host, so they only compare both with each other.
+ */
+#include <getopt.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "ad_parser.h"
+
+struct Payload {
+  const char *name;
+  std::vector<uint8_t> data;
+};
+
+// Allocations done since the start
+static uint64_t allocations = 0;
+static uint32_t rngState;
+static unsigned checks = 0;
+static unsigned failures = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+// xorshift32, so runs with the same seed are identical
+static uint32_t random32() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+static void check(bool ok, const char *what, int line) {
+  checks++;
+  if (!ok) {
+    printf("Line %d: %s failed\n", line, what);
+    failures++;
+  }
+}
+
+/* The accessors of NimBLEAdvertisedDevice in NimBLE-Arduino 1.x,
+ * for 16-bit UUIDs.
+ */
+class LegacyAdvertisedDevice {
+public:
+  LegacyAdvertisedDevice(const std::vector<uint8_t> &payload)
+      : payload(payload) {}
+
+  bool haveManufacturerData() const {
+    return findAdvField(AD_TYPE_MANUFACTURER_DATA) > 0;
+  }
+
+  std::string getManufacturerData() const {
+    size_t location = 0;
+
+    if (findAdvField(AD_TYPE_MANUFACTURER_DATA, 1, &location) > 0) {
+      const uint8_t *field = &payload[location];
+      if (field[0] > 1) {
+        return std::string((const char *)&field[2], field[0] - 1);
+      }
+    }
+    return "";
+  }
+
+  uint8_t getServiceDataCount() const {
+    return findAdvField(AD_TYPE_SERVICE_DATA16);
+  }
+
+  uint16_t getServiceDataUUID(uint8_t index) const {
+    size_t location = 0;
+
+    if (findAdvField(AD_TYPE_SERVICE_DATA16, index + 1, &location) >
+        0) {
+      const uint8_t *field = &payload[location];
+      if (field[0] >= 3) {
+        return (uint16_t)(field[2] | (field[3] << 8));
+      }
+    }
+    return 0;
+  }
+
+  std::string getServiceData(uint16_t uuid) const {
+    uint8_t count = getServiceDataCount();
+
+    for (uint8_t i = 0; i < count; i++) {
+      if (getServiceDataUUID(i) != uuid) {
+        continue;
+      }
+      size_t location = 0;
+      findAdvField(AD_TYPE_SERVICE_DATA16, i + 1, &location);
+      const uint8_t *field = &payload[location];
+      return std::string((const char *)&field[4], field[0] - 3);
+    }
+    return "";
+  }
+
+  uint8_t getServiceUUIDCount() const {
+    return findAdvField(AD_TYPE_UUID16_COMPLETE) +
+           findAdvField(AD_TYPE_UUID16_INCOMPLETE);
+  }
+
+  uint16_t getServiceUUID(uint8_t index) const {
+    static const uint8_t types[] = {AD_TYPE_UUID16_COMPLETE,
+                                    AD_TYPE_UUID16_INCOMPLETE};
+
+    for (uint8_t type : types) {
+      size_t location = 0;
+      uint8_t count = findAdvField(type, index + 1, &location);
+      if (count > index) {
+        const uint8_t *field = &payload[location];
+        // Index in this field
+        uint8_t i = index - (count - field[0] / 2);
+        return (uint16_t)(field[2 + 2 * i] | (field[3 + 2 * i] << 8));
+      }
+      index -= count;
+    }
+    return 0;
+  }
+
+private:
+  std::vector<uint8_t> payload;
+
+  /* Count the fields of a type, or the UUIDs in fields with 16-bit
+   * UUIDs. With location, stop at the field that brings the count to
+   * index and store its offset.
+   */
+  uint8_t findAdvField(uint8_t type, uint8_t index = 0,
+                       size_t *location = nullptr) const {
+    size_t length = payload.size();
+    size_t offset = 0;
+    uint8_t count = 0;
+
+    while (length > 2) {
+      const uint8_t *field = &payload[offset];
+      if (field[0] >= length) {
+        return count;
+      }
+      if (field[1] == type) {
+        if (type == AD_TYPE_UUID16_COMPLETE ||
+            type == AD_TYPE_UUID16_INCOMPLETE) {
+          count += field[0] / 2;
+        } else {
+          count++;
+        }
+        if (location != nullptr && (index == 0 || count >= index)) {
+          *location = offset;
+          return count;
+        }
+      }
+      length -= 1 + field[0];
+      offset += 1 + field[0];
+    }
+    return count;
+  }
+};
+
+// Flags, three 16-bit service UUIDs, two service data and a name
+static const uint8_t sensor[] = {
+    0x02, 0x01, 0x06, 0x07, 0x03, 0x1a, 0x18, 0x0f, 0x18, 0xd2,
+    0xfc, 0x04, 0x16, 0x0f, 0x18, 0x64, 0x07, 0x16, 0x1a, 0x18,
+    0xc8, 0x00, 0x10, 0x27, 0x05, 0x09, 'S',  'e',  'n',  's'};
+
+static size_t countStructures(const uint8_t *payload, size_t length) {
+  AdParser parser(payload, length);
+  AdStructure ad;
+  size_t count = 0;
+
+  while (parser.next(ad)) {
+    count++;
+  }
+  return count;
+}
+
+static void checkWellFormed() {
+  static const uint8_t types[] = {0x01, 0x03, 0x16, 0x16, 0x09};
+  static const uint8_t lengths[] = {1, 6, 3, 6, 4};
+  AdParser parser(sensor, sizeof(sensor));
+  AdStructure ad;
+  size_t i = 0;
+
+  while (parser.next(ad)) {
+    CHECK(i < sizeof(types) && ad.type == types[i] &&
+          ad.length == lengths[i]);
+    i++;
+  }
+  CHECK(i == sizeof(types));
+
+  uint8_t flags = 0;
+  CHECK(parser.getFlags(flags) && flags == 0x06);
+
+  Uuid16List uuids;
+  CHECK(parser.getUuid16List(uuids) && uuids.count == 3);
+  CHECK(uuids.at(0) == 0x181a && uuids.at(2) == 0xfcd2);
+  CHECK(uuids.contains(0x180f) && !uuids.contains(0x1809));
+  CHECK(parser.isAdvertisingService(0xfcd2));
+  CHECK(!parser.isAdvertisingService(0x1809));
+
+  // The second service data structure has the UUID.
+  ServiceData16 serviceData;
+  CHECK(parser.getServiceData16(0x181a, serviceData) &&
+        serviceData.length == 4 && serviceData.data == &sensor[20]);
+  CHECK(parser.getServiceData16(0x180f, serviceData) &&
+        serviceData.length == 1 && serviceData.data[0] == 0x64);
+  CHECK(!parser.getServiceData16(0xfeaa, serviceData));
+
+  CHECK(parser.find(AD_TYPE_NAME_COMPLETE, ad) && ad.length == 4 &&
+        ad.data == &sensor[26]);
+  LocalName name;
+  CHECK(parser.getName(name) && name.length == 4 &&
+        memcmp(name.name, "Sens", 4) == 0);
+
+  int8_t txPower;
+  ManufacturerData manufacturerData;
+  CHECK(!parser.find(AD_TYPE_TX_POWER, ad));
+  CHECK(!parser.getTxPower(txPower));
+  CHECK(!parser.getManufacturerData(manufacturerData));
+}
+
+// The last structures don't fit in the payload.
+static void checkTruncated() {
+  AdParser name(sensor, sizeof(sensor) - 3);
+  AdStructure ad;
+  ServiceData16 serviceData;
+
+  CHECK(countStructures(sensor, sizeof(sensor) - 3) == 4);
+  CHECK(!name.find(AD_TYPE_NAME_COMPLETE, ad));
+  CHECK(name.getServiceData16(0x181a, serviceData));
+
+  AdParser data(sensor, 20);
+  CHECK(countStructures(sensor, 20) == 3);
+  CHECK(!data.getServiceData16(0x181a, serviceData));
+  CHECK(data.getServiceData16(0x180f, serviceData) &&
+        serviceData.length == 1);
+
+  // Only the length byte of the next structure
+  AdParser lengthOnly(sensor, 4);
+  CHECK(countStructures(sensor, 4) == 1);
+  CHECK(!lengthOnly.find(AD_TYPE_UUID16_COMPLETE, ad));
+
+  // No payload at all
+  AdParser empty(sensor, 0);
+  CHECK(!empty.next(ad));
+  CHECK(!empty.find(AD_TYPE_FLAGS, ad));
+}
+
+// A zero length ends the payload early.
+static void checkZeroLength() {
+  static const uint8_t payload[] = {0x02, 0x01, 0x06, 0x00,
+                                    0x03, 0x03, 0x0f, 0x18};
+  static const uint8_t zero[] = {0x00};
+  AdParser parser(payload, sizeof(payload));
+  Uuid16List uuids;
+
+  CHECK(countStructures(payload, sizeof(payload)) == 1);
+  CHECK(!parser.getUuid16List(uuids));
+  CHECK(!parser.isAdvertisingService(0x180f));
+  CHECK(countStructures(zero, sizeof(zero)) == 0);
+}
+
+/* The length of a structure goes beyond the payload, up to the
+ * largest possible one.
+ */
+static void checkOverlong() {
+  static const uint8_t payload[] = {0x02, 0x01, 0x06, 0xff, 0xff,
+                                    0x4c, 0x00, 0x02, 0x15};
+  static const uint8_t oneOver[] = {0x02, 0x01, 0x06, 0x04,
+                                    0x16, 0x0f, 0x18};
+  AdParser parser(payload, sizeof(payload));
+  ManufacturerData manufacturerData;
+  ServiceData16 serviceData;
+  uint8_t flags;
+
+  CHECK(countStructures(payload, sizeof(payload)) == 1);
+  CHECK(parser.getFlags(flags) && flags == 0x06);
+  CHECK(!parser.getManufacturerData(manufacturerData));
+
+  AdParser over(oneOver, sizeof(oneOver));
+  CHECK(countStructures(oneOver, sizeof(oneOver)) == 1);
+  CHECK(!over.getServiceData16(0x180f, serviceData));
+
+  // Extended advertising data with one structure of 255 bytes
+  std::vector<uint8_t> extended(256, 0x42);
+  extended[0] = 0xff;
+  extended[1] = AD_TYPE_UUID16_INCOMPLETE;
+  AdParser longest(extended.data(), extended.size());
+  Uuid16List uuids;
+  CHECK(longest.getUuid16List(uuids) && uuids.count == 127);
+  CHECK(uuids.contains(0x4242));
+  CHECK(countStructures(extended.data(), extended.size() - 1) == 0);
+}
+
+// Structures too short for their type
+static void checkShort() {
+  static const uint8_t typeOnly[] = {0x01, 0x01};
+  static const uint8_t companyId[] = {0x03, 0xff, 0x4c, 0x00};
+  static const uint8_t halfCompanyId[] = {0x02, 0xff, 0x4c};
+  static const uint8_t uuidOnly[] = {0x03, 0x16, 0x0f, 0x18};
+  static const uint8_t halfUuid[] = {0x02, 0x16, 0x0f};
+  static const uint8_t oddList[] = {0x04, 0x03, 0x0f, 0x18, 0x1a};
+  AdStructure ad;
+  ManufacturerData manufacturerData;
+  ServiceData16 serviceData;
+  Uuid16List uuids;
+  uint8_t flags;
+
+  AdParser type(typeOnly, sizeof(typeOnly));
+  CHECK(type.find(AD_TYPE_FLAGS, ad) && ad.length == 0);
+  CHECK(!type.getFlags(flags));
+
+  AdParser company(companyId, sizeof(companyId));
+  CHECK(company.getManufacturerData(manufacturerData) &&
+        manufacturerData.companyId == 0x004c &&
+        manufacturerData.length == 0);
+  AdParser halfCompany(halfCompanyId, sizeof(halfCompanyId));
+  CHECK(!halfCompany.getManufacturerData(manufacturerData));
+
+  AdParser uuid(uuidOnly, sizeof(uuidOnly));
+  CHECK(uuid.getServiceData16(0x180f, serviceData) &&
+        serviceData.length == 0);
+  AdParser half(halfUuid, sizeof(halfUuid));
+  CHECK(!half.getServiceData16(0x000f, serviceData));
+
+  AdParser odd(oddList, sizeof(oddList));
+  CHECK(odd.getUuid16List(uuids) && uuids.count == 1 &&
+        uuids.at(0) == 0x180f);
+}
+
+/* Random bytes, mostly with short length bytes, must never give
+ * data outside the payload. Random well-formed payloads must give
+ * their structures back, and the same manufacturer data as the
+ * legacy accessors.
+ */
+static void checkRandom(unsigned count) {
+  uint8_t payload[64];
+  unsigned outside = 0;
+  unsigned wrong = 0;
+
+  for (unsigned n = 0; n < count; n++) {
+    size_t length = random32() % (sizeof(payload) + 1);
+    for (size_t i = 0; i < length; i++) {
+      uint32_t r = random32();
+      payload[i] = (r & 0x100) ? (uint8_t)(r % 8) : (uint8_t)r;
+    }
+
+    AdParser parser(payload, length);
+    AdStructure ad;
+    while (parser.next(ad)) {
+      if (ad.data < payload + 2 ||
+          ad.data + ad.length > payload + length) {
+        outside++;
+      }
+    }
+
+    // Fill the payload with structures of random types and lengths.
+    std::vector<AdStructure> structures;
+    length = 0;
+    while (true) {
+      uint8_t adLength = 1 + random32() % 12;
+      if (length + 1 + adLength > 31) {
+        break;
+      }
+      static const uint8_t types[] = {0x01, 0x03, 0x09, 0x16, 0xff};
+      payload[length] = adLength;
+      payload[length + 1] = types[random32() % sizeof(types)];
+      for (size_t i = 2; i <= adLength; i++) {
+        payload[length + i] = (uint8_t)random32();
+      }
+      structures.push_back(AdStructure{payload[length + 1],
+                                       &payload[length + 2],
+                                       (uint8_t)(adLength - 1)});
+      length += 1 + adLength;
+    }
+
+    AdParser wellFormed(payload, length);
+    size_t i = 0;
+    while (wellFormed.next(ad)) {
+      if (i >= structures.size() || ad.type != structures[i].type ||
+          ad.data != structures[i].data ||
+          ad.length != structures[i].length) {
+        wrong++;
+      }
+      i++;
+    }
+    if (i != structures.size()) {
+      wrong++;
+    }
+
+    LegacyAdvertisedDevice device(
+        std::vector<uint8_t>(payload, payload + length));
+    ManufacturerData manufacturerData;
+    std::string legacy = device.getManufacturerData();
+    bool found = wellFormed.getManufacturerData(manufacturerData);
+    if (found && (legacy.size() != manufacturerData.length + 2u ||
+                  memcmp(legacy.data() + 2, manufacturerData.data,
+                         manufacturerData.length) != 0)) {
+      wrong++;
+    }
+  }
+  CHECK(outside == 0);
+  CHECK(wrong == 0);
+}
+
+static std::vector<Payload> payloads() {
+  std::vector<Payload> result;
+  std::vector<uint8_t> iBeacon = {0x02, 0x01, 0x06, 0x1a, 0xff,
+                                  0x4c, 0x00, 0x02, 0x15};
+  for (int i = 0; i < 16; i++) {
+    iBeacon.push_back(0xa0 + i);
+  }
+  iBeacon.insert(iBeacon.end(), {0x00, 0x01, 0x00, 0x48, 0xc5});
+
+  std::vector<uint8_t> eddystone = {
+      0x02, 0x01, 0x06, 0x03, 0x03, 0xaa, 0xfe, 0x0e, 0x16, 0xaa,
+      0xfe, 0x10, 0xeb, 0x03, 'e',  'x',  'a',  'm',  'p',  'l',
+      'e',  0x07};
+  std::vector<uint8_t> sensorPayload(sensor, sensor + sizeof(sensor));
+
+  result.push_back(Payload{"iBeacon", iBeacon});
+  result.push_back(Payload{"Eddystone-URL", eddystone});
+  result.push_back(Payload{"Sensor", sensorPayload});
+  return result;
+}
+
+struct Timing {
+  double ns;
+  double allocations;
+};
+
+/* Time one accessor on every payload. The lambda returns something
+ * derived from the result, so the compiler can't drop the calls.
+ */
+template <typename F>
+static Timing measure(unsigned count, uint64_t &checksum, F f) {
+  uint64_t before = allocations;
+  double start = now();
+
+  for (unsigned i = 0; i < count; i++) {
+    checksum += f();
+  }
+  Timing timing = {(now() - start) * 1e9 / count,
+                   (double)(allocations - before) / count};
+  return timing;
+}
+
+static void printTiming(const char *payload, const char *field,
+                        Timing parser, Timing legacy) {
+  printf("%-14s %-18s %8.1f %8.1f %10.2f\n", payload, field,
+         parser.ns, legacy.ns, legacy.allocations);
+  if (parser.allocations != 0) {
+    printf("AdParser allocated %.2f times per call\n",
+           parser.allocations);
+  }
+}
+
+static void benchmark(unsigned count) {
+  uint64_t checksum = 0;
+
+  printf("%-14s %-18s %8s %8s %10s\n", "Payload", "Field",
+         "AdParser", "Legacy", "Allocs");
+  for (const Payload &payload : payloads()) {
+    const uint8_t *data = payload.data.data();
+    size_t length = payload.data.size();
+    LegacyAdvertisedDevice device(payload.data);
+
+    Timing parser = measure(count, checksum, [&]() {
+      AdParser parser(data, length);
+      ManufacturerData manufacturerData;
+      return parser.getManufacturerData(manufacturerData)
+                 ? manufacturerData.data[manufacturerData.length - 1]
+                 : 0;
+    });
+    Timing legacy = measure(count, checksum, [&]() {
+      if (!device.haveManufacturerData()) {
+        return 0;
+      }
+      std::string manufacturerData = device.getManufacturerData();
+      return (int)(uint8_t)manufacturerData.back();
+    });
+    printTiming(payload.name, "Manufacturer data", parser, legacy);
+
+    parser = measure(count, checksum, [&]() {
+      AdParser parser(data, length);
+      ServiceData16 serviceData;
+      uint16_t uuid = data[9] == 0xaa ? 0xfeaa : 0x181a;
+      return parser.getServiceData16(uuid, serviceData)
+                 ? serviceData.length
+                 : 0;
+    });
+    legacy = measure(count, checksum, [&]() {
+      uint16_t uuid = data[9] == 0xaa ? 0xfeaa : 0x181a;
+      return (int)device.getServiceData(uuid).size();
+    });
+    printTiming(payload.name, "Service data", parser, legacy);
+
+    parser = measure(count, checksum, [&]() {
+      AdParser parser(data, length);
+      Uuid16List uuids;
+      int sum = 0;
+      if (parser.getUuid16List(uuids)) {
+        for (uint8_t i = 0; i < uuids.count; i++) {
+          sum += uuids.at(i);
+        }
+      }
+      return sum;
+    });
+    legacy = measure(count, checksum, [&]() {
+      uint8_t uuids = device.getServiceUUIDCount();
+      int sum = 0;
+      for (uint8_t i = 0; i < uuids; i++) {
+        sum += device.getServiceUUID(i);
+      }
+      return sum;
+    });
+    printTiming(payload.name, "Service UUIDs", parser, legacy);
+  }
+  printf("Times in ns per call, legacy allocations per call "
+         "(checksum %llu)\n",
+         (unsigned long long)checksum);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n, --count N       Calls per benchmark (1000000)\n"
+          "  -r, --random N      Random payloads to check (100000)\n"
+          "  -s, --seed N        Seed of the random payloads (1)\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"count", required_argument, nullptr, 'n'},
+      {"random", required_argument, nullptr, 'r'},
+      {"seed", required_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+  unsigned long count = 1000000;
+  unsigned long random = 100000;
+  unsigned long seed = 1;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "n:r:s:", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 'n':
+      count = strtoul(optarg, nullptr, 0);
+      break;
+    case 'r':
+      random = strtoul(optarg, nullptr, 0);
+      break;
+    case 's':
+      seed = strtoul(optarg, nullptr, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (count == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  rngState = seed ? seed : 1;
+
+  checkWellFormed();
+  checkTruncated();
+  checkZeroLength();
+  checkOverlong();
+  checkShort();
+  checkRandom(random);
+  if (failures) {
+    printf("%u of %u checks failed\n", failures, checks);
+    return EXIT_FAILURE;
+  }
+  printf("%u checks passed, %lu random payloads\n", checks, random);
+  benchmark(count);
+
+  return EXIT_SUCCESS;
+}
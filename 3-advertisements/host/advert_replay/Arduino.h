@@ -0,0 +1,106 @@
+/** Minimal stand-in for the Arduino core on Linux.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Only what the scanner sketches use. Serial output is formatted as
+ * on the ESP32, but only written to stdout when printing is enabled.
+ */
+#ifndef ARDUINO_H_
+#define ARDUINO_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The ESP32 core includes FreeRTOS for the sketches.
+#include "freertos/FreeRTOS.h"
+
+static inline uint64_t hostNanos() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Start of the program, so millis() starts at 0 like on the ESP32
+static const uint64_t hostStart = hostNanos();
+
+static inline unsigned long millis() {
+  return (unsigned long)((hostNanos() - hostStart) / 1000000u);
+}
+
+static inline unsigned long micros() {
+  return (unsigned long)((hostNanos() - hostStart) / 1000u);
+}
+
+static inline void delay(unsigned long ms) { usleep(ms * 1000); }
+
+class HostSerial {
+public:
+  bool enabled = false;
+
+  void begin(unsigned long baud) {}
+
+  size_t printf(const char *format, ...) {
+    char buffer[256];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0) {
+      return 0;
+    }
+    if ((size_t)length >= sizeof(buffer)) {
+      length = sizeof(buffer) - 1;
+    }
+    return write((const uint8_t *)buffer, length);
+  }
+
+  size_t print(const char *s) {
+    return write((const uint8_t *)s, strlen(s));
+  }
+
+  size_t print(int value) { return printf("%d", value); }
+
+  size_t println() { return print("\n"); }
+
+  size_t println(const char *s) { return print(s) + println(); }
+
+  size_t println(int value) { return print(value) + println(); }
+
+  size_t write(uint8_t byte) { return write(&byte, 1); }
+
+  size_t write(const uint8_t *buffer, size_t length) {
+    bytes += length;
+    if (enabled) {
+      fwrite(buffer, 1, length, stdout);
+    }
+    return length;
+  }
+
+  int available() { return 0; }
+
+  int read() { return -1; }
+
+  // Number of bytes that would have been sent over the UART
+  size_t bytes = 0;
+};
+
+extern HostSerial Serial;
+
+// On Linux, the "cycle count" is in nanoseconds.
+class HostEsp {
+public:
+  uint32_t getCycleCount() { return (uint32_t)hostNanos(); }
+};
+
+extern HostEsp ESP;
+
+#endif /* ARDUINO_H_ */
@@ -0,0 +1,180 @@
+/** Thin stand-in for the NimBLE-Arduino scan API on Linux.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Only the parts of NimBLE-Arduino 1.x that the scanner sketches and
+ * event_dispatcher.h use. There's no radio: the replay harness hands
+ * advertising reports to NimBLEScan::deliver(), which calls the
+ * sketch's onResult() like the NimBLE host task does. Unlike the real library, the stand-in
+ * doesn't allocate per advertisement, so all allocations the harness
+ * counts come from the sketch.
+ */
+#ifndef NIMBLE_DEVICE_H_
+#define NIMBLE_DEVICE_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "Arduino.h"
+
+// Largest advertising data in an extended advertising report
+#define REPORT_MAX_PAYLOAD 229
+
+class NimBLEAddress {
+public:
+  NimBLEAddress() : type(0) { memset(address, 0, sizeof(address)); }
+
+  NimBLEAddress(const uint8_t *native, uint8_t type = 0)
+      : type(type) {
+    memcpy(address, native, sizeof(address));
+  }
+
+  const uint8_t *getNative() const { return address; }
+
+  uint8_t getType() const { return type; }
+
+  std::string toString() const {
+    char s[18];
+
+    snprintf(s, sizeof(s), "%02x:%02x:%02x:%02x:%02x:%02x",
+             address[5], address[4], address[3], address[2],
+             address[1], address[0]);
+    return s;
+  }
+
+private:
+  uint8_t address[6];
+  uint8_t type;
+};
+
+// Stand-in only: a client with the address of its peer.
+class NimBLEClient {
+public:
+  NimBLEClient(const NimBLEAddress &peer) : peer(peer) {}
+
+  NimBLEAddress getPeerAddress() const { return peer; }
+
+private:
+  NimBLEAddress peer;
+};
+
+class NimBLEAdvertisedDevice {
+public:
+  NimBLEAdvertisedDevice() : rssi(0), length(0) {}
+
+  // Stand-in only: fill in a received advertising report.
+  void set(const uint8_t *native, uint8_t addressType, int8_t rssi,
+           const uint8_t *payload, size_t length) {
+    address = NimBLEAddress(native, addressType);
+    this->rssi = rssi;
+    this->length = length;
+    memcpy(this->payload, payload, length);
+  }
+
+  NimBLEAddress getAddress() { return address; }
+
+  uint8_t getAddressType() { return address.getType(); }
+
+  int getRSSI() { return rssi; }
+
+  uint8_t *getPayload() { return payload; }
+
+  size_t getPayloadLength() { return length; }
+
+private:
+  NimBLEAddress address;
+  int8_t rssi;
+  size_t length;
+  uint8_t payload[REPORT_MAX_PAYLOAD];
+};
+
+class NimBLEAdvertisedDeviceCallbacks {
+public:
+  virtual ~NimBLEAdvertisedDeviceCallbacks() {}
+
+  virtual void onResult(NimBLEAdvertisedDevice *advertisedDevice) = 0;
+};
+
+class NimBLEScan {
+public:
+  NimBLEScan()
+      : callbacks(nullptr), interval(100), window(100), active(false),
+        scanning(false), starts(0) {}
+
+  void setAdvertisedDeviceCallbacks(
+      NimBLEAdvertisedDeviceCallbacks *callbacks,
+      bool wantDuplicates = false) {
+    this->callbacks = callbacks;
+  }
+
+  void setInterval(uint16_t interval) { this->interval = interval; }
+
+  void setWindow(uint16_t window) { this->window = window; }
+
+  void setActiveScan(bool active) { this->active = active; }
+
+  void setMaxResults(uint8_t maxResults) {}
+
+  void setDuplicateFilter(bool enabled) {}
+
+  bool start(uint32_t duration, void (*scanEnded)(void *) = nullptr,
+             bool isContinue = false) {
+    scanning = true;
+    starts++;
+    return true;
+  }
+
+  bool stop() {
+    scanning = false;
+    return true;
+  }
+
+  bool isScanning() { return scanning; }
+
+  /* Stand-in only: pass a report to the scan callback, as the
+   * NimBLE host task does. Returns false if it was dropped because
+   * the sketch isn't scanning.
+   */
+  bool deliver(NimBLEAdvertisedDevice *advertisedDevice) {
+    if (!scanning || callbacks == nullptr) {
+      return false;
+    }
+    callbacks->onResult(advertisedDevice);
+    return true;
+  }
+
+  // Stand-in only: scan parameters and the number of (re)starts
+  uint16_t getInterval() const { return interval; }
+
+  uint16_t getWindow() const { return window; }
+
+  bool getActiveScan() const { return active; }
+
+  uint32_t getStarts() const { return starts; }
+
+private:
+  NimBLEAdvertisedDeviceCallbacks *callbacks;
+  std::atomic<uint16_t> interval;
+  std::atomic<uint16_t> window;
+  std::atomic<bool> active;
+  std::atomic<bool> scanning;
+  std::atomic<uint32_t> starts;
+};
+
+class NimBLEDevice {
+public:
+  static void init(const std::string &deviceName) {}
+
+  static NimBLEScan *getScan() {
+    static NimBLEScan scan;
+    return &scan;
+  }
+};
+
+#endif /* NIMBLE_DEVICE_H_ */
@@ -0,0 +1,406 @@
+/** Sources of advertising reports for the replay harness.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Reports come from a capture of HCI traffic or from a generator of
+ * synthetic advertisements. Captures are read completely into memory
+ * and replayed in a loop, so reading the file doesn't disturb the
+ * measurements. Supported captures:
+ *
+ * - btsnoop files with HCI UART (H4) or unencapsulated HCI packets,
+ *   such as Android's btsnoop_hci.log or `btmon -w` output.
+ * - pcap files with link type BLUETOOTH_HCI_H4 or
+ *   BLUETOOTH_HCI_H4_WITH_PHDR, such as Wireshark captures saved in
+ *   pcap format (convert pcapng with `editcap -F pcap`).
+ *
+ * Both legacy (LE Advertising Report) and extended advertising
+ * reports (LE Extended Advertising Report) are replayed.
+ */
+#ifndef ADVERT_SOURCE_H_
+#define ADVERT_SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "NimBLEDevice.h"
+
+#define HCI_H4_EVENT 0x04
+#define HCI_EVENT_LE_META 0x3e
+#define HCI_LE_ADVERTISING_REPORT 0x02
+#define HCI_LE_EXTENDED_ADVERTISING_REPORT 0x0d
+
+#define BTSNOOP_HCI_UNENCAPSULATED 1001
+#define BTSNOOP_HCI_UART 1002
+// Flags of a btsnoop record: received, command or event
+#define BTSNOOP_FLAG_RECEIVED 0x01
+#define BTSNOOP_FLAG_COMMAND_EVENT 0x02
+
+#define PCAP_BLUETOOTH_HCI_H4 187
+#define PCAP_BLUETOOTH_HCI_H4_WITH_PHDR 201
+
+struct AdvertReport {
+  uint8_t address[6]; // Little-endian, as on air
+  uint8_t addressType;
+  int8_t rssi;
+  uint8_t length;
+  uint8_t payload[REPORT_MAX_PAYLOAD];
+};
+
+class AdvertSource {
+public:
+  virtual ~AdvertSource() {}
+
+  // Get the next report. Returns false when there are none left.
+  virtual bool next(AdvertReport &report) = 0;
+};
+
+static inline uint32_t readBigEndian32(const uint8_t *data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+         ((uint32_t)data[2] << 8) | data[3];
+}
+
+static inline uint32_t readLittleEndian32(const uint8_t *data) {
+  return ((uint32_t)data[3] << 24) | ((uint32_t)data[2] << 16) |
+         ((uint32_t)data[1] << 8) | data[0];
+}
+
+/* Append the advertising reports in an HCI event (starting at the
+ * event code, without H4 packet type) to reports. Other events are
+ * ignored, and so are truncated reports.
+ */
+static void parseHciEvent(const uint8_t *event, size_t length,
+                          std::vector<AdvertReport> &reports) {
+  if (length < 5 || event[0] != HCI_EVENT_LE_META) {
+    return;
+  }
+
+  uint8_t subevent = event[2];
+  uint8_t numReports = event[3];
+  const uint8_t *p = &event[4];
+  const uint8_t *end = event + length;
+
+  for (int i = 0; i < numReports; i++) {
+    AdvertReport report;
+    size_t addressOffset;
+    size_t headerLength;
+    size_t trailerLength;
+
+    // Fields in each report, before and after the data
+    if (subevent == HCI_LE_ADVERTISING_REPORT) {
+      // Event type, address type, address, data length ... RSSI
+      addressOffset = 1;
+      headerLength = 9;
+      trailerLength = 1;
+    } else if (subevent == HCI_LE_EXTENDED_ADVERTISING_REPORT) {
+      /* Event type (2), address type, address, primary and secondary
+       * PHY, SID, TX power, RSSI, periodic advertising interval (2),
+       * direct address type, direct address, data length
+       */
+      addressOffset = 2;
+      headerLength = 24;
+      trailerLength = 0;
+    } else {
+      return;
+    }
+
+    if ((size_t)(end - p) < headerLength) {
+      return;
+    }
+    uint8_t dataLength = p[headerLength - 1];
+    size_t reportLength = headerLength + dataLength + trailerLength;
+    if ((size_t)(end - p) < reportLength ||
+        dataLength > REPORT_MAX_PAYLOAD) {
+      return;
+    }
+
+    report.addressType = p[addressOffset];
+    memcpy(report.address, &p[addressOffset + 1], 6);
+    report.length = dataLength;
+    memcpy(report.payload, &p[headerLength], dataLength);
+    // The RSSI follows the data, or is in the extended report header.
+    report.rssi =
+        (int8_t)(trailerLength ? p[reportLength - 1] : p[13]);
+    p += reportLength;
+    reports.push_back(report);
+  }
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &data) {
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    perror(path);
+    return false;
+  }
+
+  uint8_t buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.insert(data.end(), buffer, buffer + length);
+  }
+  fclose(file);
+  return true;
+}
+
+// Replay the reports in a capture, in a loop.
+class CaptureSource : public AdvertSource {
+public:
+  CaptureSource() : index(0) {}
+
+  /* Load a btsnoop or pcap file, recognized by its header. Returns
+   * the number of advertising reports, or -1 on error.
+   */
+  long load(const char *path) {
+    std::vector<uint8_t> data;
+
+    if (!readFile(path, data)) {
+      return -1;
+    }
+    if (data.size() >= 16 &&
+        memcmp(data.data(), "btsnoop\0", 8) == 0) {
+      return loadBtsnoop(data) ? (long)reports.size() : -1;
+    }
+    if (data.size() >= 24) {
+      return loadPcap(data) ? (long)reports.size() : -1;
+    }
+    fprintf(stderr, "%s: not a btsnoop or pcap file\n", path);
+    return -1;
+  }
+
+  bool next(AdvertReport &report) {
+    if (reports.empty()) {
+      return false;
+    }
+    report = reports[index];
+    index = (index + 1) % reports.size();
+    return true;
+  }
+
+private:
+  std::vector<AdvertReport> reports;
+  size_t index;
+
+  bool loadBtsnoop(const std::vector<uint8_t> &data) {
+    uint32_t datalink = readBigEndian32(&data[12]);
+    if (datalink != BTSNOOP_HCI_UNENCAPSULATED &&
+        datalink != BTSNOOP_HCI_UART) {
+      fprintf(stderr, "Unsupported btsnoop datalink type %u\n",
+              (unsigned)datalink);
+      return false;
+    }
+
+    size_t offset = 16;
+    while (offset + 24 <= data.size()) {
+      uint32_t length = readBigEndian32(&data[offset + 4]);
+      uint32_t flags = readBigEndian32(&data[offset + 8]);
+      const uint8_t *packet = data.data() + offset + 24;
+      offset += 24;
+      if (length > data.size() - offset) {
+        break;
+      }
+      offset += length;
+
+      if (datalink == BTSNOOP_HCI_UART) {
+        if (length > 0 && packet[0] == HCI_H4_EVENT) {
+          parseHciEvent(packet + 1, length - 1, reports);
+        }
+      } else if ((flags & BTSNOOP_FLAG_RECEIVED) &&
+                 (flags & BTSNOOP_FLAG_COMMAND_EVENT)) {
+        parseHciEvent(packet, length, reports);
+      }
+    }
+    return true;
+  }
+
+  bool loadPcap(const std::vector<uint8_t> &data) {
+    uint32_t magic = readLittleEndian32(&data[0]);
+    bool swapped;
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+      swapped = false;
+    } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+      swapped = true;
+    } else {
+      fprintf(stderr, "Not a btsnoop or pcap file\n");
+      return false;
+    }
+
+    uint32_t linktype = read32(&data[20], swapped);
+    size_t header;
+    if (linktype == PCAP_BLUETOOTH_HCI_H4) {
+      header = 0;
+    } else if (linktype == PCAP_BLUETOOTH_HCI_H4_WITH_PHDR) {
+      // Direction of the packet
+      header = 4;
+    } else {
+      fprintf(stderr, "Unsupported pcap link type %u\n",
+              (unsigned)linktype);
+      return false;
+    }
+
+    size_t offset = 24;
+    while (offset + 16 <= data.size()) {
+      uint32_t length = read32(&data[offset + 8], swapped);
+      const uint8_t *packet = data.data() + offset + 16;
+      offset += 16;
+      if (length > data.size() - offset) {
+        break;
+      }
+      offset += length;
+
+      if (length > header + 1 && packet[header] == HCI_H4_EVENT) {
+        parseHciEvent(packet + header + 1, length - header - 1,
+                      reports);
+      }
+    }
+    return true;
+  }
+
+  static uint32_t read32(const uint8_t *data, bool swapped) {
+    return swapped ? readBigEndian32(data) : readLittleEndian32(data);
+  }
+};
+
+/* Generate advertisements of a fixed population of devices, each
+ * advertising in turn in a random order: iBeacons, Microsoft beacons,
+ * BME280 sensors and other devices with a name and manufacturer data.
+ * The RSSI of each device wanders randomly and the sensor values
+ * change now and then, so the payload isn't always the same.
+ */
+class SyntheticSource : public AdvertSource {
+public:
+  SyntheticSource(size_t deviceCount, uint32_t seed)
+      : state(seed ? seed : 1) {
+    devices.resize(deviceCount);
+    for (size_t i = 0; i < deviceCount; i++) {
+      createDevice(devices[i], i);
+    }
+  }
+
+  bool next(AdvertReport &report) {
+    if (devices.empty()) {
+      return false;
+    }
+
+    Device &device = devices[random() % devices.size()];
+    int step = (int)(random() % 5) - 2;
+    if (device.rssi + step < -30 && device.rssi + step > -100) {
+      device.rssi += step;
+    }
+    if (device.kind == KIND_BME280 && random() % 8 == 0) {
+      // Next temperature value, in 1/100 °C
+      device.report.payload[7]++;
+    }
+
+    report = device.report;
+    report.rssi = device.rssi;
+    return true;
+  }
+
+private:
+  enum Kind { KIND_IBEACON, KIND_MICROSOFT, KIND_BME280, KIND_OTHER };
+
+  struct Device {
+    Kind kind;
+    int8_t rssi;
+    AdvertReport report;
+  };
+
+  std::vector<Device> devices;
+  uint32_t state;
+
+  // xorshift32, so runs with the same seed are identical
+  uint32_t random() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  void createDevice(Device &device, size_t index) {
+    AdvertReport &report = device.report;
+    uint8_t *p = report.payload;
+
+    for (int i = 0; i < 6; i++) {
+      report.address[i] = (uint8_t)random();
+    }
+    // Random static or public address
+    report.addressType = random() % 2;
+    device.rssi = -40 - (int8_t)(random() % 50);
+
+    // Flags: LE General Discoverable, BR/EDR not supported
+    *p++ = 2;
+    *p++ = 0x01;
+    *p++ = 0x06;
+
+    switch (index % 4) {
+    case 0:
+      device.kind = KIND_IBEACON;
+      *p++ = 26;
+      *p++ = 0xff;
+      *p++ = 0x4c; // Apple
+      *p++ = 0x00;
+      *p++ = 0x02;
+      *p++ = 0x15;
+      for (int i = 0; i < 16; i++) {
+        *p++ = (uint8_t)(0xa0 + i); // Shared UUID
+      }
+      *p++ = 0x00; // Major
+      *p++ = 0x01;
+      *p++ = (uint8_t)(index >> 8); // Minor
+      *p++ = (uint8_t)index;
+      *p++ = (uint8_t)-59; // TX power
+      break;
+    case 1:
+      device.kind = KIND_MICROSOFT;
+      *p++ = 27;
+      *p++ = 0xff;
+      *p++ = 0x06; // Microsoft
+      *p++ = 0x00;
+      *p++ = 0x01; // Scenario type
+      *p++ = 0x09; // Windows 10 Desktop
+      *p++ = 0x20; // Version and flags
+      *p++ = 0x02; // Reserved
+      for (int i = 0; i < 4 + 16; i++) {
+        *p++ = (uint8_t)random(); // Salt and device hash
+      }
+      break;
+    case 2:
+      device.kind = KIND_BME280;
+      *p++ = 9;
+      *p++ = 0xff;
+      *p++ = 0xff; // Test company ID
+      *p++ = 0xff;
+      *p++ = 0x38; // Temperature 21.04 °C
+      *p++ = 0x08;
+      *p++ = 0x78; // Pressure 1013.20 hPa
+      *p++ = 0xc8;
+      *p++ = 0x96; // Humidity 45.02 %
+      *p++ = 0x11;
+      break;
+    default:
+      device.kind = KIND_OTHER;
+      *p++ = 9;
+      *p++ = 0x09; // Complete local name
+      memcpy(p, "Device", 6);
+      p += 6;
+      *p++ = (uint8_t)('0' + index / 10 % 10);
+      *p++ = (uint8_t)('0' + index % 10);
+      *p++ = 9;
+      *p++ = 0xff;
+      *p++ = 0x59; // Nordic Semiconductor
+      *p++ = 0x00;
+      for (int i = 0; i < 6; i++) {
+        *p++ = (uint8_t)random();
+      }
+      break;
+    }
+
+    report.length = p - report.payload;
+  }
+};
+
+#endif /* ADVERT_SOURCE_H_ */
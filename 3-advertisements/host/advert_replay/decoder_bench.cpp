@@ -0,0 +1,206 @@
+/** Measure the decoding cost of each beacon decoder of
+ * NimBLE_Multi_Beacon_Scanner.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The advertisements come from the synthetic devices of the replay
+ * harness or from a capture. They're read into memory first, and then
+ * matched and decoded in a tight loop without decoders, by each
+ * decoder on its own and by the decoders of the sketch together:
+ *
+ * - matches() is what the sketch's scan callback does for every
+ *   advertisement, and what its "cycles/advertisement" report counts.
+ * - dispatch() is what loop() does for the queued advertisements that
+ *   match, here for all of them.
+ *
+ * The cost of a decoder is its time minus the time without decoders,
+ * which is the cost of walking the AD structures. Times are in ns on
+ * this host, so they only compare the decoders with each other.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "Arduino.h"
+#include "NimBLEDevice.h"
+#include "advert_source.h"
+#include "beacon_decoders.h"
+
+HostSerial Serial;
+HostEsp ESP;
+
+/* Only walk the AD structures and find the manufacturer data, as
+ * every dispatcher does. Its "matches" are the advertisements with
+ * manufacturer data.
+ */
+struct WalkOnly {
+  static bool matches(const uint8_t *payload, size_t length) {
+    int none = 0;
+    return dispatch(payload, length, none, none) > 0;
+  }
+
+  template <typename Advert, typename Handler>
+  static int dispatch(const uint8_t *payload, size_t length,
+                      const Advert &advert, Handler &handler) {
+    AdParser parser(payload, length);
+    AdStructure ad;
+    ManufacturerData manufacturerData;
+    int found = 0;
+
+    while (parser.next(ad)) {
+      found += AdParser::toManufacturerData(ad, manufacturerData);
+    }
+    return found;
+  }
+};
+
+// Use the decoded values, so the compiler can't drop the decoding.
+struct SumHandler {
+  uint32_t sum = 0;
+
+  void onBeacon(const AdvertReport &report, const IBeacon &beacon) {
+    sum += beacon.major + beacon.minor + beacon.uuid[15];
+  }
+
+  void onBeacon(const AdvertReport &report,
+                const MicrosoftBeacon &beacon) {
+    sum += beacon.deviceType + beacon.deviceHash[0];
+  }
+
+  void onBeacon(const AdvertReport &report,
+                const Bme280Beacon &beacon) {
+    sum += beacon.temperature + beacon.pressure + beacon.humidity;
+  }
+};
+
+template <typename Dispatcher>
+static void measure(const char *name,
+                    const std::vector<AdvertReport> &reports,
+                    unsigned rounds) {
+  SumHandler handler;
+  size_t matched = 0;
+  int decoded = 0;
+
+  uint64_t start = hostNanos();
+  for (unsigned round = 0; round < rounds; round++) {
+    for (const AdvertReport &report : reports) {
+      matched += Dispatcher::matches(report.payload, report.length);
+    }
+  }
+  double matchNs = (double)(hostNanos() - start) / rounds /
+                   reports.size();
+
+  start = hostNanos();
+  for (unsigned round = 0; round < rounds; round++) {
+    for (const AdvertReport &report : reports) {
+      decoded += Dispatcher::dispatch(report.payload, report.length,
+                                      report, handler);
+    }
+  }
+  double dispatchNs = (double)(hostNanos() - start) / rounds /
+                      reports.size();
+
+  printf("%-20s %9.1f %11.1f %9.1f%% (sum %u)\n", name, matchNs,
+         dispatchNs, 100.0 * matched / rounds / reports.size(),
+         (unsigned)(handler.sum + decoded));
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -f, --file PATH     Use a btsnoop or pcap capture\n"
+          "  -d, --devices N     Number of synthetic devices (100)\n"
+          "  -s, --seed N        Seed of the synthetic devices (1)\n"
+          "  -n, --count N       Number of advertisements (10000)\n"
+          "  -r, --rounds N      Times to decode them all (100)\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"file", required_argument, nullptr, 'f'},
+      {"devices", required_argument, nullptr, 'd'},
+      {"seed", required_argument, nullptr, 's'},
+      {"count", required_argument, nullptr, 'n'},
+      {"rounds", required_argument, nullptr, 'r'},
+      {nullptr, 0, nullptr, 0},
+  };
+  const char *file = nullptr;
+  unsigned long devices = 100;
+  unsigned long seed = 1;
+  unsigned long count = 10000;
+  unsigned long rounds = 100;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "f:d:s:n:r:", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 'f':
+      file = optarg;
+      break;
+    case 'd':
+      devices = strtoul(optarg, nullptr, 0);
+      break;
+    case 's':
+      seed = strtoul(optarg, nullptr, 0);
+      break;
+    case 'n':
+      count = strtoul(optarg, nullptr, 0);
+      break;
+    case 'r':
+      rounds = strtoul(optarg, nullptr, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (count == 0 || rounds == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  CaptureSource capture;
+  SyntheticSource synthetic(file ? 0 : devices, seed);
+  AdvertSource *source = &synthetic;
+  if (file) {
+    long reports = capture.load(file);
+    if (reports <= 0) {
+      fprintf(stderr, "%s: no advertising reports\n", file);
+      return EXIT_FAILURE;
+    }
+    source = &capture;
+  }
+
+  std::vector<AdvertReport> reports;
+  AdvertReport report;
+  reports.reserve(count);
+  while (reports.size() < count && source->next(report)) {
+    reports.push_back(report);
+  }
+  if (reports.empty()) {
+    fprintf(stderr, "No advertisements\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu advertisements (%s), %lu rounds\n", reports.size(),
+         file ? file : "synthetic", rounds);
+  printf("%-20s %9s %11s %10s\n", "Decoders", "matches()",
+         "dispatch()", "Matched");
+  measure<WalkOnly>("None (walk only)", reports, rounds);
+  measure<BeaconDispatcher<IBeaconDecoder>>("iBeacon", reports,
+                                            rounds);
+  measure<BeaconDispatcher<MicrosoftBeaconDecoder>>("Microsoft",
+                                                    reports, rounds);
+  measure<BeaconDispatcher<Bme280BeaconDecoder>>("BME280", reports,
+                                                 rounds);
+  measure<BeaconDispatcher<IBeaconDecoder, MicrosoftBeaconDecoder,
+                           Bme280BeaconDecoder>>("All (sketch)",
+                                                 reports, rounds);
+  printf("Times in ns per advertisement\n");
+
+  return EXIT_SUCCESS;
+}
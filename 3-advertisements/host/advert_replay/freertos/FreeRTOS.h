@@ -0,0 +1,29 @@
+/** Stand-in for the FreeRTOS spinlock of the ESP32 on Linux.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Only the critical sections that the sketches and presence.h use, as
+ * a spinlock on an int. Like in ESP-IDF, portMUX_TYPE is a struct, so
+ * it can be initialized statically.
+ */
+#ifndef FREERTOS_H_
+#define FREERTOS_H_
+
+struct portMUX_TYPE {
+  int owner;
+};
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+static inline void portENTER_CRITICAL(portMUX_TYPE *mux) {
+  while (__atomic_exchange_n(&mux->owner, 1, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+static inline void portEXIT_CRITICAL(portMUX_TYPE *mux) {
+  __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+}
+
+#endif /* FREERTOS_H_ */
@@ -0,0 +1,86 @@
+/** Stand-in for the FreeRTOS queues of the ESP32 on Linux.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Only the static queues that event_dispatcher.h uses, as a ring of
+ * copied items under the spinlock of FreeRTOS.h. Receiving never
+ * blocks: the host benches post and handle events on one thread, so
+ * an empty queue stays empty.
+ */
+#ifndef FREERTOS_QUEUE_H_
+#define FREERTOS_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY UINT32_MAX
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+struct StaticQueue_t {
+  uint8_t *storage;
+  size_t length;
+  size_t itemSize;
+  size_t head;
+  size_t count;
+  portMUX_TYPE lock;
+};
+
+typedef StaticQueue_t *QueueHandle_t;
+
+static inline QueueHandle_t xQueueCreateStatic(size_t length,
+                                               size_t itemSize,
+                                               uint8_t *storage,
+                                               StaticQueue_t *queue) {
+  queue->storage = storage;
+  queue->length = length;
+  queue->itemSize = itemSize;
+  queue->head = 0;
+  queue->count = 0;
+  queue->lock.owner = 0;
+  return queue;
+}
+
+static inline BaseType_t xQueueSend(QueueHandle_t queue,
+                                    const void *item,
+                                    TickType_t ticks) {
+  BaseType_t sent = pdFALSE;
+
+  portENTER_CRITICAL(&queue->lock);
+  if (queue->count < queue->length) {
+    size_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(&queue->storage[tail * queue->itemSize], item,
+           queue->itemSize);
+    queue->count++;
+    sent = pdTRUE;
+  }
+  portEXIT_CRITICAL(&queue->lock);
+  return sent;
+}
+
+static inline BaseType_t xQueueReceive(QueueHandle_t queue,
+                                       void *item, TickType_t ticks) {
+  BaseType_t received = pdFALSE;
+
+  portENTER_CRITICAL(&queue->lock);
+  if (queue->count > 0) {
+    memcpy(item, &queue->storage[queue->head * queue->itemSize],
+           queue->itemSize);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    received = pdTRUE;
+  }
+  portEXIT_CRITICAL(&queue->lock);
+  return received;
+}
+
+#endif /* FREERTOS_QUEUE_H_ */
@@ -0,0 +1,214 @@
+/** Replay advertisements into a scanner sketch on Linux.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The sketch is compiled against the stand-ins for NimBLE-Arduino
+ * and the Arduino core in this directory. The main thread plays the
+ * NimBLE host task: it hands advertising reports to the sketch's
+ * onResult() at a controlled rate and measures how long each callback
+ * takes and how many allocations it does. A second thread runs
+ * loop(), like the Arduino loop task on the ESP32.
+ *
+ * Latencies are measured with the monotonic clock, so they include
+ * the overhead of reading it twice (some tens of nanoseconds).
+ * Absolute numbers depend on the host CPU; compare them between
+ * builds.
+ */
+#include <algorithm>
+#include <atomic>
+#include <getopt.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "Arduino.h"
+#include "NimBLEDevice.h"
+#include "advert_source.h"
+
+#include SKETCH
+
+HostSerial Serial;
+HostEsp ESP;
+
+// Allocations done by the current thread
+static thread_local uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -f, --file PATH     Replay a btsnoop or pcap capture\n"
+          "  -d, --devices N     Number of synthetic devices (100)\n"
+          "  -s, --seed N        Seed of the synthetic devices (1)\n"
+          "  -n, --count N       Number of advertisements (100000)\n"
+          "  -r, --rate N        Advertisements/s, 0 is as fast as "
+          "possible (0)\n"
+          "  -p, --print         Print the serial output of the "
+          "sketch\n",
+          program);
+}
+
+static std::atomic<bool> running(true);
+
+// Run loop() on its own thread, like the Arduino loop task.
+static void loopTask() {
+  while (running) {
+    loop();
+  }
+}
+
+static double percentile(const std::vector<uint32_t> &sorted,
+                         unsigned p) {
+  size_t i = (sorted.size() - 1) * p / 100;
+  return sorted[i] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"file", required_argument, nullptr, 'f'},
+      {"devices", required_argument, nullptr, 'd'},
+      {"seed", required_argument, nullptr, 's'},
+      {"count", required_argument, nullptr, 'n'},
+      {"rate", required_argument, nullptr, 'r'},
+      {"print", no_argument, nullptr, 'p'},
+      {nullptr, 0, nullptr, 0},
+  };
+  const char *file = nullptr;
+  unsigned long devices = 100;
+  unsigned long seed = 1;
+  unsigned long count = 100000;
+  unsigned long rate = 0;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "f:d:s:n:r:p", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 'f':
+      file = optarg;
+      break;
+    case 'd':
+      devices = strtoul(optarg, nullptr, 0);
+      break;
+    case 's':
+      seed = strtoul(optarg, nullptr, 0);
+      break;
+    case 'n':
+      count = strtoul(optarg, nullptr, 0);
+      break;
+    case 'r':
+      rate = strtoul(optarg, nullptr, 0);
+      break;
+    case 'p':
+      Serial.enabled = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (count == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  CaptureSource capture;
+  SyntheticSource synthetic(file ? 0 : devices, seed);
+  AdvertSource *source = &synthetic;
+  if (file) {
+    long reports = capture.load(file);
+    if (reports <= 0) {
+      fprintf(stderr, "%s: no advertising reports\n", file);
+      return EXIT_FAILURE;
+    }
+    source = &capture;
+  }
+
+  setup();
+  std::thread loopThread(loopTask);
+
+  // The sketches start scanning in loop().
+  NimBLEScan *scan = NimBLEDevice::getScan();
+  while (!scan->isScanning()) {
+    delay(1);
+  }
+
+  NimBLEAdvertisedDevice device;
+  AdvertReport report;
+  std::vector<uint32_t> latencies;
+  latencies.reserve(count);
+  uint64_t callbackAllocations = 0;
+  unsigned long notScanning = 0;
+  uint64_t period = rate ? 1000000000u / rate : 0;
+  uint64_t start = hostNanos();
+  uint64_t deadline = start;
+
+  for (unsigned long i = 0; i < count && source->next(report); i++) {
+    device.set(report.address, report.addressType, report.rssi,
+               report.payload, report.length);
+
+    if (period) {
+      deadline += period;
+      struct timespec ts;
+      ts.tv_sec = deadline / 1000000000u;
+      ts.tv_nsec = deadline % 1000000000u;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+    }
+
+    uint64_t before = allocations;
+    uint64_t t0 = hostNanos();
+    bool delivered = scan->deliver(&device);
+    uint64_t t1 = hostNanos();
+    callbackAllocations += allocations - before;
+
+    if (delivered) {
+      latencies.push_back((uint32_t)(t1 - t0));
+    } else {
+      notScanning++;
+    }
+  }
+  uint64_t elapsed = hostNanos() - start;
+
+  // Give loop() time to drain the ring.
+  delay(100);
+  running = false;
+  loopThread.join();
+  fflush(stdout);
+
+  size_t delivered = latencies.size();
+  std::sort(latencies.begin(), latencies.end());
+  printf("\nReplayed %zu advertisements in %.3f s (%s)\n", delivered,
+         elapsed / 1e9, file ? file : "synthetic");
+  printf("Sustained rate   : %.0f advertisements/s\n",
+         delivered * 1e9 / elapsed);
+  if (delivered) {
+    printf("Callback latency : p50 %.3f us, p99 %.3f us, "
+           "max %.3f us\n",
+           percentile(latencies, 50), percentile(latencies, 99),
+           latencies.back() / 1000.0);
+    printf("Allocations      : %.3f per advertisement\n",
+           (double)callbackAllocations / delivered);
+  }
+  printf("Ring             : %u dropped, high-water mark %u/%u\n",
+         (unsigned)advertRing.drops(),
+         (unsigned)advertRing.highWater(),
+         (unsigned)advertRing.capacity());
+  printf("Not scanning     : %lu advertisements, %u scan starts\n",
+         notScanning, (unsigned)scan->getStarts());
+  printf("Serial output    : %zu bytes\n", Serial.bytes);
+
+  return EXIT_SUCCESS;
+}
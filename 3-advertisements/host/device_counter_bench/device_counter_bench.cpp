@@ -0,0 +1,225 @@
+/** Check and benchmark the device counter of the Microsoft beacon
+ * scanner.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Uses a DeviceCounter with the types, window and sub-windows of
+ * NimBLE_Microsoft_Beacon_Scanner, and random device hashes. It
+ * checks that:
+ * - the estimates of 5 to 50000 distinct devices are within three
+ *   standard errors,
+ * - devices drop out of the count when their sub-window expires,
+ * - an advertisement with a time before the current sub-window, as
+ *   loop() gets from the ring after printing the counts, counts in
+ *   the current sub-window and doesn't clear the window.
+ *
+ * Then it times adding a device and estimating the total count.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "device_counter.h"
+
+// Same as NimBLE_Microsoft_Beacon_Scanner.ino
+#define DEVICE_TYPES 15
+#define COUNT_WINDOW 60000
+#define COUNT_SUB_WINDOWS 6
+#define SUB_WINDOW (COUNT_WINDOW / COUNT_SUB_WINDOWS)
+// Standard error of the default precision
+#define STANDARD_ERROR 0.065
+
+typedef DeviceCounter<DEVICE_TYPES + 1, COUNT_SUB_WINDOWS> Counter;
+
+static uint32_t rngState;
+static unsigned failures = 0;
+
+// xorshift32, so runs with the same seed are identical
+static uint32_t random32() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static void randomHash(uint8_t *hash) {
+  for (int i = 0; i < 16; i++) {
+    hash[i] = (uint8_t)random32();
+  }
+}
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(bool ok, const char *what, uint32_t expected,
+                  uint32_t estimate) {
+  printf("%-40s %6u, estimate %6u: %s\n", what, (unsigned)expected,
+         (unsigned)estimate, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Add count new devices of the given type at time.
+static void addDevices(Counter &counter, uint8_t type, size_t count,
+                       uint32_t time) {
+  uint8_t hash[16];
+
+  for (size_t i = 0; i < count; i++) {
+    randomHash(hash);
+    counter.add(type, hash, time);
+  }
+}
+
+static bool close(uint32_t estimate, uint32_t expected) {
+  double error = fabs((double)estimate - expected);
+  return error <= 3 * STANDARD_ERROR * expected + 1;
+}
+
+static void checkAccuracy() {
+  static const uint32_t counts[] = {5, 50, 500, 5000, 50000};
+
+  for (uint32_t count : counts) {
+    Counter *counter = new Counter(COUNT_WINDOW);
+    uint8_t hash[16];
+
+    // Every device advertises a few times, of a random type.
+    for (uint32_t i = 0; i < count; i++) {
+      randomHash(hash);
+      uint8_t type = random32() % (DEVICE_TYPES + 1);
+      for (int j = 0; j < 3; j++) {
+        counter->add(type, hash, i % SUB_WINDOW);
+      }
+    }
+    uint32_t estimate = counter->estimateTotal(SUB_WINDOW - 1);
+    check(close(estimate, count), "Distinct devices", count,
+          estimate);
+    delete counter;
+  }
+}
+
+static void checkExpiry() {
+  Counter *counter = new Counter(COUNT_WINDOW);
+
+  addDevices(*counter, 0, 1000, 0);
+  addDevices(*counter, 0, 500, 3 * SUB_WINDOW);
+  uint32_t estimate = counter->estimate(0, COUNT_WINDOW - 1);
+  check(close(estimate, 1500), "Devices in the window", 1500,
+        estimate);
+  estimate = counter->estimate(0, COUNT_WINDOW);
+  check(close(estimate, 500), "After the first sub-window expired",
+        500, estimate);
+  estimate = counter->estimate(0, 4 * SUB_WINDOW + COUNT_WINDOW);
+  check(estimate == 0, "After the whole window expired", 0,
+        estimate);
+  delete counter;
+}
+
+/* loop() prints the counts at millis(), then handles advertisements
+ * that were queued earlier, possibly in the previous sub-window.
+ */
+static void checkOutOfOrder() {
+  Counter *counter = new Counter(COUNT_WINDOW);
+  uint32_t queued = 2 * SUB_WINDOW - 5;
+  uint32_t printed = 2 * SUB_WINDOW + 5;
+
+  addDevices(*counter, 0, 1000, SUB_WINDOW);
+  counter->estimateTotal(printed);
+  addDevices(*counter, 0, 100, queued);
+  uint32_t estimate = counter->estimateTotal(printed);
+  check(close(estimate, 1100), "Queued before the sub-window", 1100,
+        estimate);
+  estimate = counter->estimateTotal(COUNT_WINDOW + SUB_WINDOW);
+  check(close(estimate, 100), "Queued ones in the current sub-window",
+        100, estimate);
+  delete counter;
+}
+
+static void benchmark(unsigned long count) {
+  Counter *counter = new Counter(COUNT_WINDOW);
+  uint8_t(*hashes)[16] = new uint8_t[1024][16];
+  uint64_t checksum = 0;
+
+  for (int i = 0; i < 1024; i++) {
+    randomHash(hashes[i]);
+  }
+
+  double start = now();
+  for (unsigned long i = 0; i < count; i++) {
+    counter->add(i % (DEVICE_TYPES + 1), hashes[i % 1024],
+                 (uint32_t)(i / 100));
+  }
+  double addTime = (now() - start) / count;
+
+  unsigned long estimates = count / 1000 + 1;
+  start = now();
+  for (unsigned long i = 0; i < estimates; i++) {
+    checksum += counter->estimateTotal((uint32_t)(count / 100));
+  }
+  double estimateTime = (now() - start) / estimates;
+
+  printf("Add %.1f ns, estimate total %.1f us (checksum %llu)\n",
+         addTime * 1e9, estimateTime * 1e6,
+         (unsigned long long)checksum);
+  delete[] hashes;
+  delete counter;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n, --count N       Devices to add in the benchmark "
+          "(1000000)\n"
+          "  -s, --seed N        Seed of the device hashes (1)\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"count", required_argument, nullptr, 'n'},
+      {"seed", required_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+  unsigned long count = 1000000;
+  unsigned long seed = 1;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "n:s:", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 'n':
+      count = strtoul(optarg, nullptr, 0);
+      break;
+    case 's':
+      seed = strtoul(optarg, nullptr, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (count == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  rngState = seed ? seed : 1;
+
+  checkAccuracy();
+  checkExpiry();
+  checkOutOfOrder();
+  if (failures) {
+    printf("%u checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  benchmark(count);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/** Benchmark the flash log of NimBLE_Scan_Continuous on Linux.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Appends synthetic advertisement records to a FlashLog in a
+ * directory, with the page size and number of pages of the sketch,
+ * and optionally flushes partial pages every number of records, like
+ * the sketch does every LOG_FLUSH_INTERVAL. Then it reads the log
+ * back and checks that it holds the newest records in order, also
+ * after reopening it as after a reset.
+ *
+ * Records/s are measured against the host file system, so they're an
+ * upper bound for the ESP32. Write amplification and the number of
+ * page writes carry over.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "flash_log.h"
+
+// Same as NimBLE_Scan_Continuous.ino
+#define LOG_PAGE_SIZE 4096
+#define LOG_PAGES 64
+
+typedef FlashLog<LOG_PAGE_SIZE, LOG_PAGES> Log;
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] DIRECTORY\n"
+          "  -n, --count N       Number of records (100000)\n"
+          "  -f, --flush N       Flush every N records, 0 is never "
+          "(0)\n"
+          "  -s, --seed N        Seed of the records (1)\n",
+          program);
+}
+
+// Records have timestamp i, so the order can be checked.
+static void makeRecord(AdvertRecord &record, uint32_t i,
+                       uint32_t &state) {
+  // xorshift32
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+
+  record.timestamp = i;
+  memcpy(record.address, &state, 4);
+  record.address[4] = (uint8_t)i;
+  record.address[5] = (uint8_t)(i >> 8);
+  record.addressType = state & 1;
+  record.rssi = -40 - (int8_t)(state % 50);
+  // Legacy advertising data, sometimes with a scan response
+  record.length = 20 + state % 12 + (state % 4 == 0 ? 31 : 0);
+  for (uint8_t j = 0; j < record.length; j++) {
+    record.payload[j] = (uint8_t)(i + j);
+  }
+}
+
+/* Read the log and check that the records have consecutive timestamps
+ * ending at last. Returns the number of records, or 0 on error.
+ */
+static uint32_t check(Log &log, uint32_t last) {
+  uint32_t expected = 0;
+  bool first = true;
+  bool ok = true;
+
+  uint32_t records = log.read([&](const AdvertRecord &record) {
+    if (!first && record.timestamp != expected) {
+      ok = false;
+    }
+    for (uint8_t j = 0; j < record.length; j++) {
+      if (record.payload[j] != (uint8_t)(record.timestamp + j)) {
+        ok = false;
+      }
+    }
+    first = false;
+    expected = record.timestamp + 1;
+  });
+  return ok && expected == last + 1 ? records : 0;
+}
+
+static Log *openLog(const char *directory) {
+  static Log *log = nullptr;
+
+  delete log;
+  log = new Log(directory);
+  log->begin();
+  return log;
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"count", required_argument, nullptr, 'n'},
+      {"flush", required_argument, nullptr, 'f'},
+      {"seed", required_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+  unsigned long count = 100000;
+  unsigned long flushEvery = 0;
+  uint32_t state = 1;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "n:f:s:", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 'n':
+      count = strtoul(optarg, nullptr, 0);
+      break;
+    case 'f':
+      flushEvery = strtoul(optarg, nullptr, 0);
+      break;
+    case 's':
+      state = strtoul(optarg, nullptr, 0) | 1;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1 || count == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *directory = argv[optind];
+
+  Log *log = openLog(directory);
+  log->clear();
+
+  AdvertRecord record;
+  double start = now();
+  for (uint32_t i = 0; i < count; i++) {
+    makeRecord(record, i, state);
+    if (!log->append(&record)) {
+      fprintf(stderr, "Writing to %s failed\n", directory);
+      return EXIT_FAILURE;
+    }
+    if (flushEvery && (i + 1) % flushEvery == 0) {
+      log->flush();
+    }
+  }
+  log->flush();
+  double writeTime = now() - start;
+
+  printf("Appended %lu records in %.3f s: %.0f records/s\n", count,
+         writeTime, count / writeTime);
+  printf("Pages written      : %u (%u bytes each, %u in the log)\n",
+         (unsigned)log->pagesWritten(), LOG_PAGE_SIZE, LOG_PAGES);
+  printf("Bytes written      : %llu\n",
+         (unsigned long long)log->bytesWritten());
+  printf("Write amplification: %u.%02u\n",
+         (unsigned)(log->amplification() / 100),
+         (unsigned)(log->amplification() % 100));
+
+  start = now();
+  uint32_t records = check(*log, count - 1);
+  double readTime = now() - start;
+  if (records == 0) {
+    fprintf(stderr, "Reading back the log failed\n");
+    return EXIT_FAILURE;
+  }
+  printf("Read %u records in %.3f s: %.0f records/s\n",
+         (unsigned)records, readTime, records / readTime);
+
+  // Reopen the log, as after a reset.
+  log = openLog(directory);
+  uint32_t reopened = check(*log, count - 1);
+  if (reopened != records) {
+    fprintf(stderr, "Reopened log has %u records instead of %u\n",
+            (unsigned)reopened, (unsigned)records);
+    return EXIT_FAILURE;
+  }
+  printf("Reopened log has the same %u records\n", (unsigned)records);
+
+  return EXIT_SUCCESS;
+}
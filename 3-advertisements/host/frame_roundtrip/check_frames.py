@@ -0,0 +1,183 @@
+"""Check serial_scan_decoder.py against the encoder of the sketch.
+
+Copyright (c) 2022 Koen Vervloesem
+
+SPDX-License-Identifier: MIT
+
+With "cases", it decodes the frames of frame_cases and checks each
+one against the expected outcome and record: the decoded record and
+its fields encoded again, or a rejected CRC, a short frame or an
+unknown type.
+
+With "throughput", it decodes the serial output of the replayed
+NimBLE_Scan_Continuous sketch in binary mode, counts the advertisement
+lines of its output in text mode, and compares the bytes per
+advertisement and the advertisements per second that fit in a serial
+link of both.
+"""
+import os
+import sys
+
+from construct.core import StreamError
+
+sys.path.insert(
+    0, os.path.join(os.path.dirname(__file__), "..", "..", "bleak")
+)
+
+# pylint: disable=import-error,wrong-import-position
+from serial_scan_decoder import (  # noqa: E402
+    FRAME_TYPE_ADVERT,
+    FRAME_TYPE_LOST,
+    FRAME_TYPE_SCAN,
+    FRAME_TYPE_STATS,
+    advert_format,
+    cobs_decode,
+    decode_frame,
+    lost_format,
+    scan_format,
+    stats_format,
+)
+
+FORMATS = {
+    "advert": (FRAME_TYPE_ADVERT, advert_format),
+    "stats": (FRAME_TYPE_STATS, stats_format),
+    "lost": (FRAME_TYPE_LOST, lost_format),
+    "scan": (FRAME_TYPE_SCAN, scan_format),
+}
+
+ERRORS = {
+    "crc": "CRC mismatch",
+    "short": "Frame too short",
+    "unknown": "Unknown frame type",
+}
+
+
+def check_frame(frame: bytes, outcome: str, raw: bytes) -> bool:
+    """Check a frame against its expected outcome and record."""
+    if cobs_decode(frame) != raw:
+        return False
+
+    try:
+        frame_type, record = decode_frame(frame)
+    except StreamError:
+        return False
+    except ValueError as error:
+        return outcome in ERRORS and str(error).startswith(
+            ERRORS[outcome]
+        )
+
+    if outcome not in FORMATS:
+        return False
+    expected_type, record_format = FORMATS[outcome]
+    return (
+        frame_type == expected_type
+        and record_format.build(record) == raw[1:-2]
+    )
+
+
+def check_cases(frames_path: str, expected_path: str) -> bool:
+    """Check all frames of frame_cases."""
+    with open(frames_path, "rb") as frames_file:
+        frames = frames_file.read().split(b"\x00")[:-1]
+    with open(expected_path, encoding="ascii") as expected_file:
+        expected = [line.split(" ") for line in expected_file]
+
+    if len(frames) != len(expected):
+        print(f"{len(frames)} frames, {len(expected)} expected")
+        return False
+
+    failures = 0
+    outcomes = {}
+    for index, (frame, (outcome, raw)) in enumerate(
+        zip(frames, expected)
+    ):
+        if not check_frame(frame, outcome, bytes.fromhex(raw)):
+            print(f"Frame {index} ({outcome}): FAILED")
+            failures += 1
+        outcomes[outcome] = outcomes.get(outcome, 0) + 1
+
+    summary = ", ".join(
+        f"{count} {outcome}" for outcome, count in outcomes.items()
+    )
+    print(f"{len(frames)} frames ({summary}): {failures} failed")
+    return failures == 0
+
+
+def count_binary(path: str):
+    """Count the advertisement frames and their bytes."""
+    with open(path, "rb") as output:
+        data = output.read()
+    # The replay summary follows the last frame.
+    data = data[: data.rfind(b"\x00") + 1]
+
+    adverts = 0
+    advert_bytes = 0
+    errors = 0
+    for frame in data.split(b"\x00")[:-1]:
+        try:
+            frame_type, _ = decode_frame(frame)
+        except (ValueError, StreamError):
+            errors += 1
+            continue
+        if frame_type == FRAME_TYPE_ADVERT:
+            adverts += 1
+            advert_bytes += len(frame) + 1
+    return adverts, advert_bytes, errors
+
+
+def count_text(path: str):
+    """Count the advertisement lines and their bytes."""
+    adverts = 0
+    advert_bytes = 0
+    with open(path, "rb") as output:
+        for line in output:
+            if line.startswith(b"Advertised Device:"):
+                adverts += 1
+                advert_bytes += len(line)
+    return adverts, advert_bytes
+
+
+def compare_throughput(
+    binary_path: str, text_path: str, baud: int = 115200
+) -> bool:
+    """Compare the serial throughput of both output modes."""
+    adverts, binary_bytes, errors = count_binary(binary_path)
+    text_adverts, text_bytes = count_text(text_path)
+    if adverts == 0 or text_adverts == 0:
+        print("No advertisements")
+        return False
+
+    # 8N1: ten bits per byte
+    bytes_per_second = baud / 10
+    for mode, count, total in (
+        ("Binary", adverts, binary_bytes),
+        ("Text", text_adverts, text_bytes),
+    ):
+        print(
+            f"{mode:6}: {count} advertisements, "
+            f"{total / count:.1f} bytes each, at most "
+            f"{bytes_per_second * count / total:.0f} "
+            f"advertisements/s at {baud} baud"
+        )
+    ratio = binary_bytes * text_adverts / adverts / text_bytes
+    print(
+        f"Binary frames take {100 * ratio:.0f}% of the bytes of "
+        f"text, {errors} frames rejected"
+    )
+    return errors == 0
+
+
+if __name__ == "__main__":
+
+    if len(sys.argv) == 4 and sys.argv[1] == "cases":
+        sys.exit(0 if check_cases(sys.argv[2], sys.argv[3]) else 1)
+    elif len(sys.argv) == 4 and sys.argv[1] == "throughput":
+        sys.exit(
+            0 if compare_throughput(sys.argv[2], sys.argv[3]) else 1
+        )
+    else:
+        print(
+            "Please specify cases FRAMES EXPECTED or throughput "
+            "BINARY_OUTPUT TEXT_OUTPUT."
+        )
+        sys.exit(1)
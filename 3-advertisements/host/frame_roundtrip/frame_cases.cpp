@@ -0,0 +1,252 @@
+/** Write frames of the continuous scanner for serial_scan_decoder.py.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Encodes records with the functions of advert_frame.h, as
+ * NimBLE_Scan_Continuous sends them in binary mode, and writes the
+ * frames one after the other to a file. For every frame, a line in a
+ * second file has the outcome that check_frames.py expects from the
+ * decoder and the record with its CRC in hex:
+ *
+ * - advert, stats, lost and scan: a record of that type, among which
+ *   advertisements with an empty payload and with payloads of only
+ *   zero or 0xff bytes,
+ * - unknown: records of type 0 around the COBS block boundaries and
+ *   with runs of more than 254 zero bytes, which the records of the
+ *   scanner are too short for, and random ones of up to 600 bytes,
+ * - short: a frame with only the CRC of an empty record,
+ * - crc: a frame with a wrong CRC or a changed record.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "advert_frame.h"
+
+// Largest test record
+#define RAW_MAX 600
+
+static uint32_t rngState;
+static FILE *frames;
+static FILE *expected;
+static unsigned written = 0;
+
+// xorshift32, so runs with the same seed are identical
+static uint32_t random32() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+/* Write a frame, and the expected outcome with the record and CRC
+ * that were encoded. These are the decoded frame, unless the frame
+ * was corrupted after encoding.
+ */
+static void write(const char *outcome, const uint8_t *frame,
+                  size_t length, const uint8_t *raw,
+                  size_t rawLength) {
+  fwrite(frame, 1, length, frames);
+  fprintf(expected, "%s ", outcome);
+  for (size_t i = 0; i < rawLength; i++) {
+    fprintf(expected, "%02x", raw[i]);
+  }
+  fprintf(expected, "\n");
+  written++;
+}
+
+// Encode a record of any length and write it.
+static void writeRaw(const char *outcome, const uint8_t *record,
+                     size_t length) {
+  uint8_t raw[RAW_MAX + 2];
+  uint8_t frame[RAW_MAX + 2 + RAW_MAX / 254 + 3];
+
+  memcpy(raw, record, length);
+  size_t frameLength = frameFinish(raw, length, frame);
+  write(outcome, frame, frameLength, raw, length + 2);
+}
+
+/* COBS-decode a frame of this program, without the checks of the
+ * decoder. Returns the record length.
+ */
+static size_t decode(const uint8_t *frame, uint8_t *raw) {
+  size_t length = 0;
+
+  while (*frame != 0) {
+    uint8_t code = *frame++;
+    for (uint8_t i = 1; i < code; i++) {
+      raw[length++] = *frame++;
+    }
+    if (code < 0xff && *frame != 0) {
+      raw[length++] = 0;
+    }
+  }
+  return length;
+}
+
+static void writeAdvert(uint8_t length, uint8_t fill) {
+  AdvertRecord record;
+  uint8_t frame[FRAME_MAX_SIZE];
+  uint8_t raw[FRAME_MAX_RAW];
+
+  for (int i = 0; i < 6; i++) {
+    record.address[i] = (uint8_t)random32();
+  }
+  record.addressType = random32() % 2;
+  record.rssi = -30 - (int8_t)(random32() % 70);
+  record.timestamp = random32();
+  record.length = length;
+  for (int i = 0; i < length; i++) {
+    record.payload[i] = fill;
+  }
+  size_t frameLength =
+      frameEncodeAdvert(&record, record.rssi, frame);
+  write("advert", frame, frameLength, raw, decode(frame, raw));
+}
+
+static void writeTypes() {
+  uint8_t frame[FRAME_MAX_SIZE];
+  uint8_t raw[FRAME_MAX_RAW];
+  size_t length;
+
+  length = frameEncodeStats(0, 255, 65536, 0xffffffff, frame);
+  write("stats", frame, length, raw, decode(frame, raw));
+
+  DeviceEntry entry = {{1, 2, 3, 0, 5, 6}, 1, 1, -960, -960, 0,
+                       1000, 61000, 100, 600};
+  length = frameEncodeLost(entry, frame);
+  write("lost", frame, length, raw, decode(frame, raw));
+
+  // Like NimBLE_Scan_Continuous.ino
+  ScanSchedulerConfig config = {100, 1000, 30, 100, 10000,
+                                50, 500, true};
+  ScanScheduler scheduler(config);
+  length = frameEncodeScan(scheduler, frame);
+  write("scan", frame, length, raw, decode(frame, raw));
+}
+
+// Records of type 0 around the COBS block boundaries
+static void writeBoundaries() {
+  static const size_t lengths[] = {1,   2,   253, 254, 255,
+                                   256, 508, 509, RAW_MAX};
+  uint8_t record[RAW_MAX];
+
+  for (size_t length : lengths) {
+    // 0, 1, 2, ..., 255, 1, 2, ...
+    for (size_t i = 0; i < length; i++) {
+      record[i] = i == 0 ? 0 : (uint8_t)((i - 1) % 255 + 1);
+    }
+    writeRaw("unknown", record, length);
+    // Only zero bytes
+    memset(record, 0, length);
+    writeRaw("unknown", record, length);
+  }
+
+  // Runs of 300 zero bytes and 254 other bytes
+  for (size_t i = 0; i < RAW_MAX; i++) {
+    record[i] = i % 554 < 300 ? 0 : 0xa5;
+  }
+  writeRaw("unknown", record, RAW_MAX);
+}
+
+// Random records, with runs of zero bytes
+static void writeRandom(unsigned count) {
+  uint8_t record[RAW_MAX];
+
+  for (unsigned n = 0; n < count; n++) {
+    size_t length = 1 + random32() % RAW_MAX;
+    uint32_t zeroes = random32() % 100;
+
+    record[0] = 0;
+    for (size_t i = 1; i < length; i++) {
+      record[i] =
+          random32() % 100 < zeroes ? 0 : (uint8_t)random32();
+    }
+    writeRaw("unknown", record, length);
+  }
+}
+
+static void writeCorrupt() {
+  // A CRC bit, then a record bit
+  static const size_t bits[] = {17 * 8 + 14, 5 * 8 + 3};
+  uint8_t frame[FRAME_MAX_SIZE];
+  uint8_t raw[FRAME_MAX_RAW];
+  size_t length;
+
+  // Only the CRC of an empty record
+  writeRaw("short", raw, 0);
+
+  // Changed after adding the CRC
+  for (size_t bit : bits) {
+    frameEncodeStats(1, 2, 3, 4, frame);
+    length = decode(frame, raw);
+    raw[bit / 8] ^= 1 << bit % 8;
+    size_t frameLength = frameCobsEncode(raw, length, frame);
+    write("crc", frame, frameLength, raw, length);
+  }
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] FRAMES EXPECTED\n"
+          "  -n, --count N       Number of random records (1000)\n"
+          "  -s, --seed N        Seed of the random records (1)\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"count", required_argument, nullptr, 'n'},
+      {"seed", required_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+  unsigned long count = 1000;
+  unsigned long seed = 1;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "n:s:", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 'n':
+      count = strtoul(optarg, nullptr, 0);
+      break;
+    case 's':
+      seed = strtoul(optarg, nullptr, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  rngState = seed ? seed : 1;
+
+  frames = fopen(argv[optind], "wb");
+  expected = fopen(argv[optind + 1], "w");
+  if (frames == nullptr || expected == nullptr) {
+    perror("fopen");
+    return EXIT_FAILURE;
+  }
+
+  writeAdvert(0, 0);
+  writeAdvert(31, 0x5a);
+  writeAdvert(ADVERT_MAX_PAYLOAD, 0);
+  writeAdvert(ADVERT_MAX_PAYLOAD, 0xff);
+  writeTypes();
+  // A corrupt frame in between, so the decoder resynchronizes
+  writeCorrupt();
+  writeAdvert(1, 0xff);
+  writeBoundaries();
+  writeRandom(count);
+
+  fclose(frames);
+  fclose(expected);
+  printf("%u frames written\n", written);
+  return EXIT_SUCCESS;
+}
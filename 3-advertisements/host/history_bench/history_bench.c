@@ -0,0 +1,343 @@
+/*
+ * Simulate the samples that a gateway receives from
+ * advertise_bme280_history, compared with advertise_bme280.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * A simulated BME280 is sampled every second for the given time, and
+ * both firmwares advertise it with the same advertising events: every
+ * 1 to 1.2 s, plus a random delay of 0 to 10 ms. The gateway loses
+ * advertisements in bursts, with a two-state (Gilbert-Elliott) model
+ * of the average loss and burst length. Both firmwares see the same
+ * losses.
+ *
+ * - Legacy: each received advertisement delivers its newest sample.
+ * - History: each received advertisement delivers the samples that
+ *   history_encode() of advertise_bme280_history fits in it, from
+ *   the sample ring of the bme280_sampler module. The bench decodes
+ *   them like a gateway, and checks them against the simulated
+ *   values.
+ *
+ * The radio-on time of an advertising event is the air time of its
+ * packets plus a ramp-up time of the radio for each, on three primary
+ * channels for both, plus one AUX_ADV_IND on the 2M PHY (or 1M with
+ * --phy1m) for extended advertising. It doesn't include the current
+ * of the CPU or the sensor, which is the same for both.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+// Assumed time for the radio to ramp up before each packet, in us
+#define RADIO_RAMP_US 40
+// Flags AD structure
+#define AD_FLAGS_SIZE 3
+// Manufacturer data: length, type and company ID
+#define AD_MANUFACTURER_HEADER_SIZE 4
+// Advertiser address in ADV_NONCONN_IND and AUX_ADV_IND
+#define ADV_ADDRESS_SIZE 6
+// Extended header of ADV_EXT_IND: length, flags, ADI and AuxPtr
+#define ADV_EXT_HEADER_SIZE 7
+// Extended header of AUX_ADV_IND: length, flags, AdvA and ADI
+#define AUX_EXT_HEADER_SIZE 10
+
+struct options {
+  unsigned seconds;
+  double loss;
+  double burst;
+  unsigned history;
+  bool phy1m;
+  unsigned seed;
+};
+
+struct result {
+  unsigned delivered;
+  unsigned longest_gap; // Consecutive samples not delivered
+  double radio_us;
+  unsigned long samples_sent; // In all advertisements
+  unsigned long bytes_sent;   // Encoded history
+  unsigned truncated; // Encodings stopped by a large difference
+};
+
+static unsigned rng_state;
+
+// xorshift32, in [0, 1)
+static double uniform(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state / 4294967296.0;
+}
+
+static int uniform_int(int min, int max) {
+  return min + (int)(uniform() * (max - min + 1));
+}
+
+// Air time of a packet with a PDU payload of length bytes, in us
+static double air_time_1m(unsigned length) {
+  // Preamble, access address, header, payload and CRC
+  return (1 + 4 + 2 + length + 3) * 8.0;
+}
+
+static double air_time_2m(unsigned length) {
+  return (2 + 4 + 2 + length + 3) * 4.0;
+}
+
+static double legacy_event_us(void) {
+  unsigned length = ADV_ADDRESS_SIZE + AD_FLAGS_SIZE +
+                    AD_MANUFACTURER_HEADER_SIZE + HISTORY_SAMPLE_SIZE;
+
+  return 3 * (RADIO_RAMP_US + air_time_1m(length));
+}
+
+static double extended_event_us(size_t encoded, bool phy1m) {
+  unsigned length = AUX_EXT_HEADER_SIZE + AD_FLAGS_SIZE +
+                    AD_MANUFACTURER_HEADER_SIZE + encoded;
+
+  return 3 * (RADIO_RAMP_US + air_time_1m(ADV_EXT_HEADER_SIZE)) +
+         RADIO_RAMP_US +
+         (phy1m ? air_time_1m(length) : air_time_2m(length));
+}
+
+static void next_sample(struct bme280_sample *sample) {
+  // A step now and then, like a window that opens
+  if (uniform() < 1.0 / 600) {
+    sample->temperature += uniform_int(-300, 300);
+    sample->humidity += uniform_int(-1000, 1000);
+  }
+  sample->temperature += uniform_int(-3, 3);
+  sample->pressure += uniform_int(-5, 5);
+  sample->humidity += uniform_int(-10, 10);
+}
+
+static uint16_t get_uint16(const uint8_t *buf) {
+  return (uint16_t)(buf[0] | buf[1] << 8);
+}
+
+/*
+ * Decode an encoded history like a gateway, check it against the
+ * simulated samples and mark them as delivered. Returns the number of
+ * samples in it, or 0 if it's invalid.
+ */
+static unsigned decode(const uint8_t *buf, size_t length,
+                       const struct bme280_sample *samples,
+                       bool *delivered) {
+  struct bme280_sample sample;
+  uint16_t sequence = get_uint16(&buf[1]);
+  unsigned count = buf[3];
+
+  if (length < HISTORY_HEADER_SIZE + HISTORY_SAMPLE_SIZE ||
+      buf[0] != HISTORY_VERSION || count == 0 ||
+      length != HISTORY_HEADER_SIZE + HISTORY_SAMPLE_SIZE +
+                    (count - 1) * HISTORY_DELTA_SIZE) {
+    return 0;
+  }
+
+  sample.temperature = (int16_t)get_uint16(&buf[5]);
+  sample.pressure = get_uint16(&buf[7]);
+  sample.humidity = get_uint16(&buf[9]);
+  for (unsigned i = 0; i < count; i++) {
+    if (i > 0) {
+      const uint8_t *delta = &buf[HISTORY_HEADER_SIZE +
+                                  HISTORY_SAMPLE_SIZE +
+                                  (i - 1) * HISTORY_DELTA_SIZE];
+      sample.temperature += (int8_t)delta[0];
+      sample.pressure += (int8_t)delta[1];
+      sample.humidity += (int8_t)delta[2];
+    }
+    // The simulation doesn't run long enough to wrap around.
+    unsigned index = sequence - i;
+    if (memcmp(&sample, &samples[index], sizeof(sample)) != 0) {
+      fprintf(stderr, "Sample %u decoded wrong\n", index);
+      exit(EXIT_FAILURE);
+    }
+    delivered[index] = true;
+  }
+  return count;
+}
+
+static unsigned longest_gap(const bool *delivered, unsigned count) {
+  unsigned longest = 0, gap = 0;
+
+  for (unsigned i = 0; i < count; i++) {
+    gap = delivered[i] ? 0 : gap + 1;
+    if (gap > longest) {
+      longest = gap;
+    }
+  }
+  return longest;
+}
+
+static void print_result(const char *name, const struct result *r,
+                         unsigned samples, unsigned events) {
+  printf("%s:\n", name);
+  printf("  Delivered: %u of %u samples (%.1f%%), longest gap %u "
+         "samples\n",
+         r->delivered, samples, 100.0 * r->delivered / samples,
+         r->longest_gap);
+  printf("  Radio on: %.0f us per event, %.2f s in total, %.1f "
+         "delivered samples per radio-on ms\n",
+         r->radio_us / events, r->radio_us / 1e6,
+         r->delivered / (r->radio_us / 1000));
+  if (r->bytes_sent > 0) {
+    printf("  Encoded: %.1f bytes and %.1f samples per "
+           "advertisement, %u truncated by a large difference\n",
+           (double)r->bytes_sent / events,
+           (double)r->samples_sent / events, r->truncated);
+  }
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -t, --seconds N     Simulated time in s (43200)\n"
+          "  -l, --loss P        Fraction of advertisements lost "
+          "(0.5)\n"
+          "  -b, --burst N       Average advertisements in a loss "
+          "burst (4)\n"
+          "  -n, --history N     Samples per advertisement (%u)\n"
+          "  -1, --phy1m         AUX_ADV_IND on the 1M PHY\n"
+          "  -s, --seed N        Seed of the simulation (1)\n",
+          program, HISTORY_SIZE);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"seconds", required_argument, NULL, 't'},
+      {"loss", required_argument, NULL, 'l'},
+      {"burst", required_argument, NULL, 'b'},
+      {"history", required_argument, NULL, 'n'},
+      {"phy1m", no_argument, NULL, '1'},
+      {"seed", required_argument, NULL, 's'},
+      {NULL, 0, NULL, 0}};
+  struct options options = {43200, 0.5, 4, HISTORY_SIZE, false, 1};
+  int c;
+
+  while ((c = getopt_long(argc, argv, "t:l:b:n:1s:", long_options,
+                          NULL)) != -1) {
+    switch (c) {
+    case 't':
+      options.seconds = strtoul(optarg, NULL, 0);
+      break;
+    case 'l':
+      options.loss = strtod(optarg, NULL);
+      break;
+    case 'b':
+      options.burst = strtod(optarg, NULL);
+      break;
+    case 'n':
+      options.history = strtoul(optarg, NULL, 0);
+      break;
+    case '1':
+      options.phy1m = true;
+      break;
+    case 's':
+      options.seed = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  // Sequence numbers are 16-bit.
+  if (options.seconds == 0 || options.seconds > 65536 ||
+      options.loss < 0 || options.loss >= 1 || options.burst < 1 ||
+      options.history == 0 || options.history > HISTORY_SIZE) {
+    fprintf(stderr, "Seconds must be 1 to 65536, loss 0 to 1, "
+                    "burst at least 1 and history 1 to %u\n",
+                    HISTORY_SIZE);
+    return EXIT_FAILURE;
+  }
+  rng_state = options.seed ? options.seed : 1;
+
+  struct bme280_sample *samples =
+      calloc(options.seconds, sizeof(*samples));
+  bool *legacy_delivered = calloc(options.seconds, sizeof(bool));
+  bool *history_delivered = calloc(options.seconds, sizeof(bool));
+  struct result legacy = {0}, extended = {0};
+  struct bme280_sample ring_samples[HISTORY_SIZE];
+  struct bme280_sample newest[HISTORY_SIZE];
+  struct bme280_ring ring;
+  uint8_t buf[HISTORY_MAX_ENCODED];
+
+  if (samples == NULL || legacy_delivered == NULL ||
+      history_delivered == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  // Loss bursts end with probability 1/burst per advertisement.
+  double bad_to_good = 1 / options.burst;
+  double good_to_bad =
+      options.loss * bad_to_good / (1 - options.loss);
+  bool bad = false;
+
+  struct bme280_sample sample = {2000, 51325, 5000};
+  unsigned sampled = 0, events = 0;
+  double event_ms = 0;
+
+  bme280_ring_init(&ring, ring_samples, HISTORY_SIZE);
+  while (sampled < options.seconds) {
+    // Take the samples up to this advertising event.
+    while (sampled < options.seconds &&
+           sampled * 1000.0 <= event_ms) {
+      next_sample(&sample);
+      samples[sampled++] = sample;
+      bme280_ring_add(&ring, &sample);
+    }
+
+    size_t available =
+        bme280_ring_copy(&ring, newest, options.history);
+    size_t length =
+        history_encode(newest, available, (uint16_t)ring.sequence, 1,
+                       buf, sizeof(buf));
+    unsigned count = buf[3];
+
+    events++;
+    legacy.radio_us += legacy_event_us();
+    extended.radio_us += extended_event_us(length, options.phy1m);
+    extended.bytes_sent += length;
+    extended.samples_sent += count;
+    if (count < available) {
+      extended.truncated++;
+    }
+
+    bad = bad ? uniform() >= bad_to_good : uniform() < good_to_bad;
+    if (!bad) {
+      legacy_delivered[sampled - 1] = true;
+      decode(buf, length, samples, history_delivered);
+    }
+
+    event_ms += uniform_int(1000, 1200) + uniform() * 10;
+  }
+
+  for (unsigned i = 0; i < options.seconds; i++) {
+    legacy.delivered += legacy_delivered[i];
+    extended.delivered += history_delivered[i];
+  }
+  legacy.longest_gap = longest_gap(legacy_delivered, options.seconds);
+  extended.longest_gap =
+      longest_gap(history_delivered, options.seconds);
+
+  printf("%u s, %u advertising events, %.0f%% lost in bursts of %.1f "
+         "on average\n",
+         options.seconds, events, options.loss * 100, options.burst);
+  print_result("Legacy, newest sample", &legacy, options.seconds,
+               events);
+  char name[64];
+  snprintf(name, sizeof(name), "Extended, up to %u samples (%s)",
+           options.history, options.phy1m ? "1M" : "2M");
+  print_result(name, &extended, options.seconds, events);
+
+  free(samples);
+  free(legacy_delivered);
+  free(history_delivered);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+/*
+ * Delta-encoded history of BME280 samples.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The encoding, all little-endian:
+ * - version (uint8), HISTORY_VERSION,
+ * - sequence number of the newest sample (uint16), which increments
+ *   with each sample and wraps around,
+ * - number of samples (uint8),
+ * - time between samples in seconds (uint8),
+ * - newest sample: temperature (int16), pressure (uint16) and
+ *   humidity (uint16), as in advertise_bme280,
+ * - for each older sample, from new to old: the difference of its
+ *   temperature, pressure and humidity with the next newer sample
+ *   (int8 each).
+ *
+ * The values of a sensor sampled every few seconds change little
+ * between samples, so each older sample takes 3 bytes instead of 6.
+ * The history stops at the first difference that doesn't fit in 8
+ * bits, so the encoding stays exact. This code doesn't depend on
+ * Zephyr, so it also builds on the host.
+ */
+
+#include "history.h"
+
+static void put_uint16(uint8_t *buf, uint16_t value) {
+  buf[0] = (uint8_t)value;
+  buf[1] = (uint8_t)(value >> 8);
+}
+
+static int fits_int8(int32_t value) {
+  return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+/*
+ * Encode at most count samples, from new to old, into buf, which
+ * holds size bytes. sequence is the sequence number of the newest
+ * sample. Returns the length of the encoding, or 0 if there are no
+ * samples or buf is too small for one sample.
+ */
+size_t history_encode(const struct bme280_sample *samples,
+                      size_t count, uint16_t sequence,
+                      uint8_t interval, uint8_t *buf, size_t size) {
+  const struct bme280_sample *newer, *older;
+  size_t length = HISTORY_HEADER_SIZE + HISTORY_SAMPLE_SIZE;
+  uint8_t encoded = 1;
+
+  if (count == 0 || size < length) {
+    return 0;
+  }
+  if (count > HISTORY_SIZE) {
+    count = HISTORY_SIZE;
+  }
+
+  newer = &samples[0];
+  put_uint16(&buf[5], (uint16_t)newer->temperature);
+  put_uint16(&buf[7], newer->pressure);
+  put_uint16(&buf[9], newer->humidity);
+
+  while (encoded < count && length + HISTORY_DELTA_SIZE <= size) {
+    older = &samples[encoded];
+    int32_t temperature = older->temperature - newer->temperature;
+    int32_t pressure = older->pressure - newer->pressure;
+    int32_t humidity = older->humidity - newer->humidity;
+
+    if (!fits_int8(temperature) || !fits_int8(pressure) ||
+        !fits_int8(humidity)) {
+      break;
+    }
+    buf[length++] = (uint8_t)(int8_t)temperature;
+    buf[length++] = (uint8_t)(int8_t)pressure;
+    buf[length++] = (uint8_t)(int8_t)humidity;
+    newer = older;
+    encoded++;
+  }
+
+  buf[0] = HISTORY_VERSION;
+  put_uint16(&buf[1], sequence);
+  buf[3] = encoded;
+  buf[4] = interval;
+  return length;
+}
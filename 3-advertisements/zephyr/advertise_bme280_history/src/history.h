@@ -0,0 +1,35 @@
+/*
+ * Delta-encoded history of BME280 samples.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bme280_ring.h"
+
+// Number of samples advertised at most
+#define HISTORY_SIZE 32
+// Version of the encoding, first byte after the company ID
+#define HISTORY_VERSION 1
+// Version, sequence number (uint16), count and interval
+#define HISTORY_HEADER_SIZE 5
+// Newest sample: temperature, pressure and humidity, 16-bit
+#define HISTORY_SAMPLE_SIZE 6
+// Older samples: differences with the next newer one, 8-bit
+#define HISTORY_DELTA_SIZE 3
+#define HISTORY_MAX_ENCODED                                          \
+  (HISTORY_HEADER_SIZE + HISTORY_SAMPLE_SIZE +                       \
+   (HISTORY_SIZE - 1) * HISTORY_DELTA_SIZE)
+
+size_t history_encode(const struct bme280_sample *samples,
+                      size_t count, uint16_t sequence,
+                      uint8_t interval, uint8_t *buf, size_t size);
+
+#endif /* HISTORY_H_ */
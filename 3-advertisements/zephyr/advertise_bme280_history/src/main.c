@@ -0,0 +1,134 @@
+/*
+ * Advertise a history of BME280 sensor data in BLE extended
+ * advertising.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * advertise_bme280 advertises one sample in a legacy advertisement,
+ * so a scanner that misses it loses that sample. This firmware
+ * advertises the last HISTORY_SIZE samples from the history of the
+ * shared bme280_sampler module, delta-encoded in the
+ * manufacturer-specific data of an extended advertisement, see
+ * history.c. Its primary channels only carry a pointer to one
+ * AUX_ADV_IND on a secondary channel with the data, on the 2M PHY if
+ * the scanner supports it. A gateway that misses advertisements
+ * recovers the samples from the next one it receives, as long as the
+ * gap is shorter than the history, without connecting.
+ *
+ * The scanner-side decoder is bme280_history_scanner.py in
+ * 3-advertisements/bleak, and host/history_bench simulates the
+ * delivered samples per radio-on time compared with a legacy
+ * advertisement.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/types.h>
+
+#include "bme280_sampler.h"
+#include "history.h"
+
+// Time between samples, in s
+#define SAMPLE_INTERVAL                                              \
+  (CONFIG_BME280_SAMPLER_INTERVAL / MSEC_PER_SEC)
+
+BUILD_ASSERT(CONFIG_BME280_SAMPLER_INTERVAL % MSEC_PER_SEC == 0 &&
+                 SAMPLE_INTERVAL >= 1 && SAMPLE_INTERVAL <= UINT8_MAX,
+             "The history encodes the interval in whole seconds");
+
+#define ADV_PARAM                                                    \
+  BT_LE_ADV_PARAM(BT_LE_ADV_OPT_EXT_ADV, BT_GAP_ADV_SLOW_INT_MIN,    \
+                  BT_GAP_ADV_SLOW_INT_MAX, NULL)
+
+static struct bt_le_ext_adv *adv;
+static atomic_t advertising;
+
+// Newest samples, from new to old
+static struct bme280_sample samples[HISTORY_SIZE];
+
+// Test company ID, followed by the encoded history
+static uint8_t manufacturer_data[2 + HISTORY_MAX_ENCODED] = {0xff,
+                                                             0xff};
+
+static struct bt_data ad[] = {
+    BT_DATA_BYTES(BT_DATA_FLAGS, BT_LE_AD_NO_BREDR),
+    BT_DATA(BT_DATA_MANUFACTURER_DATA, manufacturer_data, 2)};
+
+void update_ad_bme280(void) {
+  uint32_t sequence;
+  size_t count =
+      bme280_sampler_history(samples, HISTORY_SIZE, &sequence);
+
+  ad[1].data_len =
+      2 + history_encode(samples, count, (uint16_t)sequence,
+                         SAMPLE_INTERVAL, &manufacturer_data[2],
+                         sizeof(manufacturer_data) - 2);
+}
+
+// Called in the sampler thread with each new sample.
+static void sample_cb(const struct bme280_sample *sample,
+                      const struct bme280_sample_info *info) {
+  int err;
+
+  if (!atomic_get(&advertising)) {
+    return;
+  }
+
+  // Update advertised sensor values
+  update_ad_bme280();
+  err = bt_le_ext_adv_set_data(adv, ad, ARRAY_SIZE(ad), NULL, 0);
+  if (err) {
+    printk("Advertising update failed (err %d)\n", err);
+  }
+}
+
+int main(void) {
+  int err;
+
+  printk("Starting firmware...\n");
+
+  // Sample the BME280 in the background
+  err = bme280_sampler_start(sample_cb);
+  if (err) {
+    return 0;
+  }
+
+  // Initialize the Bluetooth subsystem
+  err = bt_enable(NULL);
+  if (err) {
+    printk("Bluetooth init failed (err %d)\n", err);
+    return 0;
+  }
+
+  printk("Bluetooth initialized\n");
+
+  err = bt_le_ext_adv_create(ADV_PARAM, NULL, &adv);
+  if (err) {
+    printk("Advertising set failed to create (err %d)\n", err);
+    return 0;
+  }
+
+  // Start advertising sensor values
+  update_ad_bme280();
+  err = bt_le_ext_adv_set_data(adv, ad, ARRAY_SIZE(ad), NULL, 0);
+  if (!err) {
+    err = bt_le_ext_adv_start(adv, BT_LE_EXT_ADV_START_DEFAULT);
+  }
+
+  if (err) {
+    printk("Advertising failed to start (err %d)\n", err);
+    return 0;
+  }
+
+  // The sampler thread updates the advertisement from now on.
+  atomic_set(&advertising, 1);
+  return 0;
+}
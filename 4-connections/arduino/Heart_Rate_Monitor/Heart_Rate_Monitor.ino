@@ -1,51 +1,124 @@
-/* Monitor readings from a BLE heart rate sensor.
+/* Monitor readings from BLE heart rate sensors.
  *
  * Copyright (C) 2021 Koen Vervloesem (koen@vervloesem.eu)
  *
  * SPDX-License-Identifier: MIT
  *
  * Based on the NimBLE_Client example from H2zero.
+ *
+ * The sketch connects to up to NIMBLE_MAX_CONNECTIONS sensors (3 by
+ * default, see nimconfig.h of NimBLE-Arduino) and keeps scanning for
+ * new ones while the others are streaming, see connection_manager.h.
+ * The GATT handles of each sensor are cached in NVS, so after a reset
+ * it reconnects without service discovery, see gatt_cache.h.
+ *
+ * Each measurement is fully decoded, and the RR-intervals of each
+ * sensor feed running HRV metrics (RMSSD, SDNN and pNN50), see
+ * heart_rate.h.
+ *
+ * When a sensor drops out, the sketch waits for it with the filter
+ * accept list of the controller, so the host only sees the
+ * advertisements of lost sensors, see fast_reconnect.h. Set
+ * FAST_RECONNECT to 0 to wait with an unfiltered scan instead, to
+ * compare the reconnection latency and scan reports of both.
+ *
+ * The connection parameters of each sensor follow its traffic, see
+ * conn_policy.h.
+ *
+ * The timing of the notifications of each connection is measured,
+ * together with its connection parameters, see notify_stats.h. Send
+ * 'd' over serial to dump the statistics, 'c' to clear them.
+ *
+ * Set THROUGHPUT_TEST to 1 to connect to the peripheral_bme280
+ * example of this chapter instead, and measure how many bytes per
+ * second the application gets over each connection, see
+ * throughput_test.h.
+ *
+ * The NimBLE callbacks post events to loop(), which blocks until an
+ * event arrives, see event_dispatcher.h. Set EVENT_POLLING to 1 to
+ * poll for events every millisecond instead, to compare the wakeups
+ * and latency of both.
  */
+
+// Set to 1 to poll for events instead of blocking.
+#define EVENT_POLLING 0
+// Set to 0 to reconnect without the filter accept list.
+#define FAST_RECONNECT 1
+// Set to 1 to test the throughput of peripheral_bme280.
+#define THROUGHPUT_TEST 0
+
 #include <NimBLEDevice.h>
 
+#include "heart_rate.h"
+#include "link_setup.h"
+
+// Copy whole notifications of the negotiated MTU into events.
+#define EVENT_MAX_DATA (LINK_MTU - 3)
+static_assert(HRM_MAX_SIZE <= EVENT_MAX_DATA,
+              "Events must hold a whole measurement");
+
+#include <event_dispatcher.h>
+#include <notify_stats.h>
+
+#include "connection_manager.h"
+#include "throughput_test.h"
+
+#if THROUGHPUT_TEST
+// Custom service and characteristic of peripheral_bme280
+#define UUID_SERVICE "63bf0b19-2b9c-473c-9e0a-2cfcaf03a770"
+#define UUID_CHARACTERISTIC "63bf0b19-2b9c-473c-9e0a-2cfcaf03a771"
+#else
 #define UUID_SERVICE "180d"
 #define UUID_CHARACTERISTIC "2a37"
+#endif
+
+// Scan interval and window, in milliseconds
+#define SCAN_INTERVAL 60
+#define SCAN_WINDOW 30
+// Number of queued events
+#define EVENT_QUEUE_SIZE 32
+// Number of RR-intervals to compute HRV metrics over
+#define HRV_WINDOW 128
+// Interval to print the state of the peers, in milliseconds
+#define STATS_INTERVAL 30000
+
+static EventDispatcher<EVENT_QUEUE_SIZE> dispatcher(EVENT_POLLING);
+static Policy connPolicy;
+static Reconnect fastReconnect(FAST_RECONNECT, SCAN_INTERVAL,
+                               SCAN_WINDOW);
+static uint32_t lastStats = 0;
 
-static NimBLEAdvertisedDevice *advDevice;
+// HRV metrics per peer, only accessed from loop()
+static HrvWindow<HRV_WINDOW> hrvWindows[NIMBLE_MAX_CONNECTIONS];
 
-static bool doConnect = false;
-static uint32_t scanTime = 0; // 0 = scan forever
+// Notification timing per connection, updated on the NimBLE host task
+static NotifyStats<NIMBLE_MAX_CONNECTIONS> notifyStats;
+
+static ThroughputTest throughputTest;
+// Peers whose throughput is tested on this connection
+static bool tested[NIMBLE_MAX_CONNECTIONS];
 
 class ClientCallbacks : public NimBLEClientCallbacks {
   void onConnect(NimBLEClient *pClient) {
-    Serial.println("Connected");
-    pClient->updateConnParams(120, 120, 0, 60);
+    notifyStats.connected(pClient->getConnId());
+    dispatcher.post(EVENT_CONNECTED, pClient);
   }
 
   void onDisconnect(NimBLEClient *pClient) {
-    Serial.print(pClient->getPeerAddress().toString().c_str());
-    Serial.println(" Disconnected - Starting scan");
-    NimBLEDevice::getScan()->start(scanTime, nullptr);
+    dispatcher.post(EVENT_DISCONNECTED, pClient);
   }
 
   /* Called when the peripheral requests a change to the connection
    * parameters.
    * Return true to accept and apply them or false to reject and keep
-   * the currently used parameters. Default will return true.
+   * the currently used parameters. The connection policy decides,
+   * based on the profile of the peer.
    */
   bool onConnParamsUpdateRequest(NimBLEClient *pClient,
                                  const ble_gap_upd_params *params) {
-    if (params->itvl_min < 24) { // 1.25ms units
-      return false;
-    } else if (params->itvl_max > 40) { // 1.25ms units
-      return false;
-    } else if (params->latency > 2) { // Intervals allowed to skip
-      return false;
-    } else if (params->supervision_timeout > 100) { // 10ms units
-      return false;
-    }
-
-    return true;
+    bool accept = connPolicy.accept(pClient, params);
+    notifyStats.requested(pClient->getConnId(), params, accept);
+    return accept;
   }
 };
 
@@ -54,169 +127,245 @@ class ClientCallbacks : public NimBLEClientCallbacks {
 class AdvertisedDeviceCallbacks
     : public NimBLEAdvertisedDeviceCallbacks {
   void onResult(NimBLEAdvertisedDevice *advertisedDevice) {
-    Serial.print("Advertised Device found: ");
-    Serial.println(advertisedDevice->toString().c_str());
-    if (advertisedDevice->isAdvertisingService(
+    fastReconnect.scanned();
+    // A filtered scan only reports lost sensors.
+    if (fastReconnect.filtering() ||
+        advertisedDevice->isAdvertisingService(
             NimBLEUUID(UUID_SERVICE))) {
-      Serial.println("Found Our Service");
-      // Stop scan before connecting.
-      NimBLEDevice::getScan()->stop();
-      // Save the device reference in a global for the client to use.
-      advDevice = advertisedDevice;
-      // Ready to connect now.
-      doConnect = true;
+      // The connection manager connects to it from loop().
+      dispatcher.post(EVENT_FOUND, advertisedDevice->getAddress());
     }
   }
 };
 
-/* Notification / Indication receiving handler callback */
-void notifyCB(NimBLERemoteCharacteristic *pRemoteCharacteristic,
-              uint8_t *pData, size_t length, bool isNotify) {
-  if (length) {
-    uint16_t heart_rate_measurement = pData[1];
-    if (pData[0] & 1) {
-      heart_rate_measurement += (pData[2] << 8);
-    }
-    Serial.println(heart_rate_measurement);
-  }
-}
-
 /* Create a single global instance of the callback class to be used by
  * all clients.
  */
 static ClientCallbacks clientCB;
 
-/* Handles the provisioning of clients and connects / interfaces with
- * the server.
+/* Sets up connections to up to NIMBLE_MAX_CONNECTIONS heart rate
+ * sensors at the same time.
  */
-bool connectToServer() {
-  NimBLEClient *pClient = nullptr;
-
-  // Check if we have a client we should reuse first.
-  if (NimBLEDevice::getClientListSize()) {
-    /* Special case when we already know this device, we send false as
-     * the second argument in connect() to prevent refreshing the
-     * service database. This saves considerable time and power.
-     */
-    pClient =
-        NimBLEDevice::getClientByPeerAddress(advDevice->getAddress());
-    if (pClient) {
-      if (!pClient->connect(advDevice, false)) {
-        Serial.println("Reconnect failed");
-        return false;
-      }
-      Serial.println("Reconnected client");
-    } else {
-      /* We don't already have a client that knows this device,
-       * we will check for a client that is disconnected that we can
-       * use.
-       */
-      pClient = NimBLEDevice::getDisconnectedClient();
-    }
-  }
+static ConnectionManager connectionManager(UUID_SERVICE,
+                                           UUID_CHARACTERISTIC,
+                                           &clientCB, &connPolicy,
+                                           &fastReconnect);
 
-  // No client to reuse? Create a new one.
-  if (!pClient) {
-    if (NimBLEDevice::getClientListSize() >= NIMBLE_MAX_CONNECTIONS) {
-      Serial.println(
-          "Max clients reached. No more connections possible");
-      return false;
-    }
-
-    pClient = NimBLEDevice::createClient();
+/* Notification / Indication receiving handler. The connection manager
+ * subscribes by handle, so it also works for handles from the GATT
+ * cache.
+ */
+void notificationHandler(ble_gap_event *event) {
+  // Timestamp the notification before anything else.
+  uint32_t arrival = micros();
+  uint16_t connHandle = event->notify_rx.conn_handle;
+  GattMatch match = connectionManager.match(
+      connHandle, event->notify_rx.attr_handle);
+  if (match == GATT_MATCH_NONE) {
+    return;
+  }
 
-    Serial.println("New client created");
+  NimBLEClient *pClient = NimBLEDevice::getClientByID(connHandle);
+  if (match == GATT_MATCH_SERVICE_CHANGED) {
+    dispatcher.post(EVENT_SERVICE_CHANGED, pClient);
+    return;
+  }
 
-    pClient->setClientCallbacks(&clientCB, false);
-    pClient->setConnectionParams(40, 56, 0, 51);
-    pClient->setConnectTimeout(5);
+  uint8_t data[EVENT_MAX_DATA];
+  uint16_t length = OS_MBUF_PKTLEN(event->notify_rx.om);
+  os_mbuf_copydata(event->notify_rx.om, 0,
+                   length < EVENT_MAX_DATA ? length : EVENT_MAX_DATA,
+                   data);
+  dispatcher.post(pClient, data, length);
+  throughputTest.notified(connHandle, length);
+  notifyStats.notified(connHandle, length, arrival);
+}
 
-    if (!pClient->connect(advDevice)) {
-      /* Created a client but failed to connect, don't need to keep it
-       * as it has no data.
-       */
-      NimBLEDevice::deleteClient(pClient);
-      Serial.println("Failed to connect, deleted client");
-      return false;
+// Called for all GAP events.
+int gapEventHandler(ble_gap_event *event, void *arg) {
+  connectionManager.gapEvent(event);
+  switch (event->type) {
+  case BLE_GAP_EVENT_NOTIFY_RX:
+    notificationHandler(event);
+    break;
+  case BLE_GAP_EVENT_CONN_UPDATE:
+    if (event->conn_update.status == 0) {
+      notifyStats.updated(event->conn_update.conn_handle);
     }
+    break;
+  case BLE_GAP_EVENT_DISCONNECT:
+    // The client's connection ID is already gone in onDisconnect().
+    notifyStats.disconnected(event->disconnect.conn.conn_handle);
+    break;
   }
+  return 0;
+}
 
-  if (!pClient->isConnected()) {
-    if (!pClient->connect(advDevice)) {
-      Serial.println("Failed to connect");
-      return false;
-    }
+// Decode a measurement and update the HRV metrics of its peer.
+void handleHeartRate(const Peer *peer, const uint8_t *pData,
+                     size_t length) {
+  HeartRateMeasurement measurement;
+  if (!parseHeartRate(pData, length, measurement)) {
+    return;
   }
 
-  Serial.print("Connected to: ");
-  Serial.println(pClient->getPeerAddress().toString().c_str());
-  Serial.print("RSSI: ");
-  Serial.println(pClient->getRssi());
+  HrvWindow<HRV_WINDOW> &window =
+      hrvWindows[connectionManager.indexOf(peer)];
+  for (uint8_t i = 0; i < measurement.rrCount; i++) {
+    window.add(rrToMs(measurement.rrIntervals[i]));
+  }
 
-  /* Now we can read/write/subscribe the characteristics of the
-   * services we are interested in.
-   */
-  NimBLERemoteService *pSvc = nullptr;
-  NimBLERemoteCharacteristic *pChr = nullptr;
+  Serial.printf("%s: %u bpm", peer->address.toString().c_str(),
+                (unsigned)measurement.heartRate);
+  if (measurement.contactSupported() &&
+      !measurement.contactDetected()) {
+    Serial.print(", no contact");
+  }
+  if (measurement.hasEnergyExpended()) {
+    Serial.printf(", %u kJ", (unsigned)measurement.energyExpended);
+  }
+  if (window.size() >= 2) {
+    Serial.printf(", RMSSD %.1f ms, SDNN %.1f ms, pNN50 %.1f%% "
+                  "(%u RR)",
+                  window.rmssd(), window.sdnn(), window.pnn50(),
+                  (unsigned)window.size());
+  }
+  Serial.println();
+}
 
-  pSvc = pClient->getService(UUID_SERVICE);
-  if (pSvc) { // Make sure it's not null.
-    pChr = pSvc->getCharacteristic(UUID_CHARACTERISTIC);
+// Handle commands from the serial host.
+void handleCommands() {
+  while (Serial.available() > 0) {
+    switch (Serial.read()) {
+    case 'd':
+      notifyStats.print();
+      break;
+    case 'c':
+      notifyStats.reset();
+      break;
+    }
   }
+}
 
-  if (pChr) { // Make sure it's not null.
-    if (pChr->canNotify()) {
-      if (!pChr->subscribe(true, notifyCB)) {
-        // Disconnect if subscribe failed.
-        pClient->disconnect();
-        return false;
-      }
-    } else if (pChr->canIndicate()) {
-      if (!pChr->subscribe(false, notifyCB)) {
-        // Disconnect if subscribe failed.
-        pClient->disconnect();
-        return false;
+void handleEvent(const Event &event) {
+  switch (event.type) {
+  case EVENT_FOUND:
+    connectionManager.found(event.address, event.timestamp);
+    break;
+  case EVENT_CONNECTED:
+    Serial.printf("%s: connected\n",
+                  event.address.toString().c_str());
+    break;
+  case EVENT_DISCONNECTED: {
+    // The next RR-interval doesn't follow the last one.
+    const Peer *peer = connectionManager.find(event.client);
+    if (peer != nullptr) {
+      size_t index = connectionManager.indexOf(peer);
+      hrvWindows[index].reset();
+      tested[index] = false;
+      throughputTest.disconnected(peer);
+    }
+    connPolicy.disconnected(event.client);
+    connectionManager.disconnected(event.client, event.timestamp);
+    break;
+  }
+  case EVENT_SERVICE_CHANGED:
+    connectionManager.serviceChanged(event.client);
+    break;
+  case EVENT_NOTIFICATION: {
+    const Peer *peer =
+        connectionManager.notified(event.client, event.timestamp);
+    if (peer != nullptr) {
+      connPolicy.traffic(event.client, event.length);
+      // A cut measurement would lose RR-intervals between others.
+      if (!THROUGHPUT_TEST && !event.truncated()) {
+        handleHeartRate(peer, event.data, event.length);
       }
     }
-  } else {
-    Serial.println(
-        "Heart Rate Measurement characteristic not found.");
+    break;
+  }
+  case EVENT_COMMAND:
+    handleCommands();
+    break;
   }
-
-  Serial.println("Done with this device!");
-  return true;
 }
 
 void setup() {
   Serial.begin(115200);
   Serial.println("Starting NimBLE Client");
 
+  dispatcher.begin();
+  // Wake up loop() for commands.
+  Serial.onReceive([]() { dispatcher.post(EVENT_COMMAND); });
   NimBLEDevice::init("");
+  connectionManager.begin();
+  NimBLEDevice::setCustomGapHandler(gapEventHandler);
 
   NimBLEScan *pScan = NimBLEDevice::getScan();
 
   pScan->setAdvertisedDeviceCallbacks(
       new AdvertisedDeviceCallbacks());
-  pScan->setInterval(60);
-  pScan->setWindow(30);
+  fastReconnect.configure(pScan);
   pScan->setActiveScan(true);
-  pScan->start(scanTime, nullptr);
+  // Only the address is kept, so don't store scan results.
+  pScan->setMaxResults(0);
+  pScan->start(0, nullptr);
+}
+
+/* Test the throughput of each streaming peer once per connection,
+ * one read at a time.
+ */
+void testThroughput() {
+  const Peer *peer = throughputTest.testing();
+  if (peer != nullptr) {
+    // Reads count as traffic, so the policy keeps the bulk profile.
+    connPolicy.traffic(peer->client, throughputTest.step());
+    return;
+  }
+
+  for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; i++) {
+    peer = connectionManager.peerAt(i);
+    if (peer->state == PEER_STREAMING && !tested[i]) {
+      tested[i] = true;
+      connPolicy.start(peer->client, CONN_PROFILE_BULK);
+      throughputTest.start(peer);
+      return;
+    }
+  }
 }
 
 void loop() {
-  // Loop here until we find a device we want to connect to.
-  while (!doConnect) {
-    delay(1);
+  /* Block until the next event, policy update or statistics, unless
+   * a peer has a setup step to do.
+   */
+  uint32_t timeout = 0;
+  if (!connectionManager.busy() && !throughputTest.running()) {
+    uint32_t elapsed = millis() - lastStats;
+    timeout = elapsed < STATS_INTERVAL ? STATS_INTERVAL - elapsed : 0;
+    uint32_t policyTimeout = connPolicy.nextUpdate(millis());
+    if (policyTimeout < timeout) {
+      timeout = policyTimeout;
+    }
   }
 
-  doConnect = false;
+  Event event;
+  if (dispatcher.wait(event, timeout)) {
+    handleEvent(event);
+  }
 
-  // Found a device we want to connect to, do it now.
-  if (connectToServer()) {
-    Serial.println("Success, scanning for more...");
-  } else {
-    Serial.println("Failed to connect, starting scan...");
+  // Advance the connection setup of one peer.
+  connectionManager.step();
+  if (THROUGHPUT_TEST) {
+    testThroughput();
   }
+  // Adapt the connection parameters to the traffic.
+  connPolicy.update(millis());
 
-  NimBLEDevice::getScan()->start(scanTime, nullptr);
+  if (millis() - lastStats >= STATS_INTERVAL) {
+    lastStats = millis();
+    connectionManager.printPeers();
+    connPolicy.print();
+    fastReconnect.printStats();
+    dispatcher.printStats();
+  }
 }
@@ -0,0 +1,477 @@
+/** Connect to several peripherals and subscribe to notifications.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * loop() passes the events of event_dispatcher.h to the manager,
+ * which drives each peer through its own state machine:
+ *
+ *   pending -> connecting -> upgrading -> discovering -> subscribing
+ *   -> streaming
+ *
+ * Each call of step() advances at most one peer by one step, and
+ * restarts scanning between steps. Peers that are already streaming
+ * keep receiving notifications on the NimBLE host task in the
+ * meantime. Only one connection can be set up at a time, because the
+ * controller can't scan while it creates a connection and the client
+ * API of NimBLE-Arduino blocks until each step is done.
+ *
+ * While upgrading, the link is switched to a larger data length, the
+ * 2M PHY and a larger MTU if the peer supports them, see
+ * link_setup.h, so discovery and notifications are faster.
+ *
+ * Discovered handles are cached in NVS, see gatt_cache.h, so a peer
+ * that is known from before a reset skips service discovery. The
+ * manager subscribes by writing the CCCD itself, so notifications
+ * arrive through the sketch's GAP event handler, which looks them up
+ * with match().
+ *
+ * When a streaming peer disconnects, the manager waits for it with
+ * the filter accept list of fast_reconnect.h, which the scan uses
+ * until the peer is back or has timed out.
+ *
+ * New clients connect with the bulk profile of conn_policy.h, and
+ * switch to the streaming profile once they're subscribed.
+ *
+ * For each peer the manager measures the time from seeing its
+ * advertisement to its first notification. The manager is only used
+ * from loop(), except for match(), so it needs no locking.
+ */
+#ifndef CONNECTION_MANAGER_H_
+#define CONNECTION_MANAGER_H_
+
+#include <NimBLEDevice.h>
+#include <conn_policy.h>
+#include <fast_reconnect.h>
+#include <gatt_cache.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "link_setup.h"
+
+// Seconds to wait for a connection
+#define CONNECT_TIMEOUT 5
+
+enum PeerState : uint8_t {
+  PEER_FREE,
+  PEER_PENDING,
+  PEER_CONNECTING,
+  PEER_UPGRADING,
+  PEER_DISCOVERING,
+  PEER_SUBSCRIBING,
+  PEER_STREAMING,
+};
+
+static const char *peerStateName(PeerState state) {
+  static const char *names[] = {"free",        "pending",
+                                "connecting",  "upgrading",
+                                "discovering", "subscribing",
+                                "streaming"};
+  return names[state];
+}
+
+struct Peer {
+  NimBLEAddress address;
+  NimBLEClient *client;
+  uint16_t connHandle;
+  GattHandles handles;
+  bool cached; // Handles from the cache instead of discovery
+  LinkInfo link;
+  PeerState state;
+  // millis() when each step was reached
+  uint32_t foundTime;
+  uint32_t connectedTime;
+  uint32_t upgradedTime;
+  uint32_t discoveredTime;
+  bool notified; // Time to first notification printed
+};
+
+typedef ConnPolicy<NIMBLE_MAX_CONNECTIONS> Policy;
+typedef FastReconnect<NIMBLE_MAX_CONNECTIONS> Reconnect;
+
+class ConnectionManager {
+public:
+  ConnectionManager(const char *service, const char *characteristic,
+                    NimBLEClientCallbacks *callbacks, Policy *policy,
+                    Reconnect *reconnect)
+      : service(service), characteristic(characteristic),
+        callbacks(callbacks), policy(policy), reconnect(reconnect),
+        cache("gattcache"), dropCount(0), next(0) {
+    for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; i++) {
+      peers[i].connHandle = BLE_HS_CONN_HANDLE_NONE;
+      release(peers[i]);
+    }
+  }
+
+  // Call after NimBLEDevice::init().
+  void begin() {
+    cache.begin();
+    link.begin();
+  }
+
+  /* GAP event handler on the NimBLE host task: check whether a
+   * notification or indication is for a subscribed handle.
+   */
+  GattMatch match(uint16_t connHandle, uint16_t attrHandle) const {
+    return subscriptions.match(connHandle, attrHandle);
+  }
+
+  // GAP event handler on the NimBLE host task: pass all events.
+  void gapEvent(const ble_gap_event *event) { link.gapEvent(event); }
+
+  /* A device was found by the scan at time. Devices that are already
+   * known are ignored.
+   */
+  void found(const NimBLEAddress &address, uint32_t time) {
+    Peer *freePeer = nullptr;
+
+    for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; i++) {
+      if (peers[i].state == PEER_FREE) {
+        if (freePeer == nullptr) {
+          freePeer = &peers[i];
+        }
+      } else if (peers[i].address == address) {
+        return;
+      }
+    }
+    if (freePeer == nullptr) {
+      dropCount++;
+      return;
+    }
+
+    freePeer->address = address;
+    freePeer->foundTime = time;
+    freePeer->state = PEER_PENDING;
+    Serial.printf("%s: pending\n", address.toString().c_str());
+  }
+
+  /* A client received a notification at time. Returns its peer, or
+   * nullptr if it's unknown.
+   */
+  Peer *notified(NimBLEClient *pClient, uint32_t time) {
+    Peer *peer = find(pClient);
+    if (peer != nullptr && peer->state == PEER_STREAMING &&
+        !peer->notified) {
+      report(*peer, time);
+    }
+    return peer;
+  }
+
+  /* A client was disconnected at time. A peer that was streaming is
+   * waited for with the filter accept list.
+   */
+  void disconnected(NimBLEClient *pClient, uint32_t time) {
+    Peer *peer = find(pClient);
+    if (peer != nullptr) {
+      Serial.printf("%s: disconnected while %s\n",
+                    peer->address.toString().c_str(),
+                    peerStateName(peer->state));
+      if (peer->state == PEER_STREAMING) {
+        reconnect->lost(peer->address, time);
+      }
+      release(*peer);
+      /* Restart the scan, so the duplicate filter reports the peer
+       * again when it advertises.
+       */
+      NimBLEDevice::getScan()->stop();
+    }
+  }
+
+  /* A client's peer indicated Service Changed: forget its handles
+   * and discover them again.
+   */
+  void serviceChanged(NimBLEClient *pClient) {
+    Peer *peer = find(pClient);
+    if (peer == nullptr || peer->state < PEER_DISCOVERING) {
+      return;
+    }
+    Serial.printf("%s: service changed, discovering again\n",
+                  peer->address.toString().c_str());
+    cache.invalidate(peer->address);
+    subscriptions.remove(peer->connHandle);
+    peer->client->deleteServices();
+    peer->state = PEER_DISCOVERING;
+  }
+
+  // Whether a peer has a setup step to do.
+  bool busy() const {
+    for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; i++) {
+      PeerState state = peers[i].state;
+      if (state != PEER_FREE && state != PEER_STREAMING) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Advance the setup of the next peer that isn't free or streaming
+   * by one step. Then keep scanning between connection attempts if
+   * there's room for another peer.
+   */
+  void step() {
+    reconnect->expire(millis());
+    for (size_t n = 0; n < NIMBLE_MAX_CONNECTIONS; n++) {
+      Peer &peer = peers[next];
+      next = (next + 1) % NIMBLE_MAX_CONNECTIONS;
+      if (advance(peer)) {
+        break;
+      }
+    }
+
+    NimBLEScan *pScan = NimBLEDevice::getScan();
+    if (hasFreePeer() && !pScan->isScanning()) {
+      reconnect->configure(pScan);
+      pScan->start(0, nullptr, false);
+    }
+  }
+
+  // Print the state of all peers.
+  void printPeers() {
+    for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; i++) {
+      const Peer &peer = peers[i];
+      if (peer.state == PEER_FREE) {
+        continue;
+      }
+      Serial.printf("%s: %s", peer.address.toString().c_str(),
+                    peerStateName(peer.state));
+      if (peer.state > PEER_UPGRADING) {
+        Serial.printf(", MTU %u, PHY %s/%s%s",
+                      (unsigned)peer.link.mtu,
+                      linkPhyName(peer.link.txPhy),
+                      linkPhyName(peer.link.rxPhy),
+                      peer.link.dataLength ? ", data length" : "");
+      }
+      Serial.println();
+    }
+    Serial.printf("Ignored devices, all peers in use: %u\n",
+                  (unsigned)dropCount);
+    Serial.printf("GATT cache: %u hits, %u misses, %u invalidated\n",
+                  (unsigned)cache.hits(), (unsigned)cache.misses(),
+                  (unsigned)cache.invalidations());
+  }
+
+  // Index of a peer, less than NIMBLE_MAX_CONNECTIONS
+  size_t indexOf(const Peer *peer) const { return peer - peers; }
+
+  Peer *peerAt(size_t index) { return &peers[index]; }
+
+  Peer *find(NimBLEClient *pClient) {
+    for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; i++) {
+      if (peers[i].state != PEER_FREE && peers[i].client == pClient) {
+        return &peers[i];
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  const char *service;
+  const char *characteristic;
+  NimBLEClientCallbacks *callbacks;
+  Policy *policy;
+  Reconnect *reconnect;
+  GattCache cache;
+  GattSubscriptions<NIMBLE_MAX_CONNECTIONS> subscriptions;
+  LinkSetup link;
+  Peer peers[NIMBLE_MAX_CONNECTIONS];
+  uint32_t dropCount;
+  size_t next; // Peer to advance next, round robin
+
+  void release(Peer &peer) {
+    if (peer.connHandle != BLE_HS_CONN_HANDLE_NONE) {
+      subscriptions.remove(peer.connHandle);
+    }
+    peer.client = nullptr;
+    peer.connHandle = BLE_HS_CONN_HANDLE_NONE;
+    peer.cached = false;
+    peer.state = PEER_FREE;
+    peer.notified = false;
+  }
+
+  bool hasFreePeer() const {
+    for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; i++) {
+      if (peers[i].state == PEER_FREE) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Do the next setup step of a peer. Returns false if it had none to
+   * do.
+   */
+  bool advance(Peer &peer) {
+    bool ok;
+
+    switch (peer.state) {
+    case PEER_PENDING:
+      ok = connect(peer);
+      break;
+    case PEER_UPGRADING:
+      ok = upgrade(peer);
+      break;
+    case PEER_DISCOVERING:
+      ok = discover(peer);
+      break;
+    case PEER_SUBSCRIBING:
+      ok = subscribe(peer);
+      break;
+    default:
+      return false;
+    }
+
+    if (!ok) {
+      if (peer.client != nullptr && peer.client->isConnected()) {
+        peer.client->disconnect();
+      }
+      release(peer);
+    }
+    return true;
+  }
+
+  bool connect(Peer &peer) {
+    std::string address = peer.address.toString();
+    bool refresh = true;
+
+    /* Special case when we already know this device, we send false as
+     * the second argument in connect() to prevent refreshing the
+     * service database. This saves considerable time and power.
+     */
+    NimBLEClient *pClient =
+        NimBLEDevice::getClientByPeerAddress(peer.address);
+    if (pClient) {
+      refresh = false;
+    } else {
+      /* We don't already have a client that knows this device, we
+       * will check for a client that is disconnected that we can use.
+       */
+      pClient = NimBLEDevice::getDisconnectedClient();
+    }
+
+    // No client to reuse? Create a new one.
+    bool created = false;
+    if (!pClient) {
+      if (NimBLEDevice::getClientListSize() >=
+          NIMBLE_MAX_CONNECTIONS) {
+        Serial.println(
+            "Max clients reached. No more connections possible");
+        return false;
+      }
+      pClient = NimBLEDevice::createClient();
+      pClient->setClientCallbacks(callbacks, false);
+      policy->configure(pClient);
+      pClient->setConnectTimeout(CONNECT_TIMEOUT);
+      created = true;
+    }
+
+    peer.client = pClient;
+    peer.state = PEER_CONNECTING;
+    // The controller can't scan while it creates a connection.
+    NimBLEDevice::getScan()->stop();
+    if (!pClient->connect(peer.address, refresh)) {
+      /* Created a client but failed to connect, don't need to keep it
+       * as it has no data.
+       */
+      if (created) {
+        NimBLEDevice::deleteClient(pClient);
+        peer.client = nullptr;
+      }
+      Serial.printf("%s: failed to connect\n", address.c_str());
+      return false;
+    }
+
+    peer.connHandle = pClient->getConnId();
+    peer.connectedTime = millis();
+    peer.state = PEER_UPGRADING;
+    reconnect->connected(peer.address, peer.connectedTime);
+    return true;
+  }
+
+  // Raise the data length, PHY and MTU as far as the peer supports.
+  bool upgrade(Peer &peer) {
+    link.upgrade(peer.connHandle, peer.link);
+    if (!peer.client->isConnected()) {
+      return false;
+    }
+
+    Serial.printf("%s: MTU %u, PHY %s/%s, data length %s\n",
+                  peer.address.toString().c_str(),
+                  (unsigned)peer.link.mtu,
+                  linkPhyName(peer.link.txPhy),
+                  linkPhyName(peer.link.rxPhy),
+                  peer.link.dataLength ? "requested" : "default");
+    peer.upgradedTime = millis();
+    peer.state = PEER_DISCOVERING;
+    return true;
+  }
+
+  /* Take the handles from the cache if the Database Hash of the peer
+   * still matches, otherwise discover and cache them.
+   */
+  bool discover(Peer &peer) {
+    bool hit = cache.load(peer.address, peer.handles);
+    peer.cached =
+        hit && gattCheckHash(peer.connHandle, peer.handles);
+
+    if (!peer.cached) {
+      if (hit) {
+        Serial.printf("%s: database hash changed\n",
+                      peer.address.toString().c_str());
+        cache.invalidate(peer.address);
+        peer.client->deleteServices();
+      }
+      if (!gattDiscover(peer.client, service, characteristic,
+                        peer.handles)) {
+        Serial.printf("%s: characteristic %s not found\n",
+                      peer.address.toString().c_str(),
+                      characteristic);
+        return false;
+      }
+      cache.save(peer.address, peer.handles);
+    }
+
+    peer.discoveredTime = millis();
+    peer.state = PEER_SUBSCRIBING;
+    return true;
+  }
+
+  bool subscribe(Peer &peer) {
+    // Match notifications before the first one can arrive.
+    subscriptions.add(peer.connHandle, peer.handles);
+
+    int rc = gattSubscribe(peer.connHandle, peer.handles);
+    if (rc != 0) {
+      Serial.printf("%s: failed to subscribe: %d\n",
+                    peer.address.toString().c_str(), rc);
+      // The cached handles may be stale.
+      if (peer.cached) {
+        cache.invalidate(peer.address);
+      }
+      return false;
+    }
+
+    peer.state = PEER_STREAMING;
+    policy->start(peer.client, CONN_PROFILE_STREAMING);
+    return true;
+  }
+
+  // Print the time from advertisement to first notification.
+  void report(Peer &peer, uint32_t firstNotificationTime) {
+    Serial.printf(
+        "%s: first notification after %u ms (connect %u ms, link "
+        "%u ms, %s %u ms, subscription %u ms), connection to data "
+        "%u ms\n",
+        peer.address.toString().c_str(),
+        (unsigned)(firstNotificationTime - peer.foundTime),
+        (unsigned)(peer.connectedTime - peer.foundTime),
+        (unsigned)(peer.upgradedTime - peer.connectedTime),
+        peer.cached ? "cached handles" : "discovery",
+        (unsigned)(peer.discoveredTime - peer.upgradedTime),
+        (unsigned)(firstNotificationTime - peer.discoveredTime),
+        (unsigned)(firstNotificationTime - peer.connectedTime));
+    peer.notified = true;
+  }
+};
+
+#endif /* CONNECTION_MANAGER_H_ */
@@ -0,0 +1,227 @@
+/** Decode Heart Rate Measurements and compute heart rate variability.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * parseHeartRate() decodes all fields of the Heart Rate Measurement
+ * characteristic (0x2a37) into a fixed-size struct, without
+ * allocating:
+ *
+ *   flags (1), heart rate (1 or 2), energy expended (0 or 2),
+ *   RR-intervals (2 each, in 1/1024 s)
+ *
+ * HrvWindow keeps the last N RR-intervals of one sensor in a ring and
+ * computes the usual time-domain HRV metrics over them:
+ * - SDNN: standard deviation of the RR-intervals,
+ * - RMSSD: root mean square of successive differences,
+ * - pNN50: percentage of successive differences larger than 50 ms.
+ *
+ * Each new RR-interval updates running integer sums in O(1): the
+ * interval that leaves the ring and its difference with the next one
+ * are subtracted, so the sums never drift.
+ */
+#ifndef HEART_RATE_H_
+#define HEART_RATE_H_
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HRM_FLAG_HEART_RATE_16 0x01
+#define HRM_FLAG_CONTACT_DETECTED 0x02
+#define HRM_FLAG_CONTACT_SUPPORTED 0x04
+#define HRM_FLAG_ENERGY_EXPENDED 0x08
+#define HRM_FLAG_RR_INTERVALS 0x10
+
+// Largest measurement, a notification with an ATT MTU of 247
+#define HRM_MAX_SIZE 244
+// RR-intervals that fit in it, after the flags and heart rate
+#define HRM_MAX_RR_INTERVALS ((HRM_MAX_SIZE - 2) / 2)
+
+// Plausible RR-intervals in ms, from 24 to 240 bpm
+#define RR_MIN 250
+#define RR_MAX 2500
+// Threshold of pNN50 in ms
+#define NN50_THRESHOLD 50
+
+struct HeartRateMeasurement {
+  uint8_t flags;
+  uint16_t heartRate;      // bpm
+  uint16_t energyExpended; // kJ, if HRM_FLAG_ENERGY_EXPENDED
+  uint8_t rrCount;
+  uint16_t rrIntervals[HRM_MAX_RR_INTERVALS]; // 1/1024 s
+
+  bool contactSupported() const {
+    return flags & HRM_FLAG_CONTACT_SUPPORTED;
+  }
+
+  bool contactDetected() const {
+    return flags & HRM_FLAG_CONTACT_DETECTED;
+  }
+
+  bool hasEnergyExpended() const {
+    return flags & HRM_FLAG_ENERGY_EXPENDED;
+  }
+};
+
+/* Decode a Heart Rate Measurement. Returns false if it's too short
+ * for the fields in its flags. An odd trailing byte is ignored.
+ */
+static inline bool parseHeartRate(const uint8_t *data, size_t length,
+                                  HeartRateMeasurement &measurement) {
+  if (length < 2) {
+    return false;
+  }
+
+  uint8_t flags = data[0];
+  size_t i = 1;
+
+  measurement.flags = flags;
+  if (flags & HRM_FLAG_HEART_RATE_16) {
+    if (length < i + 2) {
+      return false;
+    }
+    measurement.heartRate = data[i] | (data[i + 1] << 8);
+    i += 2;
+  } else {
+    measurement.heartRate = data[i++];
+  }
+
+  measurement.energyExpended = 0;
+  if (flags & HRM_FLAG_ENERGY_EXPENDED) {
+    if (length < i + 2) {
+      return false;
+    }
+    measurement.energyExpended = data[i] | (data[i + 1] << 8);
+    i += 2;
+  }
+
+  measurement.rrCount = 0;
+  if (flags & HRM_FLAG_RR_INTERVALS) {
+    while (i + 2 <= length &&
+           measurement.rrCount < HRM_MAX_RR_INTERVALS) {
+      measurement.rrIntervals[measurement.rrCount++] =
+          data[i] | (data[i + 1] << 8);
+      i += 2;
+    }
+  }
+  return true;
+}
+
+// Convert an RR-interval from 1/1024 s to ms, rounded.
+static inline uint16_t rrToMs(uint16_t rr) {
+  return (uint16_t)(((uint32_t)rr * 1000 + 512) / 1024);
+}
+
+// N is the number of RR-intervals in the window.
+template <size_t N> class HrvWindow {
+  static_assert(N >= 2, "Window needs at least two RR-intervals");
+
+public:
+  HrvWindow() { reset(); }
+
+  // Start over, for example after a disconnect.
+  void reset() {
+    count = 0;
+    head = 0;
+    sum = 0;
+    sumSquares = 0;
+    sumDiffSquares = 0;
+    nn50 = 0;
+    rejectCount = 0;
+  }
+
+  /* Add an RR-interval in ms. Implausible intervals are rejected and
+   * counted.
+   */
+  void add(uint16_t rr) {
+    if (rr < RR_MIN || rr > RR_MAX) {
+      rejectCount++;
+      return;
+    }
+
+    if (count == N) {
+      // Remove the oldest interval and its difference with the next.
+      uint16_t oldest = intervals[head];
+      removeDiff(oldest, intervals[(head + 1) % N]);
+      sum -= oldest;
+      sumSquares -= (uint32_t)oldest * oldest;
+      head = (head + 1) % N;
+      count--;
+    }
+    if (count > 0) {
+      addDiff(intervals[(head + count - 1) % N], rr);
+    }
+
+    intervals[(head + count) % N] = rr;
+    count++;
+    sum += rr;
+    sumSquares += (uint32_t)rr * rr;
+  }
+
+  // Number of RR-intervals in the window
+  size_t size() const { return count; }
+
+  // Number of rejected RR-intervals since reset()
+  uint32_t rejects() const { return rejectCount; }
+
+  // Mean RR-interval in ms
+  float meanRr() const { return count ? (float)sum / count : 0; }
+
+  // Standard deviation of the RR-intervals in ms
+  float sdnn() const {
+    if (count < 2) {
+      return 0;
+    }
+    /* Exact in integers up to the final division:
+     * n * sum(x^2) - sum(x)^2 = n * (n - 1) * variance
+     */
+    uint64_t spread = (uint64_t)count * sumSquares - sum * sum;
+    return sqrtf((float)spread / ((float)count * (count - 1)));
+  }
+
+  // Root mean square of successive differences in ms
+  float rmssd() const {
+    if (count < 2) {
+      return 0;
+    }
+    return sqrtf((float)sumDiffSquares / (count - 1));
+  }
+
+  // Percentage of successive differences larger than 50 ms
+  float pnn50() const {
+    if (count < 2) {
+      return 0;
+    }
+    return 100.0f * nn50 / (count - 1);
+  }
+
+private:
+  uint16_t intervals[N];
+  size_t count; // Intervals in the window
+  size_t head;  // Oldest interval
+  uint64_t sum;
+  uint64_t sumSquares;
+  uint64_t sumDiffSquares;
+  uint32_t nn50;
+  uint32_t rejectCount;
+
+  void addDiff(uint16_t previous, uint16_t rr) {
+    int32_t diff = (int32_t)rr - previous;
+    sumDiffSquares += (uint32_t)(diff * diff);
+    if (diff > NN50_THRESHOLD || diff < -NN50_THRESHOLD) {
+      nn50++;
+    }
+  }
+
+  void removeDiff(uint16_t previous, uint16_t rr) {
+    int32_t diff = (int32_t)rr - previous;
+    sumDiffSquares -= (uint32_t)(diff * diff);
+    if (diff > NN50_THRESHOLD || diff < -NN50_THRESHOLD) {
+      nn50--;
+    }
+  }
+};
+
+#endif /* HEART_RATE_H_ */
@@ -0,0 +1,144 @@
+/** Negotiate a faster link after connecting.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * By default, a connection uses the 1M PHY, link layer packets with
+ * 27 bytes of payload and an ATT MTU of 23 bytes. upgrade() asks for
+ * all three to be raised, before service discovery:
+ * - data length extension: packets with up to LINK_TX_OCTETS bytes,
+ * - the 2M PHY, which halves the air time of each packet,
+ * - an ATT MTU of LINK_MTU bytes, so a notification or read response
+ *   can carry up to LINK_MTU - 3 bytes.
+ *
+ * The controllers negotiate the data length and PHY with link layer
+ * procedures, and the peers negotiate the MTU with an ATT request. A
+ * peer that doesn't support one of them rejects it or answers with
+ * its own limit, so the connection keeps working with the defaults.
+ * upgrade() reports what was actually agreed on.
+ *
+ * NimBLE only reports the end of the PHY update as a GAP event, so
+ * the sketch's GAP event handler passes it to gapEvent(), which gives
+ * a semaphore of its own to the waiting task.
+ *
+ * Define LINK_UPGRADE as 0 before including this file to keep the
+ * defaults, to compare the throughput of both.
+ */
+#ifndef LINK_SETUP_H_
+#define LINK_SETUP_H_
+
+#include <NimBLEDevice.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <gatt_cache.h>
+#include <stdint.h>
+
+#ifndef LINK_UPGRADE
+#define LINK_UPGRADE 1
+#endif
+
+// ATT MTU to offer, the largest that fits in one LL packet of 251
+#define LINK_MTU 247
+// Data length: LL payload bytes and their air time in us on 1M PHY
+#define LINK_TX_OCTETS 251
+#define LINK_TX_TIME 2120
+// Time to wait for the PHY update, in ms
+#define LINK_PHY_TIMEOUT 1000
+
+struct LinkInfo {
+  uint16_t mtu;
+  uint8_t txPhy; // BLE_GAP_LE_PHY_1M, _2M or _CODED
+  uint8_t rxPhy;
+  bool dataLength; // Data length extension was requested
+};
+
+static inline const char *linkPhyName(uint8_t phy) {
+  switch (phy) {
+  case BLE_GAP_LE_PHY_1M:
+    return "1M";
+  case BLE_GAP_LE_PHY_2M:
+    return "2M";
+  case BLE_GAP_LE_PHY_CODED:
+    return "Coded";
+  default:
+    return "?";
+  }
+}
+
+static int linkMtuCB(uint16_t connHandle,
+                     const struct ble_gatt_error *error, uint16_t mtu,
+                     void *arg) {
+  GattRequest *request = (GattRequest *)arg;
+
+  request->status = error->status;
+  xSemaphoreGive(request->done);
+  return 0;
+}
+
+class LinkSetup {
+public:
+  LinkSetup() : waitingConn(BLE_HS_CONN_HANDLE_NONE) {
+    phyUpdated = xSemaphoreCreateBinaryStatic(&phyUpdatedBuffer);
+  }
+
+  // Offer LINK_MTU in MTU exchanges, after NimBLEDevice::init().
+  void begin() {
+    if (LINK_UPGRADE) {
+      NimBLEDevice::setMTU(LINK_MTU);
+    }
+  }
+
+  /* Raise the data length, PHY and MTU of a new connection as far as
+   * the peer supports them. Blocks until the PHY update and the MTU
+   * exchange are done.
+   */
+  void upgrade(uint16_t connHandle, LinkInfo &info) {
+    info.dataLength = false;
+    info.txPhy = BLE_GAP_LE_PHY_1M;
+    info.rxPhy = BLE_GAP_LE_PHY_1M;
+#if LINK_UPGRADE
+    // A peer without data length extension keeps 27 bytes.
+    info.dataLength = ble_gap_set_data_len(connHandle, LINK_TX_OCTETS,
+                                           LINK_TX_TIME) == 0;
+
+    /* A peer without 2M PHY stays on 1M. A give after an earlier
+     * timeout is left over, so take it first.
+     */
+    xSemaphoreTake(phyUpdated, 0);
+    waitingConn = connHandle;
+    int rc = ble_gap_set_prefered_le_phy(
+        connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+        BLE_GAP_LE_PHY_CODED_ANY);
+    if (rc == 0) {
+      xSemaphoreTake(phyUpdated, pdMS_TO_TICKS(LINK_PHY_TIMEOUT));
+    }
+    waitingConn = BLE_HS_CONN_HANDLE_NONE;
+
+    /* NimBLE-Arduino may already have exchanged the MTU when it
+     * connected, then the request fails with BLE_HS_EALREADY.
+     */
+    GattRequest request;
+    gattWait(connHandle, request,
+             ble_gattc_exchange_mtu(connHandle, linkMtuCB, &request));
+#endif
+    ble_gap_read_le_phy(connHandle, &info.txPhy, &info.rxPhy);
+    info.mtu = ble_att_mtu(connHandle);
+  }
+
+  // Called for all GAP events on the NimBLE host task.
+  void gapEvent(const ble_gap_event *event) {
+    if (event->type == BLE_GAP_EVENT_PHY_UPDATE_COMPLETE &&
+        event->phy_updated.conn_handle == waitingConn) {
+      xSemaphoreGive(phyUpdated);
+    }
+  }
+
+private:
+  // Given when the PHY of waitingConn is updated
+  SemaphoreHandle_t phyUpdated;
+  StaticSemaphore_t phyUpdatedBuffer;
+  volatile uint16_t waitingConn;
+};
+
+#endif /* LINK_SETUP_H_ */
@@ -0,0 +1,139 @@
+/** Measure the application-level throughput of a connection.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * For THROUGHPUT_DURATION ms, the test reads the subscribed
+ * characteristic of one peer back to back from loop(), and counts the
+ * bytes of the notifications and indications that arrive from the
+ * same peer in the meantime. Both are attribute values, so the result
+ * is what the application gets, without ATT and link layer overhead.
+ *
+ * The GAP event handler counts the notification bytes on the NimBLE
+ * host task as they arrive, so the count doesn't depend on how fast
+ * loop() handles the events.
+ */
+#ifndef THROUGHPUT_TEST_H_
+#define THROUGHPUT_TEST_H_
+
+#include <NimBLEDevice.h>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection_manager.h"
+
+// Duration of a test, in ms
+#define THROUGHPUT_DURATION 10000
+
+class ThroughputTest {
+public:
+  ThroughputTest()
+      : peer(nullptr), connHandle(BLE_HS_CONN_HANDLE_NONE),
+        notifications(0), notificationBytes(0) {}
+
+  // Whether a test is running, then loop() shouldn't block.
+  bool running() const { return peer != nullptr; }
+
+  // Peer that is being tested, or nullptr
+  const Peer *testing() const { return peer; }
+
+  // Start testing a streaming peer.
+  void start(const Peer *testPeer) {
+    peer = testPeer;
+    reads = 0;
+    readBytes = 0;
+    errors = 0;
+    notifications.store(0);
+    notificationBytes.store(0);
+    startTime = millis();
+    connHandle.store(peer->connHandle);
+    Serial.printf("%s: testing throughput for %u s\n",
+                  peer->address.toString().c_str(),
+                  (unsigned)(THROUGHPUT_DURATION / 1000));
+  }
+
+  /* Count a notification of length bytes, from the GAP event handler
+   * on the NimBLE host task.
+   */
+  void notified(uint16_t notifyConnHandle, uint16_t length) {
+    if (notifyConnHandle == connHandle.load()) {
+      notifications++;
+      notificationBytes += length;
+    }
+  }
+
+  // A peer was disconnected, which ends its test.
+  void disconnected(const Peer *disconnectedPeer) {
+    if (disconnectedPeer == peer) {
+      Serial.printf("%s: disconnected during throughput test\n",
+                    peer->address.toString().c_str());
+      stop();
+    }
+  }
+
+  /* Read the characteristic once, and report the results at the end
+   * of the test. Returns the number of bytes read.
+   */
+  size_t step() {
+    uint8_t data[LINK_MTU];
+    size_t length = sizeof(data);
+
+    if (gattRead(peer->connHandle, peer->handles.value, data,
+                 length) == 0) {
+      reads++;
+      readBytes += length;
+    } else {
+      length = 0;
+      errors++;
+    }
+
+    uint32_t elapsed = millis() - startTime;
+    if (elapsed >= THROUGHPUT_DURATION) {
+      report(elapsed);
+      stop();
+    }
+    return length;
+  }
+
+private:
+  const Peer *peer; // Only accessed from loop()
+  std::atomic<uint16_t> connHandle;
+  uint32_t startTime;
+  uint32_t reads;
+  uint32_t readBytes;
+  uint32_t errors;
+  // Updated by the NimBLE host task
+  std::atomic<uint32_t> notifications;
+  std::atomic<uint32_t> notificationBytes;
+
+  void stop() {
+    connHandle.store(BLE_HS_CONN_HANDLE_NONE);
+    peer = nullptr;
+  }
+
+  void report(uint32_t elapsed) {
+    const LinkInfo &link = peer->link;
+
+    Serial.printf("%s: throughput with MTU %u, PHY %s/%s, data "
+                  "length %s:\n",
+                  peer->address.toString().c_str(),
+                  (unsigned)link.mtu, linkPhyName(link.txPhy),
+                  linkPhyName(link.rxPhy),
+                  link.dataLength ? "requested" : "default");
+    Serial.printf("  Reads: %u B/s, %u reads/s of %u bytes, %u "
+                  "errors\n",
+                  (unsigned)((uint64_t)readBytes * 1000 / elapsed),
+                  (unsigned)((uint64_t)reads * 1000 / elapsed),
+                  (unsigned)(reads ? readBytes / reads : 0),
+                  (unsigned)errors);
+    Serial.printf("  Notifications: %u B/s, %u notifications/s\n",
+                  (unsigned)((uint64_t)notificationBytes.load() *
+                             1000 / elapsed),
+                  (unsigned)((uint64_t)notifications.load() * 1000 /
+                             elapsed));
+  }
+};
+
+#endif /* THROUGHPUT_TEST_H_ */
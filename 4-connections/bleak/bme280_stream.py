@@ -0,0 +1,123 @@
+"""Subscribe to the stream of notifications of a BME280 sensor.
+
+Copyright (c) 2022 Koen Vervloesem
+
+SPDX-License-Identifier: MIT
+
+Each notification of peripheral_bme280 holds the sequence number of
+its first sample, followed by as many samples as fit in the MTU. This
+shows the newest sample of each notification, and every few seconds
+the samples/s and bytes/s received, and the samples lost, which are
+the gaps in the sequence numbers.
+"""
+import asyncio
+import sys
+import time
+
+from construct import GreedyRange, Int16sl, Int16ul, Struct
+from construct.core import ConstructError
+
+import bleak
+
+bme280_format = Struct(
+    "temperature" / Int16sl,
+    "pressure" / Int16ul,
+    "humidity" / Int16ul,
+)
+
+stream_format = Struct(
+    "sequence" / Int16ul,
+    "samples" / GreedyRange(bme280_format),
+)
+
+BME280_STREAM_UUID = "63bf0b19-2b9c-473c-9e0a-2cfcaf03a772"
+REPORT_PERIOD = 5
+
+
+class StreamStatistics:
+    """Count the samples and bytes received, and the samples lost."""
+
+    def __init__(self):
+        self.next_sequence = None
+        self.samples = 0
+        self.bytes = 0
+        self.notifications = 0
+        self.lost = 0
+        self.start = time.monotonic()
+
+    def add(self, sequence: int, samples: int, length: int):
+        """Count a notification."""
+        if self.next_sequence is not None:
+            self.lost += (sequence - self.next_sequence) % 0x10000
+        self.next_sequence = (sequence + samples) % 0x10000
+        self.samples += samples
+        self.bytes += length
+        self.notifications += 1
+
+    def report(self):
+        """Show the statistics since the previous report."""
+        now = time.monotonic()
+        elapsed = now - self.start
+        print(
+            f"{self.samples / elapsed:.1f} samples/s, "
+            f"{self.bytes / elapsed:.0f} bytes/s, "
+            f"{self.notifications} notifications, "
+            f"{self.lost} samples lost"
+        )
+        self.samples = 0
+        self.bytes = 0
+        self.notifications = 0
+        self.lost = 0
+        self.start = now
+
+
+statistics = StreamStatistics()
+
+
+def sensor_values_received(handle: int, data: bytearray):
+    """Show the newest sensor values of a notification."""
+    try:
+        stream = stream_format.parse(data)
+    except ConstructError:
+        # Wrong format
+        return
+    if not stream.samples:
+        return
+
+    statistics.add(stream.sequence, len(stream.samples), len(data))
+    sensor_data = stream.samples[-1]
+    sequence = (stream.sequence + len(stream.samples) - 1) % 0x10000
+    print(
+        f"#{sequence:5}: "
+        f"{sensor_data.temperature / 100:6.2f} °C, "
+        f"{sensor_data.humidity / 100:6.2f} %, "
+        f"{(sensor_data.pressure + 50000) / 100:7.2f} hPa"
+    )
+
+
+async def main(address):
+    """Connect to BME280 sensor and subscribe to notifications."""
+    try:
+        async with bleak.BleakClient(address) as client:
+            print(f"Connected to {address}")
+
+            await client.start_notify(
+                BME280_STREAM_UUID, sensor_values_received
+            )
+            print("Notifications started...")
+            statistics.start = time.monotonic()
+            while True:
+                await asyncio.sleep(REPORT_PERIOD)
+                statistics.report()
+
+    except asyncio.exceptions.TimeoutError:
+        print(f"Can't connect to device {address}.")
+
+
+if __name__ == "__main__":
+
+    if len(sys.argv) == 2:
+        address = sys.argv[1]
+        asyncio.run(main(address))
+    else:
+        print("Please specify the Bluetooth address.")
@@ -0,0 +1,383 @@
+/** Check and benchmark the heart rate decoder of Heart_Rate_Monitor.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Decodes Heart Rate Measurement notifications from a file, one per
+ * line as hex bytes (lines starting with # are ignored), or generates
+ * synthetic ones. The RR-intervals go through an HrvWindow with the
+ * window size of the sketch. After every interval, its incremental
+ * RMSSD, SDNN and pNN50 are compared with a direct computation over
+ * the same window in double precision.
+ *
+ * A measurement with as many RR-intervals as fit in the ATT MTU of
+ * the sketch also goes through the event dispatcher, as in the
+ * sketch's notification handler, against the stand-ins of the
+ * advert_replay harness. All its RR-intervals must come out, and the
+ * event must keep the length of the notification.
+ *
+ * Then it times decoding and updating for a number of sensors at
+ * once, each with its own window, as the sketch does per peer.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "heart_rate.h"
+
+// Same as Heart_Rate_Monitor.ino, LINK_MTU - 3
+#define EVENT_MAX_DATA HRM_MAX_SIZE
+#include "event_dispatcher.h"
+
+// Same as Heart_Rate_Monitor.ino
+#define HRV_WINDOW 128
+#define EVENT_QUEUE_SIZE 32
+// Largest payload read from a file
+#define MAX_PAYLOAD HRM_MAX_SIZE
+// Largest difference with the direct computation, in ms or %
+#define TOLERANCE 0.01
+
+typedef HrvWindow<HRV_WINDOW> Window;
+
+struct Payload {
+  uint8_t length;
+  uint8_t data[MAX_PAYLOAD];
+};
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] [FILE]\n"
+          "  -n, --count N       Synthetic notifications without "
+          "FILE (10000)\n"
+          "  -p, --peers N       Sensors to benchmark at once (64)\n"
+          "  -s, --seed N        Seed of the synthetic notifications "
+          "(1)\n",
+          program);
+}
+
+static bool loadPayloads(const char *path,
+                         std::vector<Payload> &payloads) {
+  FILE *file = fopen(path, "r");
+  char line[1024];
+
+  if (file == nullptr) {
+    return false;
+  }
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    if (line[0] == '#') {
+      continue;
+    }
+    Payload payload;
+    payload.length = 0;
+    char *p = line;
+    char *end;
+    unsigned long byte;
+    while (payload.length < MAX_PAYLOAD &&
+           (byte = strtoul(p, &end, 16), end != p)) {
+      payload.data[payload.length++] = (uint8_t)byte;
+      p = end;
+    }
+    if (payload.length > 0) {
+      payloads.push_back(payload);
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+static uint32_t xorshift32(uint32_t &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+/* Notifications as a chest strap sends them: one per second, with the
+ * beats in that second. Flags vary, so all fields are exercised.
+ */
+static void makePayloads(unsigned long count, uint32_t state,
+                         std::vector<Payload> &payloads) {
+  uint16_t rr = 820; // 1/1024 s
+  uint16_t energy = 0;
+
+  for (unsigned long i = 0; i < count; i++) {
+    Payload payload;
+    uint8_t flags = HRM_FLAG_CONTACT_SUPPORTED |
+                    HRM_FLAG_CONTACT_DETECTED | HRM_FLAG_RR_INTERVALS;
+    if (i % 10 == 0) {
+      flags |= HRM_FLAG_ENERGY_EXPENDED;
+    }
+    if (i % 7 == 0) {
+      flags |= HRM_FLAG_HEART_RATE_16;
+    }
+
+    uint8_t *p = payload.data;
+    *p++ = flags;
+    uint16_t bpm = (uint16_t)(60 * 1024 / rr);
+    *p++ = (uint8_t)bpm;
+    if (flags & HRM_FLAG_HEART_RATE_16) {
+      *p++ = (uint8_t)(bpm >> 8);
+    }
+    if (flags & HRM_FLAG_ENERGY_EXPENDED) {
+      energy++;
+      *p++ = (uint8_t)energy;
+      *p++ = (uint8_t)(energy >> 8);
+    }
+    // 1 to 3 beats, with a random walk and occasional artifacts
+    uint32_t beats = 1 + xorshift32(state) % 3;
+    for (uint32_t b = 0; b < beats; b++) {
+      rr = (uint16_t)(rr + (int)(xorshift32(state) % 141) - 70);
+      if (rr < 450 || rr > 1400) {
+        rr = 820;
+      }
+      uint16_t value = xorshift32(state) % 500 == 0 ? 100 : rr;
+      *p++ = (uint8_t)value;
+      *p++ = (uint8_t)(value >> 8);
+    }
+    payload.length = (uint8_t)(p - payload.data);
+    payloads.push_back(payload);
+  }
+}
+
+// The metrics of the last HRV_WINDOW accepted intervals, directly.
+static void direct(const std::vector<uint16_t> &intervals,
+                   double &rmssd, double &sdnn, double &pnn50) {
+  size_t n = intervals.size() < HRV_WINDOW ? intervals.size()
+                                           : HRV_WINDOW;
+  const uint16_t *x = &intervals[intervals.size() - n];
+  double mean = 0;
+  double squares = 0;
+  double diffSquares = 0;
+  size_t nn50 = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    mean += x[i];
+  }
+  mean /= n;
+  for (size_t i = 0; i < n; i++) {
+    squares += (x[i] - mean) * (x[i] - mean);
+    if (i > 0) {
+      double diff = (double)x[i] - x[i - 1];
+      diffSquares += diff * diff;
+      nn50 += fabs(diff) > NN50_THRESHOLD;
+    }
+  }
+  sdnn = sqrt(squares / (n - 1));
+  rmssd = sqrt(diffSquares / (n - 1));
+  pnn50 = 100.0 * nn50 / (n - 1);
+}
+
+/* Decode all payloads into one window and compare it with the direct
+ * computation. Returns the number of RR-intervals, or 0 on error.
+ */
+static size_t check(const std::vector<Payload> &payloads) {
+  Window window;
+  std::vector<uint16_t> accepted;
+  size_t intervals = 0;
+  double maxError = 0;
+
+  for (size_t i = 0; i < payloads.size(); i++) {
+    HeartRateMeasurement measurement;
+    if (!parseHeartRate(payloads[i].data, payloads[i].length,
+                        measurement)) {
+      fprintf(stderr, "Notification %u is too short\n", (unsigned)i);
+      return 0;
+    }
+    for (uint8_t j = 0; j < measurement.rrCount; j++) {
+      uint16_t rr = rrToMs(measurement.rrIntervals[j]);
+      window.add(rr);
+      intervals++;
+      if (rr < RR_MIN || rr > RR_MAX) {
+        continue;
+      }
+      accepted.push_back(rr);
+      if (accepted.size() < 2) {
+        continue;
+      }
+
+      double rmssd, sdnn, pnn50;
+      direct(accepted, rmssd, sdnn, pnn50);
+      double errors[] = {fabs(window.rmssd() - rmssd),
+                         fabs(window.sdnn() - sdnn),
+                         fabs(window.pnn50() - pnn50)};
+      for (double error : errors) {
+        if (error > maxError) {
+          maxError = error;
+        }
+      }
+    }
+  }
+
+  printf("Decoded %u notifications with %u RR-intervals, %u "
+         "rejected\n",
+         (unsigned)payloads.size(), (unsigned)intervals,
+         (unsigned)window.rejects());
+  printf("Last window: %u RR, mean %.1f ms, RMSSD %.1f ms, SDNN "
+         "%.1f ms, pNN50 %.1f%%\n",
+         (unsigned)window.size(), window.meanRr(), window.rmssd(),
+         window.sdnn(), window.pnn50());
+  printf("Largest difference with direct computation: %.6f\n",
+         maxError);
+  if (maxError > TOLERANCE) {
+    fprintf(stderr, "Incremental metrics differ from direct ones\n");
+    return 0;
+  }
+  return intervals;
+}
+
+/* Post the largest measurement with RR-intervals as a notification,
+ * and decode the event that comes out. Returns false on error.
+ */
+static bool checkDispatcher() {
+  static EventDispatcher<EVENT_QUEUE_SIZE> dispatcher(false);
+  static uint8_t longer[EVENT_MAX_DATA + 10];
+  NimBLEClient client{NimBLEAddress()};
+  Payload payload;
+  HeartRateMeasurement measurement;
+  Event event;
+  uint8_t sent = 0;
+
+  // 16-bit heart rate and energy expended, then RR-intervals
+  uint8_t *p = payload.data;
+  *p++ = HRM_FLAG_HEART_RATE_16 | HRM_FLAG_ENERGY_EXPENDED |
+         HRM_FLAG_RR_INTERVALS;
+  *p++ = 72;
+  *p++ = 0;
+  *p++ = 0x34;
+  *p++ = 0x12;
+  while (p + 2 <= payload.data + MAX_PAYLOAD) {
+    uint16_t rr = (uint16_t)(700 + sent * 37 % 300);
+    *p++ = (uint8_t)rr;
+    *p++ = (uint8_t)(rr >> 8);
+    sent++;
+  }
+  payload.length = (uint8_t)(p - payload.data);
+
+  dispatcher.begin();
+  dispatcher.post(&client, payload.data, payload.length);
+  if (!dispatcher.wait(event, 0) || event.truncated() ||
+      event.length != payload.length ||
+      !parseHeartRate(event.data, event.length, measurement) ||
+      measurement.rrCount != sent) {
+    fprintf(stderr, "Dispatched measurement lost RR-intervals\n");
+    return false;
+  }
+  for (uint8_t i = 0; i < sent; i++) {
+    if (measurement.rrIntervals[i] != 700 + i * 37 % 300) {
+      fprintf(stderr, "RR-interval %u changed\n", (unsigned)i);
+      return false;
+    }
+  }
+
+  // A longer notification is marked, with its length.
+  dispatcher.post(&client, longer, sizeof(longer));
+  if (!dispatcher.wait(event, 0) || !event.truncated() ||
+      event.length != sizeof(longer)) {
+    fprintf(stderr, "Longer notification not marked truncated\n");
+    return false;
+  }
+
+  printf("Dispatched %u-byte notification with %u RR-intervals, "
+         "%u decoded\n",
+         (unsigned)payload.length, (unsigned)sent,
+         (unsigned)measurement.rrCount);
+  return true;
+}
+
+// Time decoding and updating with a window per sensor.
+static void benchmark(const std::vector<Payload> &payloads,
+                      unsigned long peers) {
+  std::vector<Window> windows(peers);
+  unsigned long rounds = 2000000 / payloads.size() + 1;
+  float checksum = 0;
+
+  double start = now();
+  for (unsigned long r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < payloads.size(); i++) {
+      Window &window = windows[(r + i) % peers];
+      HeartRateMeasurement measurement;
+      if (!parseHeartRate(payloads[i].data, payloads[i].length,
+                          measurement)) {
+        continue;
+      }
+      for (uint8_t j = 0; j < measurement.rrCount; j++) {
+        window.add(rrToMs(measurement.rrIntervals[j]));
+      }
+      checksum += window.rmssd() + window.sdnn() + window.pnn50();
+    }
+  }
+  double elapsed = now() - start;
+  double notifications = (double)rounds * payloads.size();
+
+  printf("%lu sensors: %.0f ns per notification, including the "
+         "metrics (checksum %.0f)\n",
+         peers, elapsed * 1e9 / notifications, checksum);
+  printf("Memory: %u bytes per sensor\n", (unsigned)sizeof(Window));
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"count", required_argument, nullptr, 'n'},
+      {"peers", required_argument, nullptr, 'p'},
+      {"seed", required_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+  unsigned long count = 10000;
+  unsigned long peers = 64;
+  uint32_t seed = 1;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "n:p:s:", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 'n':
+      count = strtoul(optarg, nullptr, 0);
+      break;
+    case 'p':
+      peers = strtoul(optarg, nullptr, 0);
+      break;
+    case 's':
+      seed = strtoul(optarg, nullptr, 0) | 1;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind < argc - 1 || count == 0 || peers == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Payload> payloads;
+  if (optind == argc - 1) {
+    if (!loadPayloads(argv[optind], payloads)) {
+      fprintf(stderr, "Can't read %s\n", argv[optind]);
+      return EXIT_FAILURE;
+    }
+  } else {
+    makePayloads(count, seed, payloads);
+  }
+  if (payloads.empty()) {
+    fprintf(stderr, "No notifications\n");
+    return EXIT_FAILURE;
+  }
+
+  if (check(payloads) == 0 || !checkDispatcher()) {
+    return EXIT_FAILURE;
+  }
+  benchmark(payloads, peers);
+  return EXIT_SUCCESS;
+}
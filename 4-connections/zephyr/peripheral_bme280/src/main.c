@@ -1,16 +1,39 @@
 /*
- * Indications for BME280 sensor data in a custom BLE service.
+ * Indications and notifications for BME280 sensor data in a custom
+ * BLE service.
  *
  * Copyright (c) 2021 Koen Vervloesem
  *
  * SPDX-License-Identifier: MIT
+ *
+ * The first characteristic is indicated at most once a second, when
+ * a sensor value changed. Each indication waits for the confirmation
+ * of the previous one, so it can't stream samples.
+ *
+ * The second characteristic streams all samples, which the sampler
+ * takes every CONFIG_BME280_SAMPLER_INTERVAL ms (20 ms in prj.conf),
+ * in notifications. Each notification packs the sequence number of
+ * its first sample (uint16, little-endian) and as many samples as fit
+ * in the ATT MTU, each in the format of the first characteristic. To
+ * bound the latency, a notification is sent as soon as the samples of
+ * NOTIFY_MAX_LATENCY ms are waiting, even if more would fit.
+ *
+ * At most NOTIFY_IN_FLIGHT notifications wait to be sent, and the
+ * completion callback of bt_gatt_notify_cb() sends the next one. If
+ * the connection can't keep up, samples that drop out of the history
+ * of the sampler are lost, which the client sees as a gap in the
+ * sequence numbers. Every STATS_PERIOD ms while streaming, the
+ * firmware prints the samples/s and bytes/s of the notifications
+ * sent.
  */
 
 #include <errno.h>
 #include <stddef.h>
 #include <string.h>
+#include <zephyr/sys/atomic.h>
 #include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
 #include <zephyr/kernel.h>
 #include <zephyr/types.h>
 
@@ -20,7 +43,7 @@
 #include <zephyr/bluetooth/hci.h>
 #include <zephyr/bluetooth/uuid.h>
 
-#include "bme280.h"
+#include "bme280_sampler.h"
 
 // Define BLE service 63bf0b19-2b9c-473c-9e0a-2cfcaf03a770
 #define BT_UUID_CUSTOM_SERVICE_VAL                                   \
@@ -35,36 +58,71 @@ static struct bt_uuid_128 char_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x63bf0b19, 0x2b9c, 0x473c,
                                         0x9e0a, 0x2cfcaf03a771));
 
+// Define BLE characteristic 63bf0b19-2b9c-473c-9e0a-2cfcaf03a772
+static struct bt_uuid_128 stream_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x63bf0b19, 0x2b9c, 0x473c,
+                                        0x9e0a, 0x2cfcaf03a772));
+
+// Notifications waiting to be sent at most
+#define NOTIFY_IN_FLIGHT 2
+// Longest time a sample waits for its notification, in ms
+#define NOTIFY_MAX_LATENCY 200
+// Time between statistics of the stream, in ms
+#define STATS_PERIOD 5000
+
+// Sequence number of the first sample, uint16
+#define STREAM_HEADER_SIZE 2
+// Temperature, pressure and humidity, 16-bit
+#define STREAM_SAMPLE_SIZE 6
+// Largest notification value for the ATT MTU of the stack
+#define STREAM_MAX_SIZE (CONFIG_BT_L2CAP_TX_MTU - 3)
+
 // Initialize characteristic value (temperature, pressure, humidity)
 static uint8_t char_value[6] = {0, 0, 0, 0, 0, 0};
 
-const struct device *bme280 = NULL;
-
-// Update data with BME280 sensor measurement.
+static uint8_t stream_value[STREAM_MAX_SIZE];
+// Samples of the next notification, from old to new
+static struct bme280_sample
+    stream_samples[(STREAM_MAX_SIZE - STREAM_HEADER_SIZE) /
+                   STREAM_SAMPLE_SIZE];
+// Sequence number of the next sample to send
+static uint32_t next_sequence;
+
+static atomic_t streaming;
+static atomic_t stream_restart; // Start with the newest sample
+static atomic_t att_mtu = ATOMIC_INIT(BT_ATT_DEFAULT_LE_MTU);
+static K_SEM_DEFINE(notify_slots, NOTIFY_IN_FLIGHT, NOTIFY_IN_FLIGHT);
+
+static struct {
+  atomic_t samples;
+  atomic_t bytes;
+  atomic_t notifications;
+  atomic_t dropped; // Samples that left the history unsent
+} stream_stats;
+
+// Update data with the newest BME280 sample.
 // Returns 1 if at least one sensor measurement changed compared to
 // the previously stored value.
-uint8_t update_data_bme280(const struct device *dev) {
-  int16_t temperature;
-  uint16_t pressure, humidity;
+uint8_t update_data_bme280(void) {
+  struct bme280_sample sample;
   uint8_t changed = 0;
 
-  bme280_fetch_sample(dev);
+  if (bme280_sampler_latest(&sample)) {
+    return 0;
+  }
 
-  temperature = bme280_get_temperature(dev);
-  if (memcmp(&(char_value[0]), &temperature, 2)) {
-    memcpy(&(char_value[0]), &temperature, 2);
+  if (memcmp(&(char_value[0]), &sample.temperature, 2)) {
+    memcpy(&(char_value[0]), &sample.temperature, 2);
     changed = 1;
   }
 
-  pressure = bme280_get_pressure(dev);
-  if (memcmp(&(char_value[2]), &pressure, 2)) {
-    memcpy(&(char_value[2]), &pressure, 2);
+  if (memcmp(&(char_value[2]), &sample.pressure, 2)) {
+    memcpy(&(char_value[2]), &sample.pressure, 2);
     changed = 1;
   }
 
-  humidity = bme280_get_humidity(dev);
-  if (memcmp(&(char_value[4]), &humidity, 2)) {
-    memcpy(&(char_value[4]), &humidity, 2);
+  if (memcmp(&(char_value[4]), &sample.humidity, 2)) {
+    memcpy(&(char_value[4]), &sample.humidity, 2);
     changed = 1;
   }
 
@@ -76,7 +134,7 @@ static ssize_t read_characteristic(struct bt_conn *conn,
                                    const struct bt_gatt_attr *attr,
                                    void *buf, uint16_t len,
                                    uint16_t offset) {
-  update_data_bme280(bme280);
+  update_data_bme280();
   const char *value = attr->user_data;
 
   return bt_gatt_attr_read(conn, attr, buf, len, offset, value,
@@ -92,6 +150,17 @@ static void ccc_cfg_changed(const struct bt_gatt_attr *attr,
   indicate = (value == BT_GATT_CCC_INDICATE) ? 1 : 0;
 }
 
+static void stream_ccc_cfg_changed(const struct bt_gatt_attr *attr,
+                                   uint16_t value) {
+  bool enabled = value == BT_GATT_CCC_NOTIFY;
+
+  if (enabled) {
+    atomic_set(&stream_restart, 1);
+  }
+  atomic_set(&streaming, enabled);
+  printk("Stream %s\n", enabled ? "started" : "stopped");
+}
+
 // Primary Service Declaration
 BT_GATT_SERVICE_DEFINE(
     service, BT_GATT_PRIMARY_SERVICE(&service_uuid),
@@ -100,6 +169,10 @@ BT_GATT_SERVICE_DEFINE(
                            BT_GATT_PERM_READ, read_characteristic,
                            NULL, char_value),
     BT_GATT_CCC(ccc_cfg_changed,
+                BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(&stream_uuid.uuid, BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_NONE, NULL, NULL, NULL),
+    BT_GATT_CCC(stream_ccc_cfg_changed,
                 BT_GATT_PERM_READ | BT_GATT_PERM_WRITE), );
 
 // Advertising data
@@ -121,11 +194,148 @@ static void indicate_destroy(struct bt_gatt_indicate_params *params) {
   indicating = 0U;
 }
 
+// Samples in a full notification
+static size_t stream_fit(void) {
+  size_t size =
+      MIN((size_t)atomic_get(&att_mtu) - 3, STREAM_MAX_SIZE);
+
+  return (size - STREAM_HEADER_SIZE) / STREAM_SAMPLE_SIZE;
+}
+
+static void stream_handler(struct k_work *work);
+
+static K_WORK_DEFINE(stream_work, stream_handler);
+
+// Notification callback, when the notification is sent
+static void notify_complete(struct bt_conn *conn, void *user_data) {
+  size_t count = (size_t)(uintptr_t)user_data;
+
+  atomic_add(&stream_stats.samples, count);
+  atomic_add(&stream_stats.bytes,
+             STREAM_HEADER_SIZE + count * STREAM_SAMPLE_SIZE);
+  atomic_inc(&stream_stats.notifications);
+  k_sem_give(&notify_slots);
+  k_work_submit(&stream_work);
+}
+
+/*
+ * Send notifications with the samples that weren't sent yet, as long
+ * as a notification is full or its first sample waited long enough,
+ * and fewer than NOTIFY_IN_FLIGHT notifications are waiting.
+ */
+static void stream_handler(struct k_work *work) {
+  struct bt_gatt_notify_params params = {0};
+  size_t fit, count;
+  uint32_t sequence, newest;
+  uint8_t *value;
+
+  while (atomic_get(&streaming)) {
+    if (atomic_cas(&stream_restart, 1, 0)) {
+      bme280_sampler_since(&next_sequence, NULL, 0, &newest);
+      next_sequence = newest;
+    }
+
+    // Copy only the samples that weren't sent, up to a notification.
+    fit = stream_fit();
+    sequence = next_sequence;
+    count =
+        bme280_sampler_since(&sequence, stream_samples, fit, &newest);
+    if (sequence != next_sequence) {
+      atomic_add(&stream_stats.dropped, sequence - next_sequence);
+      next_sequence = sequence;
+    }
+
+    // Fewer than fit samples are all the pending ones.
+    if (count < fit && count * CONFIG_BME280_SAMPLER_INTERVAL <
+                           NOTIFY_MAX_LATENCY) {
+      return;
+    }
+    if (k_sem_take(&notify_slots, K_NO_WAIT) != 0) {
+      // notify_complete() submits the work again.
+      return;
+    }
+
+    sys_put_le16((uint16_t)next_sequence, stream_value);
+    value = &stream_value[STREAM_HEADER_SIZE];
+    for (size_t i = 0; i < count; i++) {
+      const struct bme280_sample *sample = &stream_samples[i];
+
+      sys_put_le16((uint16_t)sample->temperature, &value[0]);
+      sys_put_le16(sample->pressure, &value[2]);
+      sys_put_le16(sample->humidity, &value[4]);
+      value += STREAM_SAMPLE_SIZE;
+    }
+
+    params.attr = &service.attrs[5];
+    params.data = stream_value;
+    params.len = STREAM_HEADER_SIZE + count * STREAM_SAMPLE_SIZE;
+    params.func = notify_complete;
+    params.user_data = (void *)(uintptr_t)count;
+    if (bt_gatt_notify_cb(NULL, &params) != 0) {
+      // Out of buffers or disconnected: retry with the next sample.
+      k_sem_give(&notify_slots);
+      return;
+    }
+    next_sequence += count;
+  }
+}
+
+// Called in the sampler thread with each new sample.
+static void sample_cb(const struct bme280_sample *sample,
+                      const struct bme280_sample_info *info) {
+  if (atomic_get(&streaming)) {
+    k_work_submit(&stream_work);
+  }
+}
+
+// Print the statistics of the stream every STATS_PERIOD ms.
+static void report_stream(void) {
+  static int64_t start;
+  int64_t now = k_uptime_get();
+  int64_t elapsed = now - start;
+
+  if (!atomic_get(&streaming)) {
+    atomic_clear(&stream_stats.samples);
+    atomic_clear(&stream_stats.bytes);
+    atomic_clear(&stream_stats.notifications);
+    atomic_clear(&stream_stats.dropped);
+    start = now;
+    return;
+  }
+  if (elapsed < STATS_PERIOD) {
+    return;
+  }
+
+  uint32_t samples = atomic_clear(&stream_stats.samples);
+  uint32_t bytes = atomic_clear(&stream_stats.bytes);
+  uint32_t notifications = atomic_clear(&stream_stats.notifications);
+  uint32_t dropped = atomic_clear(&stream_stats.dropped);
+
+  printk("Stream: %u samples/s, %u bytes/s, %u notifications of %u "
+         "samples on average, %u samples dropped, MTU %u\n",
+         (uint32_t)(samples * 1000 / elapsed),
+         (uint32_t)(bytes * 1000 / elapsed), notifications,
+         samples / MAX(notifications, 1), dropped,
+         (uint32_t)atomic_get(&att_mtu));
+  start = now;
+}
+
 // GATT callbacks
 void mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx) {
   printk("Updated MTU: TX: %d RX: %d bytes\n", tx, rx);
+  atomic_set(&att_mtu, tx);
 }
 
+static void mtu_exchanged(struct bt_conn *conn, uint8_t err,
+                          struct bt_gatt_exchange_params *params) {
+  if (err) {
+    printk("MTU exchange failed (err %u)\n", err);
+  }
+}
+
+static struct bt_gatt_exchange_params exchange_params = {
+    .func = mtu_exchanged};
+
 static struct bt_gatt_cb gatt_callbacks = {.att_mtu_updated =
                                                mtu_updated};
 
@@ -135,11 +345,16 @@ static void connected(struct bt_conn *conn, uint8_t err) {
     printk("Connection failed (err 0x%02x)\n", err);
   } else {
     printk("Connected\n");
+    atomic_set(&att_mtu, BT_ATT_DEFAULT_LE_MTU);
+    k_sem_init(&notify_slots, NOTIFY_IN_FLIGHT, NOTIFY_IN_FLIGHT);
+    // Ask for the largest MTU, unless the client already did.
+    bt_gatt_exchange_mtu(conn, &exchange_params);
   }
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason) {
   printk("Disconnected (reason 0x%02x)\n", reason);
+  atomic_set(&streaming, 0);
 }
 
 static struct bt_conn_cb conn_callbacks = {
@@ -162,23 +377,21 @@ static void bt_ready(void) {
   printk("Advertising successfully started\n");
 }
 
-void main(void) {
+int main(void) {
   int err;
 
   printk("Starting firmware...\n");
 
-  // Initialize BME280
-  bme280 = bme280_get_device();
-
-  if (bme280 == NULL) {
-    return;
+  // Sample the BME280 in the background
+  if (bme280_sampler_start(sample_cb)) {
+    return 0;
   }
 
   // Initialize the Bluetooth subsystem
   err = bt_enable(NULL);
   if (err) {
     printk("Bluetooth init failed (err %d)\n", err);
-    return;
+    return 0;
   }
 
   bt_ready();
@@ -190,13 +403,14 @@ void main(void) {
   // Implement indications every second
   while (1) {
     k_sleep(K_SECONDS(1));
+    report_stream();
 
     if (indicate) {
       if (indicating) {
         continue;
       }
 
-      if (update_data_bme280(bme280)) {
+      if (update_data_bme280()) {
         ind_params.attr = &service.attrs[2];
         ind_params.func = indicate_cb;
         ind_params.destroy = indicate_destroy;
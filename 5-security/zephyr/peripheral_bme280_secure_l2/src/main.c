@@ -23,7 +23,7 @@
 #include <zephyr/bluetooth/hci.h>
 #include <zephyr/bluetooth/uuid.h>
 
-#include "bme280.h"
+#include "bme280_sampler.h"
 
 // Define BLE service 63bf0b19-2b9c-473c-9e0a-2cfcaf03a770
 #define BT_UUID_CUSTOM_SERVICE_VAL                                   \
@@ -41,33 +41,29 @@ static struct bt_uuid_128 char_uuid =
 // Initialize characteristic value (temperature, pressure, humidity)
 static uint8_t char_value[6] = {0, 0, 0, 0, 0, 0};
 
-const struct device *bme280 = NULL;
-
-// Update data with BME280 sensor measurement
+// Update data with the newest BME280 sample.
 // Returns 1 if at least one sensor measurement changed compared to
 // the previously stored value.
-uint8_t update_data_bme280(const struct device *dev) {
-  int16_t temperature;
-  uint16_t pressure, humidity;
+uint8_t update_data_bme280(void) {
+  struct bme280_sample sample;
   uint8_t changed = 0;
 
-  bme280_fetch_sample(dev);
+  if (bme280_sampler_latest(&sample)) {
+    return 0;
+  }
 
-  temperature = bme280_get_temperature(dev);
-  if (memcmp(&(char_value[0]), &temperature, 2)) {
-    memcpy(&(char_value[0]), &temperature, 2);
+  if (memcmp(&(char_value[0]), &sample.temperature, 2)) {
+    memcpy(&(char_value[0]), &sample.temperature, 2);
     changed = 1;
   }
 
-  pressure = bme280_get_pressure(dev);
-  if (memcmp(&(char_value[2]), &pressure, 2)) {
-    memcpy(&(char_value[2]), &pressure, 2);
+  if (memcmp(&(char_value[2]), &sample.pressure, 2)) {
+    memcpy(&(char_value[2]), &sample.pressure, 2);
     changed = 1;
   }
 
-  humidity = bme280_get_humidity(dev);
-  if (memcmp(&(char_value[4]), &humidity, 2)) {
-    memcpy(&(char_value[4]), &humidity, 2);
+  if (memcmp(&(char_value[4]), &sample.humidity, 2)) {
+    memcpy(&(char_value[4]), &sample.humidity, 2);
     changed = 1;
   }
 
@@ -79,7 +75,7 @@ static ssize_t read_characteristic(struct bt_conn *conn,
                                    const struct bt_gatt_attr *attr,
                                    void *buf, uint16_t len,
                                    uint16_t offset) {
-  update_data_bme280(bme280);
+  update_data_bme280();
   const char *value = attr->user_data;
 
   return bt_gatt_attr_read(conn, attr, buf, len, offset, value,
@@ -198,23 +194,21 @@ static void bt_ready(void) {
   printk("Advertising successfully started\n");
 }
 
-void main(void) {
+int main(void) {
   int err;
 
   printk("Starting firmware...\n");
 
-  // Initialize BME280
-  bme280 = bme280_get_device();
-
-  if (bme280 == NULL) {
-    return;
+  // Sample the BME280 in the background
+  if (bme280_sampler_start(NULL)) {
+    return 0;
   }
 
   // Initialize the Bluetooth subsystem
   err = bt_enable(NULL);
   if (err) {
     printk("Bluetooth init failed (err %d)\n", err);
-    return;
+    return 0;
   }
 
   bt_ready();
@@ -235,7 +229,7 @@ void main(void) {
         continue;
       }
 
-      if (update_data_bme280(bme280)) {
+      if (update_data_bme280()) {
         ind_params.attr = &service.attrs[2];
         ind_params.func = indicate_cb;
         ind_params.destroy = indicate_destroy;
@@ -1,26 +1,87 @@
 /* Minimal implementation of the Proximity Monitor role of the
  * Proximity Profile.
  *
- * This implementation supports the Link Loss service of a Proximity
- * Reporter.
+ * This implementation supports the Link Loss and Immediate Alert
+ * services of a Proximity Reporter. Their handles are cached in NVS,
+ * see gatt_cache.h.
  *
  * Copyright (C) 2021 Koen Vervloesem (koen@vervloesem.eu)
  *
  * SPDX-License-Identifier: MIT
  *
  * Based on the NimBLE_Client example from H2zero
+ *
+ * When the Proximity Reporter drops out, the sketch waits for it with
+ * the filter accept list of the controller, so the host only sees its
+ * advertisements, see fast_reconnect.h. Set FAST_RECONNECT to 0 to
+ * wait with an unfiltered scan instead, to compare the reconnection
+ * latency and scan reports of both.
+ *
+ * Once the alert level is written, the connection switches to the
+ * idle profile of conn_policy.h, which only keeps it alive.
+ *
+ * While connected, the sketch samples the RSSI and lets the reporter
+ * alert with its Immediate Alert service when it drifts away, see
+ * path_loss.h.
+ *
+ * Set PRESENCE_MODE to 1 to track hundreds of reporters (tags) from
+ * their advertisements instead, and only connect to the ones near the
+ * edge of the range, see presence.h.
+ *
+ * The NimBLE callbacks post events to loop(), which blocks until an
+ * event arrives, see event_dispatcher.h. Set EVENT_POLLING to 1 to
+ * poll for events every millisecond instead, to compare the wakeups
+ * and latency of both.
  */
+
+// Set to 1 to poll for events instead of blocking.
+#define EVENT_POLLING 0
+// Set to 0 to reconnect without the filter accept list.
+#define FAST_RECONNECT 1
+// Set to 1 to track tags from their advertisements.
+#define PRESENCE_MODE 0
+
 #include <NimBLEDevice.h>
+#include <conn_policy.h>
+#include <event_dispatcher.h>
+#include <fast_reconnect.h>
+#include <gatt_cache.h>
+
+#include "path_loss.h"
+#include "presence.h"
 
 #define UUID_LINK_LOSS_SERVICE "1803"
+#define UUID_IMMEDIATE_ALERT_SERVICE "1802"
 #define UUID_ALERT_LEVEL_CHARACTERISTIC "2a06"
 
-static NimBLEAdvertisedDevice *advDevice;
-NimBLERemoteService *pSvc = nullptr;
-NimBLERemoteCharacteristic *pChr = nullptr;
+// Scan interval and window, in milliseconds
+#define SCAN_INTERVAL 60
+#define SCAN_WINDOW 30
+// Number of queued events
+#define EVENT_QUEUE_SIZE 16
+// Interval to print event statistics, in milliseconds
+#define STATS_INTERVAL 30000
 
-static bool doConnect = false;
+/* Handles of the Link Loss service of each peer, cached in NVS so
+ * reconnecting after a reset skips service discovery.
+ */
+static GattCache gattCache("gattcache");
+// Immediate Alert handles, value 0 if the peer doesn't have it
+static GattCache alertCache("alertcache");
+static GattSubscriptions<NIMBLE_MAX_CONNECTIONS> subscriptions;
+
+static EventDispatcher<EVENT_QUEUE_SIZE> dispatcher(EVENT_POLLING);
+static uint32_t lastStats = 0;
 static uint32_t scanTime = 0; // 0 = scan forever
+static ConnPolicy<NIMBLE_MAX_CONNECTIONS> connPolicy;
+/* Tracking presence needs a continuous scan of all devices, without
+ * the filter accept list.
+ */
+static FastReconnect<NIMBLE_MAX_CONNECTIONS>
+    fastReconnect(FAST_RECONNECT && !PRESENCE_MODE, SCAN_INTERVAL,
+                  PRESENCE_MODE ? SCAN_INTERVAL : SCAN_WINDOW);
+static PathLoss<NIMBLE_MAX_CONNECTIONS> pathLoss;
+static PresenceTable<PRESENCE_TABLE_SIZE> presence;
 
 static uint8_t alert_level = 1; // Default value is Mild Alert
 
@@ -37,37 +98,23 @@ void alert_on_link_loss() {
 
 class ClientCallbacks : public NimBLEClientCallbacks {
   void onConnect(NimBLEClient *pClient) {
-    Serial.println("Connected");
-    pClient->updateConnParams(120, 120, 0, 60);
+    dispatcher.post(EVENT_CONNECTED, pClient);
   }
 
+  // Alert and restart the scan in loop().
   void onDisconnect(NimBLEClient *pClient) {
-    Serial.print(pClient->getPeerAddress().toString().c_str());
-    Serial.println(
-        "Disconnected - Alerting on link loss and starting scan");
-    alert_on_link_loss();
-    NimBLEDevice::getScan()->start(scanTime, nullptr);
+    dispatcher.post(EVENT_DISCONNECTED, pClient);
   }
 
   /* Called when the peripheral requests a change to the connection
    * parameters.
    * Return true to accept and apply them or false to reject and keep
-   * the currently used parameters. Default will return true.
+   * the currently used parameters. The connection policy decides,
+   * based on the profile of the peer.
    */
   bool onConnParamsUpdateRequest(NimBLEClient *pClient,
                                  const ble_gap_upd_params *params) {
-    if (params->itvl_min < 24) { // 1.25ms units
-      return false;
-    } else if (params->itvl_max > 40) { // 1.25ms units
-      return false;
-    } else if (params->latency > 2) { // Intervals allowed to skip
-      return false;
-
-    } else if (params->supervision_timeout > 100) { // 10ms units
-      return false;
-    }
-
-    return true;
+    return connPolicy.accept(pClient, params);
   }
 };
 
@@ -77,22 +124,59 @@ class ClientCallbacks : public NimBLEClientCallbacks {
 class AdvertisedDeviceCallbacks
     : public NimBLEAdvertisedDeviceCallbacks {
   void onResult(NimBLEAdvertisedDevice *advertisedDevice) {
-    if (advertisedDevice->isAdvertisingService(
+    fastReconnect.scanned();
+    // Only connect to tags near the edge.
+    if (PRESENCE_MODE) {
+      if (advertisedDevice->isAdvertisingService(
+              NimBLEUUID(UUID_LINK_LOSS_SERVICE)) &&
+          presence.seen(advertisedDevice->getAddress(),
+                        advertisedDevice->getRSSI(), millis())) {
+        NimBLEDevice::getScan()->stop();
+        // Tags aren't lost while the monitor doesn't scan.
+        presence.pause(millis());
+        dispatcher.post(EVENT_FOUND, advertisedDevice->getAddress());
+      }
+      return;
+    }
+    // A filtered scan only reports lost reporters.
+    if (fastReconnect.filtering() ||
+        advertisedDevice->isAdvertisingService(
             NimBLEUUID(UUID_LINK_LOSS_SERVICE))) {
-      Serial.print("Advertised Device found: ");
-      Serial.println(advertisedDevice->toString().c_str());
-
-      Serial.println("Found Link Loss Service");
       // Stop scan before connecting
       NimBLEDevice::getScan()->stop();
-      // Save the device reference in a global for the client to use
-      advDevice = advertisedDevice;
-      // Ready to connect now
-      doConnect = true;
+      // Connect to the device in loop()
+      dispatcher.post(EVENT_FOUND, advertisedDevice->getAddress());
     }
   }
 };
 
+// The cached handles of a peer are stale.
+void invalidate(const NimBLEAddress &address) {
+  gattCache.invalidate(address);
+  alertCache.invalidate(address);
+}
+
+/* Value handle of the Immediate Alert Level characteristic, or 0 if
+ * the peer doesn't have one. cached: the peer's Link Loss handles
+ * came from the cache and are still valid, so these are too.
+ */
+uint16_t immediateAlertHandle(NimBLEClient *pClient,
+                              const NimBLEAddress &address,
+                              bool cached) {
+  GattHandles handles;
+
+  if (cached && alertCache.load(address, handles)) {
+    return handles.value;
+  }
+  // Also cache a peer without the service, to look it up only once.
+  if (!gattDiscover(pClient, UUID_IMMEDIATE_ALERT_SERVICE,
+                    UUID_ALERT_LEVEL_CHARACTERISTIC, handles)) {
+    Serial.println("Immediate Alert service not found.");
+  }
+  alertCache.save(address, handles);
+  return handles.value;
+}
+
 /* Create a single global instance of the callback class to be used by
  * all clients.
  */
@@ -101,7 +185,7 @@ static ClientCallbacks clientCB;
 /* Handles the provisioning of clients and connects / interfaces with
  * the server.
  */
-bool connectToServer() {
+bool connectToServer(const NimBLEAddress &address) {
   NimBLEClient *pClient = nullptr;
 
   // Check if we have a client we should reuse first
@@ -111,9 +195,9 @@ bool connectToServer() {
      * service database. This saves considerable time and power.
      */
     pClient =
-        NimBLEDevice::getClientByPeerAddress(advDevice->getAddress());
+        NimBLEDevice::getClientByPeerAddress(address);
     if (pClient) {
-      if (!pClient->connect(advDevice, false)) {
+      if (!pClient->connect(address, false)) {
         Serial.println("Reconnect failed");
         return false;
       }
@@ -140,10 +224,10 @@ bool connectToServer() {
     Serial.println("New client created");
 
     pClient->setClientCallbacks(&clientCB, false);
-    pClient->setConnectionParams(50, 70, 0, 420);
+    connPolicy.configure(pClient);
     pClient->setConnectTimeout(5);
 
-    if (!pClient->connect(advDevice)) {
+    if (!pClient->connect(address)) {
       /* Created a client but failed to connect, don't need to keep it
        * as it has no data
        */
@@ -154,7 +238,7 @@ bool connectToServer() {
   }
 
   if (!pClient->isConnected()) {
-    if (!pClient->connect(advDevice)) {
+    if (!pClient->connect(address)) {
       Serial.println("Failed to connect");
       return false;
     }
@@ -166,37 +250,108 @@ bool connectToServer() {
   Serial.println(pClient->getRssi());
 
   /* Now we can read/write the charateristics of the services we
-   * are interested in
+   * are interested in. Take their handles from the cache if the
+   * peer's Database Hash still matches, otherwise discover them.
    */
-  pSvc = pClient->getService(UUID_LINK_LOSS_SERVICE);
-  if (pSvc) { // Make sure it's not null
-    pChr = pSvc->getCharacteristic(UUID_ALERT_LEVEL_CHARACTERISTIC);
+  uint32_t connectedTime = millis();
+  uint16_t connHandle = pClient->getConnId();
+  GattHandles handles;
+  bool hit = gattCache.load(address, handles);
+  bool cached = hit && gattCheckHash(connHandle, handles);
+
+  if (!cached) {
+    if (hit) {
+      Serial.println("Database hash changed");
+      invalidate(address);
+      pClient->deleteServices();
+    }
+    if (!gattDiscover(pClient, UUID_LINK_LOSS_SERVICE,
+                      UUID_ALERT_LEVEL_CHARACTERISTIC, handles)) {
+      Serial.println("Alert Level characteristic not found.");
+      connPolicy.start(pClient, CONN_PROFILE_IDLE);
+      return true;
+    }
+    gattCache.save(address, handles);
   }
 
-  if (pChr) { // Make sure it's not null
-
-    // Write new alert level
-    alert_level = 1; // Mild Alert
-    pChr->writeValue(&alert_level, 1, true);
-
-    // Read alert level
-    alert_level = pChr->readValue<uint8_t>();
+  // Get indications of Service Changed.
+  subscriptions.add(connHandle, handles);
+  gattSubscribe(connHandle, handles);
+
+  // Write new alert level
+  alert_level = 1; // Mild Alert
+  if (gattWrite(connHandle, handles.value, &alert_level, 1) != 0) {
+    Serial.println("Writing alert level failed");
+    // The cached handles may be stale.
+    if (cached) {
+      invalidate(address);
+    }
+    pClient->disconnect();
+    return false;
+  }
+  Serial.printf("Alert level written %u ms after connecting (%s)\n",
+                (unsigned)(millis() - connectedTime),
+                cached ? "cached handles" : "discovery");
+
+  // Read alert level
+  size_t length = 1;
+  if (gattRead(connHandle, handles.value, &alert_level, length) ==
+      0) {
     Serial.print("Alert level: ");
     Serial.println(alert_level);
-
-  } else {
-    Serial.println("Alert Level characteristic not found.");
   }
 
+  // Only link loss and path loss matter from now on.
+  connPolicy.start(pClient, CONN_PROFILE_IDLE);
+  pathLoss.start(pClient,
+                 immediateAlertHandle(pClient, address, cached));
+
   Serial.println("Done with this device!");
   return true;
 }
 
+/* Watch for Service Changed indications of connected peers, called
+ * for all GAP events on the NimBLE host task.
+ */
+int gapEventHandler(ble_gap_event *event, void *arg) {
+  switch (event->type) {
+  case BLE_GAP_EVENT_NOTIFY_RX:
+    if (subscriptions.match(event->notify_rx.conn_handle,
+                            event->notify_rx.attr_handle) ==
+        GATT_MATCH_SERVICE_CHANGED) {
+      dispatcher.post(
+          EVENT_SERVICE_CHANGED,
+          NimBLEDevice::getClientByID(event->notify_rx.conn_handle));
+    }
+    break;
+  case BLE_GAP_EVENT_DISCONNECT:
+    subscriptions.remove(event->disconnect.conn.conn_handle);
+    break;
+  }
+  return 0;
+}
+
+// (Re)start the scan, filtered while a reporter is lost.
+void startScan() {
+  NimBLEScan *pScan = NimBLEDevice::getScan();
+
+  pScan->stop();
+  fastReconnect.configure(pScan);
+  pScan->start(scanTime, nullptr);
+  if (PRESENCE_MODE) {
+    presence.resume(millis());
+  }
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println("Starting NimBLE Client");
 
+  dispatcher.begin();
+  gattCache.begin();
+  alertCache.begin();
   NimBLEDevice::init("");
+  NimBLEDevice::setCustomGapHandler(gapEventHandler);
 
   /* Set security properties:
    * No bonding, no MITM protection, secure pairing
@@ -208,26 +363,127 @@ void setup() {
 
   pScan->setAdvertisedDeviceCallbacks(
       new AdvertisedDeviceCallbacks());
-  pScan->setInterval(60);
-  pScan->setWindow(30);
-  pScan->setActiveScan(true);
-  pScan->start(scanTime, nullptr);
+  if (PRESENCE_MODE) {
+    /* Report every advertisement, without scan requests that cost the
+     * tags current, and without keeping the results.
+     */
+    pScan->setActiveScan(false);
+    pScan->setDuplicateFilter(false);
+    pScan->setMaxResults(0);
+  } else {
+    pScan->setActiveScan(true);
+  }
+  startScan();
+}
+
+void handleEvent(const Event &event) {
+  switch (event.type) {
+  case EVENT_FOUND:
+    Serial.print("Found Link Loss Service: ");
+    Serial.println(event.address.toString().c_str());
+    // Found a device we want to connect to, do it now
+    if (connectToServer(event.address)) {
+      Serial.println("Success, scanning for more...");
+      presence.connected(event.address, true);
+    } else {
+      Serial.println("Failed to connect, starting scan...");
+      presence.connected(event.address, false);
+    }
+    startScan();
+    break;
+  case EVENT_CONNECTED:
+    Serial.println("Connected");
+    // Back to an unfiltered scan if it was the last lost reporter.
+    if (fastReconnect.connected(event.address, event.timestamp)) {
+      startScan();
+    }
+    break;
+  case EVENT_SERVICE_CHANGED:
+    // Discover the handles again on the next connection.
+    Serial.print(event.address.toString().c_str());
+    Serial.println(" Service changed");
+    invalidate(event.address);
+    break;
+  case EVENT_DISCONNECTED:
+    connPolicy.disconnected(event.client);
+    pathLoss.disconnected(event.client);
+    if (presence.disconnected(event.address, event.timestamp)) {
+      Serial.print(event.address.toString().c_str());
+      Serial.println(" Released - back in range");
+      startScan();
+      break;
+    }
+    Serial.print(event.address.toString().c_str());
+    Serial.println(
+        " Disconnected - Alerting on link loss and starting scan");
+    alert_on_link_loss();
+    fastReconnect.lost(event.address, event.timestamp);
+    startScan();
+    break;
+  default:
+    break;
+  }
+}
+
+// Disconnect from the tags that are back in range.
+void releaseTags() {
+  for (NimBLEClient *pClient : *NimBLEDevice::getClientList()) {
+    if (pClient->isConnected() &&
+        pathLoss.above(pClient, PRESENCE_EDGE_RSSI +
+                                    PRESENCE_EDGE_HYSTERESIS) &&
+        presence.release(pClient->getPeerAddress())) {
+      pClient->disconnect();
+    }
+  }
 }
 
 void loop() {
-  // Loop here until we find a device we want to connect to
-  while (!doConnect) {
-    delay(1);
+  /* Block until the next event, policy update, RSSI sample or
+   * statistics.
+   */
+  uint32_t elapsed = millis() - lastStats;
+  uint32_t timeout =
+      elapsed < STATS_INTERVAL ? STATS_INTERVAL - elapsed : 0;
+  uint32_t policyTimeout = connPolicy.nextUpdate(millis());
+  if (policyTimeout < timeout) {
+    timeout = policyTimeout;
+  }
+  uint32_t sampleTimeout = pathLoss.nextUpdate(millis());
+  if (sampleTimeout < timeout) {
+    timeout = sampleTimeout;
+  }
+  if (PRESENCE_MODE) {
+    uint32_t presenceTimeout = presence.nextUpdate(millis());
+    if (presenceTimeout < timeout) {
+      timeout = presenceTimeout;
+    }
+  }
+
+  Event event;
+  if (dispatcher.wait(event, timeout)) {
+    handleEvent(event);
   }
 
-  doConnect = false;
+  connPolicy.update(millis());
+  pathLoss.update(millis());
+  if (PRESENCE_MODE) {
+    presence.update(millis());
+    releaseTags();
+  }
 
-  // Found a device we want to connect to, do it now
-  if (connectToServer()) {
-    Serial.println("Success, scanning for more...");
-  } else {
-    Serial.println("Failed to connect, starting scan...");
+  // Scan without the filter for reporters that didn't come back.
+  if (fastReconnect.expire(millis())) {
+    startScan();
   }
 
-  NimBLEDevice::getScan()->start(scanTime, nullptr);
+  if (millis() - lastStats >= STATS_INTERVAL) {
+    lastStats = millis();
+    connPolicy.print();
+    pathLoss.print();
+    if (PRESENCE_MODE) {
+      presence.print();
+    }
+    fastReconnect.printStats();
+    dispatcher.printStats();
+  }
 }
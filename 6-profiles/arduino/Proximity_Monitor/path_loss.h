@@ -0,0 +1,247 @@
+/** Alert when a connected Proximity Reporter drifts away.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The Proximity Profile lets the monitor alert on path loss, before
+ * the link is lost. update() reads the RSSI of each connection from
+ * the controller and smooths it with an exponential moving average in
+ * fixed point, 1/16 dB per step: each sample moves the average by
+ * 1/2^PATH_LOSS_FILTER_SHIFT of the difference. Without the Tx Power
+ * Level of the reporter the path loss isn't known, but it only
+ * differs from -RSSI by a constant, so the thresholds are in dBm.
+ *
+ * When the average falls below PATH_LOSS_ALERT_RSSI, the reporter is
+ * told to alert with a write to its Immediate Alert service. It's
+ * told to stop when the average rises above PATH_LOSS_CLEAR_RSSI. The
+ * gap between both thresholds keeps a reporter at the edge from
+ * toggling its alert with every sample.
+ *
+ * Reading the RSSI is a local HCI command that doesn't cost the
+ * reporter anything, but the monitor has to wake up for it. The
+ * sampling period starts at PATH_LOSS_PERIOD_MIN and doubles for
+ * every PATH_LOSS_MARGIN_STEP dB that the average is above the alert
+ * threshold, up to PATH_LOSS_PERIOD_MAX. A close reporter is sampled
+ * rarely, one that drifts away more often, and one that is alerting
+ * at the shortest period. The controller only updates the RSSI at
+ * connection events that the reporter answers, so a shorter period
+ * than the idle profile of conn_policy.h with its peripheral latency
+ * would only repeat samples.
+ */
+#ifndef PATH_LOSS_H_
+#define PATH_LOSS_H_
+
+#include <NimBLEDevice.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Thresholds of the smoothed RSSI, in dBm
+#define PATH_LOSS_ALERT_RSSI -80
+#define PATH_LOSS_CLEAR_RSSI -72
+// Weight of a new sample: 1/2^PATH_LOSS_FILTER_SHIFT
+#define PATH_LOSS_FILTER_SHIFT 2
+// Sampling periods, in ms
+#define PATH_LOSS_PERIOD_MIN 1000
+#define PATH_LOSS_PERIOD_MAX 8000
+// dB above the alert threshold that double the sampling period
+#define PATH_LOSS_MARGIN_STEP 6
+// Immediate Alert levels written to the reporter
+#define PATH_LOSS_NO_ALERT 0
+#define PATH_LOSS_HIGH_ALERT 2
+
+// N is the number of connections.
+template <size_t N> class PathLoss {
+public:
+  PathLoss() : sampleCount(0), errorCount(0), alertCount(0) {
+    for (size_t i = 0; i < N; i++) {
+      slots[i].client = nullptr;
+    }
+  }
+
+  /* Start monitoring a connected client. alertHandle is the value
+   * handle of its Immediate Alert Level characteristic, or 0 if it
+   * has none, then the alerts are only logged.
+   */
+  void start(NimBLEClient *pClient, uint16_t alertHandle) {
+    Slot *slot = find(pClient);
+    if (slot == nullptr) {
+      slot = find(nullptr);
+      if (slot == nullptr) {
+        return;
+      }
+    }
+    slot->client = pClient;
+    slot->connHandle = pClient->getConnId();
+    slot->alertHandle = alertHandle;
+    slot->address = pClient->getPeerAddress();
+    slot->samples = 0;
+    slot->alerting = false;
+    slot->period = PATH_LOSS_PERIOD_MIN;
+    slot->nextSample = millis();
+  }
+
+  // A client was disconnected.
+  void disconnected(NimBLEClient *pClient) {
+    Slot *slot = find(pClient);
+    if (slot != nullptr) {
+      slot->client = nullptr;
+    }
+  }
+
+  // Sample the RSSI of each connection that is due.
+  void update(uint32_t now) {
+    for (size_t i = 0; i < N; i++) {
+      Slot &slot = slots[i];
+      if (slot.client == nullptr ||
+          (int32_t)(now - slot.nextSample) < 0) {
+        continue;
+      }
+      sample(slot);
+      slot.nextSample = now + slot.period;
+    }
+  }
+
+  /* Time until the next update() in ms, or UINT32_MAX if there's no
+   * connection to sample.
+   */
+  uint32_t nextUpdate(uint32_t now) const {
+    uint32_t next = UINT32_MAX;
+
+    for (size_t i = 0; i < N; i++) {
+      if (slots[i].client == nullptr) {
+        continue;
+      }
+      int32_t left = (int32_t)(slots[i].nextSample - now);
+      if (left <= 0) {
+        return 0;
+      }
+      if ((uint32_t)left < next) {
+        next = left;
+      }
+    }
+    return next;
+  }
+
+  // Whether the smoothed RSSI of a client is above rssi dBm.
+  bool above(NimBLEClient *pClient, int rssi) {
+    const Slot *slot = find(pClient);
+    return slot != nullptr && slot->samples > 0 &&
+           slot->rssi > rssi * 16;
+  }
+
+  // Print the state of each connection and reset the statistics.
+  void print() {
+    for (size_t i = 0; i < N; i++) {
+      const Slot &slot = slots[i];
+      if (slot.client != nullptr && slot.samples > 0) {
+        Serial.printf("%s: RSSI %d dBm, sampled every %u ms%s\n",
+                      slot.address.toString().c_str(),
+                      (int)(slot.rssi / 16), (unsigned)slot.period,
+                      slot.alerting ? ", alerting" : "");
+      }
+    }
+    Serial.printf("Path loss: %u RSSI samples, %u errors, %u "
+                  "alerts\n",
+                  (unsigned)sampleCount, (unsigned)errorCount,
+                  (unsigned)alertCount);
+    sampleCount = 0;
+    errorCount = 0;
+    alertCount = 0;
+  }
+
+private:
+  struct Slot {
+    NimBLEClient *client;
+    uint16_t connHandle;
+    uint16_t alertHandle; // Immediate Alert Level, 0 if none
+    NimBLEAddress address;
+    int32_t rssi; // Smoothed, 1/16 dBm
+    uint32_t samples;
+    bool alerting;
+    uint32_t period;     // ms
+    uint32_t nextSample; // millis()
+  };
+
+  Slot slots[N];
+  uint32_t sampleCount;
+  uint32_t errorCount;
+  uint32_t alertCount;
+
+  Slot *find(NimBLEClient *pClient) {
+    for (size_t i = 0; i < N; i++) {
+      if (slots[i].client == pClient) {
+        return &slots[i];
+      }
+    }
+    return nullptr;
+  }
+
+  void sample(Slot &slot) {
+    int8_t rssi;
+
+    // Fails if the connection was lost and the event is still queued.
+    if (ble_gap_conn_rssi(slot.connHandle, &rssi) != 0) {
+      errorCount++;
+      return;
+    }
+    sampleCount++;
+
+    // The first sample starts the average. Shifts are arithmetic.
+    if (slot.samples++ == 0) {
+      slot.rssi = (int32_t)rssi * 16;
+    } else {
+      slot.rssi += ((int32_t)rssi * 16 - slot.rssi) >>
+                   PATH_LOSS_FILTER_SHIFT;
+    }
+
+    if (!slot.alerting && slot.rssi < PATH_LOSS_ALERT_RSSI * 16) {
+      alert(slot, true);
+    } else if (slot.alerting &&
+               slot.rssi > PATH_LOSS_CLEAR_RSSI * 16) {
+      alert(slot, false);
+    }
+    slot.period = period(slot);
+  }
+
+  // Sampling period for the smoothed RSSI of a connection.
+  static uint32_t period(const Slot &slot) {
+    int32_t margin = slot.rssi / 16 - PATH_LOSS_ALERT_RSSI;
+    uint32_t period = PATH_LOSS_PERIOD_MIN;
+
+    if (slot.alerting) {
+      return period;
+    }
+    while (margin >= PATH_LOSS_MARGIN_STEP &&
+           period < PATH_LOSS_PERIOD_MAX) {
+      period *= 2;
+      margin -= PATH_LOSS_MARGIN_STEP;
+    }
+    return period < PATH_LOSS_PERIOD_MAX ? period
+                                         : PATH_LOSS_PERIOD_MAX;
+  }
+
+  /* Tell the reporter to start or stop alerting. The Immediate Alert
+   * Level only supports a write without response.
+   */
+  void alert(Slot &slot, bool on) {
+    uint8_t level = on ? PATH_LOSS_HIGH_ALERT : PATH_LOSS_NO_ALERT;
+
+    slot.alerting = on;
+    if (on) {
+      alertCount++;
+    }
+    Serial.printf("%s: RSSI %d dBm, %s\n",
+                  slot.address.toString().c_str(),
+                  (int)(slot.rssi / 16),
+                  on ? "path loss alert" : "back in range");
+    if (slot.alertHandle != 0 &&
+        ble_gattc_write_no_rsp_flat(slot.connHandle,
+                                    slot.alertHandle, &level,
+                                    sizeof(level)) != 0) {
+      Serial.println("Writing immediate alert level failed");
+    }
+  }
+};
+
+#endif /* PATH_LOSS_H_ */
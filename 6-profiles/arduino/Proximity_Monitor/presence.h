@@ -0,0 +1,475 @@
+/** Track the presence of tags from their advertisements.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * A connection per tag limits the monitor to NIMBLE_MAX_CONNECTIONS
+ * tags. Instead, the presence table keeps the last advertisement of
+ * each tag that advertises the Link Loss service: when it was seen,
+ * its RSSI smoothed like in path_loss.h, and the shortest time
+ * between two of its advertisements, which is close to its
+ * advertising interval. A tag that isn't seen for
+ * PRESENCE_MISSED_INTERVALS of those intervals is declared lost.
+ *
+ * The table uses open addressing with linear probing, keyed by
+ * address and address type, like device_table.h of
+ * NimBLE_Scan_Continuous. It has PRESENCE_TABLE_SIZE slots, of which
+ * at most 3/4 are used, so a lookup only probes a few slots. Entries
+ * are never removed, so the probe sequences don't change. A new tag
+ * takes an empty slot, or, when the table is full, the slot of a lost
+ * tag on its probe sequence. Otherwise it isn't tracked, and counted
+ * as an overflow. The lookup time is measured, together with the
+ * rate of advertisement reports. presence_bench in 6-profiles/host
+ * simulates tags on a PC: the 1024 slots track 768 tags.
+ *
+ * Beyond the table size, the number of tags that one monitor can
+ * track is limited by the advertisement reports that the controller
+ * and host can handle. When that limit is reached, reports get lost,
+ * and the histogram of the time between advertisements of a tag
+ * shifts to multiples of the advertising interval.
+ *
+ * The scan stops while the monitor connects to a tag, for as long as
+ * the connection setup takes, which can be more than the loss
+ * deadline of a fast tag. pause() and resume() mark that time, and
+ * resume() moves the last advertisement of each present tag forward
+ * by it, so a tag is only lost after missing its advertisements
+ * while the monitor scans. A gap between advertisements across a
+ * pause doesn't count as a time between advertisements either.
+ *
+ * The monitor only connects to a tag near the edge of its range, when
+ * its smoothed RSSI drops below PRESENCE_EDGE_RSSI. It writes the
+ * Alert Level of the Link Loss service, so the tag alerts by itself
+ * when it leaves. When the tag comes back above PRESENCE_EDGE_RSSI +
+ * PRESENCE_EDGE_HYSTERESIS, the monitor releases the connection
+ * again, so the connections go to the tags that need them.
+ *
+ * seen() is called from the scan callback on the NimBLE host task,
+ * the other methods from loop(). Only seen() adds tags, so it looks
+ * up a tag without the spinlock, and only holds it while it updates
+ * the one entry. The other methods hold it for each entry they
+ * access.
+ */
+#ifndef PRESENCE_H_
+#define PRESENCE_H_
+
+#include <NimBLEDevice.h>
+#include <freertos/FreeRTOS.h>
+#include <log_histogram.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Slots in the table, a power of two: 3/4 of them can hold a tag
+#define PRESENCE_TABLE_SIZE 1024
+// Advertising intervals without advertisement before a tag is lost
+#define PRESENCE_MISSED_INTERVALS 5
+// Assumed advertising interval until a tag is seen twice, in ms
+#define PRESENCE_DEFAULT_INTERVAL 1000
+// Shortest advertising interval, in ms
+#define PRESENCE_MIN_INTERVAL 20
+// Smoothed RSSI from which the monitor connects to a tag, in dBm
+#define PRESENCE_EDGE_RSSI -75
+// dB above PRESENCE_EDGE_RSSI from which a connection is released
+#define PRESENCE_EDGE_HYSTERESIS 8
+// Time between connection attempts to the same tag, in ms
+#define PRESENCE_CONNECT_RETRY 10000
+// Weight of a new RSSI sample: 1/2^PRESENCE_FILTER_SHIFT
+#define PRESENCE_FILTER_SHIFT 2
+
+enum PresenceState : uint8_t {
+  PRESENCE_FREE,       // Unused entry
+  PRESENCE_PRESENT,    // Advertising
+  PRESENCE_CONNECTING, // Near the edge, the monitor connects
+  PRESENCE_CONNECTED,  // Connected, doesn't advertise
+  PRESENCE_RELEASING,  // Back in range, the monitor disconnects
+  PRESENCE_LOST,       // Missed too many advertisements
+};
+
+struct PresenceTag {
+  uint8_t address[6];
+  uint8_t addressType;
+  uint8_t state;        // PresenceState
+  int16_t rssi;         // Smoothed, 1/16 dBm
+  uint16_t interval;    // Shortest time between advertisements, ms
+  uint32_t lastSeen;    // millis()
+  uint32_t lastConnect; // millis() of the last connection attempt
+};
+
+// 32-bit FNV-1a hash of an address and its type
+static inline uint32_t presenceHash(const uint8_t *address,
+                                    uint8_t addressType) {
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < 6; i++) {
+    hash = (hash ^ address[i]) * 16777619u;
+  }
+  return (hash ^ addressType) * 16777619u;
+}
+
+// N must be a power of two.
+template <size_t N> class PresenceTable {
+  static_assert(N > 0 && (N & (N - 1)) == 0,
+                "Table size must be a power of two");
+
+public:
+  PresenceTable()
+      : lock(portMUX_INITIALIZER_UNLOCKED), used(0), reportCount(0),
+        lookupTotal(0), lookupMax(0), overflowCount(0),
+        returnCount(0), lostCount(0), peak(0), statsStart(0),
+        paused(false), pausedAt(0), resumedAt(0) {
+    memset(tags, 0, sizeof(tags));
+  }
+
+  /* Record an advertisement of a tag, from the scan callback on the
+   * NimBLE host task. Returns true if the monitor should connect to
+   * it now.
+   */
+  bool seen(const NimBLEAddress &address, int rssi, uint32_t now) {
+    uint32_t start = micros();
+    size_t slot = N;
+    size_t i = find(address.getNative(), address.getType(), &slot);
+    bool fresh = i == N;
+    bool connect = false;
+    uint32_t lookup = micros() - start;
+
+    portENTER_CRITICAL(&lock);
+    if (fresh && slot != N) {
+      add(slot, address, now);
+      i = slot;
+    }
+    if (i != N) {
+      connect = record(tags[i], rssi, now, fresh);
+    } else {
+      overflowCount++;
+    }
+    reportCount++;
+    lookupTotal += lookup;
+    if (lookup > lookupMax) {
+      lookupMax = lookup;
+    }
+    portEXIT_CRITICAL(&lock);
+    return connect;
+  }
+
+  /* The connection to a tag near the edge was set up (ok) or failed,
+   * then it's tried again after PRESENCE_CONNECT_RETRY ms.
+   */
+  void connected(const NimBLEAddress &address, bool ok) {
+    portENTER_CRITICAL(&lock);
+    PresenceTag *tag = get(address);
+    if (tag != nullptr && tag->state == PRESENCE_CONNECTING) {
+      tag->state = ok ? PRESENCE_CONNECTED : PRESENCE_PRESENT;
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  /* Mark the connection to a tag that is back in range as released.
+   * Returns false if the tag wasn't connected.
+   */
+  bool release(const NimBLEAddress &address) {
+    bool released = false;
+
+    portENTER_CRITICAL(&lock);
+    PresenceTag *tag = get(address);
+    if (tag != nullptr && tag->state == PRESENCE_CONNECTED) {
+      tag->state = PRESENCE_RELEASING;
+      released = true;
+    }
+    portEXIT_CRITICAL(&lock);
+    return released;
+  }
+
+  /* A tag was disconnected at time. It's present again until it
+   * misses its advertisements. Returns true if the monitor released
+   * the connection, false if the link was lost.
+   */
+  bool disconnected(const NimBLEAddress &address, uint32_t time) {
+    bool released = false;
+
+    portENTER_CRITICAL(&lock);
+    PresenceTag *tag = get(address);
+    if (tag != nullptr && (tag->state == PRESENCE_CONNECTED ||
+                           tag->state == PRESENCE_RELEASING)) {
+      released = tag->state == PRESENCE_RELEASING;
+      tag->state = PRESENCE_PRESENT;
+      tag->lastSeen = time;
+    }
+    portEXIT_CRITICAL(&lock);
+    return released;
+  }
+
+  // The scan stopped at now, to connect to a tag.
+  void pause(uint32_t now) {
+    portENTER_CRITICAL(&lock);
+    if (!paused) {
+      paused = true;
+      pausedAt = now;
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  /* The scan started again at now. Tags seen before pause() get the
+   * time without scan added to their last advertisement.
+   */
+  void resume(uint32_t now) {
+    portENTER_CRITICAL(&lock);
+    bool wasPaused = paused;
+    uint32_t start = pausedAt;
+    if (paused) {
+      paused = false;
+      resumedAt = now;
+    }
+    portEXIT_CRITICAL(&lock);
+    if (!wasPaused) {
+      return;
+    }
+
+    for (size_t i = 0; i < N; i++) {
+      portENTER_CRITICAL(&lock);
+      if (tags[i].state == PRESENCE_PRESENT &&
+          (int32_t)(start - tags[i].lastSeen) >= 0) {
+        tags[i].lastSeen += now - start;
+      }
+      portEXIT_CRITICAL(&lock);
+    }
+  }
+
+  /* Declare the tags lost that missed PRESENCE_MISSED_INTERVALS
+   * advertisements, and record the time since their last one. Does
+   * nothing while the scan is paused.
+   */
+  void update(uint32_t now) {
+    if (paused) {
+      return;
+    }
+    for (size_t i = 0; i < N; i++) {
+      bool lost = false;
+      uint32_t latency = 0;
+      PresenceTag tag;
+
+      portENTER_CRITICAL(&lock);
+      if (tags[i].state == PRESENCE_PRESENT &&
+          now - tags[i].lastSeen >= deadline(tags[i])) {
+        tags[i].state = PRESENCE_LOST;
+        latency = now - tags[i].lastSeen;
+        detection.add(latency);
+        lostCount++;
+        tag = tags[i];
+        lost = true;
+      }
+      portEXIT_CRITICAL(&lock);
+
+      if (lost) {
+        Serial.printf("%s: lost, %u ms after its last advertisement "
+                      "(interval %u ms)\n",
+                      NimBLEAddress(tag.address, tag.addressType)
+                          .toString()
+                          .c_str(),
+                      (unsigned)latency, (unsigned)tag.interval);
+      }
+    }
+  }
+
+  /* Time until the next tag can be declared lost in ms, or UINT32_MAX
+   * if there are no present tags or the scan is paused.
+   */
+  uint32_t nextUpdate(uint32_t now) {
+    uint32_t next = UINT32_MAX;
+
+    if (paused) {
+      return next;
+    }
+    for (size_t i = 0; i < N; i++) {
+      portENTER_CRITICAL(&lock);
+      if (tags[i].state == PRESENCE_PRESENT) {
+        uint32_t elapsed = now - tags[i].lastSeen;
+        uint32_t limit = deadline(tags[i]);
+        uint32_t left = elapsed < limit ? limit - elapsed : 0;
+        if (left < next) {
+          next = left;
+        }
+      }
+      portEXIT_CRITICAL(&lock);
+    }
+    return next;
+  }
+
+  // Tags in the table, and the most it can hold.
+  size_t size() const { return used; }
+
+  size_t capacity() const { return MAX_ENTRIES; }
+
+  // Since the last print(): tags not tracked, and tags declared lost.
+  uint32_t overflows() const { return overflowCount; }
+
+  uint32_t losses() const { return lostCount; }
+
+  // Print and reset the statistics.
+  void print() {
+    size_t counts[PRESENCE_LOST + 1] = {};
+    LogHistogram<16> gapsCopy;
+    LogHistogram<16> detectionCopy;
+
+    for (size_t i = 0; i < N; i++) {
+      counts[tags[i].state]++;
+    }
+
+    portENTER_CRITICAL(&lock);
+    gapsCopy = gaps;
+    detectionCopy = detection;
+    uint32_t reports = reportCount;
+    uint32_t lookupAvg = reportCount ? lookupTotal / reportCount : 0;
+    uint32_t lookupMaxCopy = lookupMax;
+    uint32_t overflows = overflowCount;
+    uint32_t returns = returnCount;
+    uint32_t lost = lostCount;
+    size_t peakCopy = peak;
+    gaps.reset();
+    detection.reset();
+    reportCount = 0;
+    lookupTotal = 0;
+    lookupMax = 0;
+    overflowCount = 0;
+    returnCount = 0;
+    lostCount = 0;
+    portEXIT_CRITICAL(&lock);
+
+    uint32_t elapsed = millis() - statsStart;
+    statsStart = millis();
+    Serial.printf("Presence: %u present, %u connected, %u lost, %u "
+                  "lost and %u returned since last time\n",
+                  (unsigned)counts[PRESENCE_PRESENT],
+                  (unsigned)(counts[PRESENCE_CONNECTING] +
+                             counts[PRESENCE_CONNECTED] +
+                             counts[PRESENCE_RELEASING]),
+                  (unsigned)counts[PRESENCE_LOST], (unsigned)lost,
+                  (unsigned)returns);
+    Serial.printf("  Table: %u of %u entries used at most, %u bytes "
+                  "each, %u tags not tracked\n",
+                  (unsigned)peakCopy, (unsigned)MAX_ENTRIES,
+                  (unsigned)sizeof(PresenceTag), (unsigned)overflows);
+    Serial.printf("  Reports: %u/s, lookup avg %u us, max %u us\n",
+                  (unsigned)(elapsed ? (uint64_t)reports * 1000 /
+                                           elapsed
+                                     : 0),
+                  (unsigned)lookupAvg, (unsigned)lookupMaxCopy);
+    gapsCopy.print("Time between advertisements", "ms");
+    detectionCopy.print("Loss detected after last advertisement",
+                        "ms");
+  }
+
+private:
+  // Keep the load factor at 3/4 so probe sequences stay short.
+  static const size_t MAX_ENTRIES = N - N / 4;
+
+  portMUX_TYPE lock;
+  PresenceTag tags[N];
+  size_t used; // Only changed by seen()
+  LogHistogram<16> gaps;
+  LogHistogram<16> detection;
+  uint32_t reportCount;
+  uint64_t lookupTotal;
+  uint32_t lookupMax;
+  uint32_t overflowCount;
+  uint32_t returnCount;
+  uint32_t lostCount;
+  size_t peak; // Most entries in use at the same time
+  uint32_t statsStart;
+  // Only changed by pause() and resume() from the scan and loop()
+  bool paused;
+  uint32_t pausedAt;
+  uint32_t resumedAt;
+
+  static uint32_t deadline(const PresenceTag &tag) {
+    return (uint32_t)tag.interval * PRESENCE_MISSED_INTERVALS;
+  }
+
+  /* Find the slot of a tag, or return N. Then slot, if not nullptr,
+   * is set to where a new tag goes: the empty slot at the end of the
+   * probe sequence, or if the table is full, the first slot of a lost
+   * tag on it, or N. Only seen() changes the addresses in the table,
+   * so it can call this without the lock.
+   */
+  size_t find(const uint8_t *address, uint8_t addressType,
+              size_t *slot) const {
+    size_t i = presenceHash(address, addressType) & (N - 1);
+
+    while (tags[i].state != PRESENCE_FREE) {
+      if (tags[i].addressType == addressType &&
+          memcmp(tags[i].address, address, 6) == 0) {
+        return i;
+      }
+      if (slot != nullptr && *slot == N &&
+          tags[i].state == PRESENCE_LOST) {
+        *slot = i;
+      }
+      i = (i + 1) & (N - 1);
+    }
+    if (slot != nullptr && used < MAX_ENTRIES) {
+      *slot = i;
+    }
+    return N;
+  }
+
+  // Look up a tag from loop(), with the lock held.
+  PresenceTag *get(const NimBLEAddress &address) {
+    size_t i = find(address.getNative(), address.getType(), nullptr);
+    return i == N ? nullptr : &tags[i];
+  }
+
+  /* Put a new tag in the slot that find() returned, with the lock
+   * held. Only seen() changes the state of a free or lost tag.
+   */
+  void add(size_t slot, const NimBLEAddress &address, uint32_t now) {
+    PresenceTag &tag = tags[slot];
+
+    if (tag.state == PRESENCE_FREE && ++used > peak) {
+      peak = used;
+    }
+    memcpy(tag.address, address.getNative(), 6);
+    tag.addressType = address.getType();
+    tag.state = PRESENCE_PRESENT;
+    tag.interval = PRESENCE_DEFAULT_INTERVAL;
+    tag.lastConnect = now - PRESENCE_CONNECT_RETRY;
+  }
+
+  /* Update a tag with an advertisement, the first one if fresh.
+   * Returns true if it's near the edge and the monitor should
+   * connect.
+   */
+  bool record(PresenceTag &tag, int rssi, uint32_t now,
+              bool fresh) {
+    if (fresh) {
+      tag.rssi = rssi * 16;
+    } else {
+      uint32_t gap = now - tag.lastSeen;
+      // A gap across a pause of the scan says nothing.
+      if ((int32_t)(tag.lastSeen - resumedAt) >= 0) {
+        if (tag.state == PRESENCE_PRESENT) {
+          gaps.add(gap);
+        }
+        if (gap >= PRESENCE_MIN_INTERVAL && gap < tag.interval) {
+          tag.interval = gap;
+        }
+      }
+      tag.rssi += (rssi * 16 - tag.rssi) >> PRESENCE_FILTER_SHIFT;
+    }
+    if (tag.state == PRESENCE_LOST) {
+      tag.state = PRESENCE_PRESENT;
+      returnCount++;
+    }
+    tag.lastSeen = now;
+
+    if (tag.state == PRESENCE_PRESENT &&
+        tag.rssi < PRESENCE_EDGE_RSSI * 16 &&
+        now - tag.lastConnect >= PRESENCE_CONNECT_RETRY) {
+      tag.state = PRESENCE_CONNECTING;
+      tag.lastConnect = now;
+      return true;
+    }
+    return false;
+  }
+};
+
+#endif /* PRESENCE_H_ */
@@ -0,0 +1,291 @@
+/** Measure how many tags the presence table of Proximity_Monitor
+ * tracks.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * presence.h is compiled against the stand-ins for the Arduino core
+ * and NimBLE-Arduino of the advert_replay harness. A number of
+ * simulated tags advertise at a fixed interval, plus the random
+ * advertising delay of 0-10 ms, for a simulated time. Each report
+ * goes to PresenceTable::seen() as in the sketch's scan callback, and
+ * update() runs every 50 ms as in loop(). A fraction of the reports
+ * can be dropped, like reports that the controller or host misses.
+ *
+ * The scan can also stop for a while every PAUSE_PERIOD ms, like
+ * when the sketch connects to a tag near the edge: reports are lost
+ * and update() doesn't run until the scan restarts, and then it runs
+ * right away, as in loop(). The table is told with pause() and
+ * resume(), unless that's turned off to show what happens without.
+ * Without lost reports, every tag that is declared lost then is a
+ * false loss.
+ *
+ * For each number of tags, it prints how many the table tracks, how
+ * many didn't fit, how many were declared lost while they kept
+ * advertising, and the time of seen() on this host. The capacity is
+ * the largest number of tags that were all tracked. The times only
+ * compare table implementations with each other: the ESP32 is much
+ * slower, and the number of reports its controller delivers isn't
+ * simulated.
+ */
+#include <algorithm>
+#include <getopt.h>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "Arduino.h"
+#include "NimBLEDevice.h"
+#include "presence.h"
+
+// Same as Proximity_Monitor.ino
+typedef PresenceTable<PRESENCE_TABLE_SIZE> Table;
+
+// Time between calls of update(), in ms
+#define UPDATE_PERIOD 50
+// Largest random advertising delay, in ms
+#define ADV_DELAY 10
+// Time between the starts of scan pauses, in ms
+#define PAUSE_PERIOD PRESENCE_CONNECT_RETRY
+
+HostSerial Serial;
+
+struct Tag {
+  NimBLEAddress address;
+  int8_t rssi;
+};
+
+struct Advert {
+  uint32_t time;
+  size_t tag;
+
+  bool operator>(const Advert &other) const {
+    return time > other.time;
+  }
+};
+
+struct Result {
+  size_t tags;
+  size_t tracked;
+  uint32_t overflows;
+  uint32_t losses;
+  uint32_t reports;
+  uint32_t p50; // Time of seen(), in ns
+  uint32_t p99;
+  uint32_t max;
+};
+
+static uint32_t rngState;
+
+// xorshift32, so runs with the same seed are identical
+static uint32_t random32() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -t, --tags N        Only simulate N tags (sweep from 64 "
+          "to 2048)\n"
+          "  -i, --interval N    Advertising interval in ms (1000)\n"
+          "  -d, --duration N    Simulated time in s (60)\n"
+          "  -l, --loss N        Percentage of reports lost (0)\n"
+          "  -p, --pause N       Stop the scan for N ms every 10 s "
+          "(0)\n"
+          "  -u, --unaware       Don't tell the table about pauses\n"
+          "  -s, --seed N        Seed of the simulation (1)\n",
+          program);
+}
+
+static Result simulate(size_t tagCount, uint32_t interval,
+                       uint32_t duration, uint32_t loss,
+                       uint32_t pause, bool aware) {
+  // The table is too large for the stack.
+  Table *table = new Table();
+  std::vector<Tag> tags(tagCount);
+  std::priority_queue<Advert, std::vector<Advert>,
+                      std::greater<Advert>>
+      adverts;
+  std::vector<uint32_t> times;
+  uint32_t end = duration * 1000;
+  uint32_t nextUpdate = UPDATE_PERIOD;
+  uint32_t pauseStart = pause ? PAUSE_PERIOD / 2 : UINT32_MAX;
+  bool paused = false;
+
+  for (size_t i = 0; i < tagCount; i++) {
+    uint8_t address[6];
+
+    for (int j = 0; j < 6; j++) {
+      address[j] = (uint8_t)random32();
+    }
+    // Above PRESENCE_EDGE_RSSI, so the monitor never connects.
+    tags[i].address = NimBLEAddress(address, random32() % 2);
+    tags[i].rssi = -45 - (int8_t)(random32() % 25);
+    adverts.push(Advert{random32() % interval, i});
+  }
+  times.reserve((size_t)tagCount * (end / interval + 1));
+
+  while (!adverts.empty() && adverts.top().time < end) {
+    Advert advert = adverts.top();
+    adverts.pop();
+    adverts.push(Advert{advert.time + interval +
+                            random32() % (ADV_DELAY + 1),
+                        advert.tag});
+
+    // Pauses and calls of update() up to this advertisement
+    for (;;) {
+      if (!paused && pauseStart <= advert.time &&
+          pauseStart < nextUpdate) {
+        if (aware) {
+          table->pause(pauseStart);
+        }
+        paused = true;
+      } else if (paused && pauseStart + pause <= advert.time) {
+        uint32_t restart = pauseStart + pause;
+        if (aware) {
+          table->resume(restart);
+        }
+        table->update(restart);
+        paused = false;
+        pauseStart += PAUSE_PERIOD;
+        nextUpdate = restart + UPDATE_PERIOD;
+      } else if (!paused && nextUpdate <= advert.time) {
+        table->update(nextUpdate);
+        nextUpdate += UPDATE_PERIOD;
+      } else {
+        break;
+      }
+    }
+    if (paused || random32() % 100 < loss) {
+      continue;
+    }
+
+    const Tag &tag = tags[advert.tag];
+    int rssi = tag.rssi + (int)(random32() % 7) - 3;
+    uint64_t start = hostNanos();
+    table->seen(tag.address, rssi, advert.time);
+    times.push_back((uint32_t)(hostNanos() - start));
+  }
+
+  Result result = {tagCount, table->size(), table->overflows(),
+                   table->losses(), (uint32_t)times.size(), 0, 0, 0};
+  if (!times.empty()) {
+    std::sort(times.begin(), times.end());
+    result.p50 = times[(times.size() - 1) / 2];
+    result.p99 = times[(times.size() - 1) * 99 / 100];
+    result.max = times.back();
+  }
+  delete table;
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"tags", required_argument, nullptr, 't'},
+      {"interval", required_argument, nullptr, 'i'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"loss", required_argument, nullptr, 'l'},
+      {"pause", required_argument, nullptr, 'p'},
+      {"unaware", no_argument, nullptr, 'u'},
+      {"seed", required_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+  static const size_t sweep[] = {64,  128, 256,  512,  640,
+                                 768, 896, 1024, 2048};
+  unsigned long tagCount = 0;
+  unsigned long interval = 1000;
+  unsigned long duration = 60;
+  unsigned long loss = 0;
+  unsigned long pause = 0;
+  bool aware = true;
+  unsigned long seed = 1;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "t:i:d:l:p:us:", options,
+                               nullptr)) != -1) {
+    switch (option) {
+    case 't':
+      tagCount = strtoul(optarg, nullptr, 0);
+      break;
+    case 'i':
+      interval = strtoul(optarg, nullptr, 0);
+      break;
+    case 'd':
+      duration = strtoul(optarg, nullptr, 0);
+      break;
+    case 'l':
+      loss = strtoul(optarg, nullptr, 0);
+      break;
+    case 'p':
+      pause = strtoul(optarg, nullptr, 0);
+      break;
+    case 'u':
+      aware = false;
+      break;
+    case 's':
+      seed = strtoul(optarg, nullptr, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (interval < PRESENCE_MIN_INTERVAL || duration == 0 ||
+      loss >= 100 || pause >= PAUSE_PERIOD) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  rngState = seed ? seed : 1;
+
+  std::vector<size_t> counts;
+  if (tagCount) {
+    counts.push_back(tagCount);
+  } else {
+    counts.assign(sweep, sweep + sizeof(sweep) / sizeof(sweep[0]));
+  }
+
+  printf("Tags advertising every %lu ms for %lu s, %lu%% of reports "
+         "lost, table of %u entries\n",
+         interval, duration, loss, (unsigned)PRESENCE_TABLE_SIZE);
+  if (pause) {
+    printf("Scan paused for %lu ms every %u ms, %s\n", pause,
+           (unsigned)PAUSE_PERIOD,
+           aware ? "with pause() and resume()" : "table unaware");
+  }
+  printf("%6s %8s %9s %6s %9s %22s\n", "Tags", "Tracked", "Overflows",
+         "Lost", "Reports", "seen() p50/p99/max ns");
+
+  size_t capacity = 0;
+  uint32_t falseLosses = 0;
+  for (size_t count : counts) {
+    Result r =
+        simulate(count, interval, duration, loss, pause, aware);
+    char times[32];
+
+    snprintf(times, sizeof(times), "%u/%u/%u", (unsigned)r.p50,
+             (unsigned)r.p99, (unsigned)r.max);
+    printf("%6zu %8zu %9u %6u %9u %22s\n", r.tags, r.tracked,
+           (unsigned)r.overflows, (unsigned)r.losses,
+           (unsigned)r.reports, times);
+    if (r.tracked == r.tags && r.overflows == 0 &&
+        r.tags > capacity) {
+      capacity = r.tags;
+    }
+    if (loss == 0) {
+      falseLosses += r.losses;
+    }
+  }
+  printf("Capacity: %zu tags tracked\n", capacity);
+  if (pause && aware && falseLosses > 0) {
+    printf("%u tags lost during scan pauses\n",
+           (unsigned)falseLosses);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
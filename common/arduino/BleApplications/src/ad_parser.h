@@ -0,0 +1,214 @@
+/** Zero-copy parser for BLE advertising data.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The parser walks the AD structures of a raw advertising payload in
+ * place. All results are views (pointer + length) into the payload,
+ * so they are only valid as long as the payload itself. Nothing is
+ * allocated or copied.
+ */
+#ifndef AD_PARSER_H_
+#define AD_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// AD types, see the Bluetooth Assigned Numbers document
+#define AD_TYPE_FLAGS 0x01
+#define AD_TYPE_UUID16_INCOMPLETE 0x02
+#define AD_TYPE_UUID16_COMPLETE 0x03
+#define AD_TYPE_NAME_SHORT 0x08
+#define AD_TYPE_NAME_COMPLETE 0x09
+#define AD_TYPE_TX_POWER 0x0a
+#define AD_TYPE_SERVICE_DATA16 0x16
+#define AD_TYPE_MANUFACTURER_DATA 0xff
+
+// One AD structure: its type and the data following the type byte.
+struct AdStructure {
+  uint8_t type;
+  const uint8_t *data;
+  uint8_t length;
+};
+
+// Manufacturer-specific data, without the company ID.
+struct ManufacturerData {
+  uint16_t companyId;
+  const uint8_t *data;
+  uint8_t length;
+};
+
+// Service data for a 16-bit service UUID, without the UUID.
+struct ServiceData16 {
+  uint16_t uuid;
+  const uint8_t *data;
+  uint8_t length;
+};
+
+// Local name, not null-terminated.
+struct LocalName {
+  const char *name;
+  uint8_t length;
+};
+
+// List of 16-bit service UUIDs.
+struct Uuid16List {
+  const uint8_t *data;
+  uint8_t count;
+
+  uint16_t at(uint8_t i) const {
+    return (uint16_t)(data[2 * i] | (data[2 * i + 1] << 8));
+  }
+
+  bool contains(uint16_t uuid) const {
+    for (uint8_t i = 0; i < count; i++) {
+      if (at(i) == uuid) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+class AdParser {
+public:
+  AdParser(const uint8_t *payload, size_t length)
+      : payload(payload), length(length), offset(0) {}
+
+  // Start walking the payload from the first AD structure again.
+  void rewind() { offset = 0; }
+
+  /* Get the next AD structure. Returns false at the end of the
+   * payload or when the remaining bytes are malformed.
+   */
+  bool next(AdStructure &ad) {
+    if (offset >= length) {
+      return false;
+    }
+
+    uint8_t adLength = payload[offset];
+
+    // A zero length marks early termination of the payload.
+    if (adLength == 0 || offset + 1 + adLength > length) {
+      offset = length;
+      return false;
+    }
+
+    ad.type = payload[offset + 1];
+    ad.data = &payload[offset + 2];
+    ad.length = adLength - 1;
+    offset += 1 + adLength;
+    return true;
+  }
+
+  // Find the first AD structure with the given type.
+  bool find(uint8_t type, AdStructure &ad) {
+    rewind();
+    while (next(ad)) {
+      if (ad.type == type) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool getFlags(uint8_t &flags) {
+    AdStructure ad;
+    if (!find(AD_TYPE_FLAGS, ad) || ad.length < 1) {
+      return false;
+    }
+    flags = ad.data[0];
+    return true;
+  }
+
+  bool getTxPower(int8_t &txPower) {
+    AdStructure ad;
+    if (!find(AD_TYPE_TX_POWER, ad) || ad.length < 1) {
+      return false;
+    }
+    txPower = (int8_t)ad.data[0];
+    return true;
+  }
+
+  bool getName(LocalName &name) {
+    AdStructure ad;
+    if (!find(AD_TYPE_NAME_COMPLETE, ad) &&
+        !find(AD_TYPE_NAME_SHORT, ad)) {
+      return false;
+    }
+    name.name = (const char *)ad.data;
+    name.length = ad.length;
+    return true;
+  }
+
+  bool getManufacturerData(ManufacturerData &manufacturerData) {
+    AdStructure ad;
+    if (!find(AD_TYPE_MANUFACTURER_DATA, ad) || ad.length < 2) {
+      return false;
+    }
+    return toManufacturerData(ad, manufacturerData);
+  }
+
+  // Service data can occur multiple times, so look for the UUID.
+  bool getServiceData16(uint16_t uuid, ServiceData16 &serviceData) {
+    AdStructure ad;
+    rewind();
+    while (next(ad)) {
+      if (ad.type == AD_TYPE_SERVICE_DATA16 && ad.length >= 2 &&
+          (uint16_t)(ad.data[0] | (ad.data[1] << 8)) == uuid) {
+        serviceData.uuid = uuid;
+        serviceData.data = ad.data + 2;
+        serviceData.length = ad.length - 2;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool getUuid16List(Uuid16List &uuids) {
+    AdStructure ad;
+    if (!find(AD_TYPE_UUID16_COMPLETE, ad) &&
+        !find(AD_TYPE_UUID16_INCOMPLETE, ad)) {
+      return false;
+    }
+    uuids.data = ad.data;
+    uuids.count = ad.length / 2;
+    return true;
+  }
+
+  // Check whether the payload advertises a 16-bit service UUID.
+  bool isAdvertisingService(uint16_t uuid) {
+    AdStructure ad;
+    rewind();
+    while (next(ad)) {
+      if (ad.type == AD_TYPE_UUID16_COMPLETE ||
+          ad.type == AD_TYPE_UUID16_INCOMPLETE) {
+        Uuid16List uuids = {ad.data, (uint8_t)(ad.length / 2)};
+        if (uuids.contains(uuid)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  static bool toManufacturerData(const AdStructure &ad,
+                                 ManufacturerData &manufacturerData) {
+    if (ad.type != AD_TYPE_MANUFACTURER_DATA || ad.length < 2) {
+      return false;
+    }
+    manufacturerData.companyId =
+        (uint16_t)(ad.data[0] | (ad.data[1] << 8));
+    manufacturerData.data = ad.data + 2;
+    manufacturerData.length = ad.length - 2;
+    return true;
+  }
+
+private:
+  const uint8_t *payload;
+  size_t length;
+  size_t offset;
+};
+
+#endif /* AD_PARSER_H_ */
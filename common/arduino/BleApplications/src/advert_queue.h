@@ -0,0 +1,49 @@
+/** Queue advertisements from the scan callback.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The scanner sketches all copy the advertisements they're
+ * interested in from onResult() into an AdvertRing, and handle them
+ * in loop(). This is the copy that the scan callback does on the
+ * NimBLE host task.
+ */
+#ifndef ADVERT_QUEUE_H_
+#define ADVERT_QUEUE_H_
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "advert_ring.h"
+
+/* Copy an advertisement into the ring, if there's room. Otherwise
+ * the ring counts it as dropped. Payloads longer than
+ * ADVERT_MAX_PAYLOAD are truncated.
+ */
+template <size_t N>
+void queueAdvert(AdvertRing<N> &ring,
+                 NimBLEAdvertisedDevice *advertisedDevice) {
+  AdvertRecord *record = ring.reserve();
+  if (record == nullptr) {
+    return;
+  }
+
+  size_t length = advertisedDevice->getPayloadLength();
+  if (length > ADVERT_MAX_PAYLOAD) {
+    length = ADVERT_MAX_PAYLOAD;
+  }
+
+  record->timestamp = millis();
+  memcpy(record->address, advertisedDevice->getAddress().getNative(),
+         6);
+  record->addressType = advertisedDevice->getAddressType();
+  record->rssi = advertisedDevice->getRSSI();
+  record->length = length;
+  memcpy(record->payload, advertisedDevice->getPayload(), length);
+  ring.commit();
+}
+
+#endif /* ADVERT_QUEUE_H_ */
@@ -0,0 +1,103 @@
+/** Lock-free single-producer/single-consumer ring of advertisements.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The scan callback runs on the NimBLE host task and is the only
+ * producer. loop() is the only consumer. Both sides work on
+ * fixed-size records in place, so nothing is allocated.
+ */
+#ifndef ADVERT_RING_H_
+#define ADVERT_RING_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Advertising data and scan response data, 31 bytes each
+#define ADVERT_MAX_PAYLOAD 62
+
+struct AdvertRecord {
+  uint32_t timestamp; // millis() when the advertisement was received
+  uint8_t address[6]; // Little-endian, as on air
+  uint8_t addressType;
+  int8_t rssi;
+  uint8_t length;
+  uint8_t payload[ADVERT_MAX_PAYLOAD];
+};
+
+// N must be a power of two.
+template <size_t N> class AdvertRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0,
+                "Ring size must be a power of two");
+
+public:
+  AdvertRing() : head(0), tail(0), dropCount(0), highWaterMark(0) {}
+
+  /* Producer: get a free record to fill in, or nullptr if the ring is
+   * full. In that case the advertisement is counted as dropped. Call
+   * commit() after filling in the record.
+   */
+  AdvertRecord *reserve() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= N) {
+      dropCount.store(dropCount.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &records[h & (N - 1)];
+  }
+
+  // Producer: publish the record returned by reserve().
+  void commit() {
+    uint32_t h = head.load(std::memory_order_relaxed) + 1;
+    head.store(h, std::memory_order_release);
+
+    uint32_t used = h - tail.load(std::memory_order_relaxed);
+    if (used > highWaterMark.load(std::memory_order_relaxed)) {
+      highWaterMark.store(used, std::memory_order_relaxed);
+    }
+  }
+
+  // Consumer: get the oldest record, or nullptr if the ring is empty.
+  const AdvertRecord *peek() const {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &records[t & (N - 1)];
+  }
+
+  // Consumer: release the record returned by peek().
+  void pop() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  size_t capacity() const { return N; }
+
+  size_t size() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_acquire);
+  }
+
+  // Number of advertisements dropped because the ring was full.
+  uint32_t drops() const {
+    return dropCount.load(std::memory_order_relaxed);
+  }
+
+  // Highest number of records that were ever queued at once.
+  uint32_t highWater() const {
+    return highWaterMark.load(std::memory_order_relaxed);
+  }
+
+private:
+  AdvertRecord records[N];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> dropCount;
+  std::atomic<uint32_t> highWaterMark;
+};
+
+#endif /* ADVERT_RING_H_ */
@@ -0,0 +1,286 @@
+/** Choose the connection parameters of each peer from its traffic.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Each connection uses one of three profiles:
+ * - bulk: a short interval, for service discovery and high
+ *   notification rates,
+ * - streaming: notifications arrive within one interval,
+ * - idle: a long interval and peripheral latency, only to keep the
+ *   connection alive with a low current draw.
+ *
+ * A client connects with the bulk profile, so setting up the
+ * connection is fast. When the setup is done, the sketch calls
+ * start() with the profile it expects. From then on, update() looks
+ * at the notifications of each connection every POLICY_WINDOW ms and
+ * picks the profile that fits their rate. A faster profile is
+ * requested at the end of the window, and an idle connection switches
+ * to streaming at its first notification. A slower profile is only
+ * requested after POLICY_SLOWER_WINDOWS windows in a row, so a short
+ * pause doesn't cause a renegotiation.
+ *
+ * Requests of the peripheral for other parameters are accepted if
+ * they don't make the connection faster than the profile, which costs
+ * current, or slower, which delays notifications and the detection
+ * of a lost link.
+ *
+ * Each decision is logged with the rate that caused it, so its effect
+ * on notification latency and current draw can be measured.
+ */
+#ifndef CONN_POLICY_H_
+#define CONN_POLICY_H_
+
+#include <NimBLEDevice.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Time to observe the traffic of a connection, in ms
+#define POLICY_WINDOW 10000
+// Windows with less traffic before switching to a slower profile
+#define POLICY_SLOWER_WINDOWS 2
+// Notifications per second from which the bulk profile is used
+#define POLICY_BULK_RATE 20
+
+// From fast to slow
+enum ConnProfile : uint8_t {
+  CONN_PROFILE_BULK,
+  CONN_PROFILE_STREAMING,
+  CONN_PROFILE_IDLE,
+};
+
+struct ConnProfileParams {
+  const char *name;
+  uint16_t intervalMin; // 1.25 ms
+  uint16_t intervalMax; // 1.25 ms
+  uint16_t latency;     // Connection events the peripheral may skip
+  uint16_t timeout;     // Supervision timeout, 10 ms
+};
+
+static const ConnProfileParams connProfiles[] = {
+    // 7.5-15 ms
+    {"bulk", 6, 12, 0, 200},
+    // 30-50 ms
+    {"streaming", 24, 40, 0, 400},
+    // 200-250 ms, up to 750 ms with peripheral latency
+    {"idle", 160, 200, 2, 400},
+};
+
+// N is the number of connections.
+template <size_t N> class ConnPolicy {
+public:
+  ConnPolicy() {
+    for (size_t i = 0; i < N; i++) {
+      slots[i].client = nullptr;
+    }
+  }
+
+  // Set the parameters of a new client to the bulk profile.
+  void configure(NimBLEClient *pClient) {
+    const ConnProfileParams &p = connProfiles[CONN_PROFILE_BULK];
+    pClient->setConnectionParams(p.intervalMin, p.intervalMax,
+                                 p.latency, p.timeout);
+  }
+
+  /* The setup of a connected client is done: switch to profile and
+   * adapt it to the traffic from now on.
+   */
+  void start(NimBLEClient *pClient, ConnProfile profile) {
+    Slot *slot = find(pClient);
+    if (slot == nullptr) {
+      slot = find(nullptr);
+      if (slot == nullptr) {
+        return;
+      }
+      slot->address = pClient->getPeerAddress();
+      slot->profile = CONN_PROFILE_BULK;
+      slot->renegotiations = 0;
+      slot->client = pClient;
+    }
+    restartWindow(*slot, millis());
+    slot->slowerWindows = 0;
+    if (profile != slot->profile) {
+      apply(*slot, profile, "setup done");
+    }
+  }
+
+  // A client was disconnected.
+  void disconnected(NimBLEClient *pClient) {
+    Slot *slot = find(pClient);
+    if (slot != nullptr) {
+      slot->client = nullptr;
+    }
+  }
+
+  // A client received a notification of length bytes.
+  void traffic(NimBLEClient *pClient, size_t length) {
+    Slot *slot = find(pClient);
+    if (slot == nullptr) {
+      return;
+    }
+    slot->notifications++;
+    slot->bytes += length;
+    if (slot->profile == CONN_PROFILE_IDLE) {
+      apply(*slot, CONN_PROFILE_STREAMING, "notification");
+    }
+  }
+
+  /* Pick the profile of each connection whose window has ended, and
+   * renegotiate if it changes.
+   */
+  void update(uint32_t now) {
+    for (size_t i = 0; i < N; i++) {
+      Slot &slot = slots[i];
+      uint32_t elapsed = now - slot.windowStart;
+      if (slot.client == nullptr || elapsed < POLICY_WINDOW) {
+        continue;
+      }
+
+      ConnProfile wanted = CONN_PROFILE_IDLE;
+      if ((uint64_t)slot.notifications * 1000 >=
+          (uint64_t)POLICY_BULK_RATE * elapsed) {
+        wanted = CONN_PROFILE_BULK;
+      } else if (slot.notifications > 0) {
+        wanted = CONN_PROFILE_STREAMING;
+      }
+
+      if (wanted > slot.profile) {
+        slot.slowerWindows++;
+      } else {
+        slot.slowerWindows = 0;
+      }
+      if (wanted < slot.profile ||
+          slot.slowerWindows >= POLICY_SLOWER_WINDOWS) {
+        char reason[48];
+        snprintf(reason, sizeof(reason),
+                 "%u.%u notifications/s, %u B/s",
+                 (unsigned)(slot.notifications * 1000 / elapsed),
+                 (unsigned)(slot.notifications * 10000 / elapsed %
+                            10),
+                 (unsigned)(slot.bytes * 1000 / elapsed));
+        apply(slot, wanted, reason);
+      }
+      restartWindow(slot, now);
+    }
+  }
+
+  /* Time until the next update() in ms, or UINT32_MAX if there's no
+   * connection to update. Idle connections only change on traffic().
+   */
+  uint32_t nextUpdate(uint32_t now) const {
+    uint32_t next = UINT32_MAX;
+
+    for (size_t i = 0; i < N; i++) {
+      if (slots[i].client == nullptr ||
+          slots[i].profile == CONN_PROFILE_IDLE) {
+        continue;
+      }
+      uint32_t elapsed = now - slots[i].windowStart;
+      uint32_t left =
+          elapsed < POLICY_WINDOW ? POLICY_WINDOW - elapsed : 0;
+      if (left < next) {
+        next = left;
+      }
+    }
+    return next;
+  }
+
+  /* Whether to accept the parameters that a peripheral requests, from
+   * the client callback on the NimBLE host task. Connections that are
+   * still being set up use the bulk profile.
+   */
+  bool accept(NimBLEClient *pClient,
+              const ble_gap_upd_params *params) {
+    const Slot *slot = find(pClient);
+    ConnProfile profile = slot != nullptr ? (ConnProfile)slot->profile
+                                          : CONN_PROFILE_BULK;
+    const ConnProfileParams &p = connProfiles[profile];
+
+    // The longest time a notification waits for a connection event
+    uint32_t delay =
+        (uint32_t)params->itvl_max * (params->latency + 1);
+    uint32_t maxDelay = (uint32_t)p.intervalMax * (p.latency + 1);
+    bool accepted = params->itvl_min >= p.intervalMin &&
+                    delay <= maxDelay &&
+                    params->supervision_timeout <= p.timeout;
+
+    Serial.printf("%s: %s request for interval %u-%u, latency %u, "
+                  "timeout %u (%s profile)\n",
+                  pClient->getPeerAddress().toString().c_str(),
+                  accepted ? "accepted" : "rejected",
+                  (unsigned)params->itvl_min,
+                  (unsigned)params->itvl_max,
+                  (unsigned)params->latency,
+                  (unsigned)params->supervision_timeout, p.name);
+    return accepted;
+  }
+
+  // Print the profile of each connection.
+  void print() {
+    for (size_t i = 0; i < N; i++) {
+      const Slot &slot = slots[i];
+      if (slot.client != nullptr) {
+        Serial.printf("%s: %s profile, %u renegotiations\n",
+                      slot.address.toString().c_str(),
+                      connProfiles[slot.profile].name,
+                      (unsigned)slot.renegotiations);
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    // Only changed from loop(), also read by accept()
+    NimBLEClient *volatile client;
+    volatile uint8_t profile; // ConnProfile
+    NimBLEAddress address;
+    uint32_t windowStart; // millis()
+    uint32_t notifications;
+    uint32_t bytes;
+    uint8_t slowerWindows; // In a row that wanted a slower profile
+    uint32_t renegotiations;
+  };
+
+  Slot slots[N];
+
+  Slot *find(NimBLEClient *pClient) {
+    for (size_t i = 0; i < N; i++) {
+      if (slots[i].client == pClient) {
+        return &slots[i];
+      }
+    }
+    return nullptr;
+  }
+
+  static void restartWindow(Slot &slot, uint32_t now) {
+    slot.windowStart = now;
+    slot.notifications = 0;
+    slot.bytes = 0;
+  }
+
+  void apply(Slot &slot, ConnProfile profile, const char *reason) {
+    const ConnProfileParams &p = connProfiles[profile];
+
+    // Intervals in 0.01 ms
+    uint32_t min = (uint32_t)p.intervalMin * 125;
+    uint32_t max = (uint32_t)p.intervalMax * 125;
+
+    Serial.printf(
+        "%s: %s -> %s (%s): interval %u.%02u-%u.%02u ms, latency %u, "
+        "timeout %u ms\n",
+        slot.address.toString().c_str(),
+        connProfiles[slot.profile].name, p.name, reason,
+        (unsigned)(min / 100), (unsigned)(min % 100),
+        (unsigned)(max / 100), (unsigned)(max % 100),
+        (unsigned)p.latency, (unsigned)p.timeout * 10);
+    slot.client->updateConnParams(p.intervalMin, p.intervalMax,
+                                  p.latency, p.timeout);
+    slot.profile = profile;
+    slot.slowerWindows = 0;
+    slot.renegotiations++;
+  }
+};
+
+#endif /* CONN_POLICY_H_ */
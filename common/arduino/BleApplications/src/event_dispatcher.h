@@ -0,0 +1,193 @@
+/** Pass BLE events from NimBLE callbacks to loop().
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * NimBLE calls the scan and client callbacks on its host task. They
+ * post an event to a FreeRTOS queue, which copies it, so there's no
+ * shared state between the tasks and the queue takes care of the
+ * memory ordering. loop() blocks in wait() until an event arrives or
+ * the timeout expires, so the loop task doesn't wake up when there's
+ * nothing to do.
+ *
+ * For comparison, the dispatcher can also poll the queue every
+ * millisecond, like the delay(1) loops it replaces. In both modes it
+ * counts the wakeups of the loop task and measures the latency from
+ * posting an event to handling it.
+ */
+#ifndef EVENT_DISPATCHER_H_
+#define EVENT_DISPATCHER_H_
+
+#include <NimBLEDevice.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Notification data copied into an event. The default is the default
+ * ATT MTU - 3. Define it before including this file as the negotiated
+ * ATT MTU - 3, so events hold whole notifications.
+ */
+#ifndef EVENT_MAX_DATA
+#define EVENT_MAX_DATA 20
+#endif
+// Timeout of wait() to block until the next event
+#define EVENT_WAIT_FOREVER UINT32_MAX
+
+enum EventType : uint8_t {
+  EVENT_FOUND,           // address: device found by the scan
+  EVENT_CONNECTED,       // client
+  EVENT_DISCONNECTED,    // client, address
+  EVENT_NOTIFICATION,    // client, data
+  EVENT_SERVICE_CHANGED, // client
+  EVENT_COMMAND,         // serial input available
+};
+
+struct Event {
+  EventType type;
+  uint16_t length;       // Length of the notification
+  uint32_t timestamp;    // millis() when the event was posted
+  uint32_t postedMicros; // micros() when the event was posted
+  NimBLEAddress address;
+  NimBLEClient *client;
+  uint8_t data[EVENT_MAX_DATA];
+
+  // data only holds the first EVENT_MAX_DATA bytes.
+  bool truncated() const { return length > EVENT_MAX_DATA; }
+};
+
+template <size_t Size> class EventDispatcher {
+public:
+  // polling: poll the queue every millisecond instead of blocking
+  EventDispatcher(bool polling)
+      : queue(nullptr), polling(polling), dropCount(0),
+        truncateCount(0), wakeupCount(0), eventCount(0),
+        latencyTotal(0), latencyMax(0), statsStart(0) {}
+
+  void begin() {
+    queue = xQueueCreateStatic(Size, sizeof(Event), storage,
+                               &queueBuffer);
+    statsStart = millis();
+  }
+
+  /* Post an event from a NimBLE callback. The event is dropped if the
+   * queue is full, the host task never blocks.
+   */
+  bool post(EventType type, NimBLEClient *client = nullptr) {
+    Event event;
+    event.type = type;
+    event.length = 0;
+    event.client = client;
+    if (client != nullptr) {
+      event.address = client->getPeerAddress();
+    }
+    return send(event);
+  }
+
+  bool post(EventType type, const NimBLEAddress &address) {
+    Event event;
+    event.type = type;
+    event.length = 0;
+    event.address = address;
+    event.client = nullptr;
+    return send(event);
+  }
+
+  /* Post a notification of length bytes, with at most EVENT_MAX_DATA
+   * bytes of data. Longer notifications are counted as truncated,
+   * data only needs to hold the first EVENT_MAX_DATA bytes.
+   */
+  bool post(NimBLEClient *client, const uint8_t *data,
+            size_t length) {
+    Event event;
+    event.type = EVENT_NOTIFICATION;
+    event.length = length;
+    event.client = client;
+    if (event.truncated()) {
+      length = EVENT_MAX_DATA;
+      truncateCount++;
+    }
+    memcpy(event.data, data, length);
+    return send(event);
+  }
+
+  /* Wait for an event for at most timeout ms, or EVENT_WAIT_FOREVER.
+   * Returns false if none arrived.
+   */
+  bool wait(Event &event, uint32_t timeout) {
+    bool received;
+
+    if (polling) {
+      uint32_t start = millis();
+      while (!(received = xQueueReceive(queue, &event, 0)) &&
+             millis() - start < timeout) {
+        delay(1);
+        wakeupCount++;
+      }
+    } else {
+      TickType_t ticks = timeout == EVENT_WAIT_FOREVER
+                             ? portMAX_DELAY
+                             : pdMS_TO_TICKS(timeout);
+      received = xQueueReceive(queue, &event, ticks) == pdTRUE;
+    }
+    wakeupCount++;
+
+    if (received) {
+      uint32_t latency = micros() - event.postedMicros;
+      eventCount++;
+      latencyTotal += latency;
+      if (latency > latencyMax) {
+        latencyMax = latency;
+      }
+    }
+    return received;
+  }
+
+  // Print and reset the statistics.
+  void printStats() {
+    uint32_t elapsed = millis() - statsStart;
+
+    Serial.printf(
+        "Events (%s): %u handled, %u dropped, %u truncated, "
+        "%u wakeups/s, latency avg %u us, max %u us\n",
+        polling ? "polling" : "blocking", (unsigned)eventCount,
+        (unsigned)dropCount, (unsigned)truncateCount,
+        (unsigned)(elapsed ? (uint64_t)wakeupCount * 1000 / elapsed
+                           : 0),
+        (unsigned)(eventCount ? latencyTotal / eventCount : 0),
+        (unsigned)latencyMax);
+    wakeupCount = 0;
+    eventCount = 0;
+    latencyTotal = 0;
+    latencyMax = 0;
+    statsStart = millis();
+  }
+
+private:
+  QueueHandle_t queue;
+  StaticQueue_t queueBuffer;
+  uint8_t storage[Size * sizeof(Event)];
+  bool polling;
+  // Only updated by the NimBLE host task
+  volatile uint32_t dropCount;
+  volatile uint32_t truncateCount;
+  // Only updated by the loop task
+  uint32_t wakeupCount;
+  uint32_t eventCount;
+  uint64_t latencyTotal;
+  uint32_t latencyMax;
+  uint32_t statsStart;
+
+  bool send(Event &event) {
+    event.timestamp = millis();
+    event.postedMicros = micros();
+    if (xQueueSend(queue, &event, 0) != pdTRUE) {
+      dropCount++;
+      return false;
+    }
+    return true;
+  }
+};
+
+#endif /* EVENT_DISPATCHER_H_ */
@@ -0,0 +1,212 @@
+/** Reconnect to lost peers with the controller's filter accept list.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * When a peer disconnects, a general scan has to see it advertise
+ * again, and the host checks every advertisement of every device
+ * nearby until it does. Instead, lost() adds the peer's address to
+ * the filter accept list (white list) of the controller, and
+ * configure() switches the scan to the list's filter policy. The
+ * controller then drops the advertisements of all other devices
+ * before they reach the host, so the host only wakes up for the peers
+ * it's waiting for. The scan window is widened to the whole scan
+ * interval in the meantime, so the first advertisement of a lost peer
+ * is caught.
+ *
+ * A peer leaves the list when it's connected again, or after
+ * RECONNECT_TIMEOUT ms, so the sketch can look for other devices
+ * again with an unfiltered scan. The controller rejects changes to
+ * the list while a scan uses it, so each change stops the scan. The
+ * sketch restarts it after calling configure().
+ *
+ * The controller could also connect directly to the first device of
+ * the list it sees, with ble_gap_connect() without a peer address.
+ * NimBLE-Arduino 1.x doesn't support that: NimBLEClient::connect()
+ * always passes a peer address, and a client can't take over a
+ * connection that was made without it. So the sketch still connects
+ * after the first filtered advertisement, which costs one more
+ * advertising interval.
+ *
+ * For comparison, with enabled set to false the list isn't used and
+ * the scan isn't changed, but the reconnection latency and the scan
+ * reports while reconnecting are measured all the same.
+ */
+#ifndef FAST_RECONNECT_H_
+#define FAST_RECONNECT_H_
+
+#include <NimBLEDevice.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Time to wait for a lost peer in the filter accept list, in ms
+#define RECONNECT_TIMEOUT 60000
+
+// N is the number of lost peers to wait for at the same time.
+template <size_t N> class FastReconnect {
+public:
+  /* enabled: use the filter accept list
+   * interval, window: of the unfiltered scan, in ms
+   */
+  FastReconnect(bool enabled, uint16_t interval, uint16_t window)
+      : enabled(enabled), interval(interval), window(window),
+        lostCount(0), filtered(false),
+        reportCount(0), reconnectCount(0), expiredCount(0),
+        latencyTotal(0), latencyMax(0) {}
+
+  /* Whether the scan only reports peers in the filter accept list.
+   * Called from the scan callback on the NimBLE host task.
+   */
+  bool filtering() const { return filtered; }
+
+  /* Count a scan report, from the scan callback on the NimBLE host
+   * task. Only reports while a peer is lost are counted.
+   */
+  void scanned() {
+    if (lostCount > 0) {
+      reportCount++;
+    }
+  }
+
+  // Whether address is a lost peer.
+  bool isLost(const NimBLEAddress &address) const {
+    return indexOf(address) < N;
+  }
+
+  /* A peer with address was lost at time. Returns false if no more
+   * peers can be added. Stops the scan if enabled.
+   */
+  bool lost(const NimBLEAddress &address, uint32_t time) {
+    if (isLost(address)) {
+      return true;
+    }
+    if (lostCount == N) {
+      return false;
+    }
+    if (enabled) {
+      // The controller rejects changes while the list is in use.
+      NimBLEDevice::getScan()->stop();
+      if (!NimBLEDevice::whiteListAdd(address)) {
+        Serial.printf("%s: can't add to filter accept list\n",
+                      address.toString().c_str());
+        return false;
+      }
+    }
+    peers[lostCount].address = address;
+    peers[lostCount].time = time;
+    lostCount++;
+    return true;
+  }
+
+  /* A peer with address was connected at time. Returns true if it
+   * was lost, and records its reconnection latency. Stops the scan
+   * if enabled.
+   */
+  bool connected(const NimBLEAddress &address, uint32_t time) {
+    size_t i = indexOf(address);
+    if (i == N) {
+      return false;
+    }
+
+    uint32_t latency = time - peers[i].time;
+    reconnectCount++;
+    latencyTotal += latency;
+    if (latency > latencyMax) {
+      latencyMax = latency;
+    }
+    Serial.printf("%s: reconnected after %u ms\n",
+                  address.toString().c_str(), (unsigned)latency);
+    remove(i);
+    return true;
+  }
+
+  /* Stop waiting for peers that were lost longer than
+   * RECONNECT_TIMEOUT ago. Returns true if there were any.
+   */
+  bool expire(uint32_t now) {
+    size_t before = lostCount;
+    size_t i = 0;
+    while (i < lostCount) {
+      if (now - peers[i].time >= RECONNECT_TIMEOUT) {
+        Serial.printf("%s: not back after %u s\n",
+                      peers[i].address.toString().c_str(),
+                      (unsigned)(RECONNECT_TIMEOUT / 1000));
+        expiredCount++;
+        remove(i);
+      } else {
+        i++;
+      }
+    }
+    return lostCount < before;
+  }
+
+  /* Configure a stopped scan: filtered with a full window while peers
+   * are lost, otherwise unfiltered.
+   */
+  void configure(NimBLEScan *pScan) {
+    filtered = enabled && lostCount > 0;
+    pScan->setFilterPolicy(filtered ? BLE_HCI_SCAN_FILT_USE_WL
+                                    : BLE_HCI_SCAN_FILT_NO_WL);
+    pScan->setInterval(interval);
+    pScan->setWindow(filtered ? interval : window);
+  }
+
+  // Print and reset the statistics.
+  void printStats() {
+    Serial.printf(
+        "Reconnects (%s): %u, latency avg %u ms, max %u ms, %u "
+        "expired, %u scan reports while reconnecting\n",
+        enabled ? "filter accept list" : "unfiltered scan",
+        (unsigned)reconnectCount,
+        (unsigned)(reconnectCount ? latencyTotal / reconnectCount
+                                  : 0),
+        (unsigned)latencyMax, (unsigned)expiredCount,
+        (unsigned)reportCount);
+    reportCount = 0;
+    reconnectCount = 0;
+    expiredCount = 0;
+    latencyTotal = 0;
+    latencyMax = 0;
+  }
+
+private:
+  struct LostPeer {
+    NimBLEAddress address;
+    uint32_t time; // millis() when it was lost
+  };
+
+  bool enabled;
+  uint16_t interval;
+  uint16_t window;
+  LostPeer peers[N];
+  // Read by the NimBLE host task
+  volatile size_t lostCount;
+  volatile bool filtered;
+  // Only updated by the NimBLE host task
+  volatile uint32_t reportCount;
+  uint32_t reconnectCount;
+  uint32_t expiredCount;
+  uint64_t latencyTotal;
+  uint32_t latencyMax;
+
+  size_t indexOf(const NimBLEAddress &address) const {
+    for (size_t i = 0; i < lostCount; i++) {
+      if (peers[i].address == address) {
+        return i;
+      }
+    }
+    return N;
+  }
+
+  void remove(size_t i) {
+    if (enabled) {
+      NimBLEDevice::getScan()->stop();
+      NimBLEDevice::whiteListRemove(peers[i].address);
+    }
+    peers[i] = peers[lostCount - 1];
+    lostCount--;
+  }
+};
+
+#endif /* FAST_RECONNECT_H_ */
@@ -0,0 +1,405 @@
+/** Cache discovered GATT handles in NVS, keyed by peer address.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * NimBLE-Arduino keeps discovered services only as long as the client
+ * exists, so after a reset every peer goes through service discovery
+ * again. The cache stores the handles of one characteristic, its
+ * CCCD and the Service Changed characteristic in NVS with the
+ * Preferences library. On reconnect, the sketch writes the CCCD and
+ * reads or writes the characteristic value directly by handle with
+ * the blocking helpers below, without discovery. Each request waits
+ * on its own binary semaphore, not on the task notification that
+ * NimBLE-Arduino's blocking calls use, and gives up after
+ * GATT_TIMEOUT ms.
+ *
+ * An entry is invalidated when:
+ * - the peer has a Database Hash characteristic (0x2b2a) and its
+ *   value differs from the cached one, checked with a single Read By
+ *   Type request after connecting,
+ * - the peer indicates Service Changed (0x2a05), or
+ * - a write to a cached handle fails.
+ *
+ * Notifications for cached handles don't reach NimBLE-Arduino's
+ * notify callbacks, because the client has no remote characteristic
+ * for them. The sketch's custom GAP event handler matches them with
+ * GattSubscriptions instead.
+ */
+#ifndef GATT_CACHE_H_
+#define GATT_CACHE_H_
+
+#include <NimBLEDevice.h>
+#include <Preferences.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define GATT_CACHE_VERSION 1
+#define UUID_GENERIC_ATTRIBUTE_SERVICE "1801"
+#define UUID_SERVICE_CHANGED_CHARACTERISTIC "2a05"
+#define UUID_DATABASE_HASH 0x2b2a
+#define UUID_CCCD 0x2902
+#define DATABASE_HASH_SIZE 16
+// CCCD values
+#define CCCD_NOTIFY 0x0001
+#define CCCD_INDICATE 0x0002
+// Time to wait for a GATT request, in ms
+#ifndef GATT_TIMEOUT
+#define GATT_TIMEOUT 5000
+#endif
+
+struct GattHandles {
+  uint8_t version;
+  uint8_t hasHash;
+  uint16_t value;              // Characteristic value
+  uint16_t cccd;               // Its CCCD, 0 if none
+  uint16_t cccdValue;          // CCCD_NOTIFY, CCCD_INDICATE or 0
+  uint16_t serviceChanged;     // Service Changed value, 0 if none
+  uint16_t serviceChangedCccd; // Its CCCD, 0 if none
+  uint8_t hash[DATABASE_HASH_SIZE];
+};
+
+// A GATT procedure that the calling task waits for
+struct GattRequest {
+  GattRequest(bool multiple = false, uint8_t *data = nullptr,
+              size_t maxLength = 0)
+      : status(0), multiple(multiple), data(data), length(0),
+        maxLength(maxLength) {
+    done = xSemaphoreCreateBinaryStatic(&doneBuffer);
+  }
+
+  ~GattRequest() { vSemaphoreDelete(done); }
+
+  SemaphoreHandle_t done; // Given when the procedure completes
+  StaticSemaphore_t doneBuffer;
+  int status;
+  bool multiple; // Read By Type: wait for BLE_HS_EDONE
+  uint8_t *data;
+  size_t length;
+  size_t maxLength;
+};
+
+static int gattAttributeCB(uint16_t connHandle,
+                           const struct ble_gatt_error *error,
+                           struct ble_gatt_attr *attr, void *arg) {
+  GattRequest *request = (GattRequest *)arg;
+
+  if (error->status == 0 && attr != nullptr &&
+      request->data != nullptr && request->length == 0) {
+    uint16_t length = OS_MBUF_PKTLEN(attr->om);
+    if (length > request->maxLength) {
+      length = request->maxLength;
+    }
+    os_mbuf_copydata(attr->om, 0, length, request->data);
+    request->length = length;
+  }
+  if (request->multiple && error->status == 0) {
+    return 0; // Wait for BLE_HS_EDONE
+  }
+
+  request->status =
+      error->status == BLE_HS_EDONE ? 0 : (int)error->status;
+  xSemaphoreGive(request->done);
+  return 0;
+}
+
+/* Wait for the procedure that rc started. The callback still gets
+ * the request after a timeout, so then drop the connection: NimBLE
+ * ends all its procedures, and the request stays alive until the
+ * callback is done with it.
+ */
+static inline int gattWait(uint16_t connHandle, GattRequest &request,
+                           int rc) {
+  if (rc != 0) {
+    return rc;
+  }
+  if (xSemaphoreTake(request.done, pdMS_TO_TICKS(GATT_TIMEOUT)) ==
+      pdTRUE) {
+    return request.status;
+  }
+  ble_gap_terminate(connHandle, BLE_ERR_REM_USER_CONN_TERM);
+  xSemaphoreTake(request.done, portMAX_DELAY);
+  return BLE_HS_ETIMEOUT;
+}
+
+// Read an attribute value by handle. Returns 0 or an error code.
+static inline int gattRead(uint16_t connHandle, uint16_t handle,
+                           uint8_t *data, size_t &length) {
+  GattRequest request(false, data, length);
+  int rc = gattWait(connHandle, request,
+                    ble_gattc_read(connHandle, handle,
+                                   gattAttributeCB, &request));
+  length = request.length;
+  return rc;
+}
+
+/* Read the first attribute value with a 16-bit UUID with a Read By
+ * Type request. Returns 0 or an error code.
+ */
+static inline int gattReadByUuid(uint16_t connHandle,
+                                 uint16_t uuid16, uint8_t *data,
+                                 size_t &length) {
+  GattRequest request(true, data, length);
+  ble_uuid16_t uuid = BLE_UUID16_INIT(uuid16);
+  int rc = gattWait(connHandle, request,
+                    ble_gattc_read_by_uuid(connHandle, 1, 0xffff,
+                                           &uuid.u, gattAttributeCB,
+                                           &request));
+  length = request.length;
+  return rc;
+}
+
+// Write an attribute value with response. Returns 0 or an error code.
+static inline int gattWrite(uint16_t connHandle, uint16_t handle,
+                            const void *data, size_t length) {
+  GattRequest request;
+  return gattWait(connHandle, request,
+                  ble_gattc_write_flat(connHandle, handle, data,
+                                       length, gattAttributeCB,
+                                       &request));
+}
+
+/* Enable notifications or indications of the cached characteristic
+ * and indications of Service Changed. The CCCDs of a peer without
+ * bonding are reset on every connection. Returns 0 or an error code.
+ */
+static inline int gattSubscribe(uint16_t connHandle,
+                                const GattHandles &handles) {
+  int rc = 0;
+
+  if (handles.cccd != 0 && handles.cccdValue != 0) {
+    uint8_t value[2] = {(uint8_t)handles.cccdValue, 0};
+    rc = gattWrite(connHandle, handles.cccd, value, sizeof(value));
+  }
+  if (rc == 0 && handles.serviceChangedCccd != 0) {
+    uint8_t value[2] = {CCCD_INDICATE, 0};
+    rc = gattWrite(connHandle, handles.serviceChangedCccd, value,
+                   sizeof(value));
+  }
+  return rc;
+}
+
+/* Discover the handles of a characteristic, its CCCD, Service Changed
+ * and the Database Hash with NimBLE-Arduino. Returns false if the
+ * characteristic isn't found.
+ */
+static inline bool gattDiscover(NimBLEClient *pClient,
+                                const char *service,
+                                const char *characteristic,
+                                GattHandles &handles) {
+  memset(&handles, 0, sizeof(handles));
+  handles.version = GATT_CACHE_VERSION;
+
+  NimBLERemoteService *pSvc = pClient->getService(service);
+  NimBLERemoteCharacteristic *pChr = nullptr;
+  if (pSvc) { // Make sure it's not null.
+    pChr = pSvc->getCharacteristic(characteristic);
+  }
+  if (!pChr) {
+    return false;
+  }
+  handles.value = pChr->getHandle();
+  if (pChr->canNotify() || pChr->canIndicate()) {
+    NimBLERemoteDescriptor *pDsc =
+        pChr->getDescriptor(NimBLEUUID((uint16_t)UUID_CCCD));
+    if (pDsc) {
+      handles.cccd = pDsc->getHandle();
+      handles.cccdValue =
+          pChr->canNotify() ? CCCD_NOTIFY : CCCD_INDICATE;
+    }
+  }
+
+  pSvc = pClient->getService(UUID_GENERIC_ATTRIBUTE_SERVICE);
+  pChr = nullptr;
+  if (pSvc) {
+    pChr = pSvc->getCharacteristic(
+        UUID_SERVICE_CHANGED_CHARACTERISTIC);
+  }
+  if (pChr) {
+    handles.serviceChanged = pChr->getHandle();
+    NimBLERemoteDescriptor *pDsc =
+        pChr->getDescriptor(NimBLEUUID((uint16_t)UUID_CCCD));
+    if (pDsc) {
+      handles.serviceChangedCccd = pDsc->getHandle();
+    }
+  }
+
+  size_t length = sizeof(handles.hash);
+  handles.hasHash =
+      gattReadByUuid(pClient->getConnId(), UUID_DATABASE_HASH,
+                     handles.hash, length) == 0 &&
+      length == sizeof(handles.hash);
+  return true;
+}
+
+/* Check the cached handles against the peer's Database Hash. Returns
+ * true if they're still valid, or if the peer has no hash to check.
+ */
+static inline bool gattCheckHash(uint16_t connHandle,
+                                 const GattHandles &handles) {
+  if (!handles.hasHash) {
+    return true;
+  }
+
+  uint8_t hash[DATABASE_HASH_SIZE];
+  size_t length = sizeof(hash);
+  return gattReadByUuid(connHandle, UUID_DATABASE_HASH, hash,
+                        length) == 0 &&
+         length == sizeof(hash) &&
+         memcmp(hash, handles.hash, sizeof(hash)) == 0;
+}
+
+class GattCache {
+public:
+  // name: NVS namespace, at most 15 characters
+  GattCache(const char *name)
+      : name(name), hitCount(0), missCount(0), invalidationCount(0) {}
+
+  void begin() { preferences.begin(name, false); }
+
+  // Look up the cached handles of a peer.
+  bool load(const NimBLEAddress &address, GattHandles &handles) {
+    char key[13];
+
+    makeKey(address, key);
+    bool found = preferences.getBytesLength(key) == sizeof(handles) &&
+                 preferences.getBytes(key, &handles,
+                                      sizeof(handles)) ==
+                     sizeof(handles) &&
+                 handles.version == GATT_CACHE_VERSION;
+    if (found) {
+      hitCount++;
+    } else {
+      missCount++;
+    }
+    return found;
+  }
+
+  void save(const NimBLEAddress &address,
+            const GattHandles &handles) {
+    char key[13];
+
+    makeKey(address, key);
+    preferences.putBytes(key, &handles, sizeof(handles));
+  }
+
+  // Remove the cached handles of a peer because they're stale.
+  void invalidate(const NimBLEAddress &address) {
+    char key[13];
+
+    makeKey(address, key);
+    if (preferences.remove(key)) {
+      invalidationCount++;
+    }
+  }
+
+  void clear() { preferences.clear(); }
+
+  uint32_t hits() const { return hitCount; }
+
+  uint32_t misses() const { return missCount; }
+
+  uint32_t invalidations() const { return invalidationCount; }
+
+private:
+  const char *name;
+  Preferences preferences;
+  uint32_t hitCount;
+  uint32_t missCount;
+  uint32_t invalidationCount;
+
+  // NVS keys are at most 15 characters: 12 hex digits, MSB first
+  static void makeKey(const NimBLEAddress &address, char *key) {
+    const uint8_t *native = address.getNative();
+
+    for (int i = 0; i < 6; i++) {
+      snprintf(&key[2 * i], 3, "%02x", native[5 - i]);
+    }
+  }
+};
+
+enum GattMatch : uint8_t {
+  GATT_MATCH_NONE,
+  GATT_MATCH_VALUE,           // The subscribed characteristic
+  GATT_MATCH_SERVICE_CHANGED, // Service Changed
+};
+
+/* Handles that the custom GAP event handler on the NimBLE host task
+ * looks for in notifications and indications, per connection. The
+ * loop task adds them, either task may remove them. Each is one
+ * atomic word.
+ */
+template <size_t N> class GattSubscriptions {
+public:
+  GattSubscriptions() {
+    for (size_t i = 0; i < N; i++) {
+      values[i].store(0, std::memory_order_relaxed);
+      serviceChanged[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  bool add(uint16_t connHandle, const GattHandles &handles) {
+    for (size_t i = 0; i < N; i++) {
+      if (values[i].load(std::memory_order_relaxed) == 0 &&
+          serviceChanged[i].load(std::memory_order_relaxed) == 0) {
+        values[i].store(pack(connHandle, handles.value),
+                        std::memory_order_release);
+        serviceChanged[i].store(
+            pack(connHandle, handles.serviceChanged),
+            std::memory_order_release);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void remove(uint16_t connHandle) {
+    for (size_t i = 0; i < N; i++) {
+      if (uses(values[i], connHandle) ||
+          uses(serviceChanged[i], connHandle)) {
+        values[i].store(0, std::memory_order_release);
+        serviceChanged[i].store(0, std::memory_order_release);
+      }
+    }
+  }
+
+  // Called from the GAP event handler for each notification.
+  GattMatch match(uint16_t connHandle, uint16_t attrHandle) const {
+    uint32_t word = pack(connHandle, attrHandle);
+
+    for (size_t i = 0; i < N; i++) {
+      if (values[i].load(std::memory_order_acquire) == word) {
+        return GATT_MATCH_VALUE;
+      }
+      if (serviceChanged[i].load(std::memory_order_acquire) == word) {
+        return GATT_MATCH_SERVICE_CHANGED;
+      }
+    }
+    return GATT_MATCH_NONE;
+  }
+
+private:
+  std::atomic<uint32_t> values[N];
+  std::atomic<uint32_t> serviceChanged[N];
+
+  static bool uses(const std::atomic<uint32_t> &word,
+                   uint16_t connHandle) {
+    uint32_t w = word.load(std::memory_order_relaxed);
+    return w != 0 && w >> 16 == connHandle;
+  }
+
+  // Handle 0 is invalid, so a used entry is never 0.
+  static uint32_t pack(uint16_t connHandle, uint16_t attrHandle) {
+    return attrHandle == 0
+               ? 0
+               : ((uint32_t)connHandle << 16) | attrHandle;
+  }
+};
+
+#endif /* GATT_CACHE_H_ */
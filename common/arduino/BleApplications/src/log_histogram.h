@@ -0,0 +1,112 @@
+/** Histogram with buckets of powers of two.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * A fixed-size histogram of 32-bit values for the statistics that
+ * the sketches print, such as the time between notifications in
+ * notify_stats.h. Adding a value is a count of leading zeros.
+ */
+#ifndef LOG_HISTOGRAM_H_
+#define LOG_HISTOGRAM_H_
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buckets of powers of two: bucket 0 counts 0, bucket b counts values
+ * from 2^(b-1) to 2^b - 1. The last bucket also counts all larger
+ * values.
+ */
+template <size_t Buckets> class LogHistogram {
+  static_assert(Buckets >= 2 && Buckets <= 33,
+                "Histogram needs 2 to 33 buckets");
+
+public:
+  LogHistogram() { reset(); }
+
+  void reset() {
+    for (size_t i = 0; i < Buckets; i++) {
+      counts[i] = 0;
+    }
+    total = 0;
+    sum = 0;
+    minValue = UINT32_MAX;
+    maxValue = 0;
+  }
+
+  void add(uint32_t value) {
+    size_t bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+    if (bucket >= Buckets) {
+      bucket = Buckets - 1;
+    }
+    counts[bucket]++;
+    total++;
+    sum += value;
+    if (value < minValue) {
+      minValue = value;
+    }
+    if (value > maxValue) {
+      maxValue = value;
+    }
+  }
+
+  uint32_t count() const { return total; }
+
+  uint32_t max() const { return maxValue; }
+
+  /* Upper bound of the bucket with the given percentile, capped by
+   * the largest value. In the last bucket, that's the largest value.
+   */
+  uint32_t percentile(uint32_t percent) const {
+    uint64_t rank = ((uint64_t)total * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < Buckets; i++) {
+      seen += counts[i];
+      if (seen >= rank && seen > 0 && i < Buckets - 1) {
+        uint32_t upper = i == 0 ? 0 : (uint32_t)((1ull << i) - 1);
+        return upper < maxValue ? upper : maxValue;
+      }
+    }
+    return maxValue;
+  }
+
+  void print(const char *name, const char *unit) const {
+    if (total == 0) {
+      Serial.printf("  %s: none\n", name);
+      return;
+    }
+    Serial.printf("  %s (%s): %u, min %u, mean %u, p50 <= %u, "
+                  "p99 <= %u, max %u\n",
+                  name, unit, (unsigned)total, (unsigned)minValue,
+                  (unsigned)(sum / total), (unsigned)percentile(50),
+                  (unsigned)percentile(99), (unsigned)maxValue);
+    for (size_t i = 0; i < Buckets; i++) {
+      if (counts[i] == 0) {
+        continue;
+      }
+      uint32_t lower = i == 0 ? 0 : (uint32_t)1 << (i - 1);
+      if (i == 0) {
+        Serial.printf("    0: %u\n", (unsigned)counts[i]);
+      } else if (i == Buckets - 1) {
+        Serial.printf("    >= %u: %u\n", (unsigned)lower,
+                      (unsigned)counts[i]);
+      } else {
+        uint32_t upper = (uint32_t)((1ull << i) - 1);
+        Serial.printf("    %u-%u: %u\n", (unsigned)lower,
+                      (unsigned)upper, (unsigned)counts[i]);
+      }
+    }
+  }
+
+private:
+  uint32_t counts[Buckets];
+  uint32_t total;
+  uint64_t sum;
+  uint32_t minValue;
+  uint32_t maxValue;
+};
+
+#endif /* LOG_HISTOGRAM_H_ */
@@ -0,0 +1,301 @@
+/** Measure the timing of notifications per connection.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The GAP event handler timestamps every notification with micros()
+ * as soon as it arrives and records it here, for each connection:
+ * - the time between successive notifications,
+ * - the payload size,
+ * - the execution time of the handler itself.
+ *
+ * Each goes into a histogram with buckets of powers of two, so it has
+ * a fixed size, and adding a value is a count of leading zeros. Next
+ * to that, each connection keeps a short log of its connection
+ * parameters: at connection, at each request of the peripheral
+ * (accepted or rejected) and at each update. Both have a timestamp in
+ * milliseconds, so a spike in the time between notifications can be
+ * correlated with the connection interval that was in use.
+ *
+ * The statistics are updated on the NimBLE host task and printed from
+ * loop(). Both hold a spinlock for a short copy, so print() never
+ * sees a half-updated connection.
+ */
+#ifndef NOTIFY_STATS_H_
+#define NOTIFY_STATS_H_
+
+#include <NimBLEDevice.h>
+#include <freertos/FreeRTOS.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "log_histogram.h"
+
+// Connection parameter changes logged per connection
+#define CONN_PARAMS_LOG_SIZE 8
+
+enum ConnParamsSource : uint8_t {
+  CONN_PARAMS_CONNECTED, // Parameters of the new connection
+  CONN_PARAMS_ACCEPTED,  // Request of the peripheral, accepted
+  CONN_PARAMS_REJECTED,  // Request of the peripheral, rejected
+  CONN_PARAMS_UPDATED,   // Parameters after an update
+};
+
+static const char *connParamsSourceName(ConnParamsSource source) {
+  static const char *names[] = {"connected", "accepted", "rejected",
+                                "updated"};
+  return names[source];
+}
+
+struct ConnParamsRecord {
+  uint32_t time; // millis()
+  ConnParamsSource source;
+  // In the units of the Bluetooth specification
+  uint16_t intervalMin; // 1.25 ms
+  uint16_t intervalMax; // 1.25 ms, same as min if not a request
+  uint16_t latency;     // Connection events
+  uint16_t timeout;     // 10 ms
+};
+
+struct ConnStats {
+  uint16_t connHandle; // BLE_HS_CONN_HANDLE_NONE if unused
+  bool connected;
+  NimBLEAddress address;
+  uint32_t connectedTime; // millis()
+  uint32_t lastMicros;    // micros() of the last notification
+  uint32_t maxGapTime;    // millis() at the end of the largest gap
+
+  LogHistogram<24> interArrival; // us, up to 8 s
+  LogHistogram<10> payloadSize;  // bytes, up to 512
+  LogHistogram<16> handlerTime;  // us, up to 32 ms
+  ConnParamsRecord params[CONN_PARAMS_LOG_SIZE];
+  uint8_t paramsCount; // Records in params, oldest overwritten
+  uint8_t paramsNext;  // Index of the next record
+};
+
+// N is the number of connections to keep statistics for.
+template <size_t N> class NotifyStats {
+public:
+  NotifyStats() {
+    lock = portMUX_INITIALIZER_UNLOCKED;
+    for (size_t i = 0; i < N; i++) {
+      stats[i].connHandle = BLE_HS_CONN_HANDLE_NONE;
+      stats[i].connected = false;
+    }
+  }
+
+  /* A connection was established, from onConnect(). Takes a free
+   * slot, or the slot of the oldest closed connection.
+   */
+  void connected(uint16_t connHandle) {
+    ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(connHandle, &desc) != 0) {
+      return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    ConnStats *slot = nullptr;
+    for (size_t i = 0; i < N; i++) {
+      ConnStats &s = stats[i];
+      if (s.connected) {
+        continue;
+      }
+      if (s.connHandle == BLE_HS_CONN_HANDLE_NONE) {
+        slot = &s;
+        break;
+      }
+      if (slot == nullptr ||
+          (int32_t)(s.connectedTime - slot->connectedTime) < 0) {
+        slot = &s;
+      }
+    }
+    if (slot != nullptr) {
+      slot->connHandle = connHandle;
+      slot->connected = true;
+      slot->address = NimBLEAddress(desc.peer_id_addr);
+      slot->connectedTime = millis();
+      slot->paramsCount = 0;
+      slot->paramsNext = 0;
+      clear(*slot);
+      log(*slot, CONN_PARAMS_CONNECTED, desc.conn_itvl,
+          desc.conn_itvl, desc.conn_latency,
+          desc.supervision_timeout);
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  // A connection was closed. Its statistics stay until reused.
+  void disconnected(uint16_t connHandle) {
+    portENTER_CRITICAL(&lock);
+    ConnStats *s = find(connHandle);
+    if (s != nullptr) {
+      s->connected = false;
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  // The peripheral requested new parameters, from the client.
+  void requested(uint16_t connHandle,
+                 const ble_gap_upd_params *params, bool accepted) {
+    portENTER_CRITICAL(&lock);
+    ConnStats *s = find(connHandle);
+    if (s != nullptr) {
+      log(*s, accepted ? CONN_PARAMS_ACCEPTED : CONN_PARAMS_REJECTED,
+          params->itvl_min, params->itvl_max, params->latency,
+          params->supervision_timeout);
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  // The connection parameters were updated, on a GAP CONN_UPDATE.
+  void updated(uint16_t connHandle) {
+    ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(connHandle, &desc) != 0) {
+      return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    ConnStats *s = find(connHandle);
+    if (s != nullptr) {
+      log(*s, CONN_PARAMS_UPDATED, desc.conn_itvl, desc.conn_itvl,
+          desc.conn_latency, desc.supervision_timeout);
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  /* A notification of length bytes arrived at arrivalMicros, when the
+   * GAP event handler was called. Call this at the end of the
+   * handler, so its execution time is included.
+   */
+  void notified(uint16_t connHandle, uint16_t length,
+                uint32_t arrivalMicros) {
+    portENTER_CRITICAL(&lock);
+    ConnStats *s = find(connHandle);
+    if (s != nullptr) {
+      if (s->payloadSize.count() > 0) {
+        uint32_t gap = arrivalMicros - s->lastMicros;
+        if (gap > s->interArrival.max()) {
+          s->maxGapTime = millis();
+        }
+        s->interArrival.add(gap);
+      }
+      s->lastMicros = arrivalMicros;
+      s->payloadSize.add(length);
+      s->handlerTime.add(micros() - arrivalMicros);
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  // Print the statistics of all connections, from loop().
+  void print() {
+    bool any = false;
+
+    for (size_t i = 0; i < N; i++) {
+      // Copy, so the lock isn't held while printing.
+      portENTER_CRITICAL(&lock);
+      ConnStats s = stats[i];
+      portEXIT_CRITICAL(&lock);
+      if (s.connHandle == BLE_HS_CONN_HANDLE_NONE) {
+        continue;
+      }
+      any = true;
+      printConnection(s);
+    }
+    if (!any) {
+      Serial.println("No connections yet");
+    }
+  }
+
+  /* Clear the histograms of all connections, but keep the log of
+   * connection parameters.
+   */
+  void reset() {
+    portENTER_CRITICAL(&lock);
+    for (size_t i = 0; i < N; i++) {
+      clear(stats[i]);
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+private:
+  portMUX_TYPE lock;
+  ConnStats stats[N];
+
+  // Call with the lock held.
+  ConnStats *find(uint16_t connHandle) {
+    for (size_t i = 0; i < N; i++) {
+      if (stats[i].connected && stats[i].connHandle == connHandle) {
+        return &stats[i];
+      }
+    }
+    return nullptr;
+  }
+
+  static void clear(ConnStats &s) {
+    s.lastMicros = 0;
+    s.maxGapTime = 0;
+    s.interArrival.reset();
+    s.payloadSize.reset();
+    s.handlerTime.reset();
+  }
+
+  static void log(ConnStats &s, ConnParamsSource source,
+                  uint16_t intervalMin, uint16_t intervalMax,
+                  uint16_t latency, uint16_t timeout) {
+    ConnParamsRecord &record = s.params[s.paramsNext];
+    record.time = millis();
+    record.source = source;
+    record.intervalMin = intervalMin;
+    record.intervalMax = intervalMax;
+    record.latency = latency;
+    record.timeout = timeout;
+    s.paramsNext = (s.paramsNext + 1) % CONN_PARAMS_LOG_SIZE;
+    if (s.paramsCount < CONN_PARAMS_LOG_SIZE) {
+      s.paramsCount++;
+    }
+  }
+
+  static void printConnection(const ConnStats &s) {
+    Serial.printf("%s (handle %u, %s since %u ms):\n",
+                  s.address.toString().c_str(),
+                  (unsigned)s.connHandle,
+                  s.connected ? "connected" : "disconnected",
+                  (unsigned)s.connectedTime);
+    s.interArrival.print("Time between notifications", "us");
+    if (s.interArrival.count() > 0) {
+      Serial.printf("  Largest gap ended at %u ms\n",
+                    (unsigned)s.maxGapTime);
+    }
+    s.payloadSize.print("Payload size", "bytes");
+    s.handlerTime.print("Handler time", "us");
+
+    // Oldest first
+    Serial.println("  Connection parameters:");
+    size_t first = (s.paramsNext + CONN_PARAMS_LOG_SIZE -
+                    s.paramsCount) %
+                   CONN_PARAMS_LOG_SIZE;
+    for (size_t n = 0; n < s.paramsCount; n++) {
+      const ConnParamsRecord &r =
+          s.params[(first + n) % CONN_PARAMS_LOG_SIZE];
+      Serial.printf("    %u ms %s: interval ", (unsigned)r.time,
+                    connParamsSourceName(r.source));
+      printInterval(r.intervalMin);
+      if (r.intervalMax != r.intervalMin) {
+        Serial.print("-");
+        printInterval(r.intervalMax);
+      }
+      Serial.printf(" ms, latency %u, timeout %u ms\n",
+                    (unsigned)r.latency, (unsigned)r.timeout * 10);
+    }
+  }
+
+  // Print an interval in units of 1.25 ms as ms with two decimals.
+  static void printInterval(uint16_t interval) {
+    uint32_t hundredths = (uint32_t)interval * 125;
+    Serial.printf("%u.%02u", (unsigned)(hundredths / 100),
+                  (unsigned)(hundredths % 100));
+  }
+};
+
+#endif /* NOTIFY_STATS_H_ */
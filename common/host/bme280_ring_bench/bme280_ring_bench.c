@@ -0,0 +1,311 @@
+/*
+ * Check and time the sample ring of the bme280_sampler module.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Adds simulated BME280 samples to a ring, and after every few
+ * samples checks the history, the samples since a random sequence
+ * number and the statistics of the newest samples against a
+ * straightforward computation over all samples taken. Then it times
+ * adding a sample, copying the history, copying the newest samples
+ * that fit in a notification of the stream of peripheral_bme280,
+ * computing the statistics of the whole ring, from the running sums
+ * and extremes, after every sample, and computing those of all but
+ * one sample, with a pass over them, in ns on this host. These only
+ * compare the operations with each other: a microcontroller is much
+ * slower.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bme280_ring.h"
+
+// Samples in a notification of 247 bytes, the largest ATT MTU
+#define NOTIFY_SAMPLES 40
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+struct options {
+  unsigned size;
+  unsigned samples;
+  unsigned check_every;
+  unsigned seed;
+};
+
+static unsigned rng_state;
+
+// xorshift32, in [0, 1)
+static double uniform(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state / 4294967296.0;
+}
+
+static int uniform_int(int min, int max) {
+  return min + (int)(uniform() * (max - min + 1));
+}
+
+static void next_sample(struct bme280_sample *sample) {
+  sample->temperature += uniform_int(-20, 20);
+  sample->pressure += uniform_int(-50, 50);
+  sample->humidity += uniform_int(-100, 100);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Round half away from zero, like the ring.
+static long long divide_round(long long sum, long long count) {
+  return (sum >= 0 ? sum + count / 2 : sum - count / 2) / count;
+}
+
+static void fail(const char *what, unsigned taken, unsigned count) {
+  fprintf(stderr, "%s wrong after %u samples, count %u\n", what,
+          taken, count);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Check the newest count samples of the ring against all samples
+ * taken.
+ */
+static void check(struct bme280_ring *ring,
+                  const struct bme280_sample *taken, unsigned n,
+                  unsigned count, struct bme280_sample *copy) {
+  unsigned expected = count < n ? count : n;
+  long long temperature = 0, pressure = 0, humidity = 0;
+  struct bme280_stats stats, want;
+
+  if (expected > ring->size) {
+    expected = ring->size;
+  }
+  if (bme280_ring_copy(ring, copy, count) != expected ||
+      ring->sequence != n - 1) {
+    fail("History length", n, count);
+  }
+
+  memset(&want, 0, sizeof(want));
+  for (unsigned i = 0; i < expected; i++) {
+    const struct bme280_sample *sample = &taken[n - 1 - i];
+
+    if (memcmp(&copy[i], sample, sizeof(*sample)) != 0) {
+      fail("History", n, count);
+    }
+    if (i == 0) {
+      want.min = want.max = *sample;
+    }
+    want.min.temperature =
+        MIN(want.min.temperature, sample->temperature);
+    want.max.temperature =
+        MAX(want.max.temperature, sample->temperature);
+    want.min.pressure = MIN(want.min.pressure, sample->pressure);
+    want.max.pressure = MAX(want.max.pressure, sample->pressure);
+    want.min.humidity = MIN(want.min.humidity, sample->humidity);
+    want.max.humidity = MAX(want.max.humidity, sample->humidity);
+    temperature += sample->temperature;
+    pressure += sample->pressure;
+    humidity += sample->humidity;
+  }
+  want.count = (uint16_t)expected;
+  if (expected > 0) {
+    want.mean.temperature =
+        (int16_t)divide_round(temperature, expected);
+    want.mean.pressure = (uint16_t)divide_round(pressure, expected);
+    want.mean.humidity = (uint16_t)divide_round(humidity, expected);
+  }
+
+  bme280_ring_stats(ring, count, &stats);
+  if (stats.count != want.count ||
+      (expected > 0 &&
+       (memcmp(&stats.min, &want.min, sizeof(want.min)) != 0 ||
+        memcmp(&stats.max, &want.max, sizeof(want.max)) != 0 ||
+        memcmp(&stats.mean, &want.mean, sizeof(want.mean)) != 0))) {
+    fail("Statistics", n, count);
+  }
+}
+
+/*
+ * Check the samples since the sequence number of taken[first], at
+ * most max of them. first can be before the oldest sample in the ring
+ * or after the newest one.
+ */
+static void check_since(const struct bme280_ring *ring,
+                        const struct bme280_sample *taken, unsigned n,
+                        long long first, unsigned max,
+                        struct bme280_sample *copy) {
+  long long oldest = (long long)n - MIN(n, ring->size);
+  uint32_t sequence = (uint32_t)first;
+  unsigned expected;
+  size_t count;
+
+  if (first < oldest) {
+    first = oldest;
+  }
+  expected = first < n ? MIN((unsigned)(n - first), max) : 0;
+  count = bme280_ring_copy_since(ring, &sequence, copy, max);
+  if (count != expected || sequence != (uint32_t)first) {
+    fail("Samples since", n, max);
+  }
+  for (unsigned i = 0; i < expected; i++) {
+    if (memcmp(&copy[i], &taken[first + i], sizeof(copy[i])) != 0) {
+      fail("Samples since", n, max);
+    }
+  }
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n, --size N        Samples in the ring (60)\n"
+          "  -t, --samples N     Samples to add (1000000)\n"
+          "  -c, --check N       Check every N samples (97)\n"
+          "  -s, --seed N        Seed of the simulation (1)\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"size", required_argument, NULL, 'n'},
+      {"samples", required_argument, NULL, 't'},
+      {"check", required_argument, NULL, 'c'},
+      {"seed", required_argument, NULL, 's'},
+      {NULL, 0, NULL, 0}};
+  struct options options = {60, 1000000, 97, 1};
+  int c;
+
+  while ((c = getopt_long(argc, argv, "n:t:c:s:", long_options,
+                          NULL)) != -1) {
+    switch (c) {
+    case 'n':
+      options.size = strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      options.samples = strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      options.check_every = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      options.seed = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (options.size == 0 || options.size > 65535 ||
+      options.samples == 0 || options.check_every == 0) {
+    fprintf(stderr, "Size must be 1 to 65535, samples and check at "
+                    "least 1\n");
+    return EXIT_FAILURE;
+  }
+  rng_state = options.seed ? options.seed : 1;
+
+  struct bme280_sample *buffer =
+      calloc(options.size, sizeof(*buffer));
+  struct bme280_sample *copy = calloc(options.size, sizeof(*copy));
+  struct bme280_sample *taken =
+      calloc(options.samples, sizeof(*taken));
+  struct bme280_sample sample = {2000, 51325, 5000};
+  struct bme280_ring ring;
+  struct bme280_stats stats;
+  unsigned checks = 0;
+
+  if (buffer == NULL || copy == NULL || taken == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  // Check the ring while it fills up, when it wraps and when it's
+  // full.
+  bme280_ring_init(&ring, buffer, (uint16_t)options.size);
+  bme280_ring_stats(&ring, options.size, &stats);
+  if (stats.count != 0 || bme280_ring_copy(&ring, copy, 1) != 0) {
+    fail("Empty ring", 0, options.size);
+  }
+  check_since(&ring, taken, 0, 0, options.size, copy);
+  for (unsigned n = 1; n <= options.samples; n++) {
+    next_sample(&sample);
+    taken[n - 1] = sample;
+    bme280_ring_add(&ring, &sample);
+    if (n % options.check_every == 0 || n % options.size <= 1) {
+      check(&ring, taken, n, 1, copy);
+      check(&ring, taken, n, (n * 7) % options.size + 1, copy);
+      check(&ring, taken, n, options.size, copy);
+      check_since(&ring, taken, n, n - 1, 1, copy);
+      check_since(&ring, taken, n,
+                  (long long)n - uniform_int(-2, options.size + 5),
+                  uniform_int(1, options.size), copy);
+      checks += 5;
+    }
+  }
+  printf("%u samples in a ring of %u: %u checks passed\n",
+         options.samples, options.size, checks);
+
+  // Time the operations on a full ring.
+  double start = now_ns();
+  for (unsigned n = 0; n < options.samples; n++) {
+    bme280_ring_add(&ring, &taken[n]);
+  }
+  double add_ns = (now_ns() - start) / options.samples;
+
+  unsigned queries = options.samples / options.size + 1;
+  long long checksum = 0;
+  start = now_ns();
+  for (unsigned n = 0; n < queries; n++) {
+    checksum += bme280_ring_copy(&ring, copy, options.size);
+    checksum += copy[n % options.size].temperature;
+  }
+  double copy_ns = (now_ns() - start) / queries;
+
+  // The samples of a notification, as if the previous one was sent
+  unsigned fit = MIN(options.size, NOTIFY_SAMPLES);
+  start = now_ns();
+  for (unsigned n = 0; n < queries; n++) {
+    uint32_t sequence = ring.sequence + 1 - fit;
+
+    checksum += bme280_ring_copy_since(&ring, &sequence, copy, fit);
+    checksum += copy[n % fit].temperature;
+  }
+  double since_ns = (now_ns() - start) / queries;
+
+  // After every sample, so evicted extremes count
+  start = now_ns();
+  for (unsigned n = 0; n < options.samples; n++) {
+    bme280_ring_add(&ring, &taken[n]);
+    bme280_ring_stats(&ring, options.size, &stats);
+    checksum += stats.mean.temperature + stats.max.humidity;
+  }
+  double stats_ns = (now_ns() - start) / options.samples - add_ns;
+
+  start = now_ns();
+  for (unsigned n = 0; n < queries; n++) {
+    bme280_ring_stats(&ring, options.size - 1u, &stats);
+    checksum += stats.mean.temperature;
+  }
+  double scan_ns = (now_ns() - start) / queries;
+
+  printf("Add %.1f ns, copy history %.1f ns, copy %u since %.1f ns, "
+         "statistics %.1f ns, statistics of %u samples %.1f ns "
+         "(checksum %lld)\n",
+         add_ns, copy_ns, fit, since_ns, stats_ns, options.size - 1u,
+         scan_ns, checksum);
+
+  free(buffer);
+  free(copy);
+  free(taken);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+/*
+ * Ring buffer of BME280 samples.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef BME280_RING_H_
+#define BME280_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sensor values in the units of the advertisement
+struct bme280_sample {
+  int16_t temperature; // 0.01 degrees Celsius
+  uint16_t pressure;   // Pa - 50000
+  uint16_t humidity;   // 0.01 %RH
+};
+
+// Minimum, maximum and mean of the newest count samples
+struct bme280_stats {
+  struct bme280_sample min;
+  struct bme280_sample max;
+  struct bme280_sample mean; // Rounded to the nearest unit
+  uint16_t count;
+};
+
+struct bme280_ring {
+  struct bme280_sample *samples; // size elements
+  uint16_t size;
+  uint16_t newest; // Index of the newest sample
+  uint16_t count;
+  uint32_t sequence; // Sequence number of the newest sample
+  // Sums and extremes of all samples in the ring
+  int32_t temperature_sum;
+  uint32_t pressure_sum;
+  uint32_t humidity_sum;
+  struct bme280_sample min;
+  struct bme280_sample max;
+  bool extremes_valid; // False when an extreme left the ring
+};
+
+void bme280_ring_init(struct bme280_ring *ring,
+                      struct bme280_sample *samples, uint16_t size);
+void bme280_ring_add(struct bme280_ring *ring,
+                     const struct bme280_sample *sample);
+size_t bme280_ring_copy(const struct bme280_ring *ring,
+                        struct bme280_sample *samples, size_t max);
+size_t bme280_ring_copy_since(const struct bme280_ring *ring,
+                              uint32_t *sequence,
+                              struct bme280_sample *samples,
+                              size_t max);
+void bme280_ring_stats(struct bme280_ring *ring, size_t count,
+                       struct bme280_stats *stats);
+
+#endif /* BME280_RING_H_ */
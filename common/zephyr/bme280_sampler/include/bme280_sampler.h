@@ -0,0 +1,40 @@
+/*
+ * Sample a BME280 sensor in the background.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef BME280_SAMPLER_H_
+#define BME280_SAMPLER_H_
+
+#include <stddef.h>
+#include <zephyr/types.h>
+
+#include "bme280_ring.h"
+
+struct bme280_sample_info {
+  uint32_t sequence; // Sequence number of the sample
+  uint32_t started;  // k_cycle_get_32() when the read started
+  uint32_t sampled;  // k_cycle_get_32() when the sample was decoded
+};
+
+/*
+ * Called in the sampler thread after each sample is added to the
+ * history.
+ */
+typedef void (*bme280_sampler_cb_t)(
+    const struct bme280_sample *sample,
+    const struct bme280_sample_info *info);
+
+int bme280_sampler_start(bme280_sampler_cb_t cb);
+int bme280_sampler_latest(struct bme280_sample *sample);
+size_t bme280_sampler_history(struct bme280_sample *samples,
+                              size_t max, uint32_t *sequence);
+size_t bme280_sampler_since(uint32_t *sequence,
+                            struct bme280_sample *samples, size_t max,
+                            uint32_t *newest);
+int bme280_sampler_stats(size_t count, struct bme280_stats *stats);
+
+#endif /* BME280_SAMPLER_H_ */
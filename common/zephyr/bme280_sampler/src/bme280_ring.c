@@ -0,0 +1,224 @@
+/*
+ * Ring buffer of BME280 samples.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * The ring keeps the newest samples in a buffer of the caller, and
+ * numbers them, so a reader can tell which samples it didn't see yet.
+ * The statistics use integer arithmetic in the units of the samples:
+ * 32-bit sums can't overflow for the 65535 samples that a ring holds
+ * at most, and a microcontroller without an FPU doesn't need floating
+ * point. This code doesn't depend on Zephyr, so it also builds on the
+ * host.
+ *
+ * The ring keeps the sums of its samples up to date when it adds a
+ * sample and evicts the oldest one, and the minimum and maximum as
+ * long as the evicted sample isn't one of them. The statistics of all
+ * samples in the ring then don't need a pass over the samples, except
+ * for the extremes after one of them was evicted. The statistics of
+ * fewer samples take one pass.
+ */
+
+#include "bme280_ring.h"
+
+void bme280_ring_init(struct bme280_ring *ring,
+                      struct bme280_sample *samples, uint16_t size) {
+  ring->samples = samples;
+  ring->size = size;
+  ring->newest = 0;
+  ring->count = 0;
+  ring->sequence = 0;
+  ring->temperature_sum = 0;
+  ring->pressure_sum = 0;
+  ring->humidity_sum = 0;
+  ring->extremes_valid = false;
+}
+
+static bool is_extreme(const struct bme280_ring *ring,
+                       const struct bme280_sample *sample) {
+  return sample->temperature == ring->min.temperature ||
+         sample->temperature == ring->max.temperature ||
+         sample->pressure == ring->min.pressure ||
+         sample->pressure == ring->max.pressure ||
+         sample->humidity == ring->min.humidity ||
+         sample->humidity == ring->max.humidity;
+}
+
+static void update_extremes(struct bme280_sample *min,
+                            struct bme280_sample *max,
+                            const struct bme280_sample *sample) {
+  if (sample->temperature < min->temperature) {
+    min->temperature = sample->temperature;
+  } else if (sample->temperature > max->temperature) {
+    max->temperature = sample->temperature;
+  }
+  if (sample->pressure < min->pressure) {
+    min->pressure = sample->pressure;
+  } else if (sample->pressure > max->pressure) {
+    max->pressure = sample->pressure;
+  }
+  if (sample->humidity < min->humidity) {
+    min->humidity = sample->humidity;
+  } else if (sample->humidity > max->humidity) {
+    max->humidity = sample->humidity;
+  }
+}
+
+void bme280_ring_add(struct bme280_ring *ring,
+                     const struct bme280_sample *sample) {
+  if (ring->count > 0) {
+    ring->newest =
+        ring->newest + 1 == ring->size ? 0 : ring->newest + 1;
+    ring->sequence++;
+  }
+
+  if (ring->count == ring->size) {
+    // Evict the oldest sample, which the new one overwrites.
+    const struct bme280_sample *oldest = &ring->samples[ring->newest];
+
+    ring->temperature_sum -= oldest->temperature;
+    ring->pressure_sum -= oldest->pressure;
+    ring->humidity_sum -= oldest->humidity;
+    if (is_extreme(ring, oldest)) {
+      ring->extremes_valid = false;
+    }
+  } else {
+    ring->count++;
+  }
+
+  ring->samples[ring->newest] = *sample;
+  ring->temperature_sum += sample->temperature;
+  ring->pressure_sum += sample->pressure;
+  ring->humidity_sum += sample->humidity;
+  if (ring->count == 1) {
+    ring->min = ring->max = *sample;
+    ring->extremes_valid = true;
+  } else if (ring->extremes_valid) {
+    update_extremes(&ring->min, &ring->max, sample);
+  }
+}
+
+/*
+ * Copy at most max samples into samples, from new to old. Returns the
+ * number of samples copied.
+ */
+size_t bme280_ring_copy(const struct bme280_ring *ring,
+                        struct bme280_sample *samples, size_t max) {
+  size_t count = ring->count < max ? ring->count : max;
+  size_t index = ring->newest;
+
+  for (size_t i = 0; i < count; i++) {
+    samples[i] = ring->samples[index];
+    index = index == 0 ? ring->size - 1u : index - 1;
+  }
+  return count;
+}
+
+/*
+ * Copy at most max samples into samples, from old to new, starting
+ * at the one with sequence number *sequence, or at the oldest one if
+ * that one left the ring. Sets *sequence to the sequence number of
+ * the first sample copied, and returns the number of samples copied.
+ */
+size_t bme280_ring_copy_since(const struct bme280_ring *ring,
+                              uint32_t *sequence,
+                              struct bme280_sample *samples,
+                              size_t max) {
+  // The first sample has sequence number 0, like an empty ring.
+  uint32_t next = ring->count > 0 ? ring->sequence + 1 : 0;
+  uint32_t first = *sequence;
+  size_t count, index, back;
+
+  if ((int32_t)(next - ring->count - first) > 0) {
+    first = next - ring->count;
+  }
+  *sequence = first;
+  if ((int32_t)(next - first) <= 0) {
+    return 0;
+  }
+
+  count = next - first;
+  if (count > max) {
+    count = max;
+  }
+  back = ring->sequence - first;
+  index = ring->newest >= back ? ring->newest - back
+                               : ring->newest + ring->size - back;
+  for (size_t i = 0; i < count; i++) {
+    samples[i] = ring->samples[index];
+    index = index + 1 == ring->size ? 0 : index + 1;
+  }
+  return count;
+}
+
+// Divide and round half away from zero.
+static int32_t divide_round(int32_t sum, uint16_t count) {
+  return (sum >= 0 ? sum + count / 2 : sum - count / 2) / count;
+}
+
+/*
+ * Compute the sums and extremes of the newest count samples, with
+ * count at least 1, in one pass.
+ */
+static void scan(const struct bme280_ring *ring, size_t count,
+                 int32_t *temperature, uint32_t *pressure,
+                 uint32_t *humidity, struct bme280_sample *min,
+                 struct bme280_sample *max) {
+  size_t index = ring->newest;
+
+  *temperature = 0;
+  *pressure = 0;
+  *humidity = 0;
+  *min = *max = ring->samples[index];
+  for (size_t i = 0; i < count; i++) {
+    const struct bme280_sample *sample = &ring->samples[index];
+
+    *temperature += sample->temperature;
+    *pressure += sample->pressure;
+    *humidity += sample->humidity;
+    update_extremes(min, max, sample);
+    index = index == 0 ? ring->size - 1u : index - 1;
+  }
+}
+
+/*
+ * Compute the statistics of at most count of the newest samples.
+ * stats->count is 0 if the ring is empty. For all samples in the
+ * ring, this updates the extremes of the ring if one was evicted.
+ */
+void bme280_ring_stats(struct bme280_ring *ring, size_t count,
+                       struct bme280_stats *stats) {
+  int32_t temperature;
+  uint32_t pressure, humidity;
+
+  if (count > ring->count) {
+    count = ring->count;
+  }
+  stats->count = (uint16_t)count;
+  if (count == 0) {
+    return;
+  }
+
+  if (count == ring->count) {
+    if (!ring->extremes_valid) {
+      scan(ring, count, &temperature, &pressure, &humidity,
+           &ring->min, &ring->max);
+      ring->extremes_valid = true;
+    }
+    temperature = ring->temperature_sum;
+    pressure = ring->pressure_sum;
+    humidity = ring->humidity_sum;
+    stats->min = ring->min;
+    stats->max = ring->max;
+  } else {
+    scan(ring, count, &temperature, &pressure, &humidity,
+         &stats->min, &stats->max);
+  }
+
+  stats->mean.temperature =
+      (int16_t)divide_round(temperature, stats->count);
+  stats->mean.pressure = (uint16_t)((pressure + count / 2) / count);
+  stats->mean.humidity = (uint16_t)((humidity + count / 2) / count);
+}
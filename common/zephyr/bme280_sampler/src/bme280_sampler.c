@@ -0,0 +1,326 @@
+/*
+ * Sample a BME280 sensor in the background.
+ *
+ * Copyright (c) 2022 Koen Vervloesem
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * A thread reads the sensor every CONFIG_BME280_SAMPLER_INTERVAL ms
+ * on an absolute schedule, and keeps the newest
+ * CONFIG_BME280_SAMPLER_HISTORY_SIZE samples in a ring in RAM. The
+ * applications read the sensor values from there instead of doing
+ * I2C transfers themselves, for example in a GATT read callback, and
+ * get the minimum, maximum and mean of the last samples without
+ * reading the sensor again. The oversampling, IIR filter and mode of
+ * the sensor are Kconfig options of Zephyr's BME280 driver, which
+ * each application sets, most of them with
+ * bme280_sampler_weather.conf.
+ *
+ * With CONFIG_BME280_SAMPLER_ASYNC, the thread reads all three
+ * channels with Zephyr's asynchronous sensor API. The driver encodes
+ * a reading into a buffer from the memory pool of the RTIO context,
+ * which the decoder converts to fixed-point values afterwards, and
+ * the thread sleeps until the read completes. Otherwise, it fetches
+ * and converts the sample with blocking calls.
+ */
+
+#include <errno.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/types.h>
+
+#ifdef CONFIG_BME280_SAMPLER_ASYNC
+#include <zephyr/rtio/rtio.h>
+#endif
+
+#include "bme280_sampler.h"
+
+#define BME280_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(bosch_bme280)
+
+static struct bme280_sample
+    samples[CONFIG_BME280_SAMPLER_HISTORY_SIZE];
+static struct bme280_ring ring;
+static K_MUTEX_DEFINE(ring_mutex);
+
+static const struct device *bme280;
+static bme280_sampler_cb_t sample_cb;
+static bool started;
+
+/*
+ * Get a device structure from a devicetree node with compatible
+ * "bosch,bme280". (If there are multiple, just pick one.)
+ */
+static const struct device *get_device(void) {
+  const struct device *dev = DEVICE_DT_GET_ANY(bosch_bme280);
+
+  if (dev == NULL) {
+    /* No such node, or the node does not have status "okay". */
+    printk("\nError: no device found.\n");
+    return NULL;
+  }
+
+  if (!device_is_ready(dev)) {
+    printk("\nError: Device \"%s\" is not ready; "
+           "check the driver initialization logs for errors.\n",
+           dev->name);
+    return NULL;
+  }
+
+  printk("Found device \"%s\", getting sensor data\n", dev->name);
+  return dev;
+}
+
+#ifdef CONFIG_BME280_SAMPLER_ASYNC
+
+SENSOR_DT_READ_IODEV(bme280_iodev, BME280_NODE,
+                     {SENSOR_CHAN_AMBIENT_TEMP, 0},
+                     {SENSOR_CHAN_PRESS, 0},
+                     {SENSOR_CHAN_HUMIDITY, 0});
+RTIO_DEFINE_WITH_MEMPOOL(bme280_ctx, 1, 1, 2, 16, sizeof(void *));
+
+struct read_request {
+  struct bme280_sample sample;
+  int result;
+};
+
+/*
+ * Convert a Q31 value with a shift to an integer in units of
+ * 1/scale.
+ */
+static int32_t q31_to_fixed(q31_t value, int8_t shift,
+                            int32_t scale) {
+  int64_t scaled = (int64_t)value * scale;
+
+  if (shift >= 0) {
+    return (int32_t)((scaled * ((int64_t)1 << shift)) >> 31);
+  }
+  return (int32_t)(scaled >> (31 - shift));
+}
+
+static int decode_channel(const struct sensor_decoder_api *decoder,
+                          const uint8_t *buf,
+                          enum sensor_channel channel,
+                          int32_t scale, int32_t *value) {
+  struct sensor_chan_spec spec = {channel, 0};
+  struct sensor_q31_data data = {0};
+  uint32_t fit = 0;
+  int rc = decoder->decode(buf, spec, &fit, 1, &data);
+
+  if (rc < 0) {
+    return rc;
+  }
+  *value = q31_to_fixed(data.readings[0].value, data.shift, scale);
+  return 0;
+}
+
+static void process_cb(int result, uint8_t *buf, uint32_t buf_len,
+                       void *userdata) {
+  struct read_request *request = userdata;
+  const struct sensor_decoder_api *decoder;
+  int32_t temperature, pressure, humidity;
+
+  if (result == 0) {
+    result = sensor_get_decoder(DEVICE_DT_GET(BME280_NODE), &decoder);
+  }
+  if (result == 0) {
+    result = decode_channel(decoder, buf, SENSOR_CHAN_AMBIENT_TEMP,
+                            100, &temperature);
+  }
+  if (result == 0) {
+    // kPa to Pa
+    result = decode_channel(decoder, buf, SENSOR_CHAN_PRESS, 1000,
+                            &pressure);
+  }
+  if (result == 0) {
+    result = decode_channel(decoder, buf, SENSOR_CHAN_HUMIDITY, 100,
+                            &humidity);
+  }
+
+  request->result = result;
+  if (result == 0) {
+    request->sample.temperature = (int16_t)temperature;
+    request->sample.pressure = (uint16_t)(pressure - 50000);
+    request->sample.humidity = (uint16_t)humidity;
+  }
+}
+
+static int read_sample(struct bme280_sample *sample) {
+  struct read_request request;
+  int err;
+
+  err = sensor_read_async_mempool(&bme280_iodev, &bme280_ctx,
+                                  &request);
+  if (err) {
+    return err;
+  }
+  // Wait for the read to complete and decode it.
+  sensor_processing_with_callback(&bme280_ctx, process_cb);
+  if (request.result == 0) {
+    *sample = request.sample;
+  }
+  return request.result;
+}
+
+#else
+
+static int read_sample(struct bme280_sample *sample) {
+  struct sensor_value temperature, pressure, humidity;
+  int err;
+
+  err = sensor_sample_fetch(bme280);
+  if (!err) {
+    err = sensor_channel_get(bme280, SENSOR_CHAN_AMBIENT_TEMP,
+                             &temperature);
+  }
+  if (!err) {
+    err = sensor_channel_get(bme280, SENSOR_CHAN_PRESS, &pressure);
+  }
+  if (!err) {
+    err = sensor_channel_get(bme280, SENSOR_CHAN_HUMIDITY, &humidity);
+  }
+  if (err) {
+    return err;
+  }
+
+  sample->temperature =
+      (int16_t)(temperature.val1 * 100 + temperature.val2 / 10000);
+  // kPa to Pa, without offset
+  sample->pressure = (uint16_t)(pressure.val1 * 1000 +
+                                pressure.val2 / 1000 - 50000);
+  sample->humidity =
+      (uint16_t)(humidity.val1 * 100 + humidity.val2 / 10000);
+  return 0;
+}
+
+#endif /* CONFIG_BME280_SAMPLER_ASYNC */
+
+static void sampler_thread(void *p1, void *p2, void *p3) {
+  struct bme280_sample_info info;
+  struct bme280_sample sample;
+  int64_t next = k_uptime_get();
+  int err;
+
+  while (1) {
+    next += CONFIG_BME280_SAMPLER_INTERVAL;
+    k_sleep(K_TIMEOUT_ABS_MS(next));
+
+    info.started = k_cycle_get_32();
+    err = read_sample(&sample);
+    info.sampled = k_cycle_get_32();
+    if (err) {
+      printk("Sensor read failed (err %d)\n", err);
+      continue;
+    }
+
+    k_mutex_lock(&ring_mutex, K_FOREVER);
+    bme280_ring_add(&ring, &sample);
+    info.sequence = ring.sequence;
+    k_mutex_unlock(&ring_mutex);
+
+    if (sample_cb != NULL) {
+      sample_cb(&sample, &info);
+    }
+  }
+}
+
+K_THREAD_DEFINE(bme280_sampler_tid, CONFIG_BME280_SAMPLER_STACK_SIZE,
+                sampler_thread, NULL, NULL, NULL,
+                CONFIG_BME280_SAMPLER_PRIORITY, 0, SYS_FOREVER_MS);
+
+/*
+ * Take the first sample in the calling thread, and start the sampler
+ * thread. It calls cb, if not NULL, for each sample after this one.
+ * Returns 0, -ENODEV if there's no BME280 or a negative error code if
+ * the read failed.
+ */
+int bme280_sampler_start(bme280_sampler_cb_t cb) {
+  struct bme280_sample sample;
+  int err;
+
+  if (started) {
+    return -EALREADY;
+  }
+
+  bme280 = get_device();
+  if (bme280 == NULL) {
+    return -ENODEV;
+  }
+
+  err = read_sample(&sample);
+  if (err) {
+    printk("Sensor read failed (err %d)\n", err);
+    return err;
+  }
+
+  bme280_ring_init(&ring, samples, ARRAY_SIZE(samples));
+  bme280_ring_add(&ring, &sample);
+  sample_cb = cb;
+  started = true;
+  k_thread_start(bme280_sampler_tid);
+  return 0;
+}
+
+/*
+ * Copy the newest sample. Returns 0 or -EAGAIN if the sampler didn't
+ * start.
+ */
+int bme280_sampler_latest(struct bme280_sample *sample) {
+  int err = -EAGAIN;
+
+  k_mutex_lock(&ring_mutex, K_FOREVER);
+  if (bme280_ring_copy(&ring, sample, 1) == 1) {
+    err = 0;
+  }
+  k_mutex_unlock(&ring_mutex);
+  return err;
+}
+
+/*
+ * Copy at most max of the newest samples, from new to old, and the
+ * sequence number of the newest one. Returns the number of samples
+ * copied.
+ */
+size_t bme280_sampler_history(struct bme280_sample *samples,
+                              size_t max, uint32_t *sequence) {
+  size_t count;
+
+  k_mutex_lock(&ring_mutex, K_FOREVER);
+  count = bme280_ring_copy(&ring, samples, max);
+  *sequence = ring.sequence;
+  k_mutex_unlock(&ring_mutex);
+  return count;
+}
+
+/*
+ * Copy at most max samples, from old to new, starting at the one
+ * with sequence number *sequence, or at the oldest one if that one
+ * left the history. Sets *sequence to the sequence number of the
+ * first sample copied and *newest to that of the newest sample.
+ * Returns the number of samples copied.
+ */
+size_t bme280_sampler_since(uint32_t *sequence,
+                            struct bme280_sample *samples, size_t max,
+                            uint32_t *newest) {
+  size_t count;
+
+  k_mutex_lock(&ring_mutex, K_FOREVER);
+  count = bme280_ring_copy_since(&ring, sequence, samples, max);
+  *newest = ring.sequence;
+  k_mutex_unlock(&ring_mutex);
+  return count;
+}
+
+/*
+ * Compute the minimum, maximum and mean of at most count of the
+ * newest samples. Returns 0 or -EAGAIN if the sampler didn't start.
+ */
+int bme280_sampler_stats(size_t count, struct bme280_stats *stats) {
+  k_mutex_lock(&ring_mutex, K_FOREVER);
+  bme280_ring_stats(&ring, count, stats);
+  k_mutex_unlock(&ring_mutex);
+  return stats->count > 0 ? 0 : -EAGAIN;
+}
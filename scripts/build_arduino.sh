@@ -2,6 +2,8 @@
 set -e
 
 DIR=$(pwd)
+# Library with the code shared by the sketches
+LIBRARY="$DIR/common/arduino/BleApplications"
 
 for directory in 3-advertisements 4-connections 5-security 6-profiles 7-lowpower 8-reverse; do
   cd "$DIR" || exit
@@ -14,7 +16,7 @@ for directory in 3-advertisements 4-connections 5-security 6-profiles 7-lowpower
     for i in $(ls); do
       cd "$i" || exit
       echo Building "$i"...
-      make build
+      make build LIBRARY="$LIBRARY"
       cd ..
     done
     cd ..
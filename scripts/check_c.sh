@@ -1,7 +1,7 @@
 #!/usr/bin/env bash
 DIR=$(pwd)
 
-for directory in 3-advertisements 4-connections 5-security 6-profiles 7-lowpower 8-reverse; do
+for directory in common 3-advertisements 4-connections 5-security 6-profiles 7-lowpower 8-reverse; do
   cd "$DIR" || exit
   cd "$directory" || exit
   echo Checking "$directory"...
@@ -18,6 +18,18 @@ for directory in 3-advertisements 4-connections 5-security 6-profiles 7-lowpower
     cd ..
   fi
 
+  if [ -d host ]; then
+    echo Checking host code...
+    cd host
+    for i in $(ls); do
+      cd "$i" || exit
+      echo Checking "$i"...
+      make lint
+      cd ..
+    done
+    cd ..
+  fi
+
   if [ -d zephyr ]; then
     echo Checking Zephyr code...
     cd zephyr